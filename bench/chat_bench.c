@@ -0,0 +1,931 @@
+#define _GNU_SOURCE
+// Load generator cho chat_server: vài thread, mỗi thread một epoll lái hàng nghìn client ảo
+// non-blocking. Kịch bản: kết nối và thỏa thuận v2, tạo phòng, vào phòng, bật mã hóa cho
+// một số phòng, rồi gửi tin với tốc độ cố định (open loop) và upload file trong thời gian đo.
+// Mọi file có cùng nội dung nên với --offer, từ file thứ hai server phát thẳng từ cache.
+// Mỗi tin mang thời điểm gửi theo lịch (CLOCK_MONOTONIC) nên độ trễ end-to-end chỉ đúng
+// khi bench và server chạy trên cùng một máy; tin gửi trễ lịch vẫn bị tính trễ.
+//   ./chat_bench [--clients n] [--rooms n] [--rate tin/giây] [--duration giây] [--json] ...
+#include "../common/protocol.h"
+#include "../common/wire.h"
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define BENCH_MARKER "~cb "
+#define BENCH_FILE_PREFIX "cb-"
+#define BENCH_TX_BUFFER_SIZE WIRE_MAX_FRAME_SIZE
+#define BENCH_EPOLL_EVENTS 256
+#define BENCH_SETUP_TIMEOUT_SECONDS 30
+#define BENCH_DRAIN_MAX_MS 3000
+#define BENCH_DRAIN_IDLE_MS 300
+
+typedef enum {
+    PHASE_SETUP = 0,              // Kết nối, MSG_JOIN, tạo phòng, vào phòng
+    PHASE_ENCRYPT,                // Chủ phòng mã hóa bật mã hóa, chờ mọi thành viên có key
+    PHASE_RUN,                    // Gửi tin và upload file theo lịch
+    PHASE_DRAIN,                  // Ngừng gửi, chờ các tin còn trên đường
+    PHASE_DONE
+} bench_phase_t;
+
+typedef enum {
+    VC_WELCOME = 0,               // Đã gửi MSG_JOIN, chờ MSG_WELCOME
+    VC_WAIT_ROOM,                 // Chờ chủ phòng tạo phòng
+    VC_JOINING,                   // Đã gửi MSG_JOIN_ROOM
+    VC_JOINED,
+    VC_CLOSED
+} vclient_state_t;
+
+typedef struct {
+    const char* host;
+    int port;
+    int clients;
+    int threads;
+    int rooms;
+    int encrypted_rooms;          // Phòng 0..encrypted_rooms-1 bật AES-256-GCM
+    double rate;                  // Tin/giây của mỗi client
+    int duration;
+    int msg_size;
+    int files;                    // Tổng số file upload trong thời gian đo
+    int file_kb;
+    int deflate;
+    int offer;                    // File thường được offer theo SHA-256 trước khi upload
+    int json;
+} bench_config_t;
+
+typedef struct {
+    int fd;
+    int index;
+    int room;                     // Chỉ số phòng, client i ở phòng i % rooms
+    vclient_state_t state;
+    int client_id;
+    int wire_version;
+    int wire_features;
+    int has_key;
+    int encryption_requested;
+    room_crypto_t crypto;
+    ringbuf_t rx;
+    ringbuf_t tx;
+    int tx_armed;
+    unsigned long next_send_ns;
+    int next_upload;              // Upload k tiếp theo của client (k % clients == index)
+    int upload_chunk;             // -1 khi không upload
+    int upload_offered;           // Đã gửi MSG_FILE_OFFER, chờ server trả lời
+    int upload_stream;            // stream_id của upload hiện tại (k + 1)
+    int upload_total;
+    long upload_file_id;          // AAD của chunk mã hóa
+    unsigned long upload_start_ns;
+} vclient_t;
+
+typedef struct {
+    unsigned long sent;
+    unsigned long skipped;        // Tới lịch nhưng hàng đợi gửi còn đầy hoặc đang upload
+    unsigned long delivered;
+    unsigned long files_sent;
+    unsigned long files_received;
+    unsigned long files_cached;   // Offer được server phát từ cache, không upload
+    unsigned long file_bytes;
+    unsigned long connect_errors;
+    unsigned long disconnects;
+    unsigned long protocol_errors;
+    unsigned long server_errors;
+    unsigned long decrypt_errors;
+} bench_counters_t;
+
+typedef struct {
+    int index;
+    pthread_t thread;
+    int epoll_fd;
+    vclient_t* clients;
+    int count;
+    bench_counters_t counters;    // Chỉ thread này ghi; delivered đọc relaxed khi drain
+    metrics_histogram_t latency;
+    metrics_histogram_t file_latency;
+} bench_thread_t;
+
+static bench_config_t g_config = {
+    .host = "127.0.0.1",
+    .port = SERVER_PORT,
+    .clients = 1000,
+    .threads = 4,
+    .rooms = 50,
+    .encrypted_rooms = 0,
+    .rate = 1.0,
+    .duration = 10,
+    .msg_size = 64,
+    .files = 0,
+    .file_kb = 256,
+    .deflate = 0,
+    .offer = 0,
+    .json = 0,
+};
+
+static int g_phase = PHASE_SETUP;
+static unsigned long g_run_start_ns;
+static unsigned long g_run_end_ns;
+static int* g_room_ids;                  // 0 = chủ phòng chưa tạo xong
+static int* g_room_members;
+static unsigned long* g_room_sent;       // Tin đã gửi vào mỗi phòng
+static unsigned long* g_room_files;      // File đã upload vào mỗi phòng
+static int g_ready;
+static int g_joined;
+static int g_keyed;
+static unsigned char g_file_chunk[FILE_CHUNK_SIZE];
+static unsigned char g_file_hash[SHA256_DIGEST_LENGTH];
+
+static int load_phase(void) {
+    return __atomic_load_n(&g_phase, __ATOMIC_ACQUIRE);
+}
+
+static void bench_count(unsigned long* counter, unsigned long value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static unsigned long interval_ns(void) {
+    return (unsigned long)(1e9 / g_config.rate);
+}
+
+static unsigned long upload_time(int k) {
+    return g_run_start_ns + (unsigned long)((double)k * g_config.duration * 1e9 / g_config.files);
+}
+
+static void vclient_close(bench_thread_t* t, vclient_t* c) {
+    if (c->state == VC_CLOSED) {
+        return;
+    }
+    if (load_phase() < PHASE_DONE) {
+        t->counters.disconnects++;
+    }
+    epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->state = VC_CLOSED;
+}
+
+static void vclient_flush(bench_thread_t* t, vclient_t* c) {
+    if (ringbuf_used(&c->tx) > 0 && ringbuf_send(&c->tx, c->fd, ringbuf_used(&c->tx)) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        vclient_close(t, c);
+        return;
+    }
+    int want = ringbuf_used(&c->tx) > 0;
+    if (want != c->tx_armed) {
+        struct epoll_event ev = { .events = EPOLLIN | (want ? EPOLLOUT : 0), .data.ptr = c };
+        epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->tx_armed = want;
+    }
+}
+
+// Encode vào hàng đợi gửi, -1 nếu chưa đủ chỗ
+static int vclient_queue_message(vclient_t* c, const message_t* msg) {
+    unsigned char frame[WIRE_MAX_FRAME_SIZE];
+    unsigned char packed[WIRE_MAX_FRAME_SIZE];
+    int len = encode_message_frame(msg, c->wire_version, frame, sizeof(frame));
+    if (len < 0) {
+        return -1;
+    }
+    if ((c->wire_features & WIRE_FEATURE_DEFLATE) && !msg->is_encrypted) {
+        int packed_len = wire_compress_frame(frame, (size_t)len, packed, sizeof(packed));
+        if (packed_len > 0) {
+            return ringbuf_write(&c->tx, packed, (size_t)packed_len);
+        }
+    }
+    return ringbuf_write(&c->tx, frame, (size_t)len);
+}
+
+static void vclient_send_simple(vclient_t* c, message_type_t type, int room_id, const char* content) {
+    message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    msg.room_id = room_id;
+    if (content) {
+        strncpy(msg.content, content, MAX_MESSAGE_LEN - 1);
+    }
+    vclient_queue_message(c, &msg);
+}
+
+static int vclient_connect(vclient_t* c) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)g_config.port);
+    if (inet_pton(AF_INET, g_config.host, &addr.sin_addr) != 1) {
+        return -1;
+    }
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || set_nonblocking(c->fd) < 0) {
+        close(c->fd);
+        return -1;
+    }
+
+    // MSG_JOIN đi theo layout v1, xin nâng lên v2 (và deflate nếu bật)
+    message_t join;
+    memset(&join, 0, sizeof(join));
+    join.type = MSG_JOIN;
+    snprintf(join.username, MAX_USERNAME_LEN, "bench%d", c->index);
+    join.room_id = WIRE_NEGOTIATE_MAGIC | (g_config.deflate ? WIRE_FEATURE_DEFLATE : 0) | WIRE_VERSION_V2;
+    c->wire_version = WIRE_VERSION_LEGACY;
+    return vclient_queue_message(c, &join);
+}
+
+static void vclient_send_chat(bench_thread_t* t, vclient_t* c, unsigned long scheduled_ns) {
+    message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_MESSAGE;
+    int len = snprintf(msg.content, MAX_MESSAGE_LEN, BENCH_MARKER "%lu %d ", scheduled_ns, c->index);
+    static const char filler[] = "hello from chat bench, xin chào cả phòng ";
+    while (len < g_config.msg_size) {
+        msg.content[len] = filler[len % (sizeof(filler) - 1)];
+        len++;
+    }
+    msg.content[len] = '\0';
+
+    if (c->room < g_config.encrypted_rooms && encrypt_message_content(&msg, &c->crypto) != 0) {
+        t->counters.decrypt_errors++;
+        return;
+    }
+    if (vclient_queue_message(c, &msg) < 0) {
+        t->counters.skipped++;
+        return;
+    }
+    t->counters.sent++;
+    __atomic_fetch_add(&g_room_sent[c->room], 1, __ATOMIC_RELAXED);
+}
+
+static void vclient_begin_upload(vclient_t* c, unsigned long now) {
+    int encrypted = c->room < g_config.encrypted_rooms;
+    int chunk_size = encrypted ? FILE_CRYPT_CHUNK_SIZE : FILE_CHUNK_SIZE;
+    long file_size = (long)g_config.file_kb * 1024;
+    char filename[MAX_FILENAME_LEN];
+    snprintf(filename, sizeof(filename), BENCH_FILE_PREFIX "%lu-%d.bin", now, c->next_upload);
+
+    // Chunk mã hóa có nonce ngẫu nhiên nên chỉ file thường mới offer theo hash
+    message_t request;
+    memset(&request, 0, sizeof(request));
+    request.type = g_config.offer && !encrypted ? MSG_FILE_OFFER : MSG_FILE_REQUEST;
+    strncpy(request.content, filename, MAX_MESSAGE_LEN - 1);
+    request.file_size = file_size;
+    request.stream_id = c->next_upload + 1;
+    if (request.type == MSG_FILE_OFFER) {
+        key_to_hex(g_file_hash, SHA256_DIGEST_LENGTH, request.file_hash_hex);
+    }
+    vclient_queue_message(c, &request);
+    c->upload_offered = request.type == MSG_FILE_OFFER;
+    c->upload_stream = request.stream_id;
+    c->upload_chunk = c->upload_offered ? -1 : 0;
+    c->upload_total = (int)((file_size + chunk_size - 1) / chunk_size);
+    c->upload_file_id = random_file_id();
+    c->upload_start_ns = now;
+    c->next_upload += g_config.clients;
+}
+
+// Nội dung file ở offset: g_file_chunk lặp lại
+static int bench_file_read(void* arg, long offset, unsigned char* buf, size_t len) {
+    (void)arg;
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = g_file_chunk[(offset + (long)i) % FILE_CHUNK_SIZE];
+    }
+    return 0;
+}
+
+// Server trả lời offer: ACCEPT thì upload như thường, CHALLENGE thì gửi bằng chứng có file,
+// COMPLETE là đã phát từ cache
+static void vclient_offer_reply(bench_thread_t* t, vclient_t* c, const message_t* msg) {
+    if (!c->upload_offered || msg->stream_id != c->upload_stream) {
+        return;  // COMPLETE của upload trước
+    }
+    message_type_t type = msg->type;
+    if (type == MSG_FILE_CHALLENGE) {
+        unsigned char nonce[FILE_PROOF_NONCE_SIZE];
+        unsigned char proof[SHA256_DIGEST_LENGTH];
+        message_t reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.type = MSG_FILE_PROOF;
+        reply.stream_id = c->upload_stream;
+        hex_to_key(msg->file_hash_hex, nonce, FILE_PROOF_NONCE_SIZE);
+        if (file_proof_digest(nonce, msg->file_size, bench_file_read, NULL, proof) == 0) {
+            key_to_hex(proof, SHA256_DIGEST_LENGTH, reply.file_hash_hex);
+        }
+        vclient_queue_message(c, &reply);
+        return;
+    }
+    c->upload_offered = 0;
+    if (type == MSG_FILE_ACCEPT) {
+        c->upload_chunk = 0;
+    } else if (type == MSG_FILE_COMPLETE) {
+        t->counters.files_sent++;
+        t->counters.files_cached++;
+        __atomic_fetch_add(&g_room_files[c->room], 1, __ATOMIC_RELAXED);
+    } else {
+        t->counters.server_errors++;
+    }
+}
+
+// Đưa thêm chunk vào hàng đợi khi còn chỗ cho cả một frame
+static void vclient_continue_upload(bench_thread_t* t, vclient_t* c) {
+    int encrypted = c->room < g_config.encrypted_rooms;
+    int chunk_size = encrypted ? FILE_CRYPT_CHUNK_SIZE : FILE_CHUNK_SIZE;
+    long file_size = (long)g_config.file_kb * 1024;
+
+    while (c->upload_chunk >= 0 && ringbuf_space(&c->tx) >= WIRE_MAX_FRAME_SIZE) {
+        file_transfer_t ft;
+        memset(&ft, 0, offsetof(file_transfer_t, data));
+        snprintf(ft.filename, MAX_FILENAME_LEN, BENCH_FILE_PREFIX "%lu-%d.bin", c->upload_start_ns,
+                 c->next_upload - g_config.clients);
+        ft.file_size = file_size;
+        ft.sender_id = c->client_id;
+        snprintf(ft.sender_name, MAX_USERNAME_LEN, "bench%d", c->index);
+        ft.chunk_number = c->upload_chunk;
+        ft.total_chunks = c->upload_total;
+        ft.file_id = c->upload_file_id;
+        ft.stream_id = c->upload_stream;
+        long remaining = file_size - (long)c->upload_chunk * chunk_size;
+        int plain_len = remaining < chunk_size ? (int)remaining : chunk_size;
+        if (encrypted) {
+            ft.encrypted = 1;
+            chunk_binding_t binding = { ft.file_id, ft.file_size, ft.total_chunks };
+            ft.data_size = gcm_encrypt_chunk(c->crypto.key, &binding, ft.chunk_number, g_file_chunk,
+                                             plain_len, (unsigned char*)ft.data);
+        } else {
+            // Đã thỏa thuận deflate thì nén từng chunk như chat_client, không nhỏ hơn thì gửi nguyên
+            int len = g_config.deflate && (c->wire_features & WIRE_FEATURE_DEFLATE)
+                          ? compress_buffer(g_file_chunk, (size_t)plain_len, (unsigned char*)ft.data, sizeof(ft.data))
+                          : -1;
+            if (len > 0) {
+                ft.compressed = 1;
+                ft.data_size = len;
+            } else {
+                memcpy(ft.data, g_file_chunk, (size_t)plain_len);
+                ft.data_size = plain_len;
+            }
+        }
+
+        unsigned char frame[WIRE_MAX_FRAME_SIZE];
+        int len = ft.data_size < 0 ? -1 : encode_file_transfer_frame(&ft, c->wire_version, frame, sizeof(frame));
+        if (len < 0 || ringbuf_write(&c->tx, frame, (size_t)len) < 0) {
+            t->counters.protocol_errors++;
+            c->upload_chunk = -1;
+            return;
+        }
+        if (++c->upload_chunk == c->upload_total) {
+            c->upload_chunk = -1;
+            t->counters.files_sent++;
+            __atomic_fetch_add(&g_room_files[c->room], 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void handle_broadcast(bench_thread_t* t, vclient_t* c, message_t* msg) {
+    if (msg->is_encrypted) {
+        if (!c->has_key || decrypt_message_content(msg, &c->crypto) != 0) {
+            t->counters.decrypt_errors++;
+            return;
+        }
+    }
+    if (strncmp(msg->content, BENCH_MARKER, sizeof(BENCH_MARKER) - 1) != 0) {
+        return;  // Thông báo vào/rời phòng
+    }
+    unsigned long sent_ns = strtoul(msg->content + sizeof(BENCH_MARKER) - 1, NULL, 10);
+    unsigned long now = metrics_now_ns();
+    bench_count(&t->counters.delivered, 1);
+    metrics_histogram_add(&t->latency, now > sent_ns ? now - sent_ns : 0);
+}
+
+static void handle_file_chunk(bench_thread_t* t, const file_transfer_t* ft) {
+    t->counters.file_bytes += (unsigned long)ft->data_size;
+    if (ft->chunk_number != ft->total_chunks - 1) {
+        return;
+    }
+    t->counters.files_received++;
+    if (strncmp(ft->filename, BENCH_FILE_PREFIX, sizeof(BENCH_FILE_PREFIX) - 1) == 0) {
+        unsigned long start_ns = strtoul(ft->filename + sizeof(BENCH_FILE_PREFIX) - 1, NULL, 10);
+        unsigned long now = metrics_now_ns();
+        metrics_histogram_add(&t->file_latency, now > start_ns ? now - start_ns : 0);
+    }
+}
+
+static void handle_message(bench_thread_t* t, vclient_t* c, message_t* msg) {
+    switch (msg->type) {
+        case MSG_WELCOME:
+            if ((msg->room_id & WIRE_NEGOTIATE_MASK) == WIRE_NEGOTIATE_MAGIC) {
+                c->wire_version = msg->room_id & WIRE_NEGOTIATE_VERSION_MASK;
+                c->wire_features = msg->room_id & WIRE_FEATURES_SUPPORTED;
+            }
+            c->client_id = msg->client_id;
+            c->state = VC_WAIT_ROOM;
+            __atomic_fetch_add(&g_ready, 1, __ATOMIC_RELAXED);
+            // Client đầu tiên của mỗi phòng là chủ phòng
+            if (c->index < g_config.rooms) {
+                char name[MAX_ROOM_NAME_LEN];
+                snprintf(name, sizeof(name), "bench-%d", c->room);
+                vclient_send_simple(c, MSG_CREATE_ROOM, 0, name);
+            }
+            break;
+        case MSG_ROOM_CREATED:
+            __atomic_store_n(&g_room_ids[c->room], msg->room_id, __ATOMIC_RELEASE);
+            break;
+        case MSG_ROOM_JOINED:
+            c->state = VC_JOINED;
+            __atomic_fetch_add(&g_joined, 1, __ATOMIC_RELAXED);
+            break;
+        case MSG_ROOM_KEY:
+            hex_to_key(msg->room_key_hex, c->crypto.key, AES_KEY_SIZE);
+            hex_to_key(msg->room_iv_hex, c->crypto.iv, AES_IV_SIZE);
+            c->crypto.cipher = msg->is_encrypted == ROOM_CIPHER_GCM ? ROOM_CIPHER_GCM : ROOM_CIPHER_CBC;
+            if (!c->has_key) {
+                c->has_key = 1;
+                __atomic_fetch_add(&g_keyed, 1, __ATOMIC_RELAXED);
+            }
+            break;
+        case MSG_BROADCAST:
+            handle_broadcast(t, c, msg);
+            break;
+        case MSG_FILE_ACCEPT:
+        case MSG_FILE_CHALLENGE:
+        case MSG_FILE_COMPLETE:
+        case MSG_FILE_REJECT:
+            vclient_offer_reply(t, c, msg);
+            break;
+        case MSG_ERROR:
+            t->counters.server_errors++;
+            if (!g_config.json) {
+                fprintf(stderr, "client %d: %s\n", c->index, msg->content);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void vclient_read(bench_thread_t* t, vclient_t* c) {
+    while (c->state != VC_CLOSED) {
+        ssize_t n = ringbuf_recv(&c->rx, c->fd, ringbuf_space(&c->rx));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            vclient_close(t, c);
+            return;
+        }
+
+        frame_t frame;
+        int rc;
+        while ((rc = parse_buffered_frame(&c->rx, c->wire_version, FRAME_MESSAGE, &frame)) > 0) {
+            if (frame.kind == FRAME_FILE_CHUNK) {
+                handle_file_chunk(t, &frame.body.ft);
+            } else {
+                handle_message(t, c, &frame.body.msg);
+            }
+        }
+        if (rc < 0) {
+            t->counters.protocol_errors++;
+            vclient_close(t, c);
+            return;
+        }
+        if (n < 0) {
+            return;
+        }
+    }
+}
+
+// Việc theo lịch và theo giai đoạn của một client
+static void vclient_tick(bench_thread_t* t, vclient_t* c, int phase, unsigned long now) {
+    if (c->state == VC_CLOSED) {
+        return;
+    }
+    if (c->state == VC_WAIT_ROOM) {
+        int room_id = __atomic_load_n(&g_room_ids[c->room], __ATOMIC_ACQUIRE);
+        if (room_id != 0) {
+            vclient_send_simple(c, MSG_JOIN_ROOM, room_id, NULL);
+            c->state = VC_JOINING;
+        }
+    }
+    if (phase == PHASE_ENCRYPT && c->index < g_config.encrypted_rooms && !c->encryption_requested) {
+        message_t msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = MSG_ENABLE_ENCRYPTION;
+        msg.is_encrypted = ROOM_CIPHER_GCM;
+        vclient_queue_message(c, &msg);
+        c->encryption_requested = 1;
+    }
+
+    if (phase == PHASE_RUN && now < g_run_end_ns) {
+        if (c->upload_chunk < 0 && !c->upload_offered && c->next_upload < g_config.files && now >= upload_time(c->next_upload)) {
+            vclient_begin_upload(c, now);
+        }
+        // Đang upload thì server chỉ chờ chunk của client này: tin tới lịch bị bỏ qua
+        while (c->next_send_ns <= now) {
+            if (c->upload_chunk >= 0) {
+                t->counters.skipped++;
+            } else {
+                vclient_send_chat(t, c, c->next_send_ns);
+            }
+            c->next_send_ns += interval_ns();
+        }
+    }
+    if (c->upload_chunk >= 0) {
+        vclient_continue_upload(t, c);
+    }
+    vclient_flush(t, c);
+}
+
+static void* bench_thread_loop(void* arg) {
+    bench_thread_t* t = (bench_thread_t*)arg;
+    struct epoll_event events[BENCH_EPOLL_EVENTS];
+    int scheduled = 0;
+
+    for (int i = 0; i < t->count; i++) {
+        vclient_t* c = &t->clients[i];
+        if (vclient_connect(c) < 0) {
+            t->counters.connect_errors++;
+            c->state = VC_CLOSED;
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+        vclient_flush(t, c);
+    }
+
+    int phase;
+    while ((phase = load_phase()) != PHASE_DONE) {
+        if (phase == PHASE_RUN && !scheduled) {
+            // Rải lịch gửi đều trong một chu kỳ để các client không gửi cùng lúc
+            for (int i = 0; i < t->count; i++) {
+                vclient_t* c = &t->clients[i];
+                c->next_send_ns = g_run_start_ns + interval_ns() * (unsigned long)c->index / (unsigned long)g_config.clients;
+            }
+            scheduled = 1;
+        }
+        int n = epoll_wait(t->epoll_fd, events, BENCH_EPOLL_EVENTS, 1);
+        for (int i = 0; i < n; i++) {
+            vclient_t* c = (vclient_t*)events[i].data.ptr;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                vclient_read(t, c);
+            }
+            if ((events[i].events & EPOLLOUT) && c->state != VC_CLOSED) {
+                vclient_flush(t, c);
+            }
+        }
+        unsigned long now = metrics_now_ns();
+        for (int i = 0; i < t->count; i++) {
+            vclient_tick(t, &t->clients[i], phase, now);
+        }
+    }
+
+    for (int i = 0; i < t->count; i++) {
+        vclient_t* c = &t->clients[i];
+        if (c->state != VC_CLOSED) {
+            close(c->fd);
+        }
+        ringbuf_free(&c->rx);
+        ringbuf_free(&c->tx);
+    }
+    return NULL;
+}
+
+static int wait_for(int* counter, int target, const char* what) {
+    unsigned long deadline = metrics_now_ns() + BENCH_SETUP_TIMEOUT_SECONDS * 1000000000UL;
+    while (__atomic_load_n(counter, __ATOMIC_RELAXED) < target) {
+        if (metrics_now_ns() > deadline) {
+            fprintf(stderr, "Hết thời gian chờ %s: %d/%d\n", what, __atomic_load_n(counter, __ATOMIC_RELAXED), target);
+            return -1;
+        }
+        usleep(1000);
+    }
+    return 0;
+}
+
+static unsigned long total_delivered(bench_thread_t* threads) {
+    unsigned long total = 0;
+    for (int i = 0; i < g_config.threads; i++) {
+        total += __atomic_load_n(&threads[i].counters.delivered, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// Chờ tới khi không còn tin nào tới trong BENCH_DRAIN_IDLE_MS
+static void drain(bench_thread_t* threads) {
+    unsigned long last = total_delivered(threads);
+    int idle_ms = 0;
+    for (int waited = 0; waited < BENCH_DRAIN_MAX_MS && idle_ms < BENCH_DRAIN_IDLE_MS; waited += 10) {
+        usleep(10000);
+        unsigned long now = total_delivered(threads);
+        idle_ms = now == last ? idle_ms + 10 : 0;
+        last = now;
+    }
+}
+
+static void raise_fd_limit(int needed) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)needed) {
+        limit.rlim_cur = limit.rlim_max < (rlim_t)needed ? limit.rlim_max : (rlim_t)needed;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// SHA-256 của file upload: g_file_chunk lặp lại tới đủ --file-size
+static int hash_bench_file(unsigned char* hash) {
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+    long file_size = (long)g_config.file_kb * 1024;
+    for (long offset = 0; offset < file_size; offset += FILE_CHUNK_SIZE) {
+        long len = file_size - offset < FILE_CHUNK_SIZE ? file_size - offset : FILE_CHUNK_SIZE;
+        EVP_DigestUpdate(ctx, g_file_chunk, (size_t)len);
+    }
+    int rc = EVP_DigestFinal_ex(ctx, hash, NULL) == 1 ? 0 : -1;
+    EVP_MD_CTX_free(ctx);
+    return rc;
+}
+
+static void print_usage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --host <ip>              Địa chỉ server (mặc định: 127.0.0.1)\n");
+    printf("  --port <port>            Port server (mặc định: %d)\n", SERVER_PORT);
+    printf("  --clients <n>            Số client ảo (mặc định: %d)\n", g_config.clients);
+    printf("  --threads <n>            Số thread lái client (mặc định: %d)\n", g_config.threads);
+    printf("  --rooms <n>              Số phòng, client i vào phòng i %% n (mặc định: %d)\n", g_config.rooms);
+    printf("  --encrypted-rooms <n>    Số phòng bật AES-256-GCM (mặc định: 0)\n");
+    printf("  --rate <tin/giây>        Tốc độ gửi của mỗi client (mặc định: %.0f)\n", g_config.rate);
+    printf("  --duration <giây>        Thời gian đo (mặc định: %d)\n", g_config.duration);
+    printf("  --msg-size <byte>        Độ dài nội dung tin (mặc định: %d)\n", g_config.msg_size);
+    printf("  --files <n>              Số file upload rải đều trong thời gian đo (mặc định: 0)\n");
+    printf("  --file-size <KB>         Kích thước mỗi file (mặc định: %d)\n", g_config.file_kb);
+    printf("  --deflate                Thỏa thuận nén deflate, chunk file được nén\n");
+    printf("  --offer                  Offer file theo SHA-256 trước khi upload, kiểm tra cache hit\n");
+    printf("  --json                   In kết quả một dòng JSON\n");
+    printf("  --help                   Hiển thị hướng dẫn\n");
+}
+
+static void parse_arguments(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        { "host", required_argument, NULL, 'H' },
+        { "port", required_argument, NULL, 'p' },
+        { "clients", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "rooms", required_argument, NULL, 'r' },
+        { "encrypted-rooms", required_argument, NULL, 'e' },
+        { "rate", required_argument, NULL, 'R' },
+        { "duration", required_argument, NULL, 'd' },
+        { "msg-size", required_argument, NULL, 'm' },
+        { "files", required_argument, NULL, 'f' },
+        { "file-size", required_argument, NULL, 'F' },
+        { "deflate", no_argument, NULL, 'z' },
+        { "offer", no_argument, NULL, 'o' },
+        { "json", no_argument, NULL, 'j' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:c:t:r:e:R:d:m:f:F:zojh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'H': g_config.host = optarg; break;
+            case 'p': g_config.port = atoi(optarg); break;
+            case 'c': g_config.clients = atoi(optarg); break;
+            case 't': g_config.threads = atoi(optarg); break;
+            case 'r': g_config.rooms = atoi(optarg); break;
+            case 'e': g_config.encrypted_rooms = atoi(optarg); break;
+            case 'R': g_config.rate = atof(optarg); break;
+            case 'd': g_config.duration = atoi(optarg); break;
+            case 'm': g_config.msg_size = atoi(optarg); break;
+            case 'f': g_config.files = atoi(optarg); break;
+            case 'F': g_config.file_kb = atoi(optarg); break;
+            case 'z': g_config.deflate = 1; break;
+            case 'o': g_config.offer = 1; break;
+            case 'j': g_config.json = 1; break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (g_config.clients <= 0 || g_config.threads <= 0 || g_config.rooms <= 0 || g_config.rate <= 0 ||
+        g_config.duration <= 0 || g_config.file_kb <= 0 || g_config.files < 0) {
+        fprintf(stderr, "Tham số không hợp lệ\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_config.rooms > g_config.clients) {
+        g_config.rooms = g_config.clients;
+    }
+    if (g_config.threads > g_config.clients) {
+        g_config.threads = g_config.clients;
+    }
+    if (g_config.encrypted_rooms > g_config.rooms) {
+        g_config.encrypted_rooms = g_config.rooms;
+    }
+    // Chừa chỗ cho marker, thời điểm gửi và chỉ số client
+    if (g_config.msg_size < 40) {
+        g_config.msg_size = 40;
+    }
+    // Tin mã hóa phải vừa encrypted_content sau khi thêm nonce/tag hoặc padding
+    if (g_config.msg_size > MAX_MESSAGE_LEN - AES_GCM_OVERHEAD - AES_BLOCK_SIZE) {
+        g_config.msg_size = MAX_MESSAGE_LEN - AES_GCM_OVERHEAD - AES_BLOCK_SIZE;
+    }
+}
+
+typedef struct {
+    bench_counters_t counters;
+    metrics_histogram_t latency;
+    metrics_histogram_t file_latency;
+    unsigned long expected;
+    unsigned long files_expected;
+    double setup_seconds;
+    double run_seconds;
+} bench_result_t;
+
+static void collect(bench_thread_t* threads, bench_result_t* result) {
+    for (int i = 0; i < g_config.threads; i++) {
+        bench_counters_t* c = &threads[i].counters;
+        result->counters.sent += c->sent;
+        result->counters.skipped += c->skipped;
+        result->counters.delivered += c->delivered;
+        result->counters.files_sent += c->files_sent;
+        result->counters.files_received += c->files_received;
+        result->counters.files_cached += c->files_cached;
+        result->counters.file_bytes += c->file_bytes;
+        result->counters.connect_errors += c->connect_errors;
+        result->counters.disconnects += c->disconnects;
+        result->counters.protocol_errors += c->protocol_errors;
+        result->counters.server_errors += c->server_errors;
+        result->counters.decrypt_errors += c->decrypt_errors;
+        metrics_histogram_merge(&result->latency, &threads[i].latency);
+        metrics_histogram_merge(&result->file_latency, &threads[i].file_latency);
+    }
+    // Tin chat tới mọi thành viên kể cả người gửi, file tới mọi người trừ người gửi
+    for (int r = 0; r < g_config.rooms; r++) {
+        result->expected += g_room_sent[r] * (unsigned long)g_room_members[r];
+        result->files_expected += g_room_files[r] * (unsigned long)(g_room_members[r] - 1);
+    }
+}
+
+static void print_text(const bench_result_t* r) {
+    const bench_counters_t* c = &r->counters;
+    metrics_summary_t latency;
+    metrics_summary_t file_latency;
+    metrics_summarize(&r->latency, &latency);
+    metrics_summarize(&r->file_latency, &file_latency);
+
+    printf("%d client, %d thread, %d phòng (%d mã hóa), %.1f tin/giây/client, %d byte, %d giây\n",
+           g_config.clients, g_config.threads, g_config.rooms, g_config.encrypted_rooms, g_config.rate,
+           g_config.msg_size, g_config.duration);
+    printf("setup: %.2f s\n", r->setup_seconds);
+    printf("gửi: %lu tin (%.0f tin/s), bỏ qua %lu\n", c->sent, (double)c->sent / r->run_seconds, c->skipped);
+    printf("nhận: %lu/%lu tin (%.0f tin/s), mất %lu\n", c->delivered, r->expected,
+           (double)c->delivered / r->run_seconds, r->expected > c->delivered ? r->expected - c->delivered : 0);
+    printf("độ trễ us: mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+           latency.mean / 1e3, latency.p50 / 1e3, latency.p90 / 1e3, latency.p99 / 1e3, latency.p999 / 1e3,
+           latency.max / 1e3);
+    if (g_config.files > 0) {
+        printf("file: gửi %lu, nhận %lu/%lu (%.2f MB/s), hoàn tất ms: p50 %.1f, p99 %.1f, max %.1f\n",
+               c->files_sent, c->files_received, r->files_expected, (double)c->file_bytes / r->run_seconds / 1e6,
+               file_latency.p50 / 1e6, file_latency.p99 / 1e6, file_latency.max / 1e6);
+    }
+    if (g_config.offer) {
+        printf("cache: %lu/%lu file phát từ cache\n", c->files_cached, c->files_sent);
+    }
+    printf("lỗi: connect %lu, ngắt kết nối %lu, protocol %lu, server %lu, giải mã %lu\n", c->connect_errors,
+           c->disconnects, c->protocol_errors, c->server_errors, c->decrypt_errors);
+}
+
+static void print_summary_json(const char* name, const metrics_histogram_t* h, double scale) {
+    metrics_summary_t s;
+    metrics_summarize(h, &s);
+    printf("\"%s\":{\"count\":%lu,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+           name, s.count, s.mean / scale, s.p50 / scale, s.p90 / scale, s.p99 / scale, s.p999 / scale, s.max / scale);
+}
+
+static void print_json(const bench_result_t* r) {
+    const bench_counters_t* c = &r->counters;
+    printf("{\"clients\":%d,\"threads\":%d,\"rooms\":%d,\"encrypted_rooms\":%d,\"rate\":%.3f,\"msg_size\":%d,"
+           "\"duration\":%d,\"files\":%d,\"file_kb\":%d,\"deflate\":%d,",
+           g_config.clients, g_config.threads, g_config.rooms, g_config.encrypted_rooms, g_config.rate,
+           g_config.msg_size, g_config.duration, g_config.files, g_config.file_kb, g_config.deflate);
+    printf("\"setup_s\":%.3f,\"sent\":%lu,\"skipped\":%lu,\"delivered\":%lu,\"expected\":%lu,"
+           "\"send_rate\":%.1f,\"delivery_rate\":%.1f,",
+           r->setup_seconds, c->sent, c->skipped, c->delivered, r->expected,
+           (double)c->sent / r->run_seconds, (double)c->delivered / r->run_seconds);
+    print_summary_json("latency_us", &r->latency, 1e3);
+    printf(",\"files_sent\":%lu,\"files_received\":%lu,\"files_expected\":%lu,\"files_cached\":%lu,"
+           "\"file_mb_s\":%.3f,",
+           c->files_sent, c->files_received, r->files_expected, c->files_cached,
+           (double)c->file_bytes / r->run_seconds / 1e6);
+    print_summary_json("file_latency_ms", &r->file_latency, 1e6);
+    printf(",\"errors\":{\"connect\":%lu,\"disconnect\":%lu,\"protocol\":%lu,\"server\":%lu,\"decrypt\":%lu}}\n",
+           c->connect_errors, c->disconnects, c->protocol_errors, c->server_errors, c->decrypt_errors);
+}
+
+int main(int argc, char* argv[]) {
+    parse_arguments(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+    init_crypto();
+    raise_fd_limit(g_config.clients + 64);
+    // 16 ký tự ngẫu nhiên: nén được khoảng một nửa, đủ để deflate có việc thật
+    for (size_t i = 0; i < sizeof(g_file_chunk); i++) {
+        g_file_chunk[i] = (unsigned char)('a' + (rand() & 0x0F));
+    }
+    if (hash_bench_file(g_file_hash) < 0) {
+        error_exit("Không băm được nội dung file");
+    }
+
+    g_room_ids = (int*)calloc((size_t)g_config.rooms, sizeof(int));
+    g_room_members = (int*)calloc((size_t)g_config.rooms, sizeof(int));
+    g_room_sent = (unsigned long*)calloc((size_t)g_config.rooms, sizeof(unsigned long));
+    g_room_files = (unsigned long*)calloc((size_t)g_config.rooms, sizeof(unsigned long));
+    vclient_t* clients = (vclient_t*)calloc((size_t)g_config.clients, sizeof(vclient_t));
+    bench_thread_t* threads = (bench_thread_t*)calloc((size_t)g_config.threads, sizeof(bench_thread_t));
+    if (!g_room_ids || !g_room_members || !g_room_sent || !g_room_files || !clients || !threads) {
+        error_exit("Không đủ bộ nhớ");
+    }
+
+    int keyed_target = 0;
+    for (int i = 0; i < g_config.clients; i++) {
+        vclient_t* c = &clients[i];
+        c->index = i;
+        c->room = i % g_config.rooms;
+        c->upload_chunk = -1;
+        c->next_upload = i;
+        if (ringbuf_init(&c->rx, CLIENT_RX_BUFFER_SIZE) < 0 || ringbuf_init(&c->tx, BENCH_TX_BUFFER_SIZE) < 0) {
+            error_exit("Không đủ bộ nhớ");
+        }
+        g_room_members[c->room]++;
+        if (c->room < g_config.encrypted_rooms) {
+            keyed_target++;
+        }
+    }
+
+    // Client chia liền nhau cho các thread
+    unsigned long setup_start = metrics_now_ns();
+    for (int i = 0; i < g_config.threads; i++) {
+        bench_thread_t* t = &threads[i];
+        int first = (int)((long)g_config.clients * i / g_config.threads);
+        int last = (int)((long)g_config.clients * (i + 1) / g_config.threads);
+        t->index = i;
+        t->clients = clients + first;
+        t->count = last - first;
+        t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (t->epoll_fd < 0 || pthread_create(&t->thread, NULL, bench_thread_loop, t) != 0) {
+            error_exit("Không thể tạo thread");
+        }
+    }
+
+    int rc = 0;
+    if (wait_for(&g_ready, g_config.clients, "MSG_WELCOME") < 0 ||
+        wait_for(&g_joined, g_config.clients, "MSG_ROOM_JOINED") < 0) {
+        rc = -1;
+    } else if (g_config.encrypted_rooms > 0) {
+        __atomic_store_n(&g_phase, PHASE_ENCRYPT, __ATOMIC_RELEASE);
+        rc = wait_for(&g_keyed, keyed_target, "MSG_ROOM_KEY");
+    }
+
+    bench_result_t result;
+    memset(&result, 0, sizeof(result));
+    if (rc == 0) {
+        g_run_start_ns = metrics_now_ns();
+        g_run_end_ns = g_run_start_ns + (unsigned long)g_config.duration * 1000000000UL;
+        result.setup_seconds = (double)(g_run_start_ns - setup_start) / 1e9;
+        __atomic_store_n(&g_phase, PHASE_RUN, __ATOMIC_RELEASE);
+        if (!g_config.json) {
+            fprintf(stderr, "Setup xong sau %.2f s, đang đo %d giây...\n", result.setup_seconds, g_config.duration);
+        }
+        sleep((unsigned)g_config.duration);
+        __atomic_store_n(&g_phase, PHASE_DRAIN, __ATOMIC_RELEASE);
+        drain(threads);
+        result.run_seconds = (double)g_config.duration;
+    }
+    __atomic_store_n(&g_phase, PHASE_DONE, __ATOMIC_RELEASE);
+    for (int i = 0; i < g_config.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        close(threads[i].epoll_fd);
+    }
+    if (rc < 0) {
+        return EXIT_FAILURE;
+    }
+
+    collect(threads, &result);
+    if (g_config.json) {
+        print_json(&result);
+    } else {
+        print_text(&result);
+    }
+
+    const bench_counters_t* c = &result.counters;
+    free(clients);
+    free(threads);
+    // Mọi file cùng nội dung: offer nhiều lần mà không lần nào trúng cache là lỗi
+    int cache_failed = g_config.offer && c->files_sent > 1 && c->files_cached == 0;
+    if (cache_failed && !g_config.json) {
+        fprintf(stderr, "Không có offer nào được phát từ cache\n");
+    }
+    return c->connect_errors || c->disconnects || c->protocol_errors || c->decrypt_errors || cache_failed
+               ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+// Microbenchmark mã hóa message: context mới + key schedule cho mỗi message (cách cũ)
+// so với context đã nạp key của thread, mỗi message chỉ đặt lại IV; GCM từng message
+// so với theo lô.
+//   ./crypto_bench [số message] [độ dài message]
+#include "../common/crypto.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_COUNT 200000
+#define BENCH_DEFAULT_LEN 500
+#define BENCH_MAX_LEN 4096
+#define BENCH_BATCH 16
+
+typedef int (*cipher_fn_t)(const unsigned char* in, int in_len, const unsigned char* key,
+                           const unsigned char* iv, unsigned char* out);
+
+// Cách làm trước đây của encrypt_message/decrypt_message
+static int oneshot(const unsigned char* in, int in_len, const unsigned char* key,
+                   const unsigned char* iv, unsigned char* out, int encrypt) {
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    int len;
+    int out_len = -1;
+    if (ctx && EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, encrypt) == 1 &&
+        EVP_CipherUpdate(ctx, out, &len, in, in_len) == 1) {
+        out_len = len;
+        if (EVP_CipherFinal_ex(ctx, out + len, &len) == 1) {
+            out_len += len;
+        } else {
+            out_len = -1;
+        }
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return out_len;
+}
+
+static int encrypt_oneshot(const unsigned char* in, int in_len, const unsigned char* key,
+                           const unsigned char* iv, unsigned char* out) {
+    return oneshot(in, in_len, key, iv, out, 1);
+}
+
+static int decrypt_oneshot(const unsigned char* in, int in_len, const unsigned char* key,
+                           const unsigned char* iv, unsigned char* out) {
+    return oneshot(in, in_len, key, iv, out, 0);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double run(cipher_fn_t fn, const unsigned char* in, int in_len, const room_crypto_t* crypto,
+                  unsigned char* out, int count) {
+    double start = now_seconds();
+    for (int i = 0; i < count; i++) {
+        if (fn(in, in_len, crypto->key, crypto->iv, out) < 0) {
+            fprintf(stderr, "cipher failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (double)count / (now_seconds() - start);
+}
+
+// GCM theo lô batch message, batch = 1 là từng message một
+static double run_gcm(const unsigned char* in, int in_len, const room_crypto_t* crypto,
+                      int encrypt, int batch, int count) {
+    static unsigned char out[BENCH_BATCH][BENCH_MAX_LEN + AES_GCM_OVERHEAD];
+    cipher_batch_item_t items[BENCH_BATCH];
+    for (int i = 0; i < batch; i++) {
+        items[i].in = in;
+        items[i].in_len = in_len;
+        items[i].out = out[i];
+    }
+
+    double start = now_seconds();
+    for (int done = 0; done < count; done += batch) {
+        int ok = encrypt ? gcm_encrypt_batch(crypto->key, items, batch)
+                         : gcm_decrypt_batch(crypto->key, items, batch);
+        if (ok != batch) {
+            fprintf(stderr, "cipher failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (double)count / (now_seconds() - start);
+}
+
+int main(int argc, char* argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_COUNT;
+    int len = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_LEN;
+    if (count <= 0 || len <= 0 || len > BENCH_MAX_LEN) {
+        fprintf(stderr, "Usage: %s [count > 0] [1..%d]\n", argv[0], BENCH_MAX_LEN);
+        return EXIT_FAILURE;
+    }
+
+    init_crypto();
+    room_crypto_t crypto;
+    generate_room_key(&crypto, ROOM_CIPHER_CBC);
+
+    unsigned char plaintext[BENCH_MAX_LEN];
+    unsigned char ciphertext[BENCH_MAX_LEN + AES_BLOCK_SIZE];
+    unsigned char decrypted[BENCH_MAX_LEN + AES_BLOCK_SIZE];
+    RAND_bytes(plaintext, len);
+
+    // Hai cách phải cho cùng kết quả
+    int cipher_len = encrypt_message(plaintext, len, crypto.key, crypto.iv, ciphertext);
+    if (cipher_len < 0 || decrypt_oneshot(ciphertext, cipher_len, crypto.key, crypto.iv, decrypted) != len ||
+        memcmp(decrypted, plaintext, (size_t)len) != 0) {
+        fprintf(stderr, "Kết quả mã hóa không khớp\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%d message, %d byte mỗi message\n", count, len);
+    printf("%-32s %12.0f msg/s\n", "encrypt: context mới mỗi lần",
+           run(encrypt_oneshot, plaintext, len, &crypto, ciphertext, count));
+    printf("%-32s %12.0f msg/s\n", "encrypt: context dùng lại",
+           run(encrypt_message, plaintext, len, &crypto, ciphertext, count));
+    printf("%-32s %12.0f msg/s\n", "decrypt: context mới mỗi lần",
+           run(decrypt_oneshot, ciphertext, cipher_len, &crypto, decrypted, count));
+    printf("%-32s %12.0f msg/s\n", "decrypt: context dùng lại",
+           run(decrypt_message, ciphertext, cipher_len, &crypto, decrypted, count));
+
+    unsigned char sealed[BENCH_MAX_LEN + AES_GCM_OVERHEAD];
+    cipher_batch_item_t item = { plaintext, len, sealed, -1 };
+    gcm_encrypt_batch(crypto.key, &item, 1);
+    int sealed_len = item.out_len;
+    printf("%-32s %12.0f msg/s\n", "gcm encrypt: từng message", run_gcm(plaintext, len, &crypto, 1, 1, count));
+    printf("%-32s %12.0f msg/s\n", "gcm encrypt: lô 16", run_gcm(plaintext, len, &crypto, 1, BENCH_BATCH, count));
+    printf("%-32s %12.0f msg/s\n", "gcm decrypt: từng message", run_gcm(sealed, sealed_len, &crypto, 0, 1, count));
+    printf("%-32s %12.0f msg/s\n", "gcm decrypt: lô 16", run_gcm(sealed, sealed_len, &crypto, 0, BENCH_BATCH, count));
+
+    cleanup_crypto();
+    return 0;
+}
@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+// Microbenchmark các hàm nóng của common/utils.c và common/crypto.c: gửi/nhận message qua
+// socketpair, mã hóa/giải mã nội dung tin, key <-> hex, list_rooms với nhiều phòng và
+// broadcast_to_room tới N thành viên loopback. Mỗi case chạy warmup để chọn số op, rồi
+// lặp lại nhiều lần và in trung vị (và min) ns/op cùng cycles/op.
+// Cycles lấy từ perf (PERF_COUNT_HW_CPU_CYCLES, tính cả kernel) nếu được phép, không thì
+// từ TSC (x86, tần số danh định chứ không phải tần số thực của core).
+//   ./micro_bench [số lần lặp] [lọc theo tên]
+#include "../common/protocol.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#define MICRO_DEFAULT_REPETITIONS 7
+#define MICRO_MAX_REPETITIONS 64
+#define MICRO_WARMUP_NS 50000000UL         // 50 ms
+#define MICRO_REPETITION_NS 100000000UL    // Mỗi lần lặp khoảng 100 ms
+#define MICRO_CONTENT_LEN 64
+#define MICRO_LIST_ROOMS 1000
+#define MICRO_MAX_MEMBERS 64
+
+typedef struct {
+    const char* name;
+    int (*setup)(void);           // 0 = sẵn sàng
+    void (*op)(void);
+    void (*reset)(void);          // Không tính giờ, gọi giữa các batch (đọc hết socket), có thể NULL
+    void (*teardown)(void);
+    int batch;                    // Số op tối đa giữa hai lần reset
+    int members;                  // Số thành viên cho case broadcast
+} micro_case_t;
+
+typedef enum {
+    CYCLES_NONE = 0,
+    CYCLES_PERF,
+    CYCLES_TSC
+} cycles_source_t;
+
+static cycles_source_t g_cycles_source = CYCLES_NONE;
+static int g_perf_fd = -1;
+
+// Trạng thái dùng chung của các case, dựng lại trong setup
+static int g_pair[2] = { -1, -1 };
+static message_t g_message;
+static message_t g_received;
+static frame_t g_frame;
+static message_t g_encrypted;
+static room_crypto_t g_crypto;
+static char g_content[MICRO_CONTENT_LEN + 1];
+static unsigned char g_key[AES_KEY_SIZE];
+static char g_key_hex[AES_KEY_SIZE * 2 + 1];
+static server_t g_bench_server;
+static client_t* g_clients[MICRO_MAX_MEMBERS];
+static int g_peers[MICRO_MAX_MEMBERS];
+static int g_client_count;
+static int g_room_id;
+static const micro_case_t* g_current;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static unsigned long read_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+static void cycles_init(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_hv = 1;
+    g_perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (g_perf_fd >= 0) {
+        g_cycles_source = CYCLES_PERF;
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    g_cycles_source = CYCLES_TSC;
+#endif
+}
+
+static unsigned long read_cycles(void) {
+    if (g_cycles_source == CYCLES_PERF) {
+        unsigned long count = 0;
+        if (read(g_perf_fd, &count, sizeof(count)) != (ssize_t)sizeof(count)) {
+            return 0;
+        }
+        return count;
+    }
+    return g_cycles_source == CYCLES_TSC ? read_tsc() : 0;
+}
+
+static void fill_message(message_t* msg, message_type_t type) {
+    memset(msg, 0, sizeof(*msg));
+    msg->type = type;
+    strcpy(msg->username, "micro");
+    strcpy(msg->content, g_content);
+    msg->room_id = 1;
+    msg->client_id = 1;
+    msg->timestamp = time(NULL);
+}
+
+static void drain_socket(int fd) {
+    char buf[65536];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+}
+
+// socketpair --------------------------------------------------------------
+
+static int setup_pair(void) {
+    fill_message(&g_message, MSG_BROADCAST);
+    return socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, g_pair);
+}
+
+static void teardown_pair(void) {
+    close(g_pair[0]);
+    close(g_pair[1]);
+}
+
+static void op_send_receive_v1(void) {
+    send_message(g_pair[0], &g_message);
+    receive_message(g_pair[1], &g_received);
+}
+
+static void op_send_receive_v2(void) {
+    send_message_wire(g_pair[0], &g_message, WIRE_VERSION_V2);
+    receive_frame(g_pair[1], WIRE_VERSION_V2, FRAME_MESSAGE, &g_frame);
+}
+
+// Mã hóa ------------------------------------------------------------------
+
+static int setup_crypto(room_cipher_t cipher) {
+    generate_room_key(&g_crypto, cipher);
+    fill_message(&g_message, MSG_MESSAGE);
+    fill_message(&g_encrypted, MSG_MESSAGE);
+    return encrypt_message_content(&g_encrypted, &g_crypto);
+}
+
+static int setup_cbc(void) {
+    return setup_crypto(ROOM_CIPHER_CBC);
+}
+
+static int setup_gcm(void) {
+    return setup_crypto(ROOM_CIPHER_GCM);
+}
+
+// encrypt_message_content xóa plaintext nên mỗi op chép lại MICRO_CONTENT_LEN byte
+static void op_encrypt(void) {
+    memcpy(g_message.content, g_content, sizeof(g_content));
+    encrypt_message_content(&g_message, &g_crypto);
+}
+
+static void op_decrypt(void) {
+    decrypt_message_content(&g_encrypted, &g_crypto);
+}
+
+// Hex ---------------------------------------------------------------------
+
+static int setup_hex(void) {
+    for (int i = 0; i < AES_KEY_SIZE; i++) {
+        g_key[i] = (unsigned char)(i * 37 + 11);
+    }
+    key_to_hex(g_key, AES_KEY_SIZE, g_key_hex);
+    return 0;
+}
+
+static void op_key_to_hex(void) {
+    key_to_hex(g_key, AES_KEY_SIZE, g_key_hex);
+}
+
+static void op_hex_to_key(void) {
+    hex_to_key(g_key_hex, g_key, AES_KEY_SIZE);
+}
+
+// Phòng -------------------------------------------------------------------
+
+// Client của server nối với một đầu socketpair, đầu kia bench đọc bỏ
+static client_t* bench_client(int index) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        return NULL;
+    }
+    client_t* client = (client_t*)calloc(1, sizeof(client_t));
+    if (!client) {
+        close(pair[0]);
+        close(pair[1]);
+        return NULL;
+    }
+    client->socket_fd = pair[0];
+    client->client_id = index + 1;
+    snprintf(client->username, MAX_USERNAME_LEN, "member%d", index);
+    client->current_room_id = -1;
+    client->room_index = -1;
+    client->wire_version = WIRE_VERSION_V2;
+    client->epoll_fd = -1;
+    pthread_mutex_init(&client->tx_mutex, NULL);
+    pthread_cond_init(&client->tx_cond, NULL);
+    g_peers[index] = pair[1];
+    return client;
+}
+
+static void reset_clients(void) {
+    for (int i = 0; i < g_client_count; i++) {
+        drain_socket(g_peers[i]);
+        // Phần còn trong hàng đợi (socket đã đầy lúc gửi) được đẩy tiếp
+        client_flush_output(g_clients[i]);
+        drain_socket(g_peers[i]);
+    }
+}
+
+static void teardown_clients(void) {
+    for (int i = 0; i < g_client_count; i++) {
+        if (g_clients[i]->current_room_id != -1) {
+            remove_client_from_room(&g_bench_server, g_clients[i]->current_room_id, g_clients[i]);
+        }
+        close(g_clients[i]->socket_fd);
+        close(g_peers[i]);
+        pthread_mutex_destroy(&g_clients[i]->tx_mutex);
+        pthread_cond_destroy(&g_clients[i]->tx_cond);
+        free(g_clients[i]);
+    }
+    g_client_count = 0;
+    registry_destroy(&g_bench_server);
+}
+
+static int setup_list_rooms(void) {
+    registry_init(&g_bench_server, 1);
+    for (int i = 0; i < MICRO_LIST_ROOMS; i++) {
+        char name[MAX_ROOM_NAME_LEN];
+        snprintf(name, sizeof(name), "room-%d", i);
+        create_room(&g_bench_server, name);
+    }
+    g_clients[0] = bench_client(0);
+    g_client_count = g_clients[0] ? 1 : 0;
+    return g_client_count == 1 ? 0 : -1;
+}
+
+static void op_list_rooms(void) {
+    list_rooms(&g_bench_server, g_clients[0]);
+}
+
+static int setup_broadcast(void) {
+    registry_init(&g_bench_server, 1);
+    room_t* room = create_room(&g_bench_server, "broadcast");
+    g_room_id = room->room_id;
+    for (int i = 0; i < g_current->members; i++) {
+        g_clients[i] = bench_client(i);
+        if (!g_clients[i] || add_client_to_room(&g_bench_server, g_room_id, g_clients[i]) < 0) {
+            return -1;
+        }
+        g_clients[i]->current_room_id = g_room_id;
+        g_client_count = i + 1;
+    }
+    fill_message(&g_message, MSG_BROADCAST);
+    g_message.room_id = g_room_id;
+    return 0;
+}
+
+static void op_broadcast(void) {
+    broadcast_to_room(&g_bench_server, g_room_id, &g_message, -1);
+}
+
+// Trace -------------------------------------------------------------------
+
+// Bật trace cho cả tiến trình nên phải là case cuối, các case trước đo khi trace tắt
+static int setup_trace(void) {
+    return trace_init(TRACE_DEFAULT_EVENTS, "/tmp");
+}
+
+static void op_trace_event(void) {
+    trace_event(TRACE_SEND_BEGIN, 1, MICRO_CONTENT_LEN);
+}
+
+static const micro_case_t g_cases[] = {
+    { "send_message+receive_message v1", setup_pair, op_send_receive_v1, NULL, teardown_pair, 1 << 20, 0 },
+    { "send_message_wire+receive_frame v2", setup_pair, op_send_receive_v2, NULL, teardown_pair, 1 << 20, 0 },
+    { "encrypt_message_content cbc", setup_cbc, op_encrypt, NULL, NULL, 1 << 20, 0 },
+    { "decrypt_message_content cbc", setup_cbc, op_decrypt, NULL, NULL, 1 << 20, 0 },
+    { "encrypt_message_content gcm", setup_gcm, op_encrypt, NULL, NULL, 1 << 20, 0 },
+    { "decrypt_message_content gcm", setup_gcm, op_decrypt, NULL, NULL, 1 << 20, 0 },
+    { "key_to_hex 32B", setup_hex, op_key_to_hex, NULL, NULL, 1 << 20, 0 },
+    { "hex_to_key 32B", setup_hex, op_hex_to_key, NULL, NULL, 1 << 20, 0 },
+    { "list_rooms 1000 rooms", setup_list_rooms, op_list_rooms, reset_clients, teardown_clients, 64, 0 },
+    { "broadcast_to_room 1 member", setup_broadcast, op_broadcast, reset_clients, teardown_clients, 256, 1 },
+    { "broadcast_to_room 8 members", setup_broadcast, op_broadcast, reset_clients, teardown_clients, 256, 8 },
+    { "broadcast_to_room 64 members", setup_broadcast, op_broadcast, reset_clients, teardown_clients, 256, 64 },
+    { "trace_event (enabled)", setup_trace, op_trace_event, NULL, NULL, 1 << 20, 0 },
+};
+
+typedef struct {
+    double ns_per_op;
+    double cycles_per_op;
+} micro_sample_t;
+
+// Chạy ops op, chỉ tính giờ phần op (reset giữa các batch không tính)
+static micro_sample_t run_ops(const micro_case_t* c, long ops) {
+    unsigned long ns = 0;
+    unsigned long cycles = 0;
+    for (long done = 0; done < ops;) {
+        long n = ops - done < c->batch ? ops - done : c->batch;
+        unsigned long start_cycles = read_cycles();
+        unsigned long start = now_ns();
+        for (long i = 0; i < n; i++) {
+            c->op();
+        }
+        ns += now_ns() - start;
+        cycles += read_cycles() - start_cycles;
+        done += n;
+        if (c->reset) {
+            c->reset();
+        }
+    }
+    micro_sample_t sample = { (double)ns / (double)ops, (double)cycles / (double)ops };
+    return sample;
+}
+
+static int compare_samples(const void* a, const void* b) {
+    double x = ((const micro_sample_t*)a)->ns_per_op;
+    double y = ((const micro_sample_t*)b)->ns_per_op;
+    return x < y ? -1 : x > y;
+}
+
+static void run_case(const micro_case_t* c, int repetitions) {
+    g_current = c;
+    if (c->setup && c->setup() != 0) {
+        printf("%-38s lỗi setup\n", c->name);
+        if (c->teardown) {
+            c->teardown();
+        }
+        return;
+    }
+
+    // Warmup: tăng gấp đôi số op tới khi đủ MICRO_WARMUP_NS, rồi chọn số op cho mỗi lần lặp
+    long ops = 1;
+    micro_sample_t sample;
+    for (;;) {
+        unsigned long start = now_ns();
+        sample = run_ops(c, ops);
+        if (now_ns() - start >= MICRO_WARMUP_NS) {
+            break;
+        }
+        ops *= 2;
+    }
+    ops = (long)((double)MICRO_REPETITION_NS / (sample.ns_per_op > 1.0 ? sample.ns_per_op : 1.0));
+    if (ops < 1) {
+        ops = 1;
+    }
+
+    micro_sample_t samples[MICRO_MAX_REPETITIONS];
+    for (int r = 0; r < repetitions; r++) {
+        samples[r] = run_ops(c, ops);
+    }
+    qsort(samples, (size_t)repetitions, sizeof(samples[0]), compare_samples);
+    micro_sample_t median = samples[repetitions / 2];
+
+    printf("%-38s %12.1f %12.1f", c->name, median.ns_per_op, samples[0].ns_per_op);
+    if (g_cycles_source != CYCLES_NONE) {
+        printf(" %12.0f", median.cycles_per_op);
+    } else {
+        printf(" %12s", "-");
+    }
+    printf(" %12ld\n", ops);
+    fflush(stdout);
+
+    if (c->teardown) {
+        c->teardown();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int repetitions = argc > 1 ? atoi(argv[1]) : MICRO_DEFAULT_REPETITIONS;
+    const char* filter = argc > 2 ? argv[2] : NULL;
+    if (repetitions <= 0 || repetitions > MICRO_MAX_REPETITIONS) {
+        fprintf(stderr, "Usage: %s [1..%d lần lặp] [lọc theo tên]\n", argv[0], MICRO_MAX_REPETITIONS);
+        return EXIT_FAILURE;
+    }
+
+    init_crypto();
+    cycles_init();
+    memset(g_content, 'a', MICRO_CONTENT_LEN);
+    g_content[MICRO_CONTENT_LEN] = '\0';
+
+    static const char* const sources[] = { "không có", "perf cpu-cycles", "TSC" };
+    printf("%d lần lặp, tin %d byte, cycles: %s\n", repetitions, MICRO_CONTENT_LEN, sources[g_cycles_source]);
+    printf("%-38s %12s %12s %12s %12s\n", "case", "ns/op", "min ns/op", "cycles/op", "ops/rep");
+    for (size_t i = 0; i < sizeof(g_cases) / sizeof(g_cases[0]); i++) {
+        if (!filter || strstr(g_cases[i].name, filter)) {
+            run_case(&g_cases[i], repetitions);
+        }
+    }
+    return 0;
+}
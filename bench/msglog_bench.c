@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+// Benchmark log tin chat: số tin/giây duy trì được khi nhiều thread cùng append vào msglog.
+// So sánh chỉ ghi page cache, group commit với vài chu kỳ khác nhau, và fdatasync mỗi tin
+// (cách ngây thơ, để thấy group commit tiết kiệm bao nhiêu).
+//   ./msglog_bench [giây mỗi chế độ] [số thread] [thư mục tạm]
+#include "../server/server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define BENCH_DEFAULT_SECONDS 3
+#define BENCH_DEFAULT_THREADS 4
+#define BENCH_ROOMS 64
+#define BENCH_FRAME_LEN 120
+
+typedef struct {
+    int index;
+    int threads;
+    int fd;                       // >= 0: ghi và fdatasync trực tiếp mỗi tin
+    unsigned long count;
+} bench_thread_t;
+
+static volatile int g_running;
+static unsigned char g_frame[BENCH_FRAME_LEN];
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void* bench_producer(void* arg) {
+    bench_thread_t* t = (bench_thread_t*)arg;
+    long seqs[BENCH_ROOMS] = { 0 };
+    int room = t->index;
+    while (g_running) {
+        long seq = ++seqs[room];
+        if (t->fd >= 0) {
+            if (write(t->fd, g_frame, sizeof(g_frame)) < 0 || fdatasync(t->fd) < 0) {
+                perror("write");
+                break;
+            }
+        } else {
+            msglog_append(room + 1, seq, time(NULL), g_frame, sizeof(g_frame));
+        }
+        t->count++;
+        // Mỗi thread một nhóm phòng riêng nên seq của phòng vẫn tăng dần
+        room += t->threads;
+        if (room >= BENCH_ROOMS) {
+            room = t->index;
+        }
+    }
+    return NULL;
+}
+
+// Tin/giây mà producer đưa vào, *elapsed là thời gian đo thực tế
+static double run_producers(int threads, int seconds, int fd, double* elapsed) {
+    pthread_t ids[threads];
+    bench_thread_t args[threads];
+    g_running = 1;
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (bench_thread_t){ i, threads, fd, 0 };
+        pthread_create(&ids[i], NULL, bench_producer, &args[i]);
+    }
+    sleep((unsigned)seconds);
+    g_running = 0;
+    unsigned long total = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        total += args[i].count;
+    }
+    *elapsed = now_seconds() - start;
+    return (double)total / *elapsed;
+}
+
+static void clear_dir(const char* dir) {
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    if (system(command) != 0) {
+        fprintf(stderr, "Không xóa được %s\n", dir);
+    }
+}
+
+static void run_log(const char* label, const char* dir, int sync_ms, int threads, int seconds) {
+    clear_dir(dir);
+    msglog_config_t config = { dir, sync_ms, 0, 0 };
+    if (msglog_open(&config) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    for (int room = 1; room <= BENCH_ROOMS; room++) {
+        msglog_room_created(room, "bench", 0);
+    }
+    double elapsed;
+    double rate = run_producers(threads, seconds, -1, &elapsed);
+    msglog_stats_t stats;
+    msglog_get_stats(&stats);
+    msglog_close();
+    // Tin bị bỏ khi bộ đệm shard đầy không tính: chỉ đo phần đĩa theo kịp
+    rate -= (double)stats.records_dropped / elapsed;
+
+    printf("%-28s %12.0f msg/s", label, rate);
+    if (stats.syncs > 0) {
+        printf("   %lu fdatasync, %.0f tin/sync, sync tb %.2f ms", stats.syncs,
+               (double)stats.records_synced / (double)stats.syncs, (double)stats.sync_ns_total / (double)stats.syncs / 1e6);
+    }
+    if (stats.records_dropped > 0) {
+        printf(", bỏ %lu tin vì bộ đệm đầy", stats.records_dropped);
+    }
+    printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+    int seconds = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_SECONDS;
+    int threads = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_THREADS;
+    const char* dir = argc > 3 ? argv[3] : "msglog_bench.tmp";
+    if (seconds <= 0 || threads <= 0 || threads > BENCH_ROOMS) {
+        fprintf(stderr, "Usage: %s [giây > 0] [1..%d thread] [thư mục]\n", argv[0], BENCH_ROOMS);
+        return EXIT_FAILURE;
+    }
+    memset(g_frame, 'x', sizeof(g_frame));
+
+    printf("%d thread, %d phòng, frame %d byte, %d giây mỗi chế độ\n", threads, BENCH_ROOMS,
+           BENCH_FRAME_LEN, seconds);
+    run_log("log, không fdatasync", dir, 0, threads, seconds);
+    run_log("group commit 10 ms", dir, 10, threads, seconds);
+    run_log("group commit 1 ms", dir, 1, threads, seconds);
+
+    clear_dir(dir);
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return EXIT_FAILURE;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/direct.log", dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+    double elapsed;
+    printf("%-28s %12.0f msg/s\n", "fdatasync mỗi tin", run_producers(threads, seconds, fd, &elapsed));
+    close(fd);
+    clear_dir(dir);
+    return 0;
+}
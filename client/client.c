@@ -1,4 +1,6 @@
 #include "../common/protocol.h"
+#include "download.h"
+#include "upload.h"
 #include <signal.h>
 #ifdef _WIN32
     #include <direct.h>
@@ -18,28 +20,168 @@ typedef struct {
     pthread_t receive_thread;
     pthread_t input_thread;
     pthread_mutex_t socket_mutex;
+    send_lanes_t lanes;           // Frame control gửi trước chunk file (upload.c) trên socket_mutex
+    ringbuf_t rx;                 // Chỉ receive thread đọc/ghi
+    int wire_version;
+    int wire_features;            // WIRE_FEATURE_* server đã chấp nhận
+    int negotiating;              // Đang chờ MSG_WELCOME sau khi gửi MSG_JOIN
+    pthread_cond_t negotiated_cond;
+    // Lịch sử phòng: seq lớn nhất đã hiện của history_room, vào lại phòng đó chỉ xin phần đã lỡ.
+    // Lô phát lại có thể đến sau vài tin trực tiếp, tin từ live_first trở đi đã hiện rồi.
+    int history_room;
+    long history_seq;
+    long history_since;           // Seq đã gửi trong yêu cầu phát lại gần nhất
+    long live_first;              // Seq của tin trực tiếp đầu tiên sau yêu cầu đó, 0 = chưa có
+    int in_history;               // Đang ở giữa MSG_HISTORY_BEGIN và MSG_HISTORY_END
     int running;
 } client_data_t;
 
 client_data_t g_client;
 
+// Tin đã hiện (trực tiếp hoặc trong lô trước) thì bỏ qua, 0 = không hiện
+static int history_should_show(const message_t* msg) {
+    long seq = msg->history_seq;
+    if (seq <= 0) {
+        return 1;
+    }
+    if (g_client.in_history) {
+        if (seq <= g_client.history_since || (g_client.live_first && seq >= g_client.live_first)) {
+            return 0;
+        }
+    } else if (!g_client.live_first) {
+        g_client.live_first = seq;
+    }
+    if (seq > g_client.history_seq) {
+        g_client.history_seq = seq;
+    }
+    return 1;
+}
+
+// Chuẩn bị nhận lô phát lại cho các tin có seq > since
+static void history_expect(int room_id, long since) {
+    if (room_id != g_client.history_room) {
+        g_client.history_room = room_id;
+        g_client.history_seq = 0;
+    }
+    g_client.history_since = since;
+    g_client.live_first = 0;
+}
+
+// Tin mã hóa đầu tiên đã nhận: gom thêm các tin mã hóa đã nằm sẵn trong rx rồi giải mã
+// cả lô một lượt. Frame khác gặp giữa chừng được trả qua next (1), 0 nếu không có,
+// -1 nếu rx chứa dữ liệu sai định dạng.
+static int receive_encrypted_batch(const message_t* first, frame_t* next) {
+    message_t batch[MESSAGE_BATCH_MAX];
+    int results[MESSAGE_BATCH_MAX];
+    int count = 0;
+    int rc = 0;
+
+    if (history_should_show(first)) {
+        batch[count++] = *first;
+    }
+    while (count < MESSAGE_BATCH_MAX) {
+        int parsed = parse_buffered_frame(&g_client.rx, g_client.wire_version, FRAME_MESSAGE, next);
+        if (parsed <= 0) {
+            rc = parsed;
+            break;
+        }
+        if (next->kind != FRAME_MESSAGE || next->body.msg.type != MSG_BROADCAST ||
+            !next->body.msg.is_encrypted) {
+            rc = 1;
+            break;
+        }
+        if (history_should_show(&next->body.msg)) {
+            batch[count++] = next->body.msg;
+        }
+    }
+    if (count == 0) {
+        return rc;
+    }
+
+    decrypt_message_content_batch(batch, count, &g_client.current_room_crypto, results);
+    for (int i = 0; i < count; i++) {
+        if (results[i] == 0) {
+            print_message(&batch[i]);
+        } else {
+            printf("❌ Không thể giải mã tin nhắn\n");
+        }
+    }
+    return rc;
+}
+
 void* receive_messages(void* arg) {
     (void)arg;
     message_t msg;
+    frame_t pending;
+    int has_pending = 0;
 
     while (g_client.running) {
-        if (receive_message(g_client.socket_fd, &msg) < 0) {
+        frame_t frame;
+        if (has_pending) {
+            frame = pending;
+            has_pending = 0;
+        } else if (receive_buffered_frame(g_client.socket_fd, &g_client.rx, g_client.wire_version,
+                                          FRAME_MESSAGE, &frame) < 0) {
             if (g_client.running) {
                 printf("\nKết nối đến server bị ngắt!\n");
             }
             break;
         }
+        if (frame.kind == FRAME_FILE_CHUNK) {
+            // Chỉ chép chunk cho writer thread rồi đọc tiếp, tin chat xen giữa vẫn hiện ngay
+            if (download_submit(&frame.body.ft, g_client.has_room_key ? &g_client.current_room_crypto : NULL) < 0) {
+                printf("Lỗi nhận file!\n");
+            }
+            continue;
+        }
+        msg = frame.body.msg;
 
         // Update client state based on message type
+        if (msg.type == MSG_WELCOME) {
+            // Server chấp nhận nâng cấp protocol: các frame sau dùng version mới
+            pthread_mutex_lock(&g_client.socket_mutex);
+            if ((msg.room_id & WIRE_NEGOTIATE_MASK) == WIRE_NEGOTIATE_MAGIC) {
+                int version = msg.room_id & WIRE_NEGOTIATE_VERSION_MASK;
+                if (version >= WIRE_VERSION_LEGACY && version <= WIRE_VERSION_MAX) {
+                    g_client.wire_version = version;
+                    g_client.wire_features = version == WIRE_VERSION_V2 ? msg.room_id & WIRE_FEATURES_SUPPORTED : 0;
+                }
+            }
+            g_client.negotiating = 0;
+            pthread_cond_broadcast(&g_client.negotiated_cond);
+            pthread_mutex_unlock(&g_client.socket_mutex);
+        }
         if (msg.type == MSG_ROOM_CREATED) {
             print_message(&msg);
             continue;
         }
+        if (msg.type == MSG_HISTORY_BEGIN) {
+            g_client.in_history = 1;
+            printf("📜 --- %s ---\n", msg.content);
+            continue;
+        }
+        if (msg.type == MSG_HISTORY_END) {
+            if (g_client.in_history) {
+                printf("📜 --- Hết lịch sử ---\n");
+            } else {
+                printf("📜 %s\n", msg.content);
+            }
+            g_client.in_history = 0;
+            continue;
+        }
+        if (msg.type == MSG_BROADCAST && !msg.is_encrypted && !history_should_show(&msg)) {
+            continue;
+        }
+        // Trả lời về một stream đang gửi: đánh thức thread gửi của stream đó
+        if (msg.type == MSG_FILE_ACCEPT || msg.type == MSG_FILE_CHALLENGE) {
+            upload_reply(&msg);
+            continue;
+        }
+        if (msg.type == MSG_FILE_COMPLETE || msg.type == MSG_FILE_REJECT) {
+            upload_reply(&msg);
+        } else if (msg.type == MSG_ERROR) {
+            upload_fail_offers();
+        }
         if (msg.type == MSG_ROOM_JOINED) {
             g_client.current_room_id = msg.room_id;
         } else if (msg.type == MSG_ROOM_LEFT) {
@@ -47,6 +189,10 @@ void* receive_messages(void* arg) {
         } else if (msg.type == MSG_FILE_NOTIFICATION) {
             // Incoming file notification
             print_message(&msg);
+            // v2: chunk có header riêng và được ghi nền (download.c), không chặn luồng chat
+            if (g_client.wire_version == WIRE_VERSION_V2) {
+                continue;
+            }
             printf("Đang nhận file...\n");
 
             // Create downloads directory if not exists
@@ -57,7 +203,7 @@ void* receive_messages(void* arg) {
             #endif
 
             // Receive file and save to downloads folder
-            if (receive_file(g_client.socket_fd, "downloads") < 0) {
+            if (receive_file(g_client.socket_fd, &g_client.rx, "downloads") < 0) {
                 printf("Lỗi nhận file!\n");
             } else {
                 printf("File đã được lưu vào trong thư mục: downloads/\n");
@@ -69,6 +215,9 @@ void* receive_messages(void* arg) {
             // Nhận key mã hóa từ server
             hex_to_key(msg.room_key_hex, g_client.current_room_crypto.key, AES_KEY_SIZE);
             hex_to_key(msg.room_iv_hex, g_client.current_room_crypto.iv, AES_IV_SIZE);
+            // Server cũ không gửi chế độ: phòng dùng CBC
+            g_client.current_room_crypto.cipher =
+                msg.is_encrypted == ROOM_CIPHER_GCM ? ROOM_CIPHER_GCM : ROOM_CIPHER_CBC;
             g_client.has_room_key = 1;
             g_client.encryption_enabled = 1;
             printf("🔑 Đã nhận key mã hóa cho phòng %d\n", msg.room_id);
@@ -79,10 +228,12 @@ void* receive_messages(void* arg) {
         } else if (msg.type == MSG_BROADCAST && msg.is_encrypted) {
             // Giải mã message
             if (g_client.has_room_key) {
-                if (decrypt_message_content(&msg, &g_client.current_room_crypto) == 0) {
-                    print_message(&msg);
-                } else {
-                    printf("❌ Không thể giải mã tin nhắn\n");
+                has_pending = receive_encrypted_batch(&msg, &pending);
+                if (has_pending < 0) {
+                    if (g_client.running) {
+                        printf("\nKết nối đến server bị ngắt!\n");
+                    }
+                    break;
                 }
             }
             continue;
@@ -91,6 +242,13 @@ void* receive_messages(void* arg) {
         print_message(&msg);
     }
 
+    // Không để input thread chờ WELCOME hay trả lời offer mãi
+    pthread_mutex_lock(&g_client.socket_mutex);
+    g_client.negotiating = 0;
+    pthread_cond_broadcast(&g_client.negotiated_cond);
+    pthread_mutex_unlock(&g_client.socket_mutex);
+    upload_fail_offers();
+
     return NULL;
 }
 
@@ -105,10 +263,14 @@ void* handle_input(void* arg) {
     printf("  /join <username>     - Đăng nhập với username\n");
     printf("  /create <room_name>  - Tạo phòng mới\n");
     printf("  /room <room_id>      - Tham gia phòng theo ID\n");
-    printf("  /encrypt             - BẬT mã hóa cho phòng hiện tại\n");
+    printf("  /encrypt [gcm|cbc]   - BẬT mã hóa cho phòng hiện tại (mặc định AES-256-GCM)\n");
     printf("  /leave               - Rời khỏi phòng hiện tại\n");
     printf("  /list                - Liệt kê tất cả phòng\n");
     printf("  /sendfile <filepath> - Gửi file vào phòng hiện tại\n");
+    printf("  /history [seq]       - Xem lại tin nhắn gần đây của phòng (sau seq nếu có)\n");
+    printf("  /stats               - Xem số liệu hiệu năng của server\n");
+    printf("  /downloads           - Xem tiến độ các file đang nhận\n");
+    printf("  /uploads             - Xem tiến độ các file đang gửi\n");
     printf("  /quit                - Thoát chương trình\n");
     printf("  <message>            - Gửi tin nhắn (khi đã tham gia phòng)\n\n");
 
@@ -132,17 +294,18 @@ void* handle_input(void* arg) {
         // Parse command
         
         if (input[0] == '/') {
+            content[0] = '\0';
             sscanf(input, "%s %[^\n]", command, content);
 
             message_t msg;
             memset(&msg, 0, sizeof(message_t));
 
-            pthread_mutex_lock(&g_client.socket_mutex);
+            send_lanes_control_lock(&g_client.lanes);
 
             if (strcmp(command, "/join") == 0) {
                 if (strlen(content) == 0) {
                     printf("Vui lòng nhập username!\n");
-                    pthread_mutex_unlock(&g_client.socket_mutex);
+                    send_lanes_control_unlock(&g_client.lanes);
                     continue;
                 }
 
@@ -150,11 +313,14 @@ void* handle_input(void* arg) {
                 strncpy(msg.username, content, MAX_USERNAME_LEN - 1);
                 msg.username[MAX_USERNAME_LEN - 1] = '\0';
                 strcpy(g_client.username, msg.username);
+                // Đề nghị dùng protocol mới nhất và mọi feature, server cũ sẽ bỏ qua
+                msg.room_id = WIRE_NEGOTIATE_MAGIC | WIRE_FEATURES_SUPPORTED | WIRE_VERSION_MAX;
+                g_client.negotiating = 1;
 
             } else if (strcmp(command, "/create") == 0) {
                 if (strlen(content) == 0) {
                     printf("Vui lòng nhập tên phòng!\n");
-                    pthread_mutex_unlock(&g_client.socket_mutex);
+                    send_lanes_control_unlock(&g_client.lanes);
                     continue;
                 }
 
@@ -166,29 +332,54 @@ void* handle_input(void* arg) {
                 int room_id = atoi(content);
                 if (room_id <= 0) {
                     printf("Vui lòng nhập ID phòng hợp lệ!\n");
-                    pthread_mutex_unlock(&g_client.socket_mutex);
+                    send_lanes_control_unlock(&g_client.lanes);
                     continue;
                 }
 
                 msg.type = MSG_JOIN_ROOM;
                 msg.room_id = room_id;
+                // Vào lại phòng vừa ở: chỉ xin các tin đã lỡ
+                msg.history_seq = room_id == g_client.history_room ? g_client.history_seq : 0;
+                history_expect(room_id, msg.history_seq);
 
                 
+            } else if (strcmp(command, "/history") == 0) {
+                if (g_client.current_room_id == -1) {
+                    printf("Bạn cần tham gia một phòng trước!\n");
+                    send_lanes_control_unlock(&g_client.lanes);
+                    continue;
+                }
+                msg.type = MSG_HISTORY_REQUEST;
+                msg.room_id = g_client.current_room_id;
+                msg.history_seq = atol(content);
+                history_expect(msg.room_id, msg.history_seq);
+
             } else if (strcmp(command, "/encrypt") == 0) {
                 if (g_client.current_room_id == -1) {
                     printf("❌ Bạn cần tham gia phòng trước!\n");
-                    pthread_mutex_unlock(&g_client.socket_mutex);
+                    send_lanes_control_unlock(&g_client.lanes);
                     continue;
                 }
                 
                 if (g_client.encryption_enabled) {
                     printf("ℹ️  Phòng này đã được mã hóa rồi!\n");
-                    pthread_mutex_unlock(&g_client.socket_mutex);
+                    send_lanes_control_unlock(&g_client.lanes);
                     continue;
                 }
                 
+                // content có thể còn từ lệnh trước nên đọc lại tham số từ input
+                char mode[16] = "";
+                sscanf(input, "%*s %15s", mode);
+                if (mode[0] != '\0' && strcmp(mode, "gcm") != 0 && strcmp(mode, "cbc") != 0) {
+                    printf("❌ Chế độ mã hóa không hợp lệ (gcm hoặc cbc)\n");
+                    send_lanes_control_unlock(&g_client.lanes);
+                    continue;
+                }
+
                 msg.type = MSG_ENABLE_ENCRYPTION;
-                printf("🔒 Đang bật mã hóa cho phòng...\n");
+                msg.is_encrypted = strcmp(mode, "cbc") == 0 ? ROOM_CIPHER_CBC : ROOM_CIPHER_GCM;
+                printf("🔒 Đang bật mã hóa %s cho phòng...\n",
+                       msg.is_encrypted == ROOM_CIPHER_GCM ? "AES-256-GCM" : "AES-256-CBC");
                 
             } else if (strcmp(command, "/leave") == 0) {
                 msg.type = MSG_LEAVE_ROOM;
@@ -196,16 +387,29 @@ void* handle_input(void* arg) {
             } else if (strcmp(command, "/list") == 0) {
                 msg.type = MSG_LIST_ROOMS;
 
+            } else if (strcmp(command, "/stats") == 0) {
+                msg.type = MSG_STATS;
+
+            } else if (strcmp(command, "/downloads") == 0) {
+                download_print_status();
+                send_lanes_control_unlock(&g_client.lanes);
+                continue;
+
+            } else if (strcmp(command, "/uploads") == 0) {
+                upload_print_status();
+                send_lanes_control_unlock(&g_client.lanes);
+                continue;
+
             } else if (strcmp(command, "/sendfile") == 0) {
                 if (g_client.current_room_id == -1) {
                     printf("Bạn cần tham gia một phòng trước khi gửi file!\n");
-                    pthread_mutex_unlock(&g_client.socket_mutex);
+                    send_lanes_control_unlock(&g_client.lanes);
                     continue;
                 }
 
                 if (strlen(content) == 0) {
                     printf("Vui lòng nhập đường dẫn file!\n");
-                    pthread_mutex_unlock(&g_client.socket_mutex);
+                    send_lanes_control_unlock(&g_client.lanes);
                     continue;
                 }
 
@@ -216,28 +420,56 @@ void* handle_input(void* arg) {
                     printf("Gợi ý:\n");
                     printf("  - Nếu file ở thư mục cha: ../test.txt\n");
                     printf("  - Nếu file ở thư mục hiện tại: ./test.txt hoặc test.txt\n");
-                    pthread_mutex_unlock(&g_client.socket_mutex);
+                    send_lanes_control_unlock(&g_client.lanes);
                     continue;
                 }
+                fseek(test_file, 0, SEEK_END);
+                long file_size = ftell(test_file);
                 fclose(test_file);
+                if (file_size <= 0) {
+                    printf("File rỗng, không có gì để gửi: %s\n", content);
+                    send_lanes_control_unlock(&g_client.lanes);
+                    continue;
+                }
+
+                // Phòng đã bật mã hóa thì file cũng được mã hóa.
+                // Chunk mã hóa không nén được, và nén trước khi mã hóa làm lộ nội dung qua độ dài
+                int encrypt_file = g_client.encryption_enabled && g_client.has_room_key;
+                int compress_file = !encrypt_file && (g_client.wire_features & WIRE_FEATURE_DEFLATE);
+
+                // v2: mỗi file là một stream gửi nền, chat vẫn đi trong lúc gửi
+                if (g_client.wire_version == WIRE_VERSION_V2) {
+                    int stream_id = upload_submit(content, g_client.username,
+                                                  encrypt_file ? &g_client.current_room_crypto : NULL,
+                                                  compress_file);
+                    if (stream_id < 0) {
+                        printf("Đang gửi tối đa %d file, chờ một file xong rồi thử lại!\n", UPLOAD_MAX_ACTIVE);
+                    } else {
+                        printf("📤 Đang gửi %s (stream %d), xem tiến độ bằng /uploads\n", content, stream_id);
+                    }
+                    send_lanes_control_unlock(&g_client.lanes);
+                    continue;
+                }
 
-                // Send file request message
+                // v1 không có stream: gửi tại chỗ, giữ socket đến khi xong file
                 msg.type = MSG_FILE_REQUEST;
                 strncpy(msg.content, content, MAX_MESSAGE_LEN - 1);
                 msg.content[MAX_MESSAGE_LEN - 1] = '\0';
 
-                if (send_message(g_client.socket_fd, &msg) < 0) {
+                if (send_message_wire(g_client.socket_fd, &msg, g_client.wire_version) < 0) {
                     printf("Lỗi gửi yêu cầu file!\n");
-                    pthread_mutex_unlock(&g_client.socket_mutex);
+                    send_lanes_control_unlock(&g_client.lanes);
                     continue;
                 }
 
-                // Send file data
-                if (send_file(g_client.socket_fd, content, g_client.current_room_id, g_client.username) < 0) {
+                // sender_id do server điền theo kết nối
+                if (send_file(g_client.socket_fd, content, 0, g_client.username,
+                              g_client.wire_version, encrypt_file ? &g_client.current_room_crypto : NULL,
+                              compress_file, 0, NULL) < 0) {
                     printf("Lỗi gửi file!\n");
                 }
 
-                pthread_mutex_unlock(&g_client.socket_mutex);
+                send_lanes_control_unlock(&g_client.lanes);
                 continue;
 
             } else if (strcmp(command, "/quit") == 0) {
@@ -246,15 +478,21 @@ void* handle_input(void* arg) {
 
             } else {
                 printf("Lệnh không hợp lệ: %s\n", command);
-                pthread_mutex_unlock(&g_client.socket_mutex);
+                send_lanes_control_unlock(&g_client.lanes);
                 continue;
             }
 
-            if (send_message(g_client.socket_fd, &msg) < 0) {
+            if (send_message_wire(g_client.socket_fd, &msg, g_client.wire_version) < 0) {
                 printf("Lỗi gửi tin nhắn!\n");
+                g_client.negotiating = 0;
             }
 
-            pthread_mutex_unlock(&g_client.socket_mutex);
+            // Chờ WELCOME để biết version được chấp nhận trước khi gửi frame tiếp theo
+            while (g_client.negotiating) {
+                pthread_cond_wait(&g_client.negotiated_cond, &g_client.socket_mutex);
+            }
+
+            send_lanes_control_unlock(&g_client.lanes);
 
             if (strcmp(command, "/quit") == 0) {
                 break;
@@ -286,11 +524,14 @@ void* handle_input(void* arg) {
                 msg.is_encrypted = 0;
             }
             
-            pthread_mutex_lock(&g_client.socket_mutex);
-            if (send_message(g_client.socket_fd, &msg) < 0) {
+            send_lanes_control_lock(&g_client.lanes);
+            int rc = !msg.is_encrypted && (g_client.wire_features & WIRE_FEATURE_DEFLATE)
+                         ? send_message_compressed(g_client.socket_fd, &msg)
+                         : send_message_wire(g_client.socket_fd, &msg, g_client.wire_version);
+            if (rc < 0) {
                 printf("Lỗi gửi tin nhắn!\n");
             }
-            pthread_mutex_unlock(&g_client.socket_mutex);
+            send_lanes_control_unlock(&g_client.lanes);
         }
     }
 
@@ -301,10 +542,18 @@ void cleanup_client_data() {
     g_client.running = 0;
 
     if (g_client.socket_fd != -1) {
+        // Chunk đang gửi dở trả lỗi ngay, thread gửi thấy bị hủy và kết thúc
+        shutdown(g_client.socket_fd, SHUT_RDWR);
+        upload_stop();
         close(g_client.socket_fd);
     }
+    // Receive thread có thể đang chờ hàng đợi ghi, download_stop đánh thức nó
+    download_stop();
 
     pthread_mutex_destroy(&g_client.socket_mutex);
+    ringbuf_free(&g_client.rx);
+    pthread_cond_destroy(&g_client.negotiated_cond);
+    send_lanes_destroy(&g_client.lanes);
 }
 
 void signal_handler(int sig) {
@@ -334,12 +583,23 @@ int main(int argc, char* argv[]) {
     g_client.has_room_key = 0;
     g_client.encryption_enabled = 0;
     g_client.running = 1;
+    g_client.wire_version = WIRE_VERSION_LEGACY;
+    g_client.negotiating = 0;
     pthread_mutex_init(&g_client.socket_mutex, NULL);
+    pthread_cond_init(&g_client.negotiated_cond, NULL);
+    send_lanes_init(&g_client.lanes, &g_client.socket_mutex);
+    if (ringbuf_init(&g_client.rx, CLIENT_RX_BUFFER_SIZE) < 0) {
+        error_exit("Memory allocation failed");
+    }
     
     // Setup signal handler
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
+    if (download_start("downloads") < 0) {
+        error_exit("Không thể khởi động writer nhận file");
+    }
+
     // Kết nối đến server
     g_client.socket_fd = create_socket();
     
@@ -355,6 +615,7 @@ int main(int argc, char* argv[]) {
     }
     
     printf("Đã kết nối đến server %s:%d\n", server_ip, server_port);
+    upload_start(g_client.socket_fd, &g_client.lanes);
     
     // Tạo threads
     if (pthread_create(&g_client.receive_thread, NULL, receive_messages, NULL) != 0) {
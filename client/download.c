@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include "download.h"
+#include "../common/filecrypt.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Một chunk chờ ghi. Key phòng được chép cùng chunk vì receive thread có thể nhận key
+// mới (đổi phòng) trong lúc writer còn đang xử lý chunk cũ.
+typedef struct download_item {
+    struct download_item* next;
+    int has_key;
+    unsigned char key[AES_KEY_SIZE];
+    file_transfer_t ft;
+} download_item_t;
+
+// File đang nhận. Chỉ writer thread đổi, riêng in_use (và tên) đổi dưới mutex để
+// download_print_status đọc được. File mã hóa có pipeline riêng: worker giải mã song
+// song, thread sink của pipeline ghi (buffer, written, progress); writer thread chỉ
+// đưa chunk vào và không đụng tới các field đó cho tới khi pipeline dừng.
+typedef struct {
+    int in_use;
+    int sender_id;
+    int stream_id;                // Cùng người gửi có thể gửi nhiều file song song
+    char filename[MAX_FILENAME_LEN];
+    char sender_name[MAX_USERNAME_LEN];
+    char path[512];
+    int fd;                       // -1 nếu không ghi (file mã hóa mà chưa có key)
+    file_pipeline_t* pipeline;    // Chỉ file mã hóa, NULL khi đã dừng
+    int failed;
+    int next_chunk;
+    int total_chunks;
+    long file_size;
+    long written;                 // Byte plaintext đã nhận, kể cả phần còn trong buffer
+    int progress;                 // Mốc % đã in gần nhất
+    unsigned long start_ns;
+    unsigned char* buffer;
+    size_t buffered;
+} download_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t work;          // Writer chờ chunk
+    pthread_cond_t space;         // Receive thread chờ hàng đợi bớt đầy
+    download_item_t* head;
+    download_item_t* tail;
+    size_t queued_bytes;
+    int started;
+    int stopping;
+    pthread_t thread;
+    char dir[256];
+    download_t active[DOWNLOAD_MAX_ACTIVE];
+} g_downloads = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+};
+
+static double elapsed_seconds(const download_t* d) {
+    double seconds = (double)(metrics_now_ns() - d->start_ns) / 1e9;
+    return seconds > 0 ? seconds : 1e-9;
+}
+
+static int write_all(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void download_flush(download_t* d) {
+    if (d->buffered > 0 && !d->failed && write_all(d->fd, d->buffer, d->buffered) < 0) {
+        perror("Không thể ghi file");
+        d->failed = 1;
+    }
+    d->buffered = 0;
+}
+
+// Dừng pipeline giải mã: chờ các chunk đã đưa vào được ghi vào buffer
+static void download_drain(download_t* d) {
+    if (d->pipeline) {
+        if (file_pipeline_finish(d->pipeline) < 0) {
+            d->failed = 1;
+        }
+        d->pipeline = NULL;
+    }
+}
+
+// Kết thúc một file: giữ lại nếu nhận đủ, không thì xóa file dở
+static void download_close(download_t* d, const char* reason) {
+    download_drain(d);
+    if (d->fd >= 0) {
+        download_flush(d);
+        if (!d->failed && !reason) {
+            // Đã cấp trước file_size byte: cắt theo số byte thật nếu khác
+            if (d->written != d->file_size && ftruncate(d->fd, d->written) < 0) {
+                d->failed = 1;
+            }
+        }
+        close(d->fd);
+        if (d->failed || reason) {
+            unlink(d->path);
+        }
+    }
+    if (reason) {
+        printf("❌ Bỏ file %s: %s\n", d->filename, reason);
+    } else if (d->fd < 0) {
+        // File mã hóa mà không có key: đã báo lúc nhận chunk đầu
+    } else if (d->failed) {
+        printf("❌ Nhận file %s thất bại (dữ liệu không xác thực được hoặc lỗi ghi)\n", d->filename);
+    } else {
+        printf("📥 Hoàn thành nhận file: %s (%.2f MB, %.1f MB/s)\n", d->path, d->written / (1024.0 * 1024.0),
+               d->written / (1024.0 * 1024.0) / elapsed_seconds(d));
+    }
+    fflush(stdout);
+    free(d->buffer);
+
+    pthread_mutex_lock(&g_downloads.mutex);
+    d->in_use = 0;
+    pthread_mutex_unlock(&g_downloads.mutex);
+}
+
+static download_t* download_find(const file_transfer_t* ft) {
+    for (int i = 0; i < DOWNLOAD_MAX_ACTIVE; i++) {
+        download_t* d = &g_downloads.active[i];
+        if (d->in_use && d->sender_id == ft->sender_id && d->stream_id == ft->stream_id &&
+            strcmp(d->filename, ft->filename) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+static void download_progress(download_t* d) {
+    if (d->file_size < DOWNLOAD_WRITE_BUFFER) {
+        return;
+    }
+    int percent = (int)(d->written * 100 / d->file_size);
+    if (percent >= 100 || percent < d->progress + DOWNLOAD_PROGRESS_STEP) {
+        return;
+    }
+    d->progress = percent - percent % DOWNLOAD_PROGRESS_STEP;
+    printf("📥 %s: %d%% (%.1f/%.1f MB, %.1f MB/s)\n", d->filename, d->progress,
+           d->written / (1024.0 * 1024.0), d->file_size / (1024.0 * 1024.0),
+           d->written / (1024.0 * 1024.0) / elapsed_seconds(d));
+    fflush(stdout);
+}
+
+// Gom plaintext vào buffer, đầy thì ghi ra file
+static void download_append(download_t* d, const unsigned char* data, int len) {
+    if (d->buffered + (size_t)len > DOWNLOAD_WRITE_BUFFER) {
+        download_flush(d);
+    }
+    memcpy(d->buffer + d->buffered, data, (size_t)len);
+    d->buffered += (size_t)len;
+    __atomic_store_n(&d->written, d->written + len, __ATOMIC_RELAXED);
+    download_progress(d);
+}
+
+// Sink của pipeline giải mã: chunk đã giải mã đến theo đúng thứ tự
+static int download_sink(void* arg, const file_chunk_t* chunk) {
+    download_t* d = (download_t*)arg;
+    download_append(d, chunk->out, chunk->out_len);
+    return d->failed ? -1 : 0;
+}
+
+// Tạo file mới trong thư mục tải về. Tên đã có (file cũ, hoặc file cùng tên đang được
+// người khác gửi) thì thêm hậu tố "name (1).ext" thay vì ghi đè.
+static int download_create(download_t* d, const char* name) {
+    const char* ext = strrchr(name, '.');
+    if (!ext || ext == name) {
+        ext = name + strlen(name);
+    }
+    for (int i = 0; i < DOWNLOAD_NAME_TRIES; i++) {
+        if (i == 0) {
+            snprintf(d->path, sizeof(d->path), "%s/%s", g_downloads.dir, name);
+        } else {
+            snprintf(d->path, sizeof(d->path), "%s/%.*s (%d)%s", g_downloads.dir, (int)(ext - name), name, i, ext);
+        }
+        int fd = open(d->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0 || errno != EEXIST) {
+            return fd;
+        }
+    }
+    errno = EEXIST;
+    return -1;
+}
+
+// Chunk 0: tạo file và cấp trước đủ dung lượng để ghi không phải cấp phát block dần
+static download_t* download_open(const download_item_t* item) {
+    const file_transfer_t* ft = &item->ft;
+    download_t* d = NULL;
+    for (int i = 0; i < DOWNLOAD_MAX_ACTIVE && !d; i++) {
+        if (!g_downloads.active[i].in_use) {
+            d = &g_downloads.active[i];
+        }
+    }
+    if (!d) {
+        printf("❌ Đang nhận quá nhiều file, bỏ qua %s\n", ft->filename);
+        return NULL;
+    }
+
+    memset(d, 0, sizeof(*d));
+    d->sender_id = ft->sender_id;
+    d->stream_id = ft->stream_id;
+    d->total_chunks = ft->total_chunks;
+    d->file_size = ft->file_size;
+    d->start_ns = metrics_now_ns();
+    d->fd = -1;
+    strncpy(d->filename, ft->filename, MAX_FILENAME_LEN - 1);
+    // Tên từ mạng: chỉ lấy phần sau dấu '/' cuối để không ghi ra ngoài thư mục tải về
+    const char* name = strrchr(ft->filename, '/');
+    name = name ? name + 1 : ft->filename;
+
+    if (ft->encrypted && !item->has_key) {
+        // Vẫn giữ slot để bỏ các chunk còn lại của file
+        printf("❌ File được mã hóa nhưng chưa có key của phòng, bỏ qua\n");
+        d->failed = 1;
+    } else {
+        d->buffer = (unsigned char*)malloc(DOWNLOAD_WRITE_BUFFER);
+        d->fd = d->buffer ? download_create(d, name) : -1;
+        if (d->fd < 0) {
+            perror("Không thể tạo file");
+            free(d->buffer);
+            return NULL;
+        }
+        if (ft->encrypted) {
+            chunk_binding_t binding = { ft->file_id, ft->file_size, ft->total_chunks };
+            d->pipeline = file_pipeline_start(item->key, &binding, 0, download_sink, d);
+            if (!d->pipeline) {
+                printf("❌ Không tạo được thread giải mã, bỏ qua %s\n", ft->filename);
+                close(d->fd);
+                unlink(d->path);
+                free(d->buffer);
+                return NULL;
+            }
+        }
+        if (ft->file_size > 0) {
+            // Filesystem không hỗ trợ thì vẫn ghi bình thường
+            (void)posix_fallocate(d->fd, 0, ft->file_size);
+        }
+        printf("\n📥 Đang nhận file%s: %s từ %s (%.2f KB)\n", ft->encrypted ? " (mã hóa)" : "",
+               ft->filename, ft->sender_name, ft->file_size / 1024.0);
+        fflush(stdout);
+    }
+
+    pthread_mutex_lock(&g_downloads.mutex);
+    strncpy(d->sender_name, ft->sender_name, MAX_USERNAME_LEN - 1);
+    d->in_use = 1;
+    pthread_mutex_unlock(&g_downloads.mutex);
+    return d;
+}
+
+static void download_chunk(const download_item_t* item) {
+    const file_transfer_t* ft = &item->ft;
+    download_t* d = download_find(ft);
+    if (ft->chunk_number == 0) {
+        if (d) {
+            download_close(d, "người gửi gửi lại từ đầu");
+        }
+        d = download_open(item);
+    }
+    // Không thấy chunk đầu (vào phòng giữa lúc đang gửi) thì không có gì để ghi
+    if (!d) {
+        return;
+    }
+
+    if (d->pipeline && ft->chunk_number == d->next_chunk) {
+        // Chỉ chép chunk vào pipeline, worker giải mã và sink ghi
+        file_chunk_t* chunk = file_pipeline_acquire(d->pipeline);
+        if (chunk) {
+            chunk->chunk_number = ft->chunk_number;
+            chunk->in_len = ft->data_size;
+            memcpy(chunk->in, ft->data, (size_t)ft->data_size);
+            file_pipeline_commit(d->pipeline, chunk);
+        } else {
+            download_drain(d);
+        }
+    } else {
+        // Thiếu chunk: dừng pipeline rồi đánh dấu lỗi bên dưới
+        download_drain(d);
+        if (!d->failed) {
+            unsigned char plain[FILE_CHUNK_SIZE];
+            const unsigned char* data = (const unsigned char*)ft->data;
+            int len = ft->data_size;
+            if (ft->chunk_number != d->next_chunk || ft->encrypted) {
+                len = -1;
+            } else if (ft->compressed) {
+                len = decompress_buffer(data, (size_t)len, plain, sizeof(plain));
+                data = plain;
+            }
+
+            if (len < 0) {
+                d->failed = 1;
+            } else {
+                download_append(d, data, len);
+            }
+        }
+    }
+    d->next_chunk = ft->chunk_number + 1;
+
+    if (ft->chunk_number >= ft->total_chunks - 1) {
+        download_close(d, NULL);
+    }
+}
+
+static void* download_writer_loop(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_downloads.mutex);
+    for (;;) {
+        while (!g_downloads.head && !g_downloads.stopping) {
+            pthread_cond_wait(&g_downloads.work, &g_downloads.mutex);
+        }
+        download_item_t* item = g_downloads.head;
+        if (!item) {
+            break;
+        }
+        g_downloads.head = g_downloads.tail = NULL;
+        pthread_mutex_unlock(&g_downloads.mutex);
+
+        while (item) {
+            download_item_t* next = item->next;
+            download_chunk(item);
+            slab_free(item, sizeof(download_item_t));
+            item = next;
+
+            pthread_mutex_lock(&g_downloads.mutex);
+            g_downloads.queued_bytes -= sizeof(download_item_t);
+            pthread_cond_signal(&g_downloads.space);
+            pthread_mutex_unlock(&g_downloads.mutex);
+        }
+        pthread_mutex_lock(&g_downloads.mutex);
+    }
+    pthread_mutex_unlock(&g_downloads.mutex);
+
+    for (int i = 0; i < DOWNLOAD_MAX_ACTIVE; i++) {
+        if (g_downloads.active[i].in_use) {
+            download_close(&g_downloads.active[i], "chưa nhận đủ khi thoát");
+        }
+    }
+    return NULL;
+}
+
+int download_start(const char* save_dir) {
+    snprintf(g_downloads.dir, sizeof(g_downloads.dir), "%s", save_dir);
+    if (mkdir(save_dir, 0755) < 0 && errno != EEXIST) {
+        perror("Không thể tạo thư mục tải về");
+        return -1;
+    }
+    if (pthread_create(&g_downloads.thread, NULL, download_writer_loop, NULL) != 0) {
+        return -1;
+    }
+    g_downloads.started = 1;
+    return 0;
+}
+
+int download_submit(const file_transfer_t* ft, const room_crypto_t* crypto) {
+    if (!g_downloads.started) {
+        return -1;
+    }
+    download_item_t* item = (download_item_t*)slab_alloc(sizeof(download_item_t));
+    if (!item) {
+        return -1;
+    }
+    item->next = NULL;
+    item->has_key = crypto != NULL;
+    if (crypto) {
+        memcpy(item->key, crypto->key, AES_KEY_SIZE);
+    }
+    item->ft = *ft;
+
+    pthread_mutex_lock(&g_downloads.mutex);
+    // Chỉ chờ khi đĩa chậm hơn mạng tới mức hàng đợi đầy
+    while (g_downloads.queued_bytes + sizeof(download_item_t) > DOWNLOAD_QUEUE_BYTES && !g_downloads.stopping) {
+        pthread_cond_wait(&g_downloads.space, &g_downloads.mutex);
+    }
+    if (g_downloads.stopping) {
+        pthread_mutex_unlock(&g_downloads.mutex);
+        slab_free(item, sizeof(download_item_t));
+        return -1;
+    }
+    if (g_downloads.tail) {
+        g_downloads.tail->next = item;
+    } else {
+        g_downloads.head = item;
+    }
+    g_downloads.tail = item;
+    g_downloads.queued_bytes += sizeof(download_item_t);
+    pthread_cond_signal(&g_downloads.work);
+    pthread_mutex_unlock(&g_downloads.mutex);
+    return 0;
+}
+
+void download_print_status(void) {
+    int count = 0;
+    pthread_mutex_lock(&g_downloads.mutex);
+    for (int i = 0; i < DOWNLOAD_MAX_ACTIVE; i++) {
+        const download_t* d = &g_downloads.active[i];
+        if (!d->in_use) {
+            continue;
+        }
+        long written = __atomic_load_n(&d->written, __ATOMIC_RELAXED);
+        printf("📥 %s từ %s: %ld%% (%.1f/%.1f MB, %.1f MB/s)\n", d->filename, d->sender_name,
+               d->file_size > 0 ? written * 100 / d->file_size : 100, written / (1024.0 * 1024.0),
+               d->file_size / (1024.0 * 1024.0), written / (1024.0 * 1024.0) / elapsed_seconds(d));
+        count++;
+    }
+    if (count == 0) {
+        printf("Không có file nào đang nhận\n");
+    } else if (g_downloads.queued_bytes > 0) {
+        printf("   (%.1f MB chunk đang chờ ghi)\n", g_downloads.queued_bytes / (1024.0 * 1024.0));
+    }
+    pthread_mutex_unlock(&g_downloads.mutex);
+}
+
+void download_stop(void) {
+    if (!g_downloads.started) {
+        return;
+    }
+    pthread_mutex_lock(&g_downloads.mutex);
+    g_downloads.stopping = 1;
+    pthread_cond_broadcast(&g_downloads.work);
+    pthread_cond_broadcast(&g_downloads.space);
+    pthread_mutex_unlock(&g_downloads.mutex);
+    pthread_join(g_downloads.thread, NULL);
+    g_downloads.started = 0;
+}
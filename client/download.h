@@ -0,0 +1,28 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include "../common/protocol.h"
+
+// Nhận file nền cho chat_client (wire v2). Receive thread chỉ chép chunk vào hàng đợi rồi
+// đọc tiếp socket, nên tin chat xen giữa các chunk vẫn hiện ngay. Một writer thread giải
+// nén, gom chunk thành lần write lớn vào file đã được cấp trước đủ dung lượng và in tiến
+// độ. File mã hóa có file_pipeline riêng: writer chỉ chép chunk vào, worker giải mã song
+// song, sink của pipeline ghi. Các chunk của nhiều file (nhiều người gửi) có thể xen nhau.
+
+#define DOWNLOAD_QUEUE_BYTES (32 * 1024 * 1024)   // Chunk chờ ghi tối đa, vượt thì receive thread chờ đĩa
+#define DOWNLOAD_WRITE_BUFFER (1024 * 1024)       // Mỗi file gom dữ liệu thành lần write 1 MB
+#define DOWNLOAD_MAX_ACTIVE 16                    // Số file nhận cùng lúc
+#define DOWNLOAD_PROGRESS_STEP 10                 // In tiến độ mỗi 10%
+#define DOWNLOAD_NAME_TRIES 100                   // Số hậu tố " (n)" thử khi trùng tên file
+
+// Tạo writer thread, file được lưu vào save_dir (tạo nếu chưa có). -1 nếu lỗi.
+int download_start(const char* save_dir);
+// Receive thread: đưa một chunk cho writer. crypto là key phòng lúc nhận (NULL nếu chưa có).
+// Chỉ chờ khi hàng đợi đã đầy DOWNLOAD_QUEUE_BYTES. -1 nếu writer đã dừng.
+int download_submit(const file_transfer_t* ft, const room_crypto_t* crypto);
+// In các file đang nhận với tiến độ và tốc độ
+void download_print_status(void);
+// Dừng writer: chunk đã nhận được ghi xong, file chưa nhận đủ bị xóa
+void download_stop(void);
+
+#endif // DOWNLOAD_H
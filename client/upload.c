@@ -0,0 +1,352 @@
+#include "upload.h"
+#include <sys/stat.h>
+
+typedef enum {
+    UPLOAD_OFFERING = 0,          // Đã gửi MSG_FILE_OFFER, chờ server trả lời
+    UPLOAD_SENDING,               // Đang gửi chunk
+    UPLOAD_DONE,                  // Server đã có nội dung, file được phát từ cache
+    UPLOAD_FAILED
+} upload_state_t;
+
+// Một file đang gửi. Thread gửi đọc các field cấu hình, state/cancelled đổi dưới mutex.
+typedef struct {
+    int in_use;                   // Slot có thread (kể cả thread đã xong nhưng chưa join)
+    int finished;
+    int stream_id;
+    upload_state_t state;
+    int cancelled;                // Server từ chối stream hoặc client đang thoát
+    int challenged;               // Server hỏi bằng chứng có file, nonce chờ thread gửi trả lời
+    unsigned char nonce[FILE_PROOF_NONCE_SIZE];
+    char path[BUFFER_SIZE];
+    char sender_name[MAX_USERNAME_LEN];
+    room_crypto_t crypto;
+    int encrypt;
+    int compress;
+    long file_size;
+    int total_chunks;
+    int chunks_sent;
+    pthread_t thread;
+} upload_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t reply;         // Thread gửi chờ server trả lời offer
+    int socket_fd;
+    send_lanes_t* lanes;
+    int next_stream;              // Stream 0 để dành cho v1, stream của v2 bắt đầu từ 1
+    int started;
+    upload_t active[UPLOAD_MAX_ACTIVE];
+} g_uploads = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .reply = PTHREAD_COND_INITIALIZER,
+};
+
+static const char* upload_name(const upload_t* u) {
+    const char* name = strrchr(u->path, '/');
+    return name ? name + 1 : u->path;
+}
+
+static int send_control(const message_t* msg) {
+    send_lanes_control_lock(g_uploads.lanes);
+    int rc = send_message_wire(g_uploads.socket_fd, msg, WIRE_VERSION_V2);
+    send_lanes_control_unlock(g_uploads.lanes);
+    return rc;
+}
+
+// Gate của send_file: mỗi chunk chờ lượt trên lane bulk, stream bị hủy thì dừng
+static int upload_acquire(void* arg) {
+    upload_t* u = (upload_t*)arg;
+    send_lanes_bulk_lock(g_uploads.lanes);
+    if (__atomic_load_n(&u->cancelled, __ATOMIC_RELAXED)) {
+        send_lanes_bulk_unlock(g_uploads.lanes);
+        return -1;
+    }
+    return 0;
+}
+
+static void upload_release(void* arg) {
+    upload_t* u = (upload_t*)arg;
+    __atomic_fetch_add(&u->chunks_sent, 1, __ATOMIC_RELAXED);
+    send_lanes_bulk_unlock(g_uploads.lanes);
+}
+
+static int proof_read_file(void* arg, long offset, unsigned char* buf, size_t len) {
+    FILE* file = (FILE*)arg;
+    if (fseek(file, offset, SEEK_SET) != 0 || fread(buf, 1, len, file) != len) {
+        return -1;
+    }
+    return 0;
+}
+
+// Trả lời MSG_FILE_CHALLENGE bằng các đoạn file đọc từ đĩa
+static int upload_prove(upload_t* u, const unsigned char* nonce, long file_size) {
+    FILE* file = fopen(u->path, "rb");
+    if (!file) {
+        return -1;
+    }
+    unsigned char proof[SHA256_DIGEST_LENGTH];
+    int rc = file_proof_digest(nonce, file_size, proof_read_file, file, proof);
+    fclose(file);
+    if (rc < 0) {
+        return -1;
+    }
+
+    message_t reply;
+    memset(&reply, 0, sizeof(message_t));
+    reply.type = MSG_FILE_PROOF;
+    key_to_hex(proof, SHA256_DIGEST_LENGTH, reply.file_hash_hex);
+    reply.stream_id = u->stream_id;
+    return send_control(&reply);
+}
+
+// Offer theo SHA-256 rồi chờ server trả lời, trả lời câu hỏi bằng chứng nếu server đã có
+// nội dung. -1: không offer được (đọc file lỗi), gửi MSG_FILE_REQUEST như thường.
+static int upload_offer(upload_t* u) {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    long file_size = hash_file_sha256(u->path, hash);
+    if (file_size <= 0) {
+        return -1;
+    }
+
+    message_t offer;
+    memset(&offer, 0, sizeof(message_t));
+    offer.type = MSG_FILE_OFFER;
+    strncpy(offer.content, upload_name(u), MAX_MESSAGE_LEN - 1);
+    key_to_hex(hash, SHA256_DIGEST_LENGTH, offer.file_hash_hex);
+    offer.file_size = file_size;
+    offer.stream_id = u->stream_id;
+
+    pthread_mutex_lock(&g_uploads.mutex);
+    if (u->cancelled) {
+        pthread_mutex_unlock(&g_uploads.mutex);
+        return UPLOAD_FAILED;
+    }
+    u->state = UPLOAD_OFFERING;
+    pthread_mutex_unlock(&g_uploads.mutex);
+
+    if (send_control(&offer) < 0) {
+        printf("Lỗi gửi yêu cầu file!\n");
+        return UPLOAD_FAILED;
+    }
+
+    pthread_mutex_lock(&g_uploads.mutex);
+    while (u->state == UPLOAD_OFFERING) {
+        if (u->challenged) {
+            unsigned char nonce[FILE_PROOF_NONCE_SIZE];
+            memcpy(nonce, u->nonce, sizeof(nonce));
+            u->challenged = 0;
+            pthread_mutex_unlock(&g_uploads.mutex);
+            int rc = upload_prove(u, nonce, file_size);
+            pthread_mutex_lock(&g_uploads.mutex);
+            if (rc < 0 && u->state == UPLOAD_OFFERING) {
+                printf("Lỗi gửi bằng chứng file!\n");
+                u->state = UPLOAD_FAILED;
+            }
+            continue;
+        }
+        pthread_cond_wait(&g_uploads.reply, &g_uploads.mutex);
+    }
+    int state = u->state;
+    pthread_mutex_unlock(&g_uploads.mutex);
+    return state;
+}
+
+static void* upload_thread(void* arg) {
+    upload_t* u = (upload_t*)arg;
+
+    // Chunk mã hóa có nonce ngẫu nhiên nên chỉ file thường mới offer theo hash
+    int offered = 0;
+    if (!u->encrypt) {
+        int state = upload_offer(u);
+        if (state == UPLOAD_DONE || state == UPLOAD_FAILED) {
+            goto finish;
+        }
+        offered = state == UPLOAD_SENDING;
+    }
+
+    if (!offered) {
+        message_t request;
+        memset(&request, 0, sizeof(message_t));
+        request.type = MSG_FILE_REQUEST;
+        strncpy(request.content, u->path, MAX_MESSAGE_LEN - 1);
+        request.file_size = u->file_size;
+        request.stream_id = u->stream_id;
+        if (send_control(&request) < 0) {
+            printf("Lỗi gửi yêu cầu file!\n");
+            goto finish;
+        }
+    }
+
+    // sender_id do server điền theo kết nối
+    send_gate_t gate = { upload_acquire, upload_release, u };
+    if (send_file(g_uploads.socket_fd, u->path, 0, u->sender_name, WIRE_VERSION_V2,
+                  u->encrypt ? &u->crypto : NULL, u->compress, u->stream_id, &gate) < 0) {
+        if (__atomic_load_n(&u->cancelled, __ATOMIC_RELAXED)) {
+            printf("Đã dừng gửi file %s\n", upload_name(u));
+        } else {
+            printf("Lỗi gửi file!\n");
+        }
+    }
+
+finish:
+    pthread_mutex_lock(&g_uploads.mutex);
+    u->finished = 1;
+    pthread_mutex_unlock(&g_uploads.mutex);
+    return NULL;
+}
+
+// Join các thread đã gửi xong để dùng lại slot. Phải giữ mutex.
+static void upload_reap_locked(void) {
+    for (int i = 0; i < UPLOAD_MAX_ACTIVE; i++) {
+        upload_t* u = &g_uploads.active[i];
+        if (u->in_use && u->finished) {
+            pthread_join(u->thread, NULL);
+            u->in_use = 0;
+        }
+    }
+}
+
+static upload_t* upload_find_locked(int stream_id) {
+    for (int i = 0; i < UPLOAD_MAX_ACTIVE; i++) {
+        upload_t* u = &g_uploads.active[i];
+        if (u->in_use && u->stream_id == stream_id) {
+            return u;
+        }
+    }
+    return NULL;
+}
+
+int upload_start(int socket_fd, send_lanes_t* lanes) {
+    g_uploads.socket_fd = socket_fd;
+    g_uploads.lanes = lanes;
+    g_uploads.started = 1;
+    return 0;
+}
+
+int upload_submit(const char* path, const char* sender_name, const room_crypto_t* crypto, int compress) {
+    if (!g_uploads.started) {
+        return -1;
+    }
+    pthread_mutex_lock(&g_uploads.mutex);
+    upload_reap_locked();
+    upload_t* u = NULL;
+    for (int i = 0; i < UPLOAD_MAX_ACTIVE && !u; i++) {
+        if (!g_uploads.active[i].in_use) {
+            u = &g_uploads.active[i];
+        }
+    }
+    if (!u) {
+        pthread_mutex_unlock(&g_uploads.mutex);
+        return -1;
+    }
+
+    memset(u, 0, sizeof(upload_t));
+    u->stream_id = ++g_uploads.next_stream;
+    u->state = UPLOAD_SENDING;
+    strncpy(u->path, path, sizeof(u->path) - 1);
+    strncpy(u->sender_name, sender_name, MAX_USERNAME_LEN - 1);
+    if (crypto) {
+        u->crypto = *crypto;
+        u->encrypt = 1;
+    }
+    u->compress = compress;
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        int chunk_size = crypto ? FILE_CRYPT_CHUNK_SIZE : FILE_CHUNK_SIZE;
+        u->file_size = (long)st.st_size;
+        u->total_chunks = (int)((st.st_size + chunk_size - 1) / chunk_size);
+    }
+    if (pthread_create(&u->thread, NULL, upload_thread, u) != 0) {
+        pthread_mutex_unlock(&g_uploads.mutex);
+        return -1;
+    }
+    u->in_use = 1;
+    int stream_id = u->stream_id;
+    pthread_mutex_unlock(&g_uploads.mutex);
+    return stream_id;
+}
+
+void upload_reply(const message_t* msg) {
+    pthread_mutex_lock(&g_uploads.mutex);
+    upload_t* u = upload_find_locked(msg->stream_id);
+    if (u) {
+        if (msg->type == MSG_FILE_REJECT) {
+            u->cancelled = 1;
+            if (u->state == UPLOAD_OFFERING) {
+                u->state = UPLOAD_FAILED;
+            }
+        } else if (msg->type == MSG_FILE_CHALLENGE) {
+            if (u->state == UPLOAD_OFFERING && strlen(msg->file_hash_hex) == FILE_PROOF_NONCE_SIZE * 2) {
+                hex_to_key(msg->file_hash_hex, u->nonce, FILE_PROOF_NONCE_SIZE);
+                u->challenged = 1;
+            }
+        } else if (u->state == UPLOAD_OFFERING) {
+            u->state = msg->type == MSG_FILE_ACCEPT ? UPLOAD_SENDING : UPLOAD_DONE;
+        }
+        pthread_cond_broadcast(&g_uploads.reply);
+    }
+    pthread_mutex_unlock(&g_uploads.mutex);
+}
+
+void upload_fail_offers(void) {
+    pthread_mutex_lock(&g_uploads.mutex);
+    for (int i = 0; i < UPLOAD_MAX_ACTIVE; i++) {
+        upload_t* u = &g_uploads.active[i];
+        if (u->in_use && u->state == UPLOAD_OFFERING) {
+            u->state = UPLOAD_FAILED;
+        }
+    }
+    pthread_cond_broadcast(&g_uploads.reply);
+    pthread_mutex_unlock(&g_uploads.mutex);
+}
+
+void upload_print_status(void) {
+    int count = 0;
+    pthread_mutex_lock(&g_uploads.mutex);
+    for (int i = 0; i < UPLOAD_MAX_ACTIVE; i++) {
+        const upload_t* u = &g_uploads.active[i];
+        if (!u->in_use || u->finished) {
+            continue;
+        }
+        if (u->state == UPLOAD_OFFERING) {
+            printf("📤 %s (stream %d): chờ server trả lời offer\n", upload_name(u), u->stream_id);
+        } else {
+            int sent = __atomic_load_n(&u->chunks_sent, __ATOMIC_RELAXED);
+            printf("📤 %s (stream %d): %d%% (%d/%d chunks)\n", upload_name(u), u->stream_id,
+                   u->total_chunks > 0 ? sent * 100 / u->total_chunks : 100, sent, u->total_chunks);
+        }
+        count++;
+    }
+    if (count == 0) {
+        printf("Không có file nào đang gửi\n");
+    }
+    pthread_mutex_unlock(&g_uploads.mutex);
+}
+
+void upload_stop(void) {
+    if (!g_uploads.started) {
+        return;
+    }
+    pthread_mutex_lock(&g_uploads.mutex);
+    for (int i = 0; i < UPLOAD_MAX_ACTIVE; i++) {
+        upload_t* u = &g_uploads.active[i];
+        if (u->in_use) {
+            u->cancelled = 1;
+            if (u->state == UPLOAD_OFFERING) {
+                u->state = UPLOAD_FAILED;
+            }
+        }
+    }
+    pthread_cond_broadcast(&g_uploads.reply);
+    pthread_mutex_unlock(&g_uploads.mutex);
+
+    // Thread gửi cần mutex để kết thúc nên join ngoài khóa
+    for (int i = 0; i < UPLOAD_MAX_ACTIVE; i++) {
+        upload_t* u = &g_uploads.active[i];
+        if (u->in_use) {
+            pthread_join(u->thread, NULL);
+            u->in_use = 0;
+        }
+    }
+    g_uploads.started = 0;
+}
@@ -0,0 +1,28 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include "../common/protocol.h"
+
+// Gửi file nền cho chat_client (wire v2). Mỗi /sendfile là một stream riêng với thread
+// riêng: offer/request, rồi gửi chunk qua lane bulk của socket. Chunk của các stream lấy
+// socket lần lượt nên nhiều file đi song song, tin chat và lệnh (lane control) luôn được
+// gửi trước chunk tiếp theo. v1 không có stream nên client.c vẫn gửi file tại chỗ.
+
+#define UPLOAD_MAX_ACTIVE MAX_UPLOAD_STREAMS
+
+// Socket và lane gửi dùng chung với luồng chat. -1 nếu lỗi.
+int upload_start(int socket_fd, send_lanes_t* lanes);
+// Bắt đầu gửi file path. crypto != NULL: gửi chunk mã hóa bằng key phòng (chép lại ngay),
+// compress: nén chunk. Trả về stream_id, -1 nếu đã có UPLOAD_MAX_ACTIVE file đang gửi.
+int upload_submit(const char* path, const char* sender_name, const room_crypto_t* crypto, int compress);
+// Receive thread: server trả lời về stream (MSG_FILE_ACCEPT, MSG_FILE_CHALLENGE, MSG_FILE_COMPLETE,
+// MSG_FILE_REJECT). Câu hỏi bằng chứng được thread gửi của stream trả lời.
+void upload_reply(const message_t* msg);
+// Receive thread: MSG_ERROR không mang stream, mọi offer đang chờ coi như bị từ chối
+void upload_fail_offers(void);
+// In các file đang gửi
+void upload_print_status(void);
+// Dừng mọi lần gửi và chờ các thread gửi kết thúc
+void upload_stop(void);
+
+#endif // UPLOAD_H
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include "compress.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+// Cửa sổ 8 KB đủ cho dictionary cộng một frame hay một chunk file (<= WIRE_MAX_FRAME_SIZE)
+#define COMPRESS_WINDOW_BITS 13
+#define COMPRESS_MEM_LEVEL 8
+
+// Chuỗi hay gặp trong tin chat và thông báo của server. zlib ưu tiên khoảng cách ngắn
+// nên chuỗi phổ biến nhất đặt ở cuối.
+static const char g_dictionary[] =
+    "https://www.youtube.com/watch?v= https://github.com/ .html .jpg .png .pdf .zip .txt "
+    "the and that have for not with you this but his from they say her she will one all would "
+    "there their what out about who get which when make can like time just him know take people "
+    "into year your good some could them see other than then now look only come its over think "
+    "also back after use two how our work first well way even new want because any these give day "
+    "most are was were been has had did does doing done sorry please thanks thank you ok okay "
+    "lol haha yes yeah no maybe sure really right now today tomorrow tonight see you later "
+    "meeting file send sent check link "
+    "không có được của và là những người một này cho các với để trong thì mình bạn anh em chị "
+    "nhé nha nhỉ ạ ơi rồi chưa vậy sao thế nào gì đâu đi làm xem biết muốn cần phải lúc bây giờ "
+    "hôm nay ngày mai tối nay sáng chiều đang sẽ đã cũng nữa thôi luôn lắm quá rất được không "
+    "cảm ơn xin lỗi vâng dạ ừ ok nhé "
+    "Chào mừng đến với chat server! đã tham gia phòng đã rời khỏi phòng đã gửi file ";
+
+typedef struct {
+    z_stream deflater;
+    z_stream inflater;
+    int has_deflater;
+    int has_inflater;
+} compress_streams_t;
+
+static __thread compress_streams_t t_streams;
+static __thread int t_streams_registered = 0;
+static pthread_key_t g_streams_key;
+static pthread_once_t g_streams_once = PTHREAD_ONCE_INIT;
+
+static compress_stats_t g_stats;
+
+static void streams_release(void* arg) {
+    (void)arg;
+    if (t_streams.has_deflater) {
+        deflateEnd(&t_streams.deflater);
+        t_streams.has_deflater = 0;
+    }
+    if (t_streams.has_inflater) {
+        inflateEnd(&t_streams.inflater);
+        t_streams.has_inflater = 0;
+    }
+}
+
+static void streams_key_init(void) {
+    pthread_key_create(&g_streams_key, streams_release);
+}
+
+static void streams_register(void) {
+    if (!t_streams_registered) {
+        pthread_once(&g_streams_once, streams_key_init);
+        pthread_setspecific(g_streams_key, &t_streams_registered);
+        t_streams_registered = 1;
+    }
+}
+
+static unsigned long thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static void count(unsigned long* counter, unsigned long value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static z_stream* get_deflater(void) {
+    z_stream* z = &t_streams.deflater;
+    if (!t_streams.has_deflater) {
+        streams_register();
+        memset(z, 0, sizeof(*z));
+        if (deflateInit2(z, 1, Z_DEFLATED, -COMPRESS_WINDOW_BITS, COMPRESS_MEM_LEVEL,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            return NULL;
+        }
+        t_streams.has_deflater = 1;
+    } else if (deflateReset(z) != Z_OK) {
+        return NULL;
+    }
+    if (deflateSetDictionary(z, (const Bytef*)g_dictionary, sizeof(g_dictionary) - 1) != Z_OK) {
+        return NULL;
+    }
+    return z;
+}
+
+static z_stream* get_inflater(void) {
+    z_stream* z = &t_streams.inflater;
+    if (!t_streams.has_inflater) {
+        streams_register();
+        memset(z, 0, sizeof(*z));
+        if (inflateInit2(z, -COMPRESS_WINDOW_BITS) != Z_OK) {
+            return NULL;
+        }
+        t_streams.has_inflater = 1;
+    } else if (inflateReset(z) != Z_OK) {
+        return NULL;
+    }
+    // Raw deflate không có header báo cần dictionary, phải nạp trước khi đọc
+    if (inflateSetDictionary(z, (const Bytef*)g_dictionary, sizeof(g_dictionary) - 1) != Z_OK) {
+        return NULL;
+    }
+    return z;
+}
+
+int compress_buffer(const unsigned char* in, size_t len, unsigned char* out, size_t cap) {
+    size_t limit = len - (len >> COMPRESS_MIN_SAVING_SHIFT);
+    if (len < COMPRESS_MIN_INPUT) {
+        return -1;
+    }
+    if (limit > cap) {
+        limit = cap;
+    }
+
+    unsigned long start = thread_cpu_ns();
+    z_stream* z = get_deflater();
+    int produced = -1;
+    if (z) {
+        z->next_in = (Bytef*)in;
+        z->avail_in = (uInt)len;
+        z->next_out = out;
+        z->avail_out = (uInt)limit;
+        // Z_STREAM_END trong giới hạn nghĩa là bản nén đủ nhỏ, hết chỗ thì bỏ
+        if (deflate(z, Z_FINISH) == Z_STREAM_END) {
+            produced = (int)(limit - z->avail_out);
+        }
+    }
+
+    count(&g_stats.compress_calls, 1);
+    count(&g_stats.compress_in, len);
+    count(&g_stats.compress_ns, thread_cpu_ns() - start);
+    if (produced < 0) {
+        count(&g_stats.compress_skipped, 1);
+        count(&g_stats.compress_out, len);
+    } else {
+        count(&g_stats.compress_out, (unsigned long)produced);
+    }
+    return produced;
+}
+
+int decompress_buffer(const unsigned char* in, size_t len, unsigned char* out, size_t cap) {
+    unsigned long start = thread_cpu_ns();
+    z_stream* z = get_inflater();
+    int produced = -1;
+    if (z) {
+        z->next_in = (Bytef*)in;
+        z->avail_in = (uInt)len;
+        z->next_out = out;
+        z->avail_out = (uInt)cap;
+        // Bản gốc lớn hơn cap (kể cả dữ liệu cố tình phình to) thì không kết thúc được
+        if (inflate(z, Z_FINISH) == Z_STREAM_END && z->avail_in == 0) {
+            produced = (int)(cap - z->avail_out);
+        }
+    }
+
+    count(&g_stats.decompress_calls, 1);
+    count(&g_stats.decompress_ns, thread_cpu_ns() - start);
+    if (produced >= 0) {
+        count(&g_stats.decompress_in, len);
+        count(&g_stats.decompress_out, (unsigned long)produced);
+    }
+    return produced;
+}
+
+static int has_prefix(const unsigned char* data, size_t len, size_t offset, const char* magic, size_t magic_len) {
+    return len >= offset + magic_len && memcmp(data + offset, magic, magic_len) == 0;
+}
+
+int compress_content_precompressed(const unsigned char* data, size_t len) {
+    static const struct {
+        size_t offset;
+        const char* magic;
+        size_t len;
+    } signatures[] = {
+        { 0, "\xFF\xD8\xFF", 3 },                 // JPEG
+        { 0, "\x89PNG", 4 },
+        { 0, "GIF8", 4 },
+        { 8, "WEBP", 4 },
+        { 0, "PK\x03\x04", 4 },                   // ZIP, docx/xlsx, jar, apk, epub
+        { 0, "\x1F\x8B", 2 },                     // gzip
+        { 0, "BZh", 3 },
+        { 0, "\xFD" "7zXZ", 5 },                  // xz
+        { 0, "\x28\xB5\x2F\xFD", 4 },             // zstd
+        { 0, "7z\xBC\xAF", 4 },
+        { 0, "Rar!", 4 },
+        { 0, "\x04\x22\x4D\x18", 4 },             // lz4
+        { 4, "ftyp", 4 },                         // MP4, MOV, HEIC
+        { 0, "ID3", 3 },                          // MP3
+        { 0, "OggS", 4 },
+        { 0, "fLaC", 4 },
+        { 0, "\x1A\x45\xDF\xA3", 4 },             // Matroska, WebM
+    };
+    for (size_t i = 0; i < sizeof(signatures) / sizeof(signatures[0]); i++) {
+        if (has_prefix(data, len, signatures[i].offset, signatures[i].magic, signatures[i].len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void compress_get_stats(compress_stats_t* stats) {
+    stats->compress_calls = __atomic_load_n(&g_stats.compress_calls, __ATOMIC_RELAXED);
+    stats->compress_in = __atomic_load_n(&g_stats.compress_in, __ATOMIC_RELAXED);
+    stats->compress_out = __atomic_load_n(&g_stats.compress_out, __ATOMIC_RELAXED);
+    stats->compress_skipped = __atomic_load_n(&g_stats.compress_skipped, __ATOMIC_RELAXED);
+    stats->compress_ns = __atomic_load_n(&g_stats.compress_ns, __ATOMIC_RELAXED);
+    stats->decompress_calls = __atomic_load_n(&g_stats.decompress_calls, __ATOMIC_RELAXED);
+    stats->decompress_in = __atomic_load_n(&g_stats.decompress_in, __ATOMIC_RELAXED);
+    stats->decompress_out = __atomic_load_n(&g_stats.decompress_out, __ATOMIC_RELAXED);
+    stats->decompress_ns = __atomic_load_n(&g_stats.decompress_ns, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,40 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+// Nén payload trên dây bằng raw deflate (zlib, mức 1) với dictionary dùng chung: tin chat
+// ngắn vẫn có chuỗi để tham chiếu ngay từ byte đầu. Mỗi thread giữ sẵn một stream nén và
+// một stream giải nén, mỗi lần gọi chỉ reset và nạp lại dictionary.
+// Dictionary là một phần của protocol (WIRE_FEATURE_DEFLATE), đổi nội dung phải đổi feature bit.
+
+// Frame ngắn hơn mức này không đáng nén
+#define COMPRESS_MIN_INPUT 64
+// Chỉ dùng bản nén khi nhỏ hơn bản gốc ít nhất 1/8
+#define COMPRESS_MIN_SAVING_SHIFT 3
+
+typedef struct {
+    unsigned long compress_calls;
+    unsigned long compress_in;        // Byte gốc đưa vào nén
+    unsigned long compress_out;       // Byte thực gửi: bản nén, hoặc bản gốc khi bỏ qua
+    unsigned long compress_skipped;   // Lần nén không đủ lợi, gửi bản gốc
+    unsigned long compress_ns;        // CPU time của thread khi nén
+    unsigned long decompress_calls;
+    unsigned long decompress_in;
+    unsigned long decompress_out;
+    unsigned long decompress_ns;
+} compress_stats_t;
+
+// Nén len byte vào out (cap byte). Trả về độ dài bản nén, -1 nếu không nhỏ hơn đủ
+// theo COMPRESS_MIN_SAVING_SHIFT (lúc đó gửi bản gốc).
+int compress_buffer(const unsigned char* in, size_t len, unsigned char* out, size_t cap);
+// Giải nén, trả về độ dài bản gốc hoặc -1 nếu dữ liệu hỏng hay bản gốc vượt cap
+int decompress_buffer(const unsigned char* in, size_t len, unsigned char* out, size_t cap);
+
+// 1 nếu data (đầu file) mang chữ ký của định dạng đã nén sẵn: JPEG, PNG, GIF, WebP,
+// ZIP (và docx/jar/apk), gzip, bzip2, xz, zstd, 7z, RAR, MP3/MP4/Ogg...
+int compress_content_precompressed(const unsigned char* data, size_t len);
+
+void compress_get_stats(compress_stats_t* stats);
+
+#endif // COMPRESS_H
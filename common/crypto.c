@@ -1,5 +1,8 @@
 #include "crypto.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <openssl/crypto.h>
 
 void init_crypto() {
     OpenSSL_add_all_algorithms();
@@ -9,76 +12,329 @@ void cleanup_crypto() {
     EVP_cleanup();
 }
 
-void generate_room_key(room_crypto_t* crypto) {
+void generate_room_key(room_crypto_t* crypto, room_cipher_t cipher) {
     // Tạo key và IV ngẫu nhiên
     RAND_bytes(crypto->key, AES_KEY_SIZE);
     RAND_bytes(crypto->iv, AES_IV_SIZE);
+    crypto->cipher = cipher;
 }
 
-int encrypt_message(const unsigned char* plaintext, int plaintext_len,
-                   const unsigned char* key, const unsigned char* iv,
-                   unsigned char* ciphertext) {
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) return -1;
-    
+int cipher_ctx_init(cipher_ctx_t* cipher, const unsigned char* key, room_cipher_t mode, int encrypt) {
+    cipher->ctx = EVP_CIPHER_CTX_new();
+    if (!cipher->ctx) {
+        return -1;
+    }
+    memcpy(cipher->key, key, AES_KEY_SIZE);
+    cipher->cipher = mode;
+    cipher->encrypt = encrypt;
+
+    // Key schedule chỉ dựng một lần ở đây
+    const EVP_CIPHER* evp = mode == ROOM_CIPHER_GCM ? EVP_aes_256_gcm() : EVP_aes_256_cbc();
+    if (EVP_CipherInit_ex(cipher->ctx, evp, NULL, key, NULL, encrypt) != 1) {
+        cipher_ctx_cleanup(cipher);
+        return -1;
+    }
+    return 0;
+}
+
+void cipher_ctx_cleanup(cipher_ctx_t* cipher) {
+    if (cipher->ctx) {
+        EVP_CIPHER_CTX_free(cipher->ctx);
+        cipher->ctx = NULL;
+    }
+    OPENSSL_cleanse(cipher->key, AES_KEY_SIZE);
+}
+
+int cipher_ctx_update(cipher_ctx_t* cipher, const unsigned char* iv,
+                      const unsigned char* in, int in_len, unsigned char* out) {
     int len;
-    int ciphertext_len;
-    
-    // Khởi tạo encryption
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    int out_len;
+
+    // cipher và key NULL: giữ key schedule, chỉ nạp IV mới
+    if (EVP_CipherInit_ex(cipher->ctx, NULL, NULL, NULL, iv, cipher->encrypt) != 1) {
         return -1;
     }
-    
-    // Mã hóa plaintext
-    if (EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    if (EVP_CipherUpdate(cipher->ctx, out, &len, in, in_len) != 1) {
         return -1;
     }
-    ciphertext_len = len;
-    
-    // Finalize encryption
-    if (EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    out_len = len;
+    if (EVP_CipherFinal_ex(cipher->ctx, out + len, &len) != 1) {
         return -1;
     }
-    ciphertext_len += len;
-    
-    EVP_CIPHER_CTX_free(ctx);
-    return ciphertext_len;
+    return out_len + len;
+}
+
+// Context theo thread: [chiều][vị trí], thay vòng tròn khi đầy
+#define CIPHER_CACHE_SIZE 8
+
+static __thread cipher_ctx_t t_cipher_cache[2][CIPHER_CACHE_SIZE];
+static __thread int t_cipher_next[2];
+static __thread int t_cipher_registered = 0;
+static pthread_key_t g_cipher_key;
+static pthread_once_t g_cipher_once = PTHREAD_ONCE_INIT;
+
+static void cipher_cache_release(void* arg) {
+    (void)arg;
+    for (int dir = 0; dir < 2; dir++) {
+        for (int i = 0; i < CIPHER_CACHE_SIZE; i++) {
+            cipher_ctx_cleanup(&t_cipher_cache[dir][i]);
+        }
+    }
+}
+
+static void cipher_cache_key_init(void) {
+    pthread_key_create(&g_cipher_key, cipher_cache_release);
+}
+
+cipher_ctx_t* cipher_ctx_for_key(const unsigned char* key, room_cipher_t mode, int encrypt) {
+    int dir = encrypt ? 1 : 0;
+    cipher_ctx_t* cache = t_cipher_cache[dir];
+    for (int i = 0; i < CIPHER_CACHE_SIZE; i++) {
+        if (cache[i].ctx && cache[i].cipher == (int)mode &&
+            memcmp(cache[i].key, key, AES_KEY_SIZE) == 0) {
+            return &cache[i];
+        }
+    }
+
+    if (!t_cipher_registered) {
+        pthread_once(&g_cipher_once, cipher_cache_key_init);
+        pthread_setspecific(g_cipher_key, &t_cipher_registered);
+        t_cipher_registered = 1;
+    }
+    cipher_ctx_t* slot = &cache[t_cipher_next[dir]];
+    t_cipher_next[dir] = (t_cipher_next[dir] + 1) % CIPHER_CACHE_SIZE;
+    cipher_ctx_cleanup(slot);
+    if (cipher_ctx_init(slot, key, mode, encrypt) < 0) {
+        return NULL;
+    }
+    return slot;
+}
+
+int encrypt_message(const unsigned char* plaintext, int plaintext_len,
+                   const unsigned char* key, const unsigned char* iv,
+                   unsigned char* ciphertext) {
+    cipher_ctx_t* cipher = cipher_ctx_for_key(key, ROOM_CIPHER_CBC, 1);
+    if (!cipher) return -1;
+    return cipher_ctx_update(cipher, iv, plaintext, plaintext_len, ciphertext);
 }
 
 int decrypt_message(const unsigned char* ciphertext, int ciphertext_len,
                    const unsigned char* key, const unsigned char* iv,
                    unsigned char* plaintext) {
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) return -1;
-    
+    cipher_ctx_t* cipher = cipher_ctx_for_key(key, ROOM_CIPHER_CBC, 0);
+    if (!cipher) return -1;
+    return cipher_ctx_update(cipher, iv, ciphertext, ciphertext_len, plaintext);
+}
+
+// Số message mỗi lần lấy nonce, giới hạn bộ đệm trên stack
+#define GCM_BATCH_CHUNK 64
+
+static int gcm_seal(cipher_ctx_t* cipher, const unsigned char* nonce, const unsigned char* aad, int aad_len,
+                    const unsigned char* in, int in_len, unsigned char* out) {
     int len;
-    int plaintext_len;
-    
-    // Khởi tạo decryption
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    int out_len;
+
+    memcpy(out, nonce, AES_GCM_NONCE_SIZE);
+    unsigned char* body = out + AES_GCM_NONCE_SIZE;
+    if (EVP_EncryptInit_ex(cipher->ctx, NULL, NULL, NULL, nonce) != 1) {
+        return -1;
+    }
+    if (aad_len > 0 && EVP_EncryptUpdate(cipher->ctx, NULL, &len, aad, aad_len) != 1) {
+        return -1;
+    }
+    if (EVP_EncryptUpdate(cipher->ctx, body, &len, in, in_len) != 1) {
+        return -1;
+    }
+    out_len = len;
+    if (EVP_EncryptFinal_ex(cipher->ctx, body + len, &len) != 1) {
+        return -1;
+    }
+    out_len += len;
+    if (EVP_CIPHER_CTX_ctrl(cipher->ctx, EVP_CTRL_GCM_GET_TAG, AES_GCM_TAG_SIZE, body + out_len) != 1) {
+        return -1;
+    }
+    return AES_GCM_NONCE_SIZE + out_len + AES_GCM_TAG_SIZE;
+}
+
+static int gcm_open(cipher_ctx_t* cipher, const unsigned char* aad, int aad_len,
+                    const unsigned char* in, int in_len, unsigned char* out) {
+    int len;
+    int out_len;
+    unsigned char tag[AES_GCM_TAG_SIZE];
+
+    if (in_len < AES_GCM_OVERHEAD) {
         return -1;
     }
-    
-    // Giải mã ciphertext
-    if (EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    int body_len = in_len - AES_GCM_OVERHEAD;
+    memcpy(tag, in + in_len - AES_GCM_TAG_SIZE, AES_GCM_TAG_SIZE);
+
+    if (EVP_DecryptInit_ex(cipher->ctx, NULL, NULL, NULL, in) != 1) {
+        return -1;
+    }
+    if (aad_len > 0 && EVP_DecryptUpdate(cipher->ctx, NULL, &len, aad, aad_len) != 1) {
+        return -1;
+    }
+    if (EVP_DecryptUpdate(cipher->ctx, out, &len, in + AES_GCM_NONCE_SIZE, body_len) != 1) {
+        return -1;
+    }
+    out_len = len;
+    // Tag phải đặt trước Final, Final thất bại nghĩa là dữ liệu bị sửa hoặc sai key
+    if (EVP_CIPHER_CTX_ctrl(cipher->ctx, EVP_CTRL_GCM_SET_TAG, AES_GCM_TAG_SIZE, tag) != 1) {
+        return -1;
+    }
+    if (EVP_DecryptFinal_ex(cipher->ctx, out + len, &len) != 1) {
+        return -1;
+    }
+    return out_len + len;
+}
+
+int gcm_encrypt_batch(const unsigned char* key, cipher_batch_item_t* items, int count) {
+    unsigned char nonces[GCM_BATCH_CHUNK * AES_GCM_NONCE_SIZE];
+    cipher_ctx_t* cipher = cipher_ctx_for_key(key, ROOM_CIPHER_GCM, 1);
+    int ok = 0;
+
+    for (int base = 0; base < count; base += GCM_BATCH_CHUNK) {
+        int n = count - base < GCM_BATCH_CHUNK ? count - base : GCM_BATCH_CHUNK;
+        int have_nonces = cipher && RAND_bytes(nonces, n * AES_GCM_NONCE_SIZE) == 1;
+        for (int i = 0; i < n; i++) {
+            cipher_batch_item_t* item = &items[base + i];
+            item->out_len = have_nonces
+                ? gcm_seal(cipher, nonces + i * AES_GCM_NONCE_SIZE, NULL, 0, item->in, item->in_len, item->out)
+                : -1;
+            if (item->out_len >= 0) {
+                ok++;
+            }
+        }
+    }
+    return ok;
+}
+
+int gcm_decrypt_batch(const unsigned char* key, cipher_batch_item_t* items, int count) {
+    cipher_ctx_t* cipher = cipher_ctx_for_key(key, ROOM_CIPHER_GCM, 0);
+    int ok = 0;
+
+    for (int i = 0; i < count; i++) {
+        items[i].out_len = cipher ? gcm_open(cipher, NULL, 0, items[i].in, items[i].in_len, items[i].out) : -1;
+        if (items[i].out_len >= 0) {
+            ok++;
+        }
+    }
+    return ok;
+}
+
+#define CHUNK_AAD_SIZE 24
+
+static void put_be(unsigned char* out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = (unsigned char)(value >> (8 * (bytes - 1 - i)));
+    }
+}
+
+// Chunk file: file_id, file_size, chunk_number và total_chunks là AAD nên chunk không đổi
+// chỗ, bị cắt bớt hay bị ghép từ file khác được
+static void chunk_aad(unsigned char aad[CHUNK_AAD_SIZE], const chunk_binding_t* file, int chunk_number) {
+    put_be(aad, (uint64_t)file->file_id, 8);
+    put_be(aad + 8, (uint64_t)file->file_size, 8);
+    put_be(aad + 16, (uint32_t)chunk_number, 4);
+    put_be(aad + 20, (uint32_t)file->total_chunks, 4);
+}
+
+int gcm_encrypt_chunk(const unsigned char* key, const chunk_binding_t* file, int chunk_number,
+                      const unsigned char* in, int in_len, unsigned char* out) {
+    unsigned char nonce[AES_GCM_NONCE_SIZE];
+    unsigned char aad[CHUNK_AAD_SIZE];
+    cipher_ctx_t* cipher = cipher_ctx_for_key(key, ROOM_CIPHER_GCM, 1);
+    if (!cipher || RAND_bytes(nonce, sizeof(nonce)) != 1) {
+        return -1;
+    }
+    chunk_aad(aad, file, chunk_number);
+    return gcm_seal(cipher, nonce, aad, sizeof(aad), in, in_len, out);
+}
+
+int gcm_decrypt_chunk(const unsigned char* key, const chunk_binding_t* file, int chunk_number,
+                      const unsigned char* in, int in_len, unsigned char* out) {
+    unsigned char aad[CHUNK_AAD_SIZE];
+    cipher_ctx_t* cipher = cipher_ctx_for_key(key, ROOM_CIPHER_GCM, 0);
+    if (!cipher) {
+        return -1;
+    }
+    chunk_aad(aad, file, chunk_number);
+    return gcm_open(cipher, aad, sizeof(aad), in, in_len, out);
+}
+
+long random_file_id(void) {
+    long id = 0;
+    if (RAND_bytes((unsigned char*)&id, sizeof(id)) != 1) {
+        return 0;
+    }
+    return id;
+}
+
+long hash_file_sha256(const char* path, unsigned char* hash) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
         return -1;
     }
-    plaintext_len = len;
-    
-    // Finalize decryption
-    if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(ctx);
+        fclose(file);
         return -1;
     }
-    plaintext_len += len;
-    
-    EVP_CIPHER_CTX_free(ctx);
-    return plaintext_len;
+
+    unsigned char buf[64 * 1024];
+    long total = 0;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+        EVP_DigestUpdate(ctx, buf, n);
+        total += (long)n;
+    }
+    int failed = ferror(file);
+    fclose(file);
+    if (failed || EVP_DigestFinal_ex(ctx, hash, NULL) != 1) {
+        total = -1;
+    }
+    EVP_MD_CTX_free(ctx);
+    return total;
+}
+
+int file_proof_digest(const unsigned char* nonce, long file_size, file_proof_read_t read, void* arg,
+                      unsigned char* proof) {
+    if (file_size <= 0) {
+        return -1;
+    }
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+    EVP_DigestUpdate(ctx, nonce, FILE_PROOF_NONCE_SIZE);
+
+    long span = file_size < FILE_PROOF_RANGE_SIZE ? file_size : FILE_PROOF_RANGE_SIZE;
+    unsigned char buf[FILE_PROOF_RANGE_SIZE];
+    int rc = 0;
+    for (int i = 0; i < FILE_PROOF_RANGES && rc == 0; i++) {
+        // Đoạn i bắt đầu ở 8 byte đầu của SHA-256(nonce || i), đọc big-endian để hai phía giống nhau
+        unsigned char seed[FILE_PROOF_NONCE_SIZE + 1];
+        unsigned char pick[SHA256_DIGEST_LENGTH];
+        memcpy(seed, nonce, FILE_PROOF_NONCE_SIZE);
+        seed[FILE_PROOF_NONCE_SIZE] = (unsigned char)i;
+        SHA256(seed, sizeof(seed), pick);
+        unsigned long long r = 0;
+        for (int b = 0; b < 8; b++) {
+            r = (r << 8) | pick[b];
+        }
+        long offset = (long)(r % (unsigned long long)(file_size - span + 1));
+        rc = read(arg, offset, buf, (size_t)span);
+        if (rc == 0) {
+            EVP_DigestUpdate(ctx, buf, (size_t)span);
+        }
+    }
+    if (rc == 0 && EVP_DigestFinal_ex(ctx, proof, NULL) != 1) {
+        rc = -1;
+    }
+    EVP_MD_CTX_free(ctx);
+    return rc < 0 ? -1 : 0;
 }
 
 void key_to_hex(const unsigned char* key, int key_len, char* hex_str) {
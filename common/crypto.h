@@ -12,13 +12,43 @@
 #define AES_KEY_SIZE 32  // 256-bit key
 #define AES_IV_SIZE 16   // 128-bit IV
 #define AES_BLOCK_SIZE 16
+#define AES_GCM_NONCE_SIZE 12
+#define AES_GCM_TAG_SIZE 16
+// Ciphertext GCM trên dây: nonce || dữ liệu mã hóa || tag
+#define AES_GCM_OVERHEAD (AES_GCM_NONCE_SIZE + AES_GCM_TAG_SIZE)
+
+// Chế độ mã hóa của phòng, cũng là giá trị is_encrypted của tin nhắn chat
+typedef enum {
+    ROOM_CIPHER_CBC = 1,          // AES-256-CBC, IV cố định của phòng
+    ROOM_CIPHER_GCM = 2           // AES-256-GCM, nonce riêng mỗi tin nhắn, có xác thực
+} room_cipher_t;
 
 // Cấu trúc lưu thông tin mã hóa của room
 typedef struct {
     unsigned char key[AES_KEY_SIZE];
-    unsigned char iv[AES_IV_SIZE];
+    unsigned char iv[AES_IV_SIZE];  // Chỉ dùng cho CBC
+    int cipher;                     // room_cipher_t
 } room_crypto_t;
 
+// Context AES-256 đã nạp key cho một chế độ và một chiều. Mỗi message chỉ đặt
+// lại IV/nonce nên không phải dựng lại key schedule.
+typedef struct {
+    EVP_CIPHER_CTX* ctx;
+    unsigned char key[AES_KEY_SIZE];
+    int cipher;                   // room_cipher_t
+    int encrypt;                  // 1 = mã hóa, 0 = giải mã
+} cipher_ctx_t;
+
+// Một message trong lô mã hóa/giải mã GCM. out phải chứa được
+// in_len + AES_GCM_OVERHEAD byte khi mã hóa; out_len = -1 nếu message đó lỗi
+// (giải mã: sai tag hoặc quá ngắn).
+typedef struct {
+    const unsigned char* in;
+    int in_len;
+    unsigned char* out;
+    int out_len;
+} cipher_batch_item_t;
+
 // Khởi tạo OpenSSL
 void init_crypto();
 
@@ -26,18 +56,69 @@ void init_crypto();
 void cleanup_crypto();
 
 // Tạo key và IV ngẫu nhiên cho room
-void generate_room_key(room_crypto_t* crypto);
+void generate_room_key(room_crypto_t* crypto, room_cipher_t cipher);
 
-// Mã hóa message
+// Mã hóa message (dùng context đã nạp key của thread hiện tại)
 int encrypt_message(const unsigned char* plaintext, int plaintext_len,
                    const unsigned char* key, const unsigned char* iv,
                    unsigned char* ciphertext);
 
-// Giải mã message
+// Giải mã message (dùng context đã nạp key của thread hiện tại)
 int decrypt_message(const unsigned char* ciphertext, int ciphertext_len,
                    const unsigned char* key, const unsigned char* iv,
                    unsigned char* plaintext);
 
+int cipher_ctx_init(cipher_ctx_t* cipher, const unsigned char* key, room_cipher_t mode, int encrypt);
+void cipher_ctx_cleanup(cipher_ctx_t* cipher);
+// Mã hóa hoặc giải mã CBC một message với IV của nó, trả về số byte ra hoặc -1
+int cipher_ctx_update(cipher_ctx_t* cipher, const unsigned char* iv,
+                      const unsigned char* in, int in_len, unsigned char* out);
+
+// Context của thread hiện tại cho key, chế độ và chiều này, tạo khi chưa có. Mỗi thread
+// giữ vài context gần nhất cho mỗi chiều, được giải phóng khi thread thoát.
+cipher_ctx_t* cipher_ctx_for_key(const unsigned char* key, room_cipher_t mode, int encrypt);
+
+// Mã hóa GCM cả lô với cùng key: một context, nonce của cả lô lấy trong một lần
+// RAND_bytes. Trả về số message thành công.
+int gcm_encrypt_batch(const unsigned char* key, cipher_batch_item_t* items, int count);
+// Giải mã và kiểm tra tag cả lô, trả về số message hợp lệ
+int gcm_decrypt_batch(const unsigned char* key, cipher_batch_item_t* items, int count);
+
+// File mà chunk thuộc về, được xác thực cùng dữ liệu (AAD) với số thứ tự chunk. file_id do
+// người gửi chọn ngẫu nhiên cho mỗi lần gửi, nên chunk của hai file cùng key phòng không
+// ghép lẫn được dù cùng số chunk.
+typedef struct {
+    long file_id;
+    long file_size;
+    int total_chunks;
+} chunk_binding_t;
+
+// GCM cho một chunk file, out = nonce || ciphertext || tag như tin chat. Vị trí chunk
+// được xác thực cùng dữ liệu. Trả về số byte ra hoặc -1 (giải mã: sai tag).
+int gcm_encrypt_chunk(const unsigned char* key, const chunk_binding_t* file, int chunk_number,
+                      const unsigned char* in, int in_len, unsigned char* out);
+int gcm_decrypt_chunk(const unsigned char* key, const chunk_binding_t* file, int chunk_number,
+                      const unsigned char* in, int in_len, unsigned char* out);
+// file_id ngẫu nhiên cho một lần gửi file, 0 nếu không lấy được byte ngẫu nhiên
+long random_file_id(void);
+
+// SHA-256 nội dung file (định danh khi offer file cho server).
+// Trả về kích thước file, -1 nếu không đọc được.
+long hash_file_sha256(const char* path, unsigned char* hash);
+
+// Chứng minh có file trước khi server phát bản trong cache: bằng chứng là SHA-256 của nonce
+// (server chọn ngẫu nhiên) nối với FILE_PROOF_RANGES đoạn của file, vị trí mỗi đoạn suy ra từ
+// nonce. Chỉ biết hash và kích thước file thì không tính được.
+#define FILE_PROOF_NONCE_SIZE 32
+#define FILE_PROOF_RANGES 4
+#define FILE_PROOF_RANGE_SIZE 4096
+
+// Đọc đúng len byte ở offset của file, -1 nếu lỗi
+typedef int (*file_proof_read_t)(void* arg, long offset, unsigned char* buf, size_t len);
+// proof nhận SHA256_DIGEST_LENGTH byte. -1 nếu đọc lỗi.
+int file_proof_digest(const unsigned char* nonce, long file_size, file_proof_read_t read, void* arg,
+                      unsigned char* proof);
+
 // Chuyển key thành string hex để truyền qua mạng
 void key_to_hex(const unsigned char* key, int key_len, char* hex_str);
 
@@ -0,0 +1,168 @@
+#include "ebr.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+// Trạng thái đọc của một thread. Record không bao giờ bị giải phóng: thread thoát
+// thì record được thả ra để thread sau dùng lại.
+typedef struct ebr_thread {
+    unsigned long epoch;          // Epoch thấy lúc vào vùng đọc
+    int active;                   // Đang trong vùng đọc
+    int in_use;                   // Đang thuộc về một thread còn sống
+    int depth;                    // Mức lồng ebr_enter, chỉ thread sở hữu dùng
+    struct ebr_thread* next;
+} ebr_thread_t;
+
+typedef struct ebr_retired {
+    void* ptr;
+    void (*destroy)(void*);
+    unsigned long epoch;          // Epoch lúc object bị gỡ
+    struct ebr_retired* next;
+} ebr_retired_t;
+
+static unsigned long g_epoch = 0;
+static ebr_thread_t* g_threads = NULL;      // Chỉ thêm vào đầu, không xóa
+static pthread_mutex_t g_limbo_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ebr_retired_t* g_limbo = NULL;       // Object đã gỡ nhưng chưa giải phóng
+static int g_pending = 0;                   // Số object trong g_limbo
+static pthread_key_t g_thread_key;
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static __thread ebr_thread_t* t_self = NULL;
+
+static void ebr_thread_exit(void* arg) {
+    ebr_thread_t* rec = (ebr_thread_t*)arg;
+    rec->depth = 0;
+    __atomic_store_n(&rec->active, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void ebr_key_init(void) {
+    pthread_key_create(&g_thread_key, ebr_thread_exit);
+}
+
+static ebr_thread_t* ebr_self(void) {
+    if (t_self) {
+        return t_self;
+    }
+    pthread_once(&g_key_once, ebr_key_init);
+
+    ebr_thread_t* rec = __atomic_load_n(&g_threads, __ATOMIC_ACQUIRE);
+    for (; rec; rec = rec->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!rec) {
+        rec = (ebr_thread_t*)calloc(1, sizeof(ebr_thread_t));
+        if (!rec) {
+            abort();
+        }
+        rec->in_use = 1;
+        rec->next = __atomic_load_n(&g_threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&g_threads, &rec->next, rec, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(g_thread_key, rec);
+    t_self = rec;
+    return rec;
+}
+
+// Epoch chỉ tăng khi mọi thread đang đọc đã thấy epoch hiện tại.
+// Vì vậy object gỡ ở epoch e không còn reader nào khi epoch đạt e + 2.
+static void ebr_try_advance_locked(void) {
+    unsigned long epoch = __atomic_load_n(&g_epoch, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    ebr_thread_t* rec = __atomic_load_n(&g_threads, __ATOMIC_ACQUIRE);
+    for (; rec; rec = rec->next) {
+        if (__atomic_load_n(&rec->active, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&rec->epoch, __ATOMIC_RELAXED) != epoch) {
+            return;
+        }
+    }
+    __atomic_store_n(&g_epoch, epoch + 1, __ATOMIC_RELEASE);
+}
+
+static void ebr_collect_locked(void) {
+    ebr_try_advance_locked();
+    unsigned long epoch = __atomic_load_n(&g_epoch, __ATOMIC_RELAXED);
+
+    ebr_retired_t** link = &g_limbo;
+    while (*link) {
+        ebr_retired_t* item = *link;
+        if (item->epoch + 2 <= epoch) {
+            *link = item->next;
+            item->destroy(item->ptr);
+            free(item);
+            __atomic_store_n(&g_pending, g_pending - 1, __ATOMIC_RELAXED);
+        } else {
+            link = &item->next;
+        }
+    }
+}
+
+void ebr_enter(void) {
+    ebr_thread_t* rec = ebr_self();
+    if (rec->depth++ > 0) {
+        return;
+    }
+    __atomic_store_n(&rec->epoch, __atomic_load_n(&g_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->active, 1, __ATOMIC_RELAXED);
+    // Phải thấy active trước khi đọc con trỏ chung
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ebr_exit(void) {
+    ebr_thread_t* rec = t_self;
+    if (--rec->depth > 0) {
+        return;
+    }
+    __atomic_store_n(&rec->active, 0, __ATOMIC_RELEASE);
+
+    // Không có retire mới thì epoch đứng yên, reader ra khỏi vùng đọc dọn giúp
+    if (__atomic_load_n(&g_pending, __ATOMIC_RELAXED) > 0 &&
+        pthread_mutex_trylock(&g_limbo_mutex) == 0) {
+        ebr_collect_locked();
+        pthread_mutex_unlock(&g_limbo_mutex);
+    }
+}
+
+void ebr_retire(void* ptr, void (*destroy)(void*)) {
+    ebr_retired_t* item = (ebr_retired_t*)malloc(sizeof(ebr_retired_t));
+    if (!item) {
+        abort();
+    }
+    item->ptr = ptr;
+    item->destroy = destroy;
+
+    // Epoch phải đọc sau khi object đã được gỡ khỏi cấu trúc chung
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&g_limbo_mutex);
+    item->epoch = __atomic_load_n(&g_epoch, __ATOMIC_RELAXED);
+    item->next = g_limbo;
+    g_limbo = item;
+    __atomic_store_n(&g_pending, g_pending + 1, __ATOMIC_RELAXED);
+    ebr_collect_locked();
+    pthread_mutex_unlock(&g_limbo_mutex);
+}
+
+void ebr_collect(void) {
+    pthread_mutex_lock(&g_limbo_mutex);
+    ebr_collect_locked();
+    pthread_mutex_unlock(&g_limbo_mutex);
+}
+
+void ebr_drain(void) {
+    pthread_mutex_lock(&g_limbo_mutex);
+    while (g_limbo) {
+        ebr_retired_t* item = g_limbo;
+        g_limbo = item->next;
+        item->destroy(item->ptr);
+        free(item);
+    }
+    __atomic_store_n(&g_pending, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_limbo_mutex);
+}
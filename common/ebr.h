@@ -0,0 +1,21 @@
+#ifndef EBR_H
+#define EBR_H
+
+// Epoch-based reclamation cho cấu trúc đọc không khóa (bảng phòng).
+// Reader bọc mọi lần dùng con trỏ lấy từ cấu trúc chung trong ebr_enter/ebr_exit
+// (lồng nhau được). Writer gỡ object khỏi cấu trúc rồi gọi ebr_retire: object chỉ bị
+// giải phóng khi mọi thread đang trong vùng đọc lúc gỡ đã ra khỏi vùng đó.
+
+void ebr_enter(void);
+void ebr_exit(void);
+
+// destroy(ptr) được gọi sau ít nhất hai lần tăng epoch, từ thread bất kỳ
+void ebr_retire(void* ptr, void (*destroy)(void*));
+
+// Thử tăng epoch và giải phóng những gì đã an toàn
+void ebr_collect(void);
+
+// Giải phóng mọi object còn chờ, chỉ gọi khi không còn reader nào (lúc tắt server)
+void ebr_drain(void);
+
+#endif // EBR_H
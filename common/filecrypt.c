@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include "filecrypt.h"
+#include <openssl/crypto.h>
+
+// 128 slot x 8 KB: đủ cho mọi worker một lượt nhận trong khi producer đọc tiếp
+#define FILE_PIPELINE_SLOTS 128
+#define FILE_PIPELINE_MAX_WORKERS 8
+// Số chunk liền nhau một worker nhận mỗi lần lấy khóa
+#define FILE_PIPELINE_CLAIM 16
+
+struct file_pipeline {
+    pthread_mutex_t mutex;
+    pthread_cond_t space;         // Producer chờ slot trống
+    pthread_cond_t work;          // Worker chờ chunk mới
+    pthread_cond_t ready;         // Sink chờ chunk đầu hàng xử lý xong
+    file_chunk_t* slots;
+    int done[FILE_PIPELINE_SLOTS];
+    unsigned long produced;       // Số chunk đã commit
+    unsigned long claimed;        // Chunk tiếp theo chưa worker nào nhận
+    unsigned long consumed;       // Chunk tiếp theo cho sink
+    int closing;
+    int failed;
+
+    unsigned char key[AES_KEY_SIZE];
+    chunk_binding_t file;
+    int encrypt;
+    file_chunk_sink_t sink;
+    void* arg;
+
+    pthread_t workers[FILE_PIPELINE_MAX_WORKERS];
+    int worker_count;
+    pthread_t sink_thread;
+    int sink_started;
+};
+
+static void process_chunk(file_pipeline_t* p, file_chunk_t* chunk) {
+    unsigned long start = metrics_now_ns();
+    if (p->encrypt) {
+        chunk->out_len = gcm_encrypt_chunk(p->key, &p->file, chunk->chunk_number,
+                                           chunk->in, chunk->in_len, chunk->out);
+    } else {
+        chunk->out_len = gcm_decrypt_chunk(p->key, &p->file, chunk->chunk_number,
+                                           chunk->in, chunk->in_len, chunk->out);
+    }
+    metrics_record(METRIC_CRYPTO_NS, metrics_now_ns() - start);
+    metrics_add(METRIC_CRYPTO_BYTES, (unsigned long)chunk->in_len);
+}
+
+static void* pipeline_worker(void* arg) {
+    file_pipeline_t* p = (file_pipeline_t*)arg;
+
+    pthread_mutex_lock(&p->mutex);
+    while (1) {
+        while (p->claimed == p->produced && !p->closing) {
+            pthread_cond_wait(&p->work, &p->mutex);
+        }
+        if (p->claimed == p->produced) {
+            break;
+        }
+        unsigned long start = p->claimed;
+        unsigned long count = p->produced - start;
+        if (count > FILE_PIPELINE_CLAIM) {
+            count = FILE_PIPELINE_CLAIM;
+        }
+        p->claimed += count;
+        pthread_mutex_unlock(&p->mutex);
+
+        for (unsigned long i = 0; i < count; i++) {
+            process_chunk(p, &p->slots[(start + i) % FILE_PIPELINE_SLOTS]);
+        }
+
+        pthread_mutex_lock(&p->mutex);
+        for (unsigned long i = 0; i < count; i++) {
+            p->done[(start + i) % FILE_PIPELINE_SLOTS] = 1;
+        }
+        pthread_cond_signal(&p->ready);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
+
+static void* pipeline_sink(void* arg) {
+    file_pipeline_t* p = (file_pipeline_t*)arg;
+
+    pthread_mutex_lock(&p->mutex);
+    while (1) {
+        int index = (int)(p->consumed % FILE_PIPELINE_SLOTS);
+        while (!p->done[index] && !(p->closing && p->consumed == p->produced)) {
+            pthread_cond_wait(&p->ready, &p->mutex);
+        }
+        if (!p->done[index]) {
+            break;
+        }
+        int failed = p->failed;
+        pthread_mutex_unlock(&p->mutex);
+
+        // Đã lỗi thì chỉ bỏ qua chunk còn lại để producer không bị kẹt
+        file_chunk_t* chunk = &p->slots[index];
+        int rc = 0;
+        if (!failed) {
+            rc = chunk->out_len < 0 ? -1 : p->sink(p->arg, chunk);
+        }
+
+        pthread_mutex_lock(&p->mutex);
+        if (rc < 0) {
+            p->failed = 1;
+        }
+        p->done[index] = 0;
+        p->consumed++;
+        // Producer chỉ chờ khi đầy, đánh thức khi đã trống nửa vòng để nó điền theo lô
+        if (p->failed || p->produced - p->consumed == FILE_PIPELINE_SLOTS / 2) {
+            pthread_cond_signal(&p->space);
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
+
+static int pipeline_worker_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > FILE_PIPELINE_MAX_WORKERS ? FILE_PIPELINE_MAX_WORKERS : (int)cpus;
+}
+
+file_pipeline_t* file_pipeline_start(const unsigned char* key, const chunk_binding_t* file, int encrypt,
+                                     file_chunk_sink_t sink, void* arg) {
+    file_pipeline_t* p = (file_pipeline_t*)calloc(1, sizeof(file_pipeline_t));
+    if (!p) {
+        return NULL;
+    }
+    p->slots = (file_chunk_t*)malloc(sizeof(file_chunk_t) * FILE_PIPELINE_SLOTS);
+    if (!p->slots) {
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->space, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->ready, NULL);
+    memcpy(p->key, key, AES_KEY_SIZE);
+    p->file = *file;
+    p->encrypt = encrypt;
+    p->sink = sink;
+    p->arg = arg;
+
+    if (pthread_create(&p->sink_thread, NULL, pipeline_sink, p) != 0) {
+        file_pipeline_finish(p);
+        return NULL;
+    }
+    p->sink_started = 1;
+    int workers = pipeline_worker_count();
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&p->workers[i], NULL, pipeline_worker, p) != 0) {
+            break;
+        }
+        p->worker_count++;
+    }
+    if (p->worker_count == 0) {
+        file_pipeline_finish(p);
+        return NULL;
+    }
+    return p;
+}
+
+file_chunk_t* file_pipeline_acquire(file_pipeline_t* p) {
+    pthread_mutex_lock(&p->mutex);
+    while (p->produced - p->consumed >= FILE_PIPELINE_SLOTS && !p->failed) {
+        // Sắp chờ: đánh thức worker cho phần lẻ chưa đủ một lượt nhận
+        pthread_cond_broadcast(&p->work);
+        pthread_cond_wait(&p->space, &p->mutex);
+    }
+    file_chunk_t* chunk = p->failed ? NULL : &p->slots[p->produced % FILE_PIPELINE_SLOTS];
+    pthread_mutex_unlock(&p->mutex);
+    return chunk;
+}
+
+void file_pipeline_commit(file_pipeline_t* p, file_chunk_t* chunk) {
+    (void)chunk;
+    pthread_mutex_lock(&p->mutex);
+    p->produced++;
+    // Gom đủ một lượt mới đánh thức worker, tránh đổi ngữ cảnh cho từng chunk 4 KB
+    if (p->produced - p->claimed >= FILE_PIPELINE_CLAIM) {
+        pthread_cond_signal(&p->work);
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
+
+int file_pipeline_finish(file_pipeline_t* p) {
+    pthread_mutex_lock(&p->mutex);
+    p->closing = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_cond_broadcast(&p->ready);
+    pthread_mutex_unlock(&p->mutex);
+
+    for (int i = 0; i < p->worker_count; i++) {
+        pthread_join(p->workers[i], NULL);
+    }
+    // Sink chỉ thoát khi đã nhận hết chunk, tức là sau khi worker xong việc
+    if (p->sink_started) {
+        pthread_join(p->sink_thread, NULL);
+    }
+
+    int rc = p->failed ? -1 : 0;
+    OPENSSL_cleanse(p->key, AES_KEY_SIZE);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->space);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->ready);
+    free(p->slots);
+    free(p);
+    return rc;
+}
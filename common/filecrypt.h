@@ -0,0 +1,36 @@
+#ifndef FILECRYPT_H
+#define FILECRYPT_H
+
+#include "protocol.h"
+
+// Pipeline mã hóa/giải mã chunk file. Một thread đưa chunk vào theo thứ tự (đọc đĩa
+// hoặc đọc socket), các worker mã hóa song song, thread sink nhận kết quả theo đúng
+// thứ tự chunk (ghi socket hoặc ghi đĩa). Số worker bằng số CPU online (tối đa 8);
+// trên máy một CPU, pipeline chỉ thêm chi phí chuyển chunk giữa các thread.
+
+typedef struct {
+    int chunk_number;
+    int in_len;
+    int out_len;                          // -1 nếu mã hóa lỗi hoặc sai tag
+    unsigned char in[FILE_CHUNK_SIZE];
+    unsigned char out[FILE_CHUNK_SIZE];
+} file_chunk_t;
+
+// Nhận chunk đã xử lý theo thứ tự, trả về -1 để dừng pipeline
+typedef int (*file_chunk_sink_t)(void* arg, const file_chunk_t* chunk);
+
+typedef struct file_pipeline file_pipeline_t;
+
+// encrypt = 1: in là plaintext (tối đa FILE_CRYPT_CHUNK_SIZE), 0: in là data đã mã hóa.
+// NULL nếu không tạo được thread.
+// file: file mà các chunk thuộc về, nằm trong AAD của từng chunk.
+file_pipeline_t* file_pipeline_start(const unsigned char* key, const chunk_binding_t* file, int encrypt,
+                                     file_chunk_sink_t sink, void* arg);
+// Slot trống cho chunk tiếp theo, chờ nếu pipeline đầy. NULL khi pipeline đã lỗi.
+file_chunk_t* file_pipeline_acquire(file_pipeline_t* pipeline);
+// Người gọi đã điền chunk_number, in và in_len
+void file_pipeline_commit(file_pipeline_t* pipeline, file_chunk_t* chunk);
+// Chờ mọi chunk qua sink rồi giải phóng pipeline. 0 nếu mọi chunk thành công.
+int file_pipeline_finish(file_pipeline_t* pipeline);
+
+#endif // FILECRYPT_H
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define METRICS_CACHE_LINE 64
+
+// Khối của một thread. Chỉ thread sở hữu ghi (load + store relaxed, không cần lock prefix),
+// người đọc snapshot đọc relaxed nên mỗi giá trị không bị xé dù có thể lệch nhau chút ít.
+typedef struct metrics_block {
+    unsigned long counters[METRIC_COUNTER_COUNT];
+    metrics_histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+    struct metrics_block* next;
+    struct metrics_block* prev;
+} metrics_block_t;
+
+static __thread metrics_block_t* t_block = NULL;
+static __thread unsigned long t_received_ns = 0;
+
+static pthread_mutex_t g_blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_block_t* g_blocks = NULL;     // Khối của các thread đang sống
+static metrics_block_t g_retired;            // Tổng của các thread đã kết thúc
+static pthread_key_t g_block_key;
+static pthread_once_t g_block_once = PTHREAD_ONCE_INIT;
+static unsigned long g_start_ns;
+
+#define METRIC_NAME(id, name, help) name,
+#define METRIC_HELP(id, name, help) help,
+static const char* const g_counter_names[] = { METRIC_COUNTERS(METRIC_NAME) };
+static const char* const g_counter_help[] = { METRIC_COUNTERS(METRIC_HELP) };
+static const char* const g_histogram_names[] = { METRIC_HISTOGRAMS(METRIC_NAME) };
+static const char* const g_histogram_help[] = { METRIC_HISTOGRAMS(METRIC_HELP) };
+#undef METRIC_NAME
+#undef METRIC_HELP
+
+unsigned long metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static void bump(unsigned long* slot, unsigned long value) {
+    __atomic_store_n(slot, *slot + value, __ATOMIC_RELAXED);
+}
+
+static unsigned long load(const unsigned long* slot) {
+    return __atomic_load_n(slot, __ATOMIC_RELAXED);
+}
+
+void metrics_histogram_merge(metrics_histogram_t* into, const metrics_histogram_t* from) {
+    into->count += load(&from->count);
+    into->sum += load(&from->sum);
+    unsigned long max = load(&from->max);
+    if (max > into->max) {
+        into->max = max;
+    }
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        into->buckets[i] += load(&from->buckets[i]);
+    }
+}
+
+static void block_merge(metrics_block_t* into, const metrics_block_t* from) {
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        into->counters[i] += load(&from->counters[i]);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        metrics_histogram_merge(&into->histograms[i], &from->histograms[i]);
+    }
+}
+
+// Thread kết thúc: gộp số liệu vào phần đã nghỉ rồi bỏ khối khỏi danh sách
+static void block_release(void* arg) {
+    metrics_block_t* block = (metrics_block_t*)arg;
+    pthread_mutex_lock(&g_blocks_mutex);
+    block_merge(&g_retired, block);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        g_blocks = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    pthread_mutex_unlock(&g_blocks_mutex);
+    free(block);
+    t_block = NULL;
+}
+
+static void block_key_init(void) {
+    pthread_key_create(&g_block_key, block_release);
+    g_start_ns = metrics_now_ns();
+}
+
+static metrics_block_t* block_get(void) {
+    if (t_block) {
+        return t_block;
+    }
+    pthread_once(&g_block_once, block_key_init);
+
+    // Làm tròn lên cache line để khối của hai thread không chung dòng nào
+    size_t size = (sizeof(metrics_block_t) + METRICS_CACHE_LINE - 1) & ~(size_t)(METRICS_CACHE_LINE - 1);
+    void* memory = NULL;
+    if (posix_memalign(&memory, METRICS_CACHE_LINE, size) != 0) {
+        return NULL;
+    }
+    metrics_block_t* block = (metrics_block_t*)memory;
+    memset(block, 0, size);
+
+    pthread_mutex_lock(&g_blocks_mutex);
+    block->next = g_blocks;
+    if (g_blocks) {
+        g_blocks->prev = block;
+    }
+    g_blocks = block;
+    pthread_mutex_unlock(&g_blocks_mutex);
+
+    pthread_setspecific(g_block_key, block);
+    t_block = block;
+    return block;
+}
+
+static int bucket_index(unsigned long value) {
+    if (value < (1UL << METRICS_SUB_BITS)) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzl(value);
+    if (exponent >= METRICS_MAX_BITS) {
+        return METRICS_BUCKETS - 1;
+    }
+    int shift = exponent - METRICS_SUB_BITS;
+    int sub = (int)((value >> shift) & ((1UL << METRICS_SUB_BITS) - 1));
+    return ((shift + 1) << METRICS_SUB_BITS) + sub;
+}
+
+// Giá trị lớn nhất rơi vào bucket
+static unsigned long bucket_upper(int index) {
+    if (index < (1 << METRICS_SUB_BITS)) {
+        return (unsigned long)index;
+    }
+    int shift = (index >> METRICS_SUB_BITS) - 1;
+    unsigned long sub = (unsigned long)(index & ((1 << METRICS_SUB_BITS) - 1));
+    unsigned long lower = ((1UL << METRICS_SUB_BITS) + sub) << shift;
+    return lower + (1UL << shift) - 1;
+}
+
+void metrics_add(metric_counter_t counter, unsigned long value) {
+    metrics_block_t* block = block_get();
+    if (block) {
+        bump(&block->counters[counter], value);
+    }
+}
+
+void metrics_histogram_add(metrics_histogram_t* h, unsigned long value) {
+    bump(&h->buckets[bucket_index(value)], 1);
+    bump(&h->count, 1);
+    bump(&h->sum, value);
+    if (value > h->max) {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_record(metric_histogram_t histogram, unsigned long value) {
+    metrics_block_t* block = block_get();
+    if (block) {
+        metrics_histogram_add(&block->histograms[histogram], value);
+    }
+}
+
+void metrics_mark_received(void) {
+    t_received_ns = metrics_now_ns();
+}
+
+unsigned long metrics_received_ns(void) {
+    return t_received_ns;
+}
+
+void metrics_set_received(unsigned long received_ns) {
+    t_received_ns = received_ns;
+}
+
+void metrics_record_since_received(metric_histogram_t histogram) {
+    if (t_received_ns != 0) {
+        metrics_record(histogram, metrics_now_ns() - t_received_ns);
+    }
+}
+
+void metrics_snapshot(metrics_snapshot_t* snapshot) {
+    metrics_block_t* total = (metrics_block_t*)calloc(1, sizeof(metrics_block_t));
+    memset(snapshot, 0, sizeof(*snapshot));
+    if (!total) {
+        return;
+    }
+    pthread_once(&g_block_once, block_key_init);
+
+    pthread_mutex_lock(&g_blocks_mutex);
+    block_merge(total, &g_retired);
+    for (metrics_block_t* block = g_blocks; block; block = block->next) {
+        block_merge(total, block);
+    }
+    pthread_mutex_unlock(&g_blocks_mutex);
+
+    snapshot->uptime_seconds = (double)(metrics_now_ns() - g_start_ns) / 1e9;
+    memcpy(snapshot->counters, total->counters, sizeof(snapshot->counters));
+    memcpy(snapshot->histograms, total->histograms, sizeof(snapshot->histograms));
+    free(total);
+}
+
+static unsigned long histogram_percentile(const metrics_histogram_t* h, double fraction) {
+    unsigned long rank = (unsigned long)((double)h->count * fraction);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    unsigned long seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            unsigned long upper = bucket_upper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+void metrics_summarize(const metrics_histogram_t* histogram, metrics_summary_t* summary) {
+    memset(summary, 0, sizeof(*summary));
+    if (histogram->count == 0) {
+        return;
+    }
+    summary->count = histogram->count;
+    summary->mean = (double)histogram->sum / (double)histogram->count;
+    summary->p50 = histogram_percentile(histogram, 0.50);
+    summary->p90 = histogram_percentile(histogram, 0.90);
+    summary->p99 = histogram_percentile(histogram, 0.99);
+    summary->p999 = histogram_percentile(histogram, 0.999);
+    summary->max = histogram->max;
+}
+
+const char* metrics_counter_name(metric_counter_t counter) {
+    return g_counter_names[counter];
+}
+
+const char* metrics_histogram_name(metric_histogram_t histogram) {
+    return g_histogram_names[histogram];
+}
+
+void metrics_write_text(FILE* out, const metrics_snapshot_t* snapshot) {
+    fprintf(out, "# HELP chat_uptime_seconds Thời gian từ khi metrics bắt đầu\n");
+    fprintf(out, "# TYPE chat_uptime_seconds gauge\nchat_uptime_seconds %.3f\n", snapshot->uptime_seconds);
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        fprintf(out, "# HELP chat_%s_total %s\n", g_counter_names[i], g_counter_help[i]);
+        fprintf(out, "# TYPE chat_%s_total counter\nchat_%s_total %lu\n", g_counter_names[i],
+                g_counter_names[i], snapshot->counters[i]);
+    }
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        const metrics_histogram_t* h = &snapshot->histograms[i];
+        const char* name = g_histogram_names[i];
+        fprintf(out, "# HELP chat_%s %s\n# TYPE chat_%s summary\n", name, g_histogram_help[i], name);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            fprintf(out, "chat_%s{quantile=\"%g\"} %lu\n", name, quantiles[q],
+                    h->count ? histogram_percentile(h, quantiles[q]) : 0);
+        }
+        fprintf(out, "chat_%s_sum %lu\nchat_%s_count %lu\n", name, h->sum, name, h->count);
+        fprintf(out, "# TYPE chat_%s_max gauge\nchat_%s_max %lu\n", name, name, h->max);
+    }
+}
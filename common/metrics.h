@@ -0,0 +1,89 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+// Metrics chi phí thấp: mỗi thread ghi vào khối counter/histogram riêng, căn theo cache line
+// nên các thread không tranh nhau dòng cache và không có lệnh atomic read-modify-write nào
+// trên đường nóng. Chỉ khi cần (MSG_STATS, cổng scrape, --stats-interval) mới cộng dồn các
+// khối; khối của thread đã kết thúc được gộp vào phần "đã nghỉ" để số liệu không mất.
+
+// X(id, tên, mô tả)
+#define METRIC_COUNTERS(X) \
+    X(METRIC_FRAMES_RECEIVED, "frames_received",  "Frame nhận từ client") \
+    X(METRIC_BROADCASTS,      "broadcasts",       "Lượt broadcast tin nhắn") \
+    X(METRIC_FILE_CHUNKS,     "file_chunks",      "Chunk file được relay") \
+    X(METRIC_FILE_BYTES_IN,   "file_bytes_in",    "Byte payload file nhận từ người gửi") \
+    X(METRIC_FILE_BYTES_OUT,  "file_bytes_out",   "Byte payload file gửi tới người nhận") \
+    X(METRIC_CRYPTO_BYTES,    "crypto_bytes",     "Byte được mã hóa/giải mã")
+
+// Histogram log-linear kiểu HDR: giá trị < 16 chính xác, lớn hơn sai số tương đối <= 1/16.
+// X(id, tên, mô tả)
+#define METRIC_HISTOGRAMS(X) \
+    X(METRIC_FANOUT_LATENCY_NS, "fanout_latency_ns",   "Từ lúc nhận frame tới khi broadcast xong") \
+    X(METRIC_FILE_CHUNK_NS,     "file_chunk_ns",       "Từ lúc nhận chunk file tới khi relay xong") \
+    X(METRIC_BROADCAST_MEMBERS, "broadcast_members",   "Số người nhận mỗi broadcast") \
+    X(METRIC_BROADCAST_BYTES,   "broadcast_bytes",     "Byte đưa vào socket mỗi broadcast") \
+    X(METRIC_SEND_QUEUE_BYTES,  "send_queue_bytes",    "Độ sâu hàng đợi gửi của client mỗi lần phải xếp hàng") \
+    X(METRIC_CRYPTO_NS,         "crypto_ns",           "Thời gian mỗi lần mã hóa/giải mã (một tin, một lô tin hoặc một chunk)")
+
+#define METRIC_ENUM(id, name, help) id,
+typedef enum { METRIC_COUNTERS(METRIC_ENUM) METRIC_COUNTER_COUNT } metric_counter_t;
+typedef enum { METRIC_HISTOGRAMS(METRIC_ENUM) METRIC_HISTOGRAM_COUNT } metric_histogram_t;
+#undef METRIC_ENUM
+
+#define METRICS_SUB_BITS 4
+#define METRICS_MAX_BITS 40           // Giá trị >= 2^40 dồn vào bucket cuối
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+typedef struct {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+// Tổng của mọi thread tại một thời điểm
+typedef struct {
+    double uptime_seconds;
+    unsigned long counters[METRIC_COUNTER_COUNT];
+    metrics_histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+} metrics_snapshot_t;
+
+typedef struct {
+    unsigned long count;
+    double mean;
+    unsigned long p50;
+    unsigned long p90;
+    unsigned long p99;
+    unsigned long p999;
+    unsigned long max;
+} metrics_summary_t;
+
+unsigned long metrics_now_ns(void);
+
+void metrics_add(metric_counter_t counter, unsigned long value);
+void metrics_record(metric_histogram_t histogram, unsigned long value);
+
+// Thời điểm frame đang xử lý trên thread này được nhận (0 = không có). Worker nhận
+// message từ network thread thì đặt lại giá trị đã lưu cùng message.
+void metrics_mark_received(void);
+unsigned long metrics_received_ns(void);
+void metrics_set_received(unsigned long received_ns);
+// Ghi thời gian từ lúc nhận frame hiện tại vào histogram (bỏ qua nếu không có)
+void metrics_record_since_received(metric_histogram_t histogram);
+
+// Histogram do người gọi sở hữu (ví dụ của chat_bench), chỉ một thread ghi
+void metrics_histogram_add(metrics_histogram_t* histogram, unsigned long value);
+void metrics_histogram_merge(metrics_histogram_t* into, const metrics_histogram_t* from);
+
+// snapshot khá lớn (vài chục KB), người gọi nên cấp phát trên heap
+void metrics_snapshot(metrics_snapshot_t* snapshot);
+void metrics_summarize(const metrics_histogram_t* histogram, metrics_summary_t* summary);
+const char* metrics_counter_name(metric_counter_t counter);
+const char* metrics_histogram_name(metric_histogram_t histogram);
+
+// Định dạng text của Prometheus, tên có tiền tố chat_
+void metrics_write_text(FILE* out, const metrics_snapshot_t* snapshot);
+
+#endif // METRICS_H
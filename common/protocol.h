@@ -11,11 +11,21 @@
 #include <unistd.h>
 #include <time.h>
 #include "crypto.h"
+#include "compress.h"
+#include "metrics.h"
+#include "trace.h"
+#include "ringbuf.h"
+#include "spool.h"
+#include "wirebuf.h"
+#include "ebr.h"
+#include "slab.h"
 
 // Constants
 #define MAX_USERNAME_LEN 50
 #define MAX_MESSAGE_LEN 500
 #define MAX_ENCRYPTED_LEN 1024
+// Số tin chat tối đa giải mã trong một lượt decrypt_message_content_batch
+#define MESSAGE_BATCH_MAX 16
 #define MAX_ROOM_NAME_LEN 100
 #define MAX_CLIENTS_PER_ROOM 20
 #define MAX_ROOMS 50
@@ -23,33 +33,115 @@
 #define BUFFER_SIZE 1024
 #define MAX_FILENAME_LEN 256
 #define FILE_CHUNK_SIZE 4096
+// Plaintext của một chunk file mã hóa, data = nonce || ciphertext || tag
+#define FILE_CRYPT_CHUNK_SIZE (FILE_CHUNK_SIZE - AES_GCM_OVERHEAD)
+#define WIRE_MAX_FRAME_SIZE 8192
+#define CLIENT_RX_BUFFER_SIZE (2 * WIRE_MAX_FRAME_SIZE)
+// Watermark mặc định của hàng đợi gửi mỗi client (byte)
+#define CLIENT_QUEUE_HIGH_DEFAULT (256 * 1024)
+#define CLIENT_QUEUE_LOW_DEFAULT (64 * 1024)
+// Số broadcast gần nhất mỗi phòng giữ lại để phát lại cho người vào sau (lũy thừa của 2)
+#define ROOM_HISTORY_SIZE 256
 
-// Message types
+// Wire protocol versions
+#define WIRE_VERSION_LEGACY 1   // Gửi nguyên struct message_t / file_transfer_t
+#define WIRE_VERSION_V2 2       // Frame có length prefix, chỉ gửi các field cần thiết
+#define WIRE_VERSION_MAX WIRE_VERSION_V2
+// MSG_JOIN (v1) mang room_id = WIRE_NEGOTIATE_MAGIC | feature | version để xin nâng cấp,
+// MSG_WELCOME trả lại cùng giá trị với version và các feature được chấp nhận
+#define WIRE_NEGOTIATE_MAGIC 0x57520000
+#define WIRE_NEGOTIATE_MASK 0xFFFF0000
+#define WIRE_NEGOTIATE_VERSION_MASK 0x000000FF
+// Feature của v2: frame chat và chunk file có thể nén raw deflate với dictionary chung
+#define WIRE_FEATURE_DEFLATE 0x00000100
+#define WIRE_FEATURES_SUPPORTED WIRE_FEATURE_DEFLATE
+
+// Field của message_t được mã hóa trong frame v2, theo đúng thứ tự này.
+// X(flag, kind, field, length_field)
+#define MESSAGE_FIELDS(X) \
+    X(MF_USERNAME,     STRING, username,          -) \
+    X(MF_CONTENT,      STRING, content,           -) \
+    X(MF_ENCRYPTED,    BLOB,   encrypted_content, encrypted_len) \
+    X(MF_IS_ENCRYPTED, U8,     is_encrypted,      -) \
+    X(MF_ROOM_ID,      I32,    room_id,           -) \
+    X(MF_CLIENT_ID,    I32,    client_id,         -) \
+    X(MF_TIMESTAMP,    I64,    timestamp,         -) \
+    X(MF_ROOM_KEY,     STRING, room_key_hex,      -) \
+    X(MF_ROOM_IV,      STRING, room_iv_hex,       -) \
+    X(MF_FILE_HASH,    STRING, file_hash_hex,     -) \
+    X(MF_FILE_SIZE,    I64,    file_size,         -) \
+    X(MF_HISTORY_SEQ,  I64,    history_seq,       -) \
+    X(MF_STREAM_ID,    I32,    stream_id,         -)
+
+// Field của file_transfer_t trong frame MSG_FILE_DATA. Payload luôn nằm cuối frame.
+#define FILE_TRANSFER_FIELDS(X) \
+    X(FF_FILENAME,     STRING, filename,     -) \
+    X(FF_FILE_SIZE,    I64,    file_size,    -) \
+    X(FF_SENDER_ID,    I32,    sender_id,    -) \
+    X(FF_RECEIVER_ID,  I32,    receiver_id,  -) \
+    X(FF_SENDER_NAME,  STRING, sender_name,  -) \
+    X(FF_CHUNK_NUMBER, I32,    chunk_number, -) \
+    X(FF_TOTAL_CHUNKS, I32,    total_chunks, -) \
+    X(FF_ENCRYPTED,    U8,     encrypted,    -) \
+    X(FF_COMPRESSED,   U8,     compressed,   -) \
+    X(FF_STREAM_ID,    I32,    stream_id,    -) \
+    X(FF_FILE_ID,      I64,    file_id,      -) \
+    X(FF_DATA,         BLOB,   data,         data_size)
+
+#define WIRE_FIELD_BIT(flag, kind, field, len) flag##_BIT,
+#define WIRE_FIELD_MASK(flag, kind, field, len) flag = 1u << flag##_BIT,
+enum { MESSAGE_FIELDS(WIRE_FIELD_BIT) FILE_TRANSFER_FIELDS(WIRE_FIELD_BIT) };
+enum { MESSAGE_FIELDS(WIRE_FIELD_MASK) FILE_TRANSFER_FIELDS(WIRE_FIELD_MASK) };
+
+#define MF_SERVER_TEXT (MF_USERNAME | MF_CONTENT)
+#define MF_CHAT (MF_CONTENT | MF_ENCRYPTED | MF_IS_ENCRYPTED)
+
+// Message types và các field mỗi loại mang trong frame v2.
+// X(type, fields)
+#define MESSAGE_TYPES(X) \
+    X(MSG_JOIN,               MF_USERNAME | MF_ROOM_ID) \
+    X(MSG_CREATE_ROOM,        MF_CONTENT) \
+    X(MSG_JOIN_ROOM,          MF_ROOM_ID | MF_HISTORY_SEQ) \
+    X(MSG_LEAVE_ROOM,         0) \
+    X(MSG_MESSAGE,            MF_CHAT) \
+    X(MSG_LIST_ROOMS,         0) \
+    X(MSG_QUIT,               0) \
+    X(MSG_WELCOME,            MF_SERVER_TEXT | MF_ROOM_ID) \
+    X(MSG_ROOM_CREATED,       MF_SERVER_TEXT | MF_ROOM_ID) \
+    X(MSG_ROOM_JOINED,        MF_SERVER_TEXT | MF_ROOM_ID) \
+    X(MSG_ROOM_LEFT,          MF_SERVER_TEXT) \
+    X(MSG_ROOM_LIST,          MF_SERVER_TEXT) \
+    X(MSG_ERROR,              MF_SERVER_TEXT) \
+    X(MSG_BROADCAST,          MF_USERNAME | MF_CHAT | MF_ROOM_ID | MF_CLIENT_ID | MF_TIMESTAMP | MF_HISTORY_SEQ) \
+    /* Mỗi lần gửi file là một stream, stream_id do người gửi chọn và khác nhau trên một kết nối */ \
+    X(MSG_FILE_REQUEST,       MF_CONTENT | MF_FILE_SIZE | MF_STREAM_ID) \
+    X(MSG_FILE_ACCEPT,        MF_CONTENT | MF_CLIENT_ID | MF_STREAM_ID) \
+    X(MSG_FILE_REJECT,        MF_CONTENT | MF_CLIENT_ID | MF_STREAM_ID) \
+    X(MSG_FILE_DATA,          0) \
+    X(MSG_FILE_COMPLETE,      MF_SERVER_TEXT | MF_STREAM_ID) \
+    X(MSG_FILE_NOTIFICATION,  MF_SERVER_TEXT | MF_CLIENT_ID | MF_STREAM_ID) \
+    /* Encryption-related messages */ \
+    X(MSG_ENABLE_ENCRYPTION,  MF_IS_ENCRYPTED) \
+    X(MSG_ROOM_KEY,           MF_USERNAME | MF_ROOM_ID | MF_ROOM_KEY | MF_ROOM_IV | MF_IS_ENCRYPTED) \
+    X(MSG_ENCRYPTION_ENABLED, MF_SERVER_TEXT | MF_ROOM_ID) \
+    /* Gửi file theo hash: server đã có nội dung thì hỏi MSG_FILE_CHALLENGE, chưa có thì MSG_FILE_ACCEPT */ \
+    X(MSG_FILE_OFFER,         MF_CONTENT | MF_FILE_HASH | MF_FILE_SIZE | MF_STREAM_ID) \
+    /* Phát lại lịch sử phòng: các MSG_BROADCAST có seq > history_seq nằm giữa BEGIN và END */ \
+    X(MSG_HISTORY_REQUEST,    MF_ROOM_ID | MF_HISTORY_SEQ) \
+    X(MSG_HISTORY_BEGIN,      MF_SERVER_TEXT | MF_ROOM_ID | MF_HISTORY_SEQ) \
+    X(MSG_HISTORY_END,        MF_SERVER_TEXT | MF_ROOM_ID | MF_HISTORY_SEQ) \
+    /* Metrics của server: client gửi MSG_STATS rỗng, server trả mỗi dòng báo cáo một MSG_STATS */ \
+    X(MSG_STATS,              MF_SERVER_TEXT) \
+    /* Offer trúng cache: server gửi nonce, client trả bằng chứng (file_proof_digest). Đúng thì */ \
+    /* server phát từ cache và trả MSG_FILE_COMPLETE, sai thì MSG_FILE_ACCEPT để upload như thường */ \
+    X(MSG_FILE_CHALLENGE,     MF_FILE_HASH | MF_FILE_SIZE | MF_STREAM_ID) \
+    X(MSG_FILE_PROOF,         MF_FILE_HASH | MF_STREAM_ID)
+
+#define MESSAGE_TYPE_ENUM(type, fields) type,
 typedef enum {
-    MSG_JOIN = 1,
-    MSG_CREATE_ROOM,
-    MSG_JOIN_ROOM,
-    MSG_LEAVE_ROOM,
-    MSG_MESSAGE,
-    MSG_LIST_ROOMS,
-    MSG_QUIT,
-    MSG_WELCOME,
-    MSG_ROOM_CREATED,
-    MSG_ROOM_JOINED,
-    MSG_ROOM_LEFT,
-    MSG_ROOM_LIST,
-    MSG_ERROR,
-    MSG_BROADCAST,
-    MSG_FILE_REQUEST,
-    MSG_FILE_ACCEPT,
-    MSG_FILE_REJECT,
-    MSG_FILE_DATA,
-    MSG_FILE_COMPLETE,
-    MSG_FILE_NOTIFICATION,
-    // Encryption-related messages
-    MSG_ENABLE_ENCRYPTION,
-    MSG_ROOM_KEY,
-    MSG_ENCRYPTION_ENABLED
+    MSG_INVALID = 0,
+    MESSAGE_TYPES(MESSAGE_TYPE_ENUM)
+    MSG_TYPE_COUNT
 } message_type_t;
 
 // Message structure
@@ -65,6 +157,10 @@ typedef struct {
     time_t timestamp;
     char room_key_hex[AES_KEY_SIZE * 2 + 1];
     char room_iv_hex[AES_IV_SIZE * 2 + 1];
+    char file_hash_hex[SHA256_DIGEST_LENGTH * 2 + 1];  // SHA-256 file (offer), nonce (challenge) hoặc bằng chứng (proof)
+    long file_size;
+    long history_seq;    // MSG_BROADCAST: seq trong phòng (0 = không lưu); JOIN_ROOM/HISTORY_REQUEST: chỉ phát lại seq lớn hơn
+    int stream_id;       // Message về file: stream của lần gửi (v1 luôn là 0)
 } message_t;
 
 // File transfer structure
@@ -76,10 +172,92 @@ typedef struct {
     char sender_name[MAX_USERNAME_LEN];
     int chunk_number;
     int total_chunks;
+    int encrypted;        // 1 = data là chunk AES-256-GCM bằng key của phòng
+    int compressed;       // 1 = data là chunk nén raw deflate (WIRE_FEATURE_DEFLATE)
+    int stream_id;        // Stream của lần gửi trên kết nối của người gửi (v1 luôn là 0)
+    long file_id;         // Id ngẫu nhiên của lần gửi, nằm trong AAD của chunk mã hóa (v1 luôn là 0)
     char data[FILE_CHUNK_SIZE];
     int data_size;
 } file_transfer_t;
 
+// Một frame đã giải mã: message hoặc chunk file
+typedef enum {
+    FRAME_MESSAGE = 0,
+    FRAME_FILE_CHUNK
+} frame_kind_t;
+
+typedef struct {
+    frame_kind_t kind;
+    union {
+        message_t msg;
+        file_transfer_t ft;
+    } body;
+} frame_t;
+
+// Receive state of a connection: chat messages or relayed file chunks
+typedef enum {
+    RX_MESSAGE = 0,
+    RX_FILE_CHUNK
+} rx_mode_t;
+
+// Số file một kết nối gửi cùng lúc (v2), mỗi file là một stream
+#define MAX_UPLOAD_STREAMS 8
+
+// Một lần gửi file đang mở trên kết nối
+typedef struct {
+    int stream_id;
+    char filename[MAX_FILENAME_LEN];
+} upload_stream_t;
+
+// Offer trúng cache đang chờ người gửi chứng minh có file
+typedef struct {
+    int stream_id;
+    long file_size;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    unsigned char proof[SHA256_DIGEST_LENGTH];  // Bằng chứng đúng, tính từ bản trong cache
+    char filename[MAX_FILENAME_LEN];
+} file_challenge_t;
+
+// Lane của frame trong hàng đợi gửi. Frame control (reply, key, tin chat) vượt lên trước
+// mọi chunk file chưa bắt đầu gửi, chỉ chờ frame bulk đang gửi dở (không cắt ngang frame).
+typedef enum {
+    TX_LANE_CONTROL = 0,
+    TX_LANE_BULK                // Chunk file
+} tx_lane_t;
+
+// Một đoạn trong hàng đợi gửi: byte nằm trong client->tx, một phần của frame broadcast
+// dùng chung, một vùng của spool file hoặc một file phát lại từ cache
+typedef enum {
+    TX_SEGMENT_BYTES = 0,
+    TX_SEGMENT_BUFFER,
+    TX_SEGMENT_FILE,
+    TX_SEGMENT_CACHED
+} tx_segment_kind_t;
+
+// File gửi lại từ cache cho một người nhận. Payload của mọi chunk nằm liền nhau trong
+// spool; chunk tiếp theo chỉ được dựng khi đoạn này tới đầu hàng đợi, nên người nhận
+// chậm không bị ngắt vì cả file dồn vào hàng đợi cùng lúc.
+typedef struct {
+    file_spool_t* spool;        // Giữ một tham chiếu
+    file_transfer_t header;     // Field của mọi chunk, chunk_number là chunk tiếp theo
+    int chunk_size;             // data_size của mọi chunk trừ chunk cuối
+} cached_file_t;
+
+typedef struct tx_segment {
+    tx_segment_kind_t kind;
+    size_t len;                 // Số byte còn phải gửi (0 với TX_SEGMENT_CACHED)
+    wire_buffer_t* buffer;      // TX_SEGMENT_BUFFER: giữ một tham chiếu
+    file_spool_t* spool;        // TX_SEGMENT_FILE: giữ một tham chiếu
+    cached_file_t* cached;      // TX_SEGMENT_CACHED
+    off_t offset;               // Vị trí byte tiếp theo trong buffer hoặc spool
+    tx_lane_t lane;
+    int frame_end;              // TX_LANE_BULK: đoạn cuối của một frame
+    struct tx_segment* next;
+} tx_segment_t;
+
+struct file_relay;
+struct client_work;
+
 // Client structure
 typedef struct client {
     int socket_fd;
@@ -87,64 +265,284 @@ typedef struct client {
     char username[MAX_USERNAME_LEN];
     int current_room_id;
     pthread_t thread_id;
-    struct client* next;
+    int wire_version;
+    int wire_features;            // WIRE_FEATURE_* đã thỏa thuận ở MSG_JOIN
+    rx_mode_t rx_mode;            // RX_FILE_CHUNK khi còn ít nhất một upload đang mở
+    upload_stream_t uploads[MAX_UPLOAD_STREAMS];
+    int upload_count;             // Số phần tử đầu của uploads đang dùng
+    file_challenge_t challenges[MAX_UPLOAD_STREAMS];
+    int challenge_count;          // Số phần tử đầu của challenges đang dùng
+    struct file_relay* relay;     // Trạng thái relay zero-copy khi đang nhận file
+    struct client_work* work;     // Hộp thư message chờ worker pool, NULL khi chưa dùng
+    // Byte đã nhận nhưng chưa đủ thành frame
+    ringbuf_t rx;
+    // Hàng đợi gửi có giới hạn: phần frame socket chưa nhận, bảo vệ bởi tx_mutex.
+    // Reactor (EPOLLOUT) hoặc writer thread gửi tiếp, người broadcast không bao giờ chờ.
+    ringbuf_t tx;
+    tx_segment_t* tx_head;
+    tx_segment_t* tx_tail;
+    tx_segment_t* tx_control_tail; // Đoạn control cuối đang chờ, frame control mới xếp ngay sau
+    int tx_bulk_open;             // Frame bulk ở đầu hàng đợi đã gửi một phần
+    int tx_inflight;              // Broadcast đang được io_uring gửi ngoài tx_mutex: người khác
+                                  // xếp hàng sau nó, hàng đợi chưa được gửi tiếp
+    size_t tx_queued;             // Tổng byte chờ gửi, kể cả vùng file
+    pthread_mutex_t tx_mutex;
+    pthread_cond_t tx_cond;       // Báo writer thread có dữ liệu mới (chế độ threaded)
+    pthread_t writer_thread;
+    int has_writer;
+    int tx_closing;
+    int tx_lossy;                 // Đang bỏ broadcast vì vượt high watermark
+    int tx_evicted;               // Đã bị ngắt do không đọc kịp
+    unsigned long tx_dropped;     // Số broadcast bị bỏ trong lần lossy hiện tại
+    int epoll_fd;                 // Reactor sở hữu client, -1 ở chế độ thread-per-client
+    int tx_armed;                 // Đang đăng ký EPOLLOUT
+    // Client còn frame trong rx chưa xử lý hết ở lần wakeup trước
+    int rx_backlogged;
+    struct client* backlog_next;
+    int shard;                    // Shard của registry (và reactor ở chế độ epoll)
+    struct client* registry_next; // Danh sách client của shard
+    int room_index;               // Vị trí trong room->members, -1 khi không ở phòng nào
 } client_t;
 
+// Thành viên của phòng, lưu liền nhau để fan-out chỉ quét mảng này mà không đọc client_t
+typedef struct {
+    int socket_fd;
+    int client_id;
+    int fanout_group;             // Cách encode frame (utils.c), -1 = không nhận broadcast. Wire
+                                  // version chỉ đổi khi client chưa ở phòng nào nên giá trị cố định
+    client_t* client;             // Hàng đợi gửi của thành viên
+} room_member_t;
+
+typedef struct {
+    long seq;                // 0 = trống
+    wire_buffer_t* frame;
+} room_history_slot_t;
+
 // Room structure
 typedef struct room {
     int room_id;
     char room_name[MAX_ROOM_NAME_LEN];
-    client_t* clients;
+    room_member_t* members;  // client_count phần tử đầu hợp lệ, xóa bằng cách đổi chỗ với phần tử cuối
+    int member_capacity;
     int client_count;
     pthread_mutex_t mutex;
     room_crypto_t crypto;
     int encryption_enabled;  // 0 = plaintext, 1 = encrypted
-    struct room* next;
+    int deleted;             // Đã gỡ khỏi bảng phòng, không nhận thêm thành viên (bảo vệ bởi mutex)
+
+    // Broadcast gần nhất, frame v2 đã encode. Chỉ ghi khi giữ mutex, đọc không khóa trong EBR:
+    // seq của slot được đọc trước và sau frame để biết slot chưa bị ghi đè.
+    long history_seq;        // Seq của broadcast mới nhất
+    room_history_slot_t history[ROOM_HISTORY_SIZE];
+    struct history_retired* history_retired;  // Frame bị ghi đè, chờ đủ lô để ebr_retire
 } room_t;
 
-// Server structure
+// Ô của bảng phòng: key là room_id, ROOM_SLOT_EMPTY hoặc ROOM_SLOT_DELETED.
+// Writer ghi room trước rồi mới ghi key, reader đọc key trước.
+typedef struct {
+    int key;
+    room_t* room;
+} room_slot_t;
+
+// Bảng băm địa chỉ mở (dò tuyến tính) theo room_id. Reader tra không khóa trong
+// vùng ebr_enter/ebr_exit; khi cần lớn hơn writer dựng bảng mới rồi thay con trỏ.
 typedef struct {
-    int server_socket;
-    room_t* rooms;
+    size_t capacity;              // Lũy thừa của 2
+    size_t used;                  // Ô đã từng dùng (kể cả ô đã xóa), chỉ writer đọc/ghi
+    size_t live;                  // Số phòng còn trong bảng, chỉ writer đọc/ghi
+    room_slot_t slots[];
+} room_table_t;
+
+// Một phần của registry: client thuộc shard (reactor) này.
+// Mỗi shard có mutex riêng nên các reactor không tranh một khóa chung.
+typedef struct {
+    pthread_mutex_t mutex;
     client_t* clients;
-    int next_room_id;
+    int client_count;
+} registry_shard_t;
+
+// Server structure
+typedef struct {
+    int server_socket;            // Listener chung (chế độ threaded), -1 khi mỗi reactor có listener riêng
+    registry_shard_t* shards;
+    int shard_count;
+    room_table_t* rooms;          // Đọc bằng atomic load, không khóa
+    pthread_mutex_t rooms_mutex;  // Chỉ tạo/xóa phòng giữ, tra cứu không bao giờ chờ khóa này
+    int next_room_id;             // Cấp phát bằng atomic
     int next_client_id;
-    pthread_mutex_t rooms_mutex;
-    pthread_mutex_t clients_mutex;
 } server_t;
 
+// I/O backend cho socket layer
+typedef enum {
+    IO_BACKEND_SOCKET = 0,   // send()/recv() thông thường
+    IO_BACKEND_URING         // io_uring: batched submission + registered buffers
+} io_backend_t;
+
+typedef struct {
+    unsigned long send_syscalls;
+    unsigned long messages_delivered;
+    unsigned long file_bytes_spliced;   // Payload file relay bằng splice/sendfile
+    unsigned long file_bytes_copied;    // Payload file phải copy qua user space
+} io_stats_t;
+
+// Xử lý client không đọc kịp khi hàng đợi gửi vượt high watermark
+typedef enum {
+    SLOW_CONSUMER_EVICT = 0,  // Ngắt kết nối client
+    SLOW_CONSUMER_DROP        // Bỏ broadcast cho tới khi hàng đợi xuống dưới low watermark
+} slow_consumer_policy_t;
+
+typedef struct {
+    unsigned long frames_queued;       // Frame phải xếp hàng vì socket chưa nhận hết
+    unsigned long frames_dropped;      // Broadcast bị bỏ ở chế độ lossy
+    unsigned long lossy_entered;       // Số lần client vào chế độ lossy
+    unsigned long lossy_clients;       // Số client đang lossy
+    unsigned long evictions;
+    unsigned long queued_bytes;        // Tổng byte đang chờ trong tất cả hàng đợi
+    unsigned long queued_bytes_peak;   // Hàng đợi lớn nhất của một client
+} queue_stats_t;
+
+io_backend_t io_backend_init(io_backend_t requested);
+io_backend_t io_backend_active(void);
+void io_backend_get_stats(io_stats_t* stats);
+
 // Function prototypes
 int send_message(int socket_fd, message_t* msg);
+int send_message_wire(int socket_fd, const message_t* msg, int wire_version);
+// Frame v2 nén (WIRE_FEATURE_DEFLATE), gửi bản thường nếu nén không có lợi
+int send_message_compressed(int socket_fd, const message_t* msg);
 int receive_message(int socket_fd, message_t* msg);
+int receive_frame(int socket_fd, int wire_version, frame_kind_t expected, frame_t* frame);
+// Lấy một frame hoàn chỉnh từ rx: 1 = có frame, 0 = cần thêm dữ liệu, -1 = sai định dạng
+int parse_buffered_frame(ringbuf_t* rx, int wire_version, frame_kind_t expected, frame_t* frame);
+// Một lần recv vào chỗ trống của rx (tối đa max byte), với socket non-blocking thì chờ tới khi có dữ liệu.
+// Giống recv(): > 0 số byte, 0 khi peer đóng kết nối, < 0 khi lỗi
+ssize_t fill_receive_ring(int socket_fd, ringbuf_t* rx, size_t max);
+// Như receive_frame nhưng đọc theo khối vào rx, các frame đã có sẵn không tốn syscall
+int receive_buffered_frame(int socket_fd, ringbuf_t* rx, int wire_version, frame_kind_t expected,
+                           frame_t* frame);
 void print_message(message_t* msg);
 
+// Encode/decode theo version của kết nối, trả về độ dài frame hoặc -1
+int encode_message_frame(const message_t* msg, int wire_version, unsigned char* buf, size_t cap);
+int encode_file_transfer_frame(const file_transfer_t* ft, int wire_version, unsigned char* buf, size_t cap);
+int decode_frame(const unsigned char* buf, size_t len, int wire_version, frame_kind_t expected, frame_t* frame);
+// Số byte cần có trong buffer để đọc hết frame hiện tại (0 nếu header không hợp lệ)
+size_t frame_size_needed(const unsigned char* buf, size_t len, int wire_version, frame_kind_t expected);
+
+// Hai lane gửi trên một socket nhiều thread dùng chung (client). mutex là khóa socket của
+// người dùng. Frame control lấy socket trước mọi chunk đang chờ; các chunk lấy socket lần
+// lượt theo thứ tự xin, nên chunk của nhiều stream xen nhau và tin chat chỉ chờ tối đa
+// một chunk.
+typedef struct {
+    pthread_mutex_t* mutex;
+    pthread_cond_t turn;
+    int control_waiting;
+    unsigned long bulk_next;      // Lượt của chunk xin socket tiếp theo
+    unsigned long bulk_serving;   // Lượt đang được gửi
+} send_lanes_t;
+
+void send_lanes_init(send_lanes_t* lanes, pthread_mutex_t* mutex);
+void send_lanes_destroy(send_lanes_t* lanes);
+// Giữ socket để gửi frame control, thả bằng send_lanes_control_unlock
+void send_lanes_control_lock(send_lanes_t* lanes);
+void send_lanes_control_unlock(send_lanes_t* lanes);
+// Chờ tới lượt gửi một chunk (không còn frame control nào đang chờ), trả về khi đã giữ mutex
+void send_lanes_bulk_lock(send_lanes_t* lanes);
+void send_lanes_bulk_unlock(send_lanes_t* lanes);
+
+// send_file gọi acquire trước mỗi chunk và release sau chunk đó. acquire trả về -1 thì dừng
+// gửi (không gọi release).
+typedef struct {
+    int (*acquire)(void* arg);
+    void (*release)(void* arg);
+    void* arg;
+} send_gate_t;
+
 // File transfer functions
 int send_file_transfer(int socket_fd, file_transfer_t* ft);
+int send_file_transfer_wire(int socket_fd, const file_transfer_t* ft, int wire_version);
 int receive_file_transfer(int socket_fd, file_transfer_t* ft);
-int send_file(int socket_fd, const char* filepath, int sender_id, const char* sender_name);
-int receive_file(int socket_fd, const char* save_dir);
+// crypto != NULL: gửi chunk mã hóa AES-256-GCM bằng key phòng qua file_pipeline (filecrypt.h).
+// compress: nén từng chunk (file thường, đã thỏa thuận WIRE_FEATURE_DEFLATE).
+// stream_id: stream đã mở bằng MSG_FILE_REQUEST/MSG_FILE_OFFER. gate: NULL nếu người gọi
+// đã giữ socket suốt lần gửi.
+int send_file(int socket_fd, const char* filepath, int sender_id, const char* sender_name, int wire_version,
+              const room_crypto_t* crypto, int compress, int stream_id, const send_gate_t* gate);
+// Nhận file tại chỗ trên kết nối v1 (chunk không có header riêng, không mã hóa hay nén).
+// v2 nhận file nền qua client/download.c.
+int receive_file(int socket_fd, ringbuf_t* rx, const char* save_dir);
 
 // Utility functions
 void error_exit(const char* msg);
 void* safe_malloc(size_t size);
 void safe_free(void* ptr);
 int create_socket();
-void setup_server_socket(int socket_fd, int port);
+// reuse_port: nhiều listener cùng port (SO_REUSEPORT), kernel chia kết nối giữa các listener
+void setup_server_socket(int socket_fd, int port, int backlog, int reuse_port);
+int set_nonblocking(int socket_fd);
+int send_all(int socket_fd, const void* buf, size_t len);
 void cleanup_client(client_t* client);
 void cleanup_room(room_t* room);
 
 // Thread-safe functions
-void add_client_to_room(server_t* server, int room_id, client_t* client);
+// -1 nếu phòng không còn (đã bị xóa khi thành viên cuối rời đi)
+int add_client_to_room(server_t* server, int room_id, client_t* client);
+// Phòng bị xóa khi thành viên cuối cùng rời đi
 void remove_client_from_room(server_t* server, int room_id, client_t* client);
+// Tin chat (MSG_BROADCAST của thành viên) được gán history_seq và lưu vào lịch sử của phòng
 void broadcast_to_room(server_t* server, int room_id, message_t* msg, int exclude_client_id);
+// Phát lại lịch sử có seq > since trong một lần ghi (v2: kèm MSG_HISTORY_BEGIN/END).
+// Người gọi phải ở trong ebr_enter. Trả về số tin đã phát lại.
+int replay_room_history(client_t* client, room_t* room, long since);
+// Nơi lưu lịch sử phòng ngoài ring, ví dụ log bền vững của server (server/msglog.c).
+// visit nhận frame v2 của tin seq, trả về khác 0 để dừng đọc.
+typedef int (*room_history_visit_t)(void* arg, long seq, const unsigned char* frame, size_t len);
+typedef struct {
+    // Gọi trước khi phòng mới xuất hiện trong bảng phòng
+    void (*created)(const room_t* room);
+    // Tin chat vừa vào ring (phòng không mã hóa), gọi khi giữ room->mutex nên đúng thứ tự seq
+    void (*appended)(const room_t* room, long seq, time_t timestamp, const wire_buffer_t* frame);
+    // Phòng bị xóa hoặc chuyển sang mã hóa: lịch sử không còn được lưu
+    void (*dropped)(const room_t* room);
+    // Đọc các tin seq trong [first, last] theo thứ tự tăng dần, trả về số tin đã đọc
+    int (*read)(int room_id, long first, long last, room_history_visit_t visit, void* arg);
+} room_log_t;
+
+void room_set_log(const room_log_t* log);
+// Dựng lại phòng đã lưu khi server khởi động, trước khi nhận kết nối
+room_t* restore_room(server_t* server, int room_id, const char* room_name, long history_seq);
+void room_history_restore(room_t* room, long seq, const unsigned char* frame, size_t len);
+void broadcast_file_chunk_to_room(server_t* server, int room_id, file_transfer_t* ft, int exclude_client_id);
+// Như trên nhưng payload nằm trong spool: người nhận được sendfile vùng [offset, offset + ft->data_size)
+void broadcast_file_range_to_room(server_t* server, int room_id, const file_transfer_t* ft,
+                                  file_spool_t* spool, off_t offset, int exclude_client_id);
+// Phát một file có trong cache (spool chứa payload mọi chunk liền nhau) tới phòng.
+// Mỗi người nhận gửi chunk theo tốc độ của mình.
+void broadcast_cached_file_to_room(server_t* server, int room_id, const file_transfer_t* header,
+                                   file_spool_t* spool, int chunk_size, int exclude_client_id);
+void registry_init(server_t* server, int shard_count);
+void registry_destroy(server_t* server);
+void registry_add_client(server_t* server, client_t* client);
+void registry_remove_client(server_t* server, client_t* client);
+// Không khóa. Người gọi phải ở trong ebr_enter/ebr_exit suốt thời gian dùng con trỏ trả về.
 room_t* find_room(server_t* server, int room_id);
 room_t* create_room(server_t* server, const char* room_name);
-void list_rooms(server_t* server, int client_socket);
+void list_rooms(server_t* server, client_t* client);
+int send_to_client(client_t* client, const message_t* msg);
+// Gửi phần output đang chờ khi socket writable, 1 nếu vẫn còn dữ liệu, -1 nếu lỗi
+int client_flush_output(client_t* client);
+// Chế độ threaded: writer thread riêng gửi hàng đợi của client
+int client_start_writer(client_t* client);
+void client_queue_configure(size_t high_watermark, size_t low_watermark, slow_consumer_policy_t policy);
+void client_queue_get_stats(queue_stats_t* stats);
 
 // Encryption helper functions
-void send_room_key_to_client(int client_socket, room_t* room);
+void send_room_key_to_client(client_t* client, room_t* room);
 int encrypt_message_content(message_t* msg, const room_crypto_t* crypto);
 int decrypt_message_content(message_t* msg, const room_crypto_t* crypto);
-void enable_room_encryption(server_t* server, room_t* room);
+// Giải mã nhiều tin chat một lượt (tin GCM dùng chung context và giải mã liền nhau).
+// results[i] = 0 hoặc -1 cho từng tin, trả về số tin giải mã được.
+int decrypt_message_content_batch(message_t* msgs, int count, const room_crypto_t* crypto, int* results);
+void enable_room_encryption(server_t* server, room_t* room, room_cipher_t cipher);
 
 #endif // PROTOCOL_H
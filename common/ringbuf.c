@@ -0,0 +1,177 @@
+#include "ringbuf.h"
+#include "slab.h"
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+int ringbuf_init(ringbuf_t* rb, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    rb->data = (unsigned char*)slab_alloc(size);
+    if (!rb->data) {
+        rb->capacity = 0;
+        return -1;
+    }
+    rb->capacity = size;
+    rb->head = 0;
+    rb->tail = 0;
+    return 0;
+}
+
+void ringbuf_free(ringbuf_t* rb) {
+    slab_free(rb->data, rb->capacity);
+    rb->data = NULL;
+    rb->capacity = 0;
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+size_t ringbuf_used(const ringbuf_t* rb) {
+    return rb->tail - rb->head;
+}
+
+size_t ringbuf_space(const ringbuf_t* rb) {
+    return rb->capacity - (rb->tail - rb->head);
+}
+
+// Chia [index, index + len) thành tối đa hai đoạn liên tục
+static int ringbuf_segments(const ringbuf_t* rb, size_t index, size_t len, struct iovec iov[2]) {
+    size_t offset = index & (rb->capacity - 1);
+    size_t first = rb->capacity - offset;
+    if (first > len) {
+        first = len;
+    }
+
+    iov[0].iov_base = rb->data + offset;
+    iov[0].iov_len = first;
+    if (first == len) {
+        return 1;
+    }
+    iov[1].iov_base = rb->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+int ringbuf_write(ringbuf_t* rb, const void* src, size_t len) {
+    if (len > ringbuf_space(rb)) {
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    struct iovec iov[2];
+    int count = ringbuf_segments(rb, rb->tail, len, iov);
+    const unsigned char* p = (const unsigned char*)src;
+    for (int i = 0; i < count; i++) {
+        memcpy(iov[i].iov_base, p, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    rb->tail += len;
+    return 0;
+}
+
+size_t ringbuf_peek(const ringbuf_t* rb, void* dst, size_t len) {
+    size_t used = ringbuf_used(rb);
+    if (len > used) {
+        len = used;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    struct iovec iov[2];
+    int count = ringbuf_segments(rb, rb->head, len, iov);
+    unsigned char* p = (unsigned char*)dst;
+    for (int i = 0; i < count; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    return len;
+}
+
+const unsigned char* ringbuf_contiguous(const ringbuf_t* rb, size_t len, unsigned char* scratch) {
+    size_t offset = rb->head & (rb->capacity - 1);
+    if (offset + len <= rb->capacity) {
+        return rb->data + offset;
+    }
+    ringbuf_peek(rb, scratch, len);
+    return scratch;
+}
+
+void ringbuf_consume(ringbuf_t* rb, size_t len) {
+    size_t used = ringbuf_used(rb);
+    rb->head += len < used ? len : used;
+    // Buffer rỗng thì quay về đầu để các frame sau không bị vòng
+    if (rb->head == rb->tail) {
+        rb->head = 0;
+        rb->tail = 0;
+    }
+}
+
+unsigned char* ringbuf_write_region(ringbuf_t* rb, size_t* len) {
+    struct iovec iov[2];
+    size_t space = ringbuf_space(rb);
+    if (space == 0) {
+        *len = 0;
+        return NULL;
+    }
+    ringbuf_segments(rb, rb->tail, space, iov);
+    *len = iov[0].iov_len;
+    return (unsigned char*)iov[0].iov_base;
+}
+
+void ringbuf_commit(ringbuf_t* rb, size_t len) {
+    rb->tail += len;
+}
+
+int ringbuf_iov(const ringbuf_t* rb, size_t offset, size_t len, struct iovec iov[2]) {
+    return ringbuf_segments(rb, rb->head + offset, len, iov);
+}
+
+ssize_t ringbuf_recv(ringbuf_t* rb, int socket_fd, size_t max) {
+    struct iovec iov[2];
+    size_t space = ringbuf_space(rb);
+    if (space > max) {
+        space = max;
+    }
+    if (space == 0) {
+        return 0;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)ringbuf_segments(rb, rb->tail, space, iov);
+
+    ssize_t bytes = recvmsg(socket_fd, &msg, 0);
+    if (bytes > 0) {
+        rb->tail += (size_t)bytes;
+    }
+    return bytes;
+}
+
+ssize_t ringbuf_send(ringbuf_t* rb, int socket_fd, size_t max) {
+    struct iovec iov[2];
+    size_t used = ringbuf_used(rb);
+    if (used > max) {
+        used = max;
+    }
+    if (used == 0) {
+        return 0;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)ringbuf_segments(rb, rb->head, used, iov);
+
+    ssize_t bytes = sendmsg(socket_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (bytes > 0) {
+        ringbuf_consume(rb, (size_t)bytes);
+    }
+    return bytes;
+}
@@ -0,0 +1,53 @@
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Ring buffer byte cho một chiều của kết nối.
+// head/tail tăng dần, vị trí thực trong data là index & (capacity - 1).
+typedef struct {
+    unsigned char* data;
+    size_t capacity;   // Lũy thừa của 2
+    size_t head;       // Byte đầu tiên chưa được đọc
+    size_t tail;       // Vị trí ghi tiếp theo
+} ringbuf_t;
+
+// capacity được làm tròn lên lũy thừa của 2
+int ringbuf_init(ringbuf_t* rb, size_t capacity);
+void ringbuf_free(ringbuf_t* rb);
+
+size_t ringbuf_used(const ringbuf_t* rb);
+size_t ringbuf_space(const ringbuf_t* rb);
+
+// Ghi len byte vào cuối buffer, -1 nếu không đủ chỗ (không ghi gì)
+int ringbuf_write(ringbuf_t* rb, const void* src, size_t len);
+
+// Copy tối đa len byte đầu tiên mà không lấy ra, trả về số byte đã copy
+size_t ringbuf_peek(const ringbuf_t* rb, void* dst, size_t len);
+
+// Con trỏ tới len byte đầu tiên liên tục trong bộ nhớ. Nếu dữ liệu vòng qua cuối
+// buffer thì copy vào scratch (phải có ít nhất len byte). Gọi khi ringbuf_used >= len.
+const unsigned char* ringbuf_contiguous(const ringbuf_t* rb, size_t len, unsigned char* scratch);
+
+void ringbuf_consume(ringbuf_t* rb, size_t len);
+
+// Vùng trống liên tục tiếp theo, dùng cho recv trực tiếp vào buffer.
+// Sau khi ghi xong gọi ringbuf_commit với số byte thực sự đã ghi.
+unsigned char* ringbuf_write_region(ringbuf_t* rb, size_t* len);
+void ringbuf_commit(ringbuf_t* rb, size_t len);
+
+// Mô tả len byte bắt đầu từ byte thứ offset (tính từ head) bằng tối đa hai iovec,
+// trả về số iovec. Gọi khi offset + len <= ringbuf_used.
+int ringbuf_iov(const ringbuf_t* rb, size_t offset, size_t len, struct iovec iov[2]);
+
+// Đọc từ socket vào chỗ trống (tối đa max byte) bằng một readv, giống recv():
+// > 0 số byte, 0 khi peer đóng kết nối, -1 với errno
+ssize_t ringbuf_recv(ringbuf_t* rb, int socket_fd, size_t max);
+
+// Gửi tối đa max byte đầu bằng một sendmsg không chờ (kể cả socket blocking)
+// và lấy phần đã gửi ra khỏi buffer
+ssize_t ringbuf_send(ringbuf_t* rb, int socket_fd, size_t max);
+
+#endif // RINGBUF_H
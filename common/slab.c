@@ -0,0 +1,189 @@
+#include "slab.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+#define SLAB_CHUNK_BYTES (64 * 1024)    // Mỗi lần xin bộ nhớ mới cho một class
+#define SLAB_CACHE_BYTES (64 * 1024)    // Giới hạn bộ nhớ trong cache của một class mỗi thread
+#define SLAB_CACHE_MAX 64
+
+// 8256 = frame lớn nhất (WIRE_MAX_FRAME_SIZE) cộng header của wire_buffer_t,
+// 16384 = ring nhận của mỗi kết nối
+static const size_t g_class_sizes[] = { 64, 128, 256, 512, 1024, 2048, 4096, 8256, 16384 };
+#define SLAB_CLASS_COUNT ((int)(sizeof(g_class_sizes) / sizeof(g_class_sizes[0])))
+
+typedef struct slab_object {
+    struct slab_object* next;
+} slab_object_t;
+
+// Kho chung của một class
+typedef struct {
+    pthread_mutex_t mutex;
+    slab_object_t* free_list;
+    unsigned long in_use;
+    unsigned long peak;
+    unsigned long allocated;
+} slab_depot_t;
+
+typedef struct {
+    void* items[SLAB_CACHE_MAX];
+    int count;
+} slab_cache_t;
+
+static slab_depot_t g_depots[SLAB_CLASS_COUNT];
+static pthread_once_t g_slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_cache_key;
+static __thread slab_cache_t t_caches[SLAB_CLASS_COUNT];
+static __thread int t_registered = 0;
+
+static int class_for_size(size_t size) {
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        if (size <= g_class_sizes[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Số object tối đa trong cache của thread, class lớn giữ ít object hơn
+static int cache_limit(int cls) {
+    int limit = (int)(SLAB_CACHE_BYTES / g_class_sizes[cls]);
+    if (limit < 2) {
+        return 2;
+    }
+    return limit < SLAB_CACHE_MAX ? limit : SLAB_CACHE_MAX;
+}
+
+// Trả count object đầu cache về kho
+static void cache_flush(int cls, slab_cache_t* cache, int count) {
+    slab_depot_t* depot = &g_depots[cls];
+    pthread_mutex_lock(&depot->mutex);
+    for (int i = 0; i < count; i++) {
+        slab_object_t* object = (slab_object_t*)cache->items[--cache->count];
+        object->next = depot->free_list;
+        depot->free_list = object;
+    }
+    pthread_mutex_unlock(&depot->mutex);
+}
+
+// Thread thoát: object trong cache về kho để thread khác dùng lại
+static void slab_thread_exit(void* arg) {
+    (void)arg;
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        if (t_caches[i].count > 0) {
+            cache_flush(i, &t_caches[i], t_caches[i].count);
+        }
+    }
+}
+
+static void slab_init(void) {
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        pthread_mutex_init(&g_depots[i].mutex, NULL);
+    }
+    pthread_key_create(&g_cache_key, slab_thread_exit);
+}
+
+// Lấy một lô từ kho vào cache, cắt slab mới nếu kho rỗng. Phải giữ depot->mutex.
+static int cache_refill_locked(int cls, slab_cache_t* cache) {
+    slab_depot_t* depot = &g_depots[cls];
+    int want = cache_limit(cls) / 2;
+    if (want < 1) {
+        want = 1;
+    }
+
+    if (!depot->free_list) {
+        size_t size = g_class_sizes[cls];
+        size_t count = SLAB_CHUNK_BYTES / size;
+        if (count < 2) {
+            count = 2;
+        }
+        unsigned char* chunk = (unsigned char*)malloc(size * count);
+        if (!chunk) {
+            return -1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            slab_object_t* object = (slab_object_t*)(chunk + i * size);
+            object->next = depot->free_list;
+            depot->free_list = object;
+        }
+        depot->allocated += count;
+    }
+
+    while (cache->count < want && depot->free_list) {
+        slab_object_t* object = depot->free_list;
+        depot->free_list = object->next;
+        cache->items[cache->count++] = object;
+    }
+    return 0;
+}
+
+static void account(slab_depot_t* depot, long delta) {
+    unsigned long in_use = __atomic_add_fetch(&depot->in_use, (unsigned long)delta, __ATOMIC_RELAXED);
+    unsigned long peak = __atomic_load_n(&depot->peak, __ATOMIC_RELAXED);
+    while (in_use > peak &&
+           !__atomic_compare_exchange_n(&depot->peak, &peak, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void* slab_alloc(size_t size) {
+    int cls = class_for_size(size);
+    if (cls < 0) {
+        return malloc(size);
+    }
+    if (!t_registered) {
+        pthread_once(&g_slab_once, slab_init);
+        pthread_setspecific(g_cache_key, &t_registered);
+        t_registered = 1;
+    }
+
+    slab_cache_t* cache = &t_caches[cls];
+    if (cache->count == 0) {
+        slab_depot_t* depot = &g_depots[cls];
+        pthread_mutex_lock(&depot->mutex);
+        int rc = cache_refill_locked(cls, cache);
+        pthread_mutex_unlock(&depot->mutex);
+        if (rc < 0) {
+            return NULL;
+        }
+    }
+    account(&g_depots[cls], 1);
+    return cache->items[--cache->count];
+}
+
+void slab_free(void* ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    int cls = class_for_size(size);
+    if (cls < 0) {
+        free(ptr);
+        return;
+    }
+    if (!t_registered) {
+        pthread_once(&g_slab_once, slab_init);
+        pthread_setspecific(g_cache_key, &t_registered);
+        t_registered = 1;
+    }
+
+    slab_cache_t* cache = &t_caches[cls];
+    int limit = cache_limit(cls);
+    if (cache->count >= limit) {
+        cache_flush(cls, cache, limit / 2);
+    }
+    cache->items[cache->count++] = ptr;
+    account(&g_depots[cls], -1);
+}
+
+int slab_class_count(void) {
+    return SLAB_CLASS_COUNT;
+}
+
+void slab_get_stats(int size_class, slab_stats_t* stats) {
+    pthread_once(&g_slab_once, slab_init);
+    slab_depot_t* depot = &g_depots[size_class];
+    stats->object_size = g_class_sizes[size_class];
+    stats->in_use = __atomic_load_n(&depot->in_use, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&depot->peak, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&depot->mutex);
+    stats->allocated = depot->allocated;
+    pthread_mutex_unlock(&depot->mutex);
+}
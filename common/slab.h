@@ -0,0 +1,26 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+// Bộ cấp phát theo size class cho các object sinh/hủy liên tục (client_t, đoạn hàng đợi,
+// frame broadcast, buffer nhận...). Mỗi thread có cache riêng cho từng class nên
+// alloc/free thường không lấy khóa; cache đầy hoặc rỗng mới trao đổi theo lô với kho chung.
+// Bộ nhớ của class không trả lại cho hệ điều hành. Kích thước lớn hơn class lớn nhất dùng malloc.
+
+typedef struct {
+    size_t object_size;
+    unsigned long in_use;         // Object đang được dùng
+    unsigned long peak;           // High-water mark của in_use
+    unsigned long allocated;      // Object đã cắt từ slab (đang dùng + nằm trong cache/kho)
+} slab_stats_t;
+
+// NULL nếu hết bộ nhớ
+void* slab_alloc(size_t size);
+// size phải đúng kích thước đã xin
+void slab_free(void* ptr, size_t size);
+
+int slab_class_count(void);
+void slab_get_stats(int size_class, slab_stats_t* stats);
+
+#endif // SLAB_H
@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+#include "spool.h"
+#include "slab.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+file_spool_t* spool_create(void) {
+    int fd = memfd_create("chat-relay", MFD_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    file_spool_t* spool = (file_spool_t*)slab_alloc(sizeof(file_spool_t));
+    if (!spool) {
+        close(fd);
+        return NULL;
+    }
+    spool->fd = fd;
+    spool->refcount = 1;
+    spool->size = 0;
+    return spool;
+}
+
+void spool_ref(file_spool_t* spool) {
+    __atomic_fetch_add(&spool->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void spool_unref(file_spool_t* spool) {
+    if (spool && __atomic_sub_fetch(&spool->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(spool->fd);
+        slab_free(spool, sizeof(file_spool_t));
+    }
+}
+
+int spool_append_from_pipe(file_spool_t* spool, int pipe_fd, size_t len) {
+    while (len > 0) {
+        loff_t offset = spool->size;
+        ssize_t moved = splice(pipe_fd, NULL, spool->fd, &offset, len, SPLICE_F_MOVE);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            return -1;
+        }
+        spool->size += moved;
+        len -= (size_t)moved;
+    }
+    return 0;
+}
+
+int spool_append(file_spool_t* spool, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t written = pwrite(spool->fd, p, len, spool->size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        spool->size += written;
+        p += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+int spool_read(file_spool_t* spool, off_t offset, void* buf, size_t len) {
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t got = pread(spool->fd, p, len, offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        p += got;
+        offset += got;
+        len -= (size_t)got;
+    }
+    return 0;
+}
+
+const unsigned char* spool_map(file_spool_t* spool, size_t len) {
+    if (len == 0 || (off_t)len > spool->size) {
+        return NULL;
+    }
+    void* data = mmap(NULL, len, PROT_READ, MAP_SHARED, spool->fd, 0);
+    return data == MAP_FAILED ? NULL : (const unsigned char*)data;
+}
@@ -0,0 +1,30 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// File trong bộ nhớ (memfd) chứa payload chunk file đang relay. Payload được splice
+// từ socket vào đây một lần rồi sendfile tới từng người nhận, không đi qua user space.
+// Hàng đợi gửi của mỗi client giữ một tham chiếu cho mỗi đoạn còn chờ gửi.
+typedef struct file_spool {
+    int fd;
+    int refcount;
+    off_t size;        // Số byte đã ghi
+} file_spool_t;
+
+// Trả về NULL nếu kernel không hỗ trợ memfd
+file_spool_t* spool_create(void);
+void spool_ref(file_spool_t* spool);
+void spool_unref(file_spool_t* spool);
+
+// Chuyển đúng len byte đang nằm trong pipe vào cuối spool bằng splice
+int spool_append_from_pipe(file_spool_t* spool, int pipe_fd, size_t len);
+// Ghi len byte từ bộ nhớ vào cuối spool (payload đã nằm trong user space)
+int spool_append(file_spool_t* spool, const void* data, size_t len);
+// Copy len byte ở offset ra buf, -1 nếu spool không đủ
+int spool_read(file_spool_t* spool, off_t offset, void* buf, size_t len);
+// Ánh xạ len byte đầu spool để đọc, NULL nếu lỗi. Trả lại bằng munmap(ptr, len).
+const unsigned char* spool_map(file_spool_t* spool, size_t len);
+
+#endif // SPOOL_H
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Ring của một thread. Chỉ thread sở hữu ghi: điền entry rồi mới tăng head (release),
+// người dump đọc head (acquire), chép ring, đọc lại head để bỏ các entry vừa bị ghi đè.
+typedef struct trace_ring {
+    uint64_t head;                // Tổng số sự kiện đã ghi
+    struct trace_ring* next;
+    int retired;                  // Thread đã kết thúc, ring chỉ còn để dump
+    uint32_t tid;
+    char name[16];
+    trace_entry_t entries[];
+} trace_ring_t;
+
+int g_trace_enabled = 0;
+
+static size_t g_capacity;                     // Lũy thừa của 2
+static const char* g_dir = ".";
+static uint64_t g_start_ticks;
+static uint64_t g_start_ns;
+static unsigned int g_dump_seq = 0;
+
+static __thread trace_ring_t* t_ring = NULL;
+static pthread_mutex_t g_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t* g_rings = NULL;          // Mới nhất ở đầu
+static int g_retired_count = 0;
+static pthread_key_t g_ring_key;
+
+#define TRACE_INFO(id, name, phase) { name, phase },
+static const trace_event_info_t g_event_info[] = { TRACE_EVENTS(TRACE_INFO) };
+#undef TRACE_INFO
+
+uint64_t trace_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Thread kết thúc: giữ ring lại để dump, bỏ ring đã nghỉ cũ nhất khi vượt TRACE_MAX_RETIRED
+static void ring_retire(void* arg) {
+    trace_ring_t* ring = (trace_ring_t*)arg;
+    pthread_mutex_lock(&g_rings_mutex);
+    ring->retired = 1;
+    if (++g_retired_count > TRACE_MAX_RETIRED) {
+        trace_ring_t** oldest = NULL;
+        for (trace_ring_t** link = &g_rings; *link; link = &(*link)->next) {
+            if ((*link)->retired) {
+                oldest = link;
+            }
+        }
+        trace_ring_t* victim = *oldest;
+        *oldest = victim->next;
+        free(victim);
+        g_retired_count--;
+    }
+    pthread_mutex_unlock(&g_rings_mutex);
+    t_ring = NULL;
+}
+
+static trace_ring_t* ring_get(void) {
+    trace_ring_t* ring = (trace_ring_t*)calloc(1, sizeof(trace_ring_t) + g_capacity * sizeof(trace_entry_t));
+    if (!ring) {
+        return NULL;
+    }
+    ring->tid = (uint32_t)syscall(SYS_gettid);
+    prctl(PR_GET_NAME, ring->name, 0, 0, 0);
+
+    pthread_mutex_lock(&g_rings_mutex);
+    ring->next = g_rings;
+    g_rings = ring;
+    pthread_mutex_unlock(&g_rings_mutex);
+
+    pthread_setspecific(g_ring_key, ring);
+    t_ring = ring;
+    return ring;
+}
+
+void trace_record(trace_event_t event, uint32_t arg, uint64_t value) {
+    trace_ring_t* ring = t_ring ? t_ring : ring_get();
+    if (!ring) {
+        return;
+    }
+    uint64_t head = ring->head;
+    trace_entry_t* entry = &ring->entries[head & (g_capacity - 1)];
+    entry->ticks = trace_ticks();
+    entry->event = (uint32_t)event;
+    entry->arg = arg;
+    entry->value = value;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Chép các entry còn nguyên của ring vào copy, trả về số entry; *first là chỉ số entry đầu
+static size_t ring_snapshot(trace_ring_t* ring, trace_entry_t* copy, uint64_t* first) {
+    uint64_t end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t begin = end > g_capacity ? end - g_capacity : 0;
+    for (uint64_t i = begin; i < end; i++) {
+        copy[i - begin] = ring->entries[i & (g_capacity - 1)];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    // Trong lúc chép, thread sở hữu có thể đã ghi tới chỉ số now (chưa công bố):
+    // mọi chỉ số <= now - capacity đã bị đè
+    uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t valid = now + 1 > g_capacity ? now + 1 - g_capacity : 0;
+    uint64_t skip = valid > begin ? valid - begin : 0;
+    if (skip > end - begin) {
+        skip = end - begin;
+    }
+    if (skip > 0) {
+        memmove(copy, copy + skip, (size_t)(end - begin - skip) * sizeof(trace_entry_t));
+    }
+    *first = begin + skip;
+    return (size_t)(end - begin - skip);
+}
+
+int trace_dump(void) {
+    if (!g_trace_enabled) {
+        return -1;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/chat-trace-%d-%u.bin", g_dir, (int)getpid(), ++g_dump_seq);
+    trace_entry_t* copy = (trace_entry_t*)malloc(g_capacity * sizeof(trace_entry_t));
+    FILE* out = copy ? fopen(path, "wb") : NULL;
+    if (!out) {
+        perror("Không thể ghi trace");
+        free(copy);
+        return -1;
+    }
+
+    trace_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.event_types = TRACE_EVENT_COUNT;
+    header.start_ticks = g_start_ticks;
+    header.start_ns = g_start_ns;
+    header.dump_ticks = trace_ticks();
+    header.dump_ns = trace_clock_ns();
+    header.pid = (uint32_t)getpid();
+    header.entry_size = sizeof(trace_entry_t);
+
+    // Giữ mutex suốt lúc dump để ring của thread vừa kết thúc không bị giải phóng
+    pthread_mutex_lock(&g_rings_mutex);
+    for (trace_ring_t* ring = g_rings; ring; ring = ring->next) {
+        header.thread_count++;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(g_event_info, sizeof(g_event_info), 1, out);
+
+    unsigned long events = 0;
+    for (trace_ring_t* ring = g_rings; ring; ring = ring->next) {
+        uint64_t first;
+        size_t count = ring_snapshot(ring, copy, &first);
+        trace_thread_header_t thread;
+        memset(&thread, 0, sizeof(thread));
+        thread.tid = ring->tid;
+        thread.event_count = (uint32_t)count;
+        thread.dropped = first;
+        memcpy(thread.name, ring->name, sizeof(thread.name));
+        fwrite(&thread, sizeof(thread), 1, out);
+        fwrite(copy, sizeof(trace_entry_t), count, out);
+        events += count;
+    }
+    unsigned int threads = header.thread_count;
+    pthread_mutex_unlock(&g_rings_mutex);
+
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed) {
+        perror("Không thể ghi trace");
+        free(copy);
+        return -1;
+    }
+    free(copy);
+    printf("[trace] %s: %u thread, %lu sự kiện\n", path, threads, events);
+    fflush(stdout);
+    return 0;
+}
+
+int trace_init(size_t events, const char* dir) {
+    if (g_trace_enabled) {
+        return 0;
+    }
+    g_capacity = 1;
+    while (g_capacity < events) {
+        g_capacity <<= 1;
+    }
+    if (dir) {
+        g_dir = dir;
+    }
+    if (pthread_key_create(&g_ring_key, ring_retire) != 0) {
+        return -1;
+    }
+    g_start_ns = trace_clock_ns();
+    g_start_ticks = trace_ticks();
+    g_trace_enabled = 1;
+    return 0;
+}
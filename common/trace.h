@@ -0,0 +1,102 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Flight recorder: mỗi thread ghi sự kiện nhị phân cỡ cố định vào ring riêng, không khóa,
+// mốc thời gian lấy từ TSC. Ring đầy thì ghi đè sự kiện cũ nhất, nên lúc nào cũng có
+// sự kiện gần nhất của mọi thread. trace_dump (chat_server gọi khi nhận SIGUSR1) ghi toàn
+// bộ ring ra file, trace_to_chrome.py đổi file đó sang JSON của Chrome trace
+// (chrome://tracing, Perfetto).
+// Tắt (mặc định) thì mỗi điểm trace chỉ tốn một lần đọc biến toàn cục.
+
+// X(id, tên, pha Chrome trace: B/E = bắt đầu/kết thúc, i = tức thời). arg/value theo từng sự kiện.
+#define TRACE_EVENTS(X) \
+    X(TRACE_FRAME_RECEIVED,   "frame_received",  'i')  /* arg: socket, value: kiểu message (MSG_FILE_DATA cho chunk) */ \
+    X(TRACE_HANDLER_BEGIN,    "handler",         'B')  /* arg: client_id, value: kiểu message */ \
+    X(TRACE_HANDLER_END,      "handler",         'E') \
+    X(TRACE_ROOMS_LOCKED,     "rooms_mutex",     'B')  /* value: tick chờ khóa */ \
+    X(TRACE_ROOMS_UNLOCKED,   "rooms_mutex",     'E') \
+    X(TRACE_ROOM_LOCKED,      "room_mutex",      'B')  /* arg: room_id, value: tick chờ khóa */ \
+    X(TRACE_ROOM_UNLOCKED,    "room_mutex",      'E')  /* arg: room_id */ \
+    X(TRACE_SEND_BEGIN,       "send",            'B')  /* arg: client_id, value: byte cần gửi */ \
+    X(TRACE_SEND_END,         "send",            'E')  /* arg: client_id, value: byte kernel đã nhận */ \
+    X(TRACE_FILE_CHUNK,       "file_chunk",      'i')  /* arg: chunk_number, value: byte payload */
+
+#define TRACE_ENUM(id, name, phase) id,
+typedef enum { TRACE_EVENTS(TRACE_ENUM) TRACE_EVENT_COUNT } trace_event_t;
+#undef TRACE_ENUM
+
+// Định dạng file dump (little-endian, đúng bố cục struct trên x86-64): trace_file_header_t,
+// event_types trace_event_info_t (tên sự kiện, để bộ đổi không cần bảng riêng), rồi với mỗi
+// thread một trace_thread_header_t và event_count trace_entry_t theo thứ tự thời gian.
+// Hai cặp (tick, ns CLOCK_MONOTONIC) lúc bật và lúc dump dùng để đổi tick sang thời gian.
+#define TRACE_FILE_MAGIC "CHTRACE1"
+#define TRACE_DEFAULT_EVENTS 65536        // Sự kiện mỗi thread khi không chỉ rõ
+#define TRACE_MAX_RETIRED 64              // Ring của thread đã kết thúc được giữ lại để dump
+
+typedef struct {
+    char magic[8];
+    uint32_t thread_count;
+    uint32_t event_types;
+    uint64_t start_ticks;
+    uint64_t start_ns;
+    uint64_t dump_ticks;
+    uint64_t dump_ns;
+    uint32_t pid;
+    uint32_t entry_size;
+} trace_file_header_t;
+
+typedef struct {
+    char name[23];
+    char phase;
+} trace_event_info_t;
+
+typedef struct {
+    uint32_t tid;
+    uint32_t event_count;
+    uint64_t dropped;                     // Sự kiện đã bị ghi đè trước lúc dump
+    char name[16];
+} trace_thread_header_t;
+
+typedef struct {
+    uint64_t ticks;
+    uint32_t event;                       // trace_event_t
+    uint32_t arg;
+    uint64_t value;
+} trace_entry_t;
+
+extern int g_trace_enabled;
+
+// Bật trace với ring events sự kiện mỗi thread (làm tròn lên lũy thừa của 2); file dump
+// ghi vào dir. Trả về -1 nếu lỗi.
+int trace_init(size_t events, const char* dir);
+// Ghi ngay toàn bộ ring ra file mới trong dir, trả về -1 nếu lỗi
+int trace_dump(void);
+
+void trace_record(trace_event_t event, uint32_t arg, uint64_t value);
+// Nguồn thời gian khi không có TSC
+uint64_t trace_clock_ns(void);
+
+static inline uint64_t trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return trace_clock_ns();
+#endif
+}
+
+static inline int trace_enabled(void) {
+    return __builtin_expect(g_trace_enabled, 0);
+}
+
+static inline void trace_event(trace_event_t event, uint32_t arg, uint64_t value) {
+    if (trace_enabled()) {
+        trace_record(event, arg, value);
+    }
+}
+
+#endif // TRACE_H
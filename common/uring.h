@@ -0,0 +1,58 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <stddef.h>
+
+// Một io_uring tối giản dùng syscall trực tiếp (không cần liburing)
+typedef struct {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned cq_entries;
+
+    // Submission queue
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sqe_tail;      // SQE đã chuẩn bị nhưng chưa publish
+    unsigned to_submit;
+
+    // Completion queue
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring_ptr;
+    size_t sq_ring_size;
+    void* cq_ring_ptr;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+// Khởi tạo ring, trả về 0 nếu thành công, -1 nếu kernel không hỗ trợ
+int uring_init(uring_t* ring, unsigned entries);
+void uring_destroy(uring_t* ring);
+
+// Lấy một SQE trống (đã được memset), NULL nếu SQ đầy
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+// Submit tất cả SQE đang chờ bằng một io_uring_enter, chờ ít nhất wait_nr CQE
+int uring_submit(uring_t* ring, unsigned wait_nr);
+
+// Lấy CQE tiếp theo, trả về 1 nếu có, 0 nếu CQ rỗng
+int uring_next_cqe(uring_t* ring, struct io_uring_cqe* cqe);
+
+int uring_register_buffers(uring_t* ring, const struct iovec* iov, unsigned count);
+
+// SQE helpers
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* buf, size_t len, int flags);
+void uring_prep_recv(struct io_uring_sqe* sqe, int fd, void* buf, size_t len, int flags);
+void uring_prep_write_fixed(struct io_uring_sqe* sqe, int fd, const void* buf, size_t len,
+                            unsigned buf_index);
+void uring_prep_multishot_accept(struct io_uring_sqe* sqe, int listen_fd);
+
+#endif // URING_H
@@ -1,4 +1,47 @@
 #include "protocol.h"
+#include "filecrypt.h"
+#include "uring.h"
+#include "wire.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+#define IO_URING_ENTRIES 256
+#define IO_FIXED_BUFFER_SIZE 8192   // Đủ chứa một message_t hoặc file_transfer_t
+#define ROOM_FDS_STACK 64
+#define ROOM_MEMBERS_MIN 8           // Dung lượng đầu tiên của room->members
+#define TX_IOV_MAX 32               // Số iovec tối đa cho một sendmsg khi gửi hàng đợi
+#define ROOM_TABLE_MIN 64           // Số ô tối thiểu của bảng phòng
+#define ROOM_SLOT_EMPTY 0           // room_id bắt đầu từ 1
+#define ROOM_SLOT_DELETED -1
+
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT 0x00000008
+#endif
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+// Mỗi thread có một io_uring riêng với một registered buffer
+typedef struct {
+    uring_t ring;
+    unsigned char* fixed_buf;
+    int has_fixed_buf;
+} io_thread_ring_t;
+
+static io_backend_t g_io_backend = IO_BACKEND_SOCKET;
+static io_stats_t g_io_stats;
+static queue_stats_t g_queue_stats;
+static size_t g_queue_high = CLIENT_QUEUE_HIGH_DEFAULT;
+static size_t g_queue_low = CLIENT_QUEUE_LOW_DEFAULT;
+static slow_consumer_policy_t g_slow_policy = SLOW_CONSUMER_EVICT;
+static pthread_key_t g_ring_key;
+static pthread_once_t g_ring_key_once = PTHREAD_ONCE_INIT;
+static __thread io_thread_ring_t* t_ring = NULL;
 
 void error_exit(const char* msg) {
     perror(msg);
@@ -27,11 +70,14 @@ int create_socket() {
     return socket_fd;
 }
 
-void setup_server_socket(int socket_fd, int port) {
+void setup_server_socket(int socket_fd, int port, int backlog, int reuse_port) {
     int opt = 1;
     if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         error_exit("setsockopt failed");
     }
+    if (reuse_port && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        error_exit("setsockopt SO_REUSEPORT failed");
+    }
 
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
@@ -42,28 +88,481 @@ void setup_server_socket(int socket_fd, int port) {
         error_exit("Bind failed");
     }
 
-    if (listen(socket_fd, 10) < 0) {
+    if (listen(socket_fd, backlog) < 0) {
         error_exit("Listen failed");
     }
 }
 
-int send_message(int socket_fd, message_t* msg) {
-    if (send(socket_fd, msg, sizeof(message_t), 0) < 0) {
+int set_nonblocking(int socket_fd) {
+    int flags = fcntl(socket_fd, F_GETFL, 0);
+    if (flags < 0) {
         return -1;
     }
+    return fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void count_syscall(void) {
+    __atomic_fetch_add(&g_io_stats.send_syscalls, 1, __ATOMIC_RELAXED);
+}
+
+static void count_delivered(unsigned long count) {
+    __atomic_fetch_add(&g_io_stats.messages_delivered, count, __ATOMIC_RELAXED);
+}
+
+static void count_file_bytes(unsigned long* counter, unsigned long bytes) {
+    __atomic_fetch_add(counter, bytes, __ATOMIC_RELAXED);
+    metrics_add(METRIC_FILE_BYTES_OUT, bytes);
+}
+
+// Gửi đủ len byte, kể cả khi socket ở chế độ non-blocking
+int send_all(int socket_fd, const void* buf, size_t len) {
+    const char* p = (const char*)buf;
+
+    while (len > 0) {
+        count_syscall();
+        ssize_t sent = send(socket_fd, p, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = socket_fd, .events = POLLOUT };
+                count_syscall();
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                    return -1;
+                }
+                continue;
+            }
+            return -1;
+        }
+        p += sent;
+        len -= (size_t)sent;
+    }
     return 0;
 }
 
+static void destroy_thread_ring(void* arg) {
+    io_thread_ring_t* tr = (io_thread_ring_t*)arg;
+    uring_destroy(&tr->ring);
+    safe_free(tr->fixed_buf);
+    safe_free(tr);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&g_ring_key, destroy_thread_ring);
+}
+
+static io_thread_ring_t* get_thread_ring(void) {
+    if (t_ring) {
+        return t_ring;
+    }
+
+    io_thread_ring_t* tr = (io_thread_ring_t*)safe_malloc(sizeof(io_thread_ring_t));
+    if (uring_init(&tr->ring, IO_URING_ENTRIES) < 0) {
+        safe_free(tr);
+        return NULL;
+    }
+
+    tr->fixed_buf = (unsigned char*)safe_malloc(IO_FIXED_BUFFER_SIZE);
+    struct iovec iov = { .iov_base = tr->fixed_buf, .iov_len = IO_FIXED_BUFFER_SIZE };
+    tr->has_fixed_buf = uring_register_buffers(&tr->ring, &iov, 1) == 0;
+
+    pthread_setspecific(g_ring_key, tr);
+    t_ring = tr;
+    return tr;
+}
+
+static void drop_thread_ring(void) {
+    if (t_ring) {
+        pthread_setspecific(g_ring_key, NULL);
+        destroy_thread_ring(t_ring);
+        t_ring = NULL;
+    }
+}
+
+io_backend_t io_backend_init(io_backend_t requested) {
+    g_io_backend = IO_BACKEND_SOCKET;
+    if (requested != IO_BACKEND_URING) {
+        return g_io_backend;
+    }
+
+    pthread_once(&g_ring_key_once, create_ring_key);
+
+    // Thử tạo ring để kiểm tra kernel có hỗ trợ io_uring không
+    uring_t probe;
+    if (uring_init(&probe, 8) < 0) {
+        perror("io_uring không khả dụng, dùng socket thông thường");
+        return g_io_backend;
+    }
+    uring_destroy(&probe);
+
+    g_io_backend = IO_BACKEND_URING;
+    return g_io_backend;
+}
+
+io_backend_t io_backend_active(void) {
+    return g_io_backend;
+}
+
+void io_backend_get_stats(io_stats_t* stats) {
+    stats->send_syscalls = __atomic_load_n(&g_io_stats.send_syscalls, __ATOMIC_RELAXED);
+    stats->messages_delivered = __atomic_load_n(&g_io_stats.messages_delivered, __ATOMIC_RELAXED);
+    stats->file_bytes_spliced = __atomic_load_n(&g_io_stats.file_bytes_spliced, __ATOMIC_RELAXED);
+    stats->file_bytes_copied = __atomic_load_n(&g_io_stats.file_bytes_copied, __ATOMIC_RELAXED);
+}
+
+// Hoàn tất gửi cho socket thứ index trong lô: rest là phần kernel chưa nhận. error khác 0
+// (errno của CQE, vd EPIPE, EOPNOTSUPP) khi io_uring không gửi được byte nào, người gọi gửi
+// lại theo đường socket để lỗi được xử lý như ở đó. Trả về -1 nếu không gửi được.
+typedef int (*batch_complete_t)(void* ctx, int index, const void* rest, size_t rest_len, int error);
+
+// Gửi cùng một buffer tới nhiều socket: mỗi lô SQE chỉ tốn một io_uring_enter.
+// nowait: socket đầy thì trả -EAGAIN ngay thay vì để kernel chờ (kể cả socket blocking).
+// Trả về số socket gửi thất bại.
+static int uring_send_batch(io_thread_ring_t* tr, const int* socket_fds, int count,
+                            const void* buf, size_t len, int nowait,
+                            batch_complete_t complete, void* ctx) {
+    const void* src = buf;
+    int fixed = tr->has_fixed_buf && len <= IO_FIXED_BUFFER_SIZE;
+    if (fixed) {
+        memcpy(tr->fixed_buf, buf, len);
+        src = tr->fixed_buf;
+    }
+
+    int failures = 0;
+    int done = 0;
+    while (done < count) {
+        int batch = 0;
+        while (done + batch < count) {
+            struct io_uring_sqe* sqe = uring_get_sqe(&tr->ring);
+            if (!sqe) {
+                break;
+            }
+            int fd = socket_fds[done + batch];
+            if (fixed) {
+                uring_prep_write_fixed(sqe, fd, src, len, 0);
+                sqe->rw_flags = nowait ? RWF_NOWAIT : 0;
+            } else {
+                uring_prep_send(sqe, fd, src, len, MSG_NOSIGNAL | (nowait ? MSG_DONTWAIT : 0));
+            }
+            sqe->user_data = (__u64)(done + batch);
+            batch++;
+        }
+
+        count_syscall();
+        if (uring_submit(&tr->ring, (unsigned)batch) < 0) {
+            // Ring hỏng: bỏ ring của thread này và gửi phần còn lại bằng socket
+            drop_thread_ring();
+            for (int i = done; i < count; i++) {
+                if (complete(ctx, i, buf, len, 0) < 0) {
+                    failures++;
+                }
+            }
+            return failures;
+        }
+
+        int reaped = 0;
+        while (reaped < batch) {
+            struct io_uring_cqe cqe;
+            if (!uring_next_cqe(&tr->ring, &cqe)) {
+                count_syscall();
+                uring_submit(&tr->ring, (unsigned)(batch - reaped));
+                continue;
+            }
+            reaped++;
+
+            int index = (int)cqe.user_data;
+            if (cqe.res == (int)len) {
+                count_delivered(1);
+                continue;
+            }
+
+            // Gửi thiếu, socket đầy hoặc lỗi: phần còn lại do người gọi xử lý
+            size_t sent = cqe.res > 0 ? (size_t)cqe.res : 0;
+            int error = cqe.res < 0 && cqe.res != -EAGAIN ? -cqe.res : 0;
+            if (complete(ctx, index, (const char*)buf + sent, len - sent, error) < 0) {
+                failures++;
+            }
+        }
+        done += batch;
+    }
+    return failures;
+}
+
+// Socket blocking: gửi nốt phần còn lại ngay. Lỗi của CQE cũng gửi lại bằng send_all,
+// lỗi thật của socket hiện ra ở đó.
+static int complete_send_all(void* ctx, int index, const void* rest, size_t rest_len, int error) {
+    const int* socket_fds = (const int*)ctx;
+    (void)error;
+    if (send_all(socket_fds[index], rest, rest_len) < 0) {
+        return -1;
+    }
+    count_delivered(1);
+    return 0;
+}
+
+static int send_buffer_batch(const int* socket_fds, int count, const void* buf, size_t len) {
+    if (g_io_backend == IO_BACKEND_URING) {
+        io_thread_ring_t* tr = get_thread_ring();
+        if (tr) {
+            return uring_send_batch(tr, socket_fds, count, buf, len, 0, complete_send_all,
+                                    (void*)socket_fds);
+        }
+    }
+
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        if (complete_send_all((void*)socket_fds, i, buf, len, 0) < 0) {
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// Chờ socket non-blocking có dữ liệu (hoặc đạt SO_RCVLOWAT)
+static int wait_readable(int socket_fd) {
+    struct pollfd pfd = { .fd = socket_fd, .events = POLLIN };
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+ssize_t fill_receive_ring(int socket_fd, ringbuf_t* rx, size_t max) {
+    if (g_io_backend == IO_BACKEND_URING) {
+        io_thread_ring_t* tr = get_thread_ring();
+        struct io_uring_sqe* sqe = tr ? uring_get_sqe(&tr->ring) : NULL;
+        if (sqe) {
+            struct io_uring_cqe cqe;
+            size_t len;
+            unsigned char* region = ringbuf_write_region(rx, &len);
+            uring_prep_recv(sqe, socket_fd, region, len < max ? len : max, 0);
+            if (uring_submit(&tr->ring, 1) < 0 || !uring_next_cqe(&tr->ring, &cqe)) {
+                drop_thread_ring();
+                return -1;
+            }
+            if (cqe.res > 0) {
+                ringbuf_commit(rx, (size_t)cqe.res);
+                return cqe.res;
+            }
+            // Socket non-blocking: io_uring trả -EAGAIN thay vì tự chờ
+            if (cqe.res != -EAGAIN || wait_readable(socket_fd) < 0) {
+                return cqe.res;
+            }
+        }
+    }
+
+    while (1) {
+        ssize_t bytes = ringbuf_recv(rx, socket_fd, max);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_readable(socket_fd) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        return bytes;
+    }
+}
+
+// Nhận đủ len byte (socket blocking)
+static int receive_buffer(int socket_fd, void* buf, size_t len) {
+    if (g_io_backend == IO_BACKEND_URING) {
+        io_thread_ring_t* tr = get_thread_ring();
+        struct io_uring_sqe* sqe = tr ? uring_get_sqe(&tr->ring) : NULL;
+        if (sqe) {
+            struct io_uring_cqe cqe;
+            uring_prep_recv(sqe, socket_fd, buf, len, MSG_WAITALL);
+            if (uring_submit(&tr->ring, 1) < 0 || !uring_next_cqe(&tr->ring, &cqe)) {
+                drop_thread_ring();
+                return -1;
+            }
+            return cqe.res == (int)len ? 0 : -1;
+        }
+    }
+
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t bytes_received = recv(socket_fd, p, len, 0);
+        if (bytes_received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_received <= 0) {
+            return -1;
+        }
+        p += bytes_received;
+        len -= (size_t)bytes_received;
+    }
+    return 0;
+}
+
+int encode_message_frame(const message_t* msg, int wire_version, unsigned char* buf, size_t cap) {
+    if (wire_version == WIRE_VERSION_V2) {
+        return wire_encode_message(msg, buf, cap);
+    }
+    if (cap < sizeof(legacy_message_t)) {
+        return -1;
+    }
+    legacy_from_message(msg, (legacy_message_t*)buf);
+    return (int)sizeof(legacy_message_t);
+}
+
+int encode_file_transfer_frame(const file_transfer_t* ft, int wire_version, unsigned char* buf, size_t cap) {
+    if (wire_version == WIRE_VERSION_V2) {
+        return wire_encode_file_transfer(ft, buf, cap);
+    }
+    if (cap < sizeof(legacy_file_transfer_t)) {
+        return -1;
+    }
+    legacy_from_file_transfer(ft, (legacy_file_transfer_t*)buf);
+    return (int)sizeof(legacy_file_transfer_t);
+}
+
+size_t frame_size_needed(const unsigned char* buf, size_t len, int wire_version, frame_kind_t expected) {
+    if (wire_version != WIRE_VERSION_V2) {
+        return expected == FRAME_FILE_CHUNK ? sizeof(legacy_file_transfer_t) : sizeof(legacy_message_t);
+    }
+    if (len < WIRE_LENGTH_SIZE) {
+        return WIRE_LENGTH_SIZE;
+    }
+    return wire_frame_length(buf);
+}
+
+int decode_frame(const unsigned char* buf, size_t len, int wire_version, frame_kind_t expected, frame_t* frame) {
+    if (wire_version != WIRE_VERSION_V2) {
+        // v1 không có header: loại frame do trạng thái kết nối quyết định
+        frame->kind = expected;
+        if (expected == FRAME_FILE_CHUNK) {
+            legacy_file_transfer_t legacy;
+            if (len != sizeof(legacy)) {
+                return -1;
+            }
+            memcpy(&legacy, buf, sizeof(legacy));
+            legacy_to_file_transfer(&legacy, &frame->body.ft);
+        } else {
+            legacy_message_t legacy;
+            if (len != sizeof(legacy)) {
+                return -1;
+            }
+            memcpy(&legacy, buf, sizeof(legacy));
+            legacy_to_message(&legacy, &frame->body.msg);
+        }
+        return 0;
+    }
+
+    unsigned char plain[WIRE_MAX_FRAME_SIZE];
+    if (len > WIRE_LENGTH_SIZE && wire_frame_compressed(buf)) {
+        int plain_len = wire_decompress_frame(buf, len, plain, sizeof(plain));
+        if (plain_len < 0) {
+            return -1;
+        }
+        buf = plain;
+        len = (size_t)plain_len;
+    }
+
+    if (len > WIRE_LENGTH_SIZE + 1 && wire_frame_type(buf) == MSG_FILE_DATA) {
+        frame->kind = FRAME_FILE_CHUNK;
+        return wire_decode_file_transfer(buf, len, &frame->body.ft);
+    }
+    frame->kind = FRAME_MESSAGE;
+    return wire_decode_message(buf, len, &frame->body.msg);
+}
+
+int send_message_wire(int socket_fd, const message_t* msg, int wire_version) {
+    unsigned char buf[WIRE_MAX_FRAME_SIZE];
+    int len = encode_message_frame(msg, wire_version, buf, sizeof(buf));
+    if (len < 0) {
+        return -1;
+    }
+    return send_buffer_batch(&socket_fd, 1, buf, (size_t)len) == 0 ? 0 : -1;
+}
+
+int send_message_compressed(int socket_fd, const message_t* msg) {
+    unsigned char buf[WIRE_MAX_FRAME_SIZE];
+    unsigned char packed[WIRE_MAX_FRAME_SIZE];
+    int len = wire_encode_message(msg, buf, sizeof(buf));
+    if (len < 0) {
+        return -1;
+    }
+    int packed_len = wire_compress_frame(buf, (size_t)len, packed, sizeof(packed));
+    if (packed_len > 0) {
+        return send_buffer_batch(&socket_fd, 1, packed, (size_t)packed_len) == 0 ? 0 : -1;
+    }
+    return send_buffer_batch(&socket_fd, 1, buf, (size_t)len) == 0 ? 0 : -1;
+}
+
+int send_message(int socket_fd, message_t* msg) {
+    return send_message_wire(socket_fd, msg, WIRE_VERSION_LEGACY);
+}
+
+int receive_frame(int socket_fd, int wire_version, frame_kind_t expected, frame_t* frame) {
+    unsigned char buf[WIRE_MAX_FRAME_SIZE];
+    size_t have = 0;
+
+    while (1) {
+        size_t need = frame_size_needed(buf, have, wire_version, expected);
+        if (need == 0 || need > sizeof(buf)) {
+            return -1;
+        }
+        if (have == need) {
+            break;
+        }
+        if (receive_buffer(socket_fd, buf + have, need - have) < 0) {
+            return -1;
+        }
+        have = need;
+    }
+    return decode_frame(buf, have, wire_version, expected, frame);
+}
+
+int parse_buffered_frame(ringbuf_t* rx, int wire_version, frame_kind_t expected, frame_t* frame) {
+    unsigned char header[WIRE_LENGTH_SIZE];
+    size_t have = ringbuf_peek(rx, header, sizeof(header));
+    size_t need = frame_size_needed(header, have, wire_version, expected);
+    if (need == 0 || need > WIRE_MAX_FRAME_SIZE) {
+        return -1;
+    }
+    if (ringbuf_used(rx) < need) {
+        return 0;
+    }
+
+    unsigned char scratch[WIRE_MAX_FRAME_SIZE];
+    const unsigned char* buf = ringbuf_contiguous(rx, need, scratch);
+    int rc = decode_frame(buf, need, wire_version, expected, frame);
+    ringbuf_consume(rx, need);
+    return rc < 0 ? -1 : 1;
+}
+
+int receive_buffered_frame(int socket_fd, ringbuf_t* rx, int wire_version, frame_kind_t expected,
+                           frame_t* frame) {
+    while (1) {
+        int rc = parse_buffered_frame(rx, wire_version, expected, frame);
+        if (rc != 0) {
+            return rc > 0 ? 0 : -1;
+        }
+        // rx chỉ còn một phần frame (< WIRE_MAX_FRAME_SIZE) nên luôn còn chỗ trống
+        if (fill_receive_ring(socket_fd, rx, SIZE_MAX) <= 0) {
+            return -1;
+        }
+    }
+}
+
 int receive_message(int socket_fd, message_t* msg) {
-    ssize_t bytes_received = recv(socket_fd, msg, sizeof(message_t), 0);
-    if (bytes_received <= 0) {
+    frame_t frame;
+    if (receive_frame(socket_fd, WIRE_VERSION_LEGACY, FRAME_MESSAGE, &frame) < 0) {
         return -1;
     }
+    *msg = frame.body.msg;
     return 0;
 }
 
 void print_message(message_t* msg) {
-    time_t now = time(NULL);
+    // Tin phát lại từ lịch sử hiện giờ gửi gốc
+    time_t now = msg->timestamp > 0 ? msg->timestamp : time(NULL);
     struct tm* tm_info = localtime(&now);
     char time_str[20];
     strftime(time_str, sizeof(time_str), "%H:%M:%S", tm_info);
@@ -107,59 +606,1161 @@ void print_message(message_t* msg) {
         case MSG_FILE_COMPLETE:
             printf("[%s] %s\n", time_str, msg->content);
             break;
+        case MSG_STATS:
+            printf("[%s] 📊 %s\n", time_str, msg->content);
+            break;
         default:
             printf("[%s] %s\n", time_str, msg->content);
             break;
     }
 }
 
+void client_queue_configure(size_t high_watermark, size_t low_watermark, slow_consumer_policy_t policy) {
+    // Hàng đợi phải chứa được ít nhất một frame
+    if (high_watermark < WIRE_MAX_FRAME_SIZE) {
+        high_watermark = WIRE_MAX_FRAME_SIZE;
+    }
+    if (low_watermark >= high_watermark) {
+        low_watermark = high_watermark / 2;
+    }
+    g_queue_high = high_watermark;
+    g_queue_low = low_watermark;
+    g_slow_policy = policy;
+}
+
+void client_queue_get_stats(queue_stats_t* stats) {
+    stats->frames_queued = __atomic_load_n(&g_queue_stats.frames_queued, __ATOMIC_RELAXED);
+    stats->frames_dropped = __atomic_load_n(&g_queue_stats.frames_dropped, __ATOMIC_RELAXED);
+    stats->lossy_entered = __atomic_load_n(&g_queue_stats.lossy_entered, __ATOMIC_RELAXED);
+    stats->lossy_clients = __atomic_load_n(&g_queue_stats.lossy_clients, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&g_queue_stats.evictions, __ATOMIC_RELAXED);
+    stats->queued_bytes = __atomic_load_n(&g_queue_stats.queued_bytes, __ATOMIC_RELAXED);
+    stats->queued_bytes_peak = __atomic_load_n(&g_queue_stats.queued_bytes_peak, __ATOMIC_RELAXED);
+}
+
+static void queue_stats_bytes(long delta, size_t client_queued) {
+    __atomic_fetch_add(&g_queue_stats.queued_bytes, (unsigned long)delta, __ATOMIC_RELAXED);
+
+    unsigned long peak = __atomic_load_n(&g_queue_stats.queued_bytes_peak, __ATOMIC_RELAXED);
+    while (client_queued > peak &&
+           !__atomic_compare_exchange_n(&g_queue_stats.queued_bytes_peak, &peak, client_queued,
+                                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static int client_set_writable_interest(client_t* client, int writable) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+    ev.data.ptr = client;
+    if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, client->socket_fd, &ev) < 0) {
+        return -1;
+    }
+    client->tx_armed = writable;
+    return 0;
+}
+
+static void client_set_lossy(client_t* client, int lossy) {
+    client->tx_lossy = lossy;
+    __atomic_fetch_add(&g_queue_stats.lossy_clients, lossy ? 1UL : (unsigned long)-1, __ATOMIC_RELAXED);
+    if (lossy) {
+        __atomic_fetch_add(&g_queue_stats.lossy_entered, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Gửi không chờ, dừng khi socket đầy hoặc lỗi. Trả về số byte kernel đã nhận.
+static size_t send_nowait(int socket_fd, const void* buf, size_t len, int flags) {
+    const char* p = (const char*)buf;
+    size_t done = 0;
+    while (done < len) {
+        count_syscall();
+        ssize_t sent = send(socket_fd, p + done, len - done, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            break;
+        }
+        done += (size_t)sent;
+    }
+    return done;
+}
+
+static void tx_segment_free(tx_segment_t* segment) {
+    if (segment->kind == TX_SEGMENT_FILE) {
+        spool_unref(segment->spool);
+    } else if (segment->kind == TX_SEGMENT_BUFFER) {
+        wire_buffer_unref(segment->buffer);
+    } else if (segment->kind == TX_SEGMENT_CACHED) {
+        spool_unref(segment->cached->spool);
+        slab_free(segment->cached, sizeof(cached_file_t));
+    }
+    slab_free(segment, sizeof(tx_segment_t));
+}
+
+// Bỏ toàn bộ output đang chờ. Phải giữ client->tx_mutex.
+static void client_discard_queue_locked(client_t* client) {
+    while (client->tx_head) {
+        tx_segment_t* segment = client->tx_head;
+        client->tx_head = segment->next;
+        tx_segment_free(segment);
+    }
+    client->tx_tail = NULL;
+    client->tx_control_tail = NULL;
+    client->tx_bulk_open = 0;
+    queue_stats_bytes(-(long)client->tx_queued, 0);
+    client->tx_queued = 0;
+    ringbuf_consume(&client->tx, ringbuf_used(&client->tx));
+}
+
+static tx_segment_t* tx_segment_new(tx_segment_kind_t kind) {
+    tx_segment_t* segment = (tx_segment_t*)slab_alloc(sizeof(tx_segment_t));
+    if (!segment) {
+        error_exit("Memory allocation failed");
+    }
+    memset(segment, 0, sizeof(tx_segment_t));
+    segment->kind = kind;
+    return segment;
+}
+
+// Đoạn mà frame control tiếp theo xếp ngay sau: frame control cuối đang chờ, hoặc cuối
+// frame bulk đang gửi dở. NULL = đầu hàng đợi, trước mọi chunk chưa bắt đầu.
+static tx_segment_t* client_control_anchor_locked(client_t* client) {
+    if (client->tx_control_tail) {
+        return client->tx_control_tail;
+    }
+    if (!client->tx_bulk_open) {
+        return NULL;
+    }
+    tx_segment_t* segment = client->tx_head;
+    while (segment->next && !segment->frame_end) {
+        segment = segment->next;
+    }
+    return segment;
+}
+
+// Bulk xếp cuối hàng đợi, control xếp theo client_control_anchor_locked. Thứ tự trong
+// mỗi lane được giữ nguyên; đoạn byte luôn là control nên thứ tự byte trong tx vẫn khớp.
+static tx_segment_t* client_append_segment(client_t* client, tx_segment_kind_t kind, tx_lane_t lane) {
+    tx_segment_t* segment = tx_segment_new(kind);
+    segment->lane = lane;
+    tx_segment_t* after = client->tx_tail;
+    if (lane == TX_LANE_CONTROL) {
+        after = client_control_anchor_locked(client);
+        client->tx_control_tail = segment;
+    }
+    if (after) {
+        segment->next = after->next;
+        after->next = segment;
+    } else {
+        segment->next = client->tx_head;
+        client->tx_head = segment;
+    }
+    if (client->tx_tail == after) {
+        client->tx_tail = segment;
+    }
+    return segment;
+}
+
+// Frame bulk vừa xếp xong (đoạn cuối là tx_tail). started: phần đầu frame đã được gửi thẳng,
+// frame control sau đó phải chờ frame này xong.
+static void client_bulk_queued_locked(client_t* client, int started) {
+    client->tx_tail->frame_end = 1;
+    if (started) {
+        client->tx_bulk_open = 1;
+    }
+}
+
+// Ghi nhận len byte vừa ghi vào cuối tx, gộp với đoạn byte control cuối nếu có
+static void client_push_bytes_locked(client_t* client, size_t len) {
+    tx_segment_t* segment = client->tx_control_tail;
+    if (!segment || segment->kind != TX_SEGMENT_BYTES) {
+        segment = client_append_segment(client, TX_SEGMENT_BYTES, TX_LANE_CONTROL);
+    }
+    segment->len += len;
+}
+
+// Ngắt client không đọc kịp. Chỉ shutdown socket: reactor/thread của client thấy
+// kết nối đóng và dọn dẹp như bình thường.
+static void client_evict_locked(client_t* client) {
+    if (client->tx_evicted) {
+        return;
+    }
+    client->tx_evicted = 1;
+    client_discard_queue_locked(client);
+    if (client->tx_lossy) {
+        client_set_lossy(client, 0);
+    }
+    __atomic_fetch_add(&g_queue_stats.evictions, 1, __ATOMIC_RELAXED);
+    shutdown(client->socket_fd, SHUT_RDWR);
+    printf("Client %s (ID: %d) bị ngắt do không nhận kịp dữ liệu\n", client->username, client->client_id);
+}
+
+// Kiểm tra watermark trước khi xếp thêm len byte: 1 = được xếp, 0 = bỏ frame (lossy),
+// -1 = client đã bị ngắt. Phải giữ client->tx_mutex.
+static int client_queue_admit_locked(client_t* client, size_t len, int droppable) {
+    if (client->tx_queued + len > g_queue_high) {
+        if (g_slow_policy == SLOW_CONSUMER_EVICT) {
+            client_evict_locked(client);
+            return -1;
+        }
+        if (!client->tx_lossy) {
+            client_set_lossy(client, 1);
+        }
+    }
+    if (client->tx_lossy && droppable) {
+        client->tx_dropped++;
+        __atomic_fetch_add(&g_queue_stats.frames_dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    // Frame bắt buộc (reply, key, chunk file) nhưng hàng đợi đã đầy hẳn
+    if (client->tx_queued + len > g_queue_high + WIRE_MAX_FRAME_SIZE) {
+        client_evict_locked(client);
+        return -1;
+    }
+    return 1;
+}
+
+// Báo reactor (EPOLLOUT) hoặc writer thread rằng hàng đợi có dữ liệu
+static int client_wake_writer_locked(client_t* client) {
+    if (client->epoll_fd >= 0) {
+        if (!client->tx_armed) {
+            return client_set_writable_interest(client, 1);
+        }
+    } else {
+        pthread_cond_signal(&client->tx_cond);
+    }
+    return 0;
+}
+
+static int client_queue_added_locked(client_t* client, size_t len) {
+    client->tx_queued += len;
+    __atomic_fetch_add(&g_queue_stats.frames_queued, 1, __ATOMIC_RELAXED);
+    queue_stats_bytes((long)len, client->tx_queued);
+    metrics_record(METRIC_SEND_QUEUE_BYTES, client->tx_queued);
+    return client_wake_writer_locked(client);
+}
+
+// Frame mới phải xếp hàng thay vì gửi thẳng: còn output chờ hoặc một broadcast đang gửi dở
+static int client_tx_busy_locked(const client_t* client) {
+    return client->tx_head || client->tx_inflight;
+}
+
+// Xếp phần frame chưa gửi vào hàng đợi của client. Phải giữ client->tx_mutex.
+// droppable: broadcast chat, có thể bỏ khi client đang lossy.
+static int client_queue_locked(client_t* client, const void* data, size_t len, int droppable) {
+    if (!client->tx.data && ringbuf_init(&client->tx, g_queue_high + WIRE_MAX_FRAME_SIZE) < 0) {
+        return -1;
+    }
+
+    int rc = client_queue_admit_locked(client, len, droppable);
+    if (rc <= 0) {
+        return rc;
+    }
+    if (ringbuf_write(&client->tx, data, len) < 0) {
+        client_evict_locked(client);
+        return -1;
+    }
+    client_push_bytes_locked(client, len);
+    return client_queue_added_locked(client, len);
+}
+
+// Xếp len byte của frame dùng chung bắt đầu từ offset, chỉ giữ tham chiếu chứ không copy.
+// Phải giữ client->tx_mutex.
+static int client_queue_buffer_locked(client_t* client, wire_buffer_t* buffer, size_t offset,
+                                      size_t len, int droppable, tx_lane_t lane) {
+    int rc = client_queue_admit_locked(client, len, droppable);
+    if (rc <= 0) {
+        return rc;
+    }
+    tx_segment_t* segment = client_append_segment(client, TX_SEGMENT_BUFFER, lane);
+    wire_buffer_ref(buffer);
+    segment->buffer = buffer;
+    segment->offset = (off_t)offset;
+    segment->len = len;
+    return client_queue_added_locked(client, len);
+}
+
+// Xếp vùng [offset, offset + len) của spool, gửi bằng sendfile khi tới lượt.
+// Phải giữ client->tx_mutex.
+static int client_queue_file_locked(client_t* client, file_spool_t* spool, off_t offset, size_t len) {
+    int rc = client_queue_admit_locked(client, len, 0);
+    if (rc <= 0) {
+        return rc;
+    }
+    tx_segment_t* segment = client_append_segment(client, TX_SEGMENT_FILE, TX_LANE_BULK);
+    spool_ref(spool);
+    segment->spool = spool;
+    segment->offset = offset;
+    segment->len = len;
+    return client_queue_added_locked(client, len);
+}
+
+// Gửi một frame tới client mà không bao giờ chờ socket. Phải giữ client->tx_mutex.
+// Hàng đợi rỗng thì thử gửi thẳng, phần kernel chưa nhận được xếp vào hàng đợi.
+static int client_write_locked(client_t* client, const void* data, size_t len, int droppable) {
+    if (client->tx_evicted) {
+        return -1;
+    }
+    if (client_tx_busy_locked(client)) {
+        return client_queue_locked(client, data, len, droppable);
+    }
+
+    const char* p = (const char*)data;
+    size_t left = len;
+    trace_event(TRACE_SEND_BEGIN, (uint32_t)client->client_id, len);
+    while (left > 0) {
+        count_syscall();
+        ssize_t sent = send(client->socket_fd, p, left, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            trace_event(TRACE_SEND_END, (uint32_t)client->client_id, len - left);
+            return -1;
+        }
+        p += sent;
+        left -= (size_t)sent;
+    }
+    trace_event(TRACE_SEND_END, (uint32_t)client->client_id, len - left);
+    if (left == 0) {
+        return 0;
+    }
+    // Đã gửi một phần thì phần còn lại không được bỏ, nếu không stream sẽ lệch frame
+    return client_queue_locked(client, p, left, droppable && left == len);
+}
+
+// Xếp phần frame dùng chung bắt đầu từ offset (offset > 0: phần đầu đã gửi thẳng).
+// Phải giữ client->tx_mutex.
+static int client_queue_frame_locked(client_t* client, wire_buffer_t* buffer, size_t offset,
+                                     int droppable, tx_lane_t lane) {
+    int rc = client_queue_buffer_locked(client, buffer, offset, buffer->len - offset, droppable, lane);
+    if (rc == 0 && lane == TX_LANE_BULK) {
+        client_bulk_queued_locked(client, offset > 0);
+    }
+    return rc;
+}
+
+// Như client_queue_frame_locked nhưng xếp lên đầu hàng đợi: frame vừa gửi ngoài khóa
+// (tx_inflight) đi trước mọi thứ xếp hàng trong lúc đó. Phải giữ client->tx_mutex.
+static int client_requeue_front_locked(client_t* client, wire_buffer_t* buffer, size_t offset,
+                                       int droppable, tx_lane_t lane) {
+    size_t len = buffer->len - offset;
+    int rc = client_queue_admit_locked(client, len, droppable);
+    if (rc <= 0) {
+        return rc;
+    }
+    tx_segment_t* segment = tx_segment_new(TX_SEGMENT_BUFFER);
+    wire_buffer_ref(buffer);
+    segment->buffer = buffer;
+    segment->offset = (off_t)offset;
+    segment->len = len;
+    segment->lane = lane;
+    segment->next = client->tx_head;
+    client->tx_head = segment;
+    if (!client->tx_tail) {
+        client->tx_tail = segment;
+    }
+    if (lane == TX_LANE_BULK) {
+        segment->frame_end = 1;
+        client->tx_bulk_open = offset > 0;
+    } else if (!client->tx_control_tail) {
+        client->tx_control_tail = segment;
+    }
+    return client_queue_added_locked(client, len);
+}
+
+// Như client_write_locked cho frame broadcast dùng chung: phần chưa gửi được chỉ xếp
+// tham chiếu tới buffer. Phải giữ client->tx_mutex.
+static int client_write_buffer_locked(client_t* client, wire_buffer_t* buffer, int droppable, tx_lane_t lane) {
+    if (client->tx_evicted) {
+        return -1;
+    }
+    if (client_tx_busy_locked(client)) {
+        return client_queue_frame_locked(client, buffer, 0, droppable, lane);
+    }
+
+    trace_event(TRACE_SEND_BEGIN, (uint32_t)client->client_id, buffer->len);
+    size_t sent = send_nowait(client->socket_fd, buffer->data, buffer->len, 0);
+    trace_event(TRACE_SEND_END, (uint32_t)client->client_id, sent);
+    if (sent == buffer->len) {
+        return 0;
+    }
+    // Đã gửi một phần thì phần còn lại không được bỏ, nếu không stream sẽ lệch frame
+    return client_queue_frame_locked(client, buffer, sent, droppable && sent == 0, lane);
+}
+
+static int client_send_frame(client_t* client, const void* frame, size_t len) {
+    pthread_mutex_lock(&client->tx_mutex);
+    int rc = client_write_locked(client, frame, len, 0);
+    pthread_mutex_unlock(&client->tx_mutex);
+    if (rc == 0) {
+        count_delivered(1);
+    }
+    return rc;
+}
+
+// Gửi từ đầu hàng đợi: các đoạn byte liền nhau gom vào một sendmsg, đoạn file
+// dùng sendfile. Trả về số byte đã gửi hoặc -1 với errno.
+static ssize_t client_send_head_locked(client_t* client) {
+    tx_segment_t* segment = client->tx_head;
+    if (segment->kind == TX_SEGMENT_FILE) {
+        off_t pos = segment->offset;
+        return sendfile(client->socket_fd, segment->spool->fd, &pos, segment->len);
+    }
+
+    struct iovec iov[TX_IOV_MAX];
+    int count = 0;
+    size_t ring_offset = 0;
+    while (segment && (segment->kind == TX_SEGMENT_BYTES || segment->kind == TX_SEGMENT_BUFFER) &&
+           count <= TX_IOV_MAX - 2) {
+        if (segment->kind == TX_SEGMENT_BYTES) {
+            count += ringbuf_iov(&client->tx, ring_offset, segment->len, iov + count);
+            ring_offset += segment->len;
+        } else {
+            iov[count].iov_base = segment->buffer->data + segment->offset;
+            iov[count].iov_len = segment->len;
+            count++;
+        }
+        segment = segment->next;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)count;
+    return sendmsg(client->socket_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+// Bỏ sent byte đã gửi khỏi đầu hàng đợi. Phải giữ client->tx_mutex.
+static void client_consume_locked(client_t* client, size_t sent) {
+    queue_stats_bytes(-(long)sent, 0);
+    client->tx_queued -= sent;
+    while (sent > 0) {
+        tx_segment_t* segment = client->tx_head;
+        size_t take = sent < segment->len ? sent : segment->len;
+        if (segment->kind == TX_SEGMENT_BYTES) {
+            ringbuf_consume(&client->tx, take);
+        } else {
+            segment->offset += (off_t)take;
+        }
+        segment->len -= take;
+        sent -= take;
+        if (segment->lane == TX_LANE_BULK) {
+            client->tx_bulk_open = segment->len > 0 || !segment->frame_end;
+        }
+        if (segment->len == 0) {
+            client->tx_head = segment->next;
+            if (!client->tx_head) {
+                client->tx_tail = NULL;
+            }
+            if (client->tx_control_tail == segment) {
+                client->tx_control_tail = NULL;
+            }
+            tx_segment_free(segment);
+        }
+    }
+}
+
+// Phần frame chunk file nằm quanh payload len byte. v1: struct cố định, payload ở giữa
+// và phần data thừa là 0. v2: payload ở cuối frame, không có suffix (NULL).
+static int file_frame_parts(const file_transfer_t* ft, int wire_version, size_t len,
+                            wire_buffer_t** prefix, wire_buffer_t** suffix) {
+    *prefix = NULL;
+    *suffix = NULL;
+    if (wire_version == WIRE_VERSION_V2) {
+        unsigned char header[WIRE_FILE_HEADER_MAX];
+        int header_len = wire_encode_file_header(ft, len, header, sizeof(header));
+        if (header_len > 0) {
+            *prefix = wire_buffer_create(header, (size_t)header_len);
+        }
+    } else {
+        legacy_file_transfer_t legacy;
+        size_t data_offset = offsetof(legacy_file_transfer_t, data);
+        legacy_from_file_transfer(ft, &legacy);
+        memset(legacy.data, 0, sizeof(legacy.data));
+        *prefix = wire_buffer_create(&legacy, data_offset);
+        *suffix = wire_buffer_create(legacy.data + len, sizeof(legacy) - data_offset - len);
+        if (!*suffix) {
+            wire_buffer_unref(*prefix);
+            *prefix = NULL;
+        }
+    }
+    return *prefix ? 0 : -1;
+}
+
+// Dựng chunk tiếp theo của file phát từ cache ngay trước đoạn cached đang ở đầu hàng đợi:
+// header dùng wire version của client, payload là vùng spool gửi bằng sendfile.
+// Phải giữ client->tx_mutex.
+static int client_expand_cached_locked(client_t* client) {
+    tx_segment_t* cached_segment = client->tx_head;
+    cached_file_t* cached = cached_segment->cached;
+    file_transfer_t* ft = &cached->header;
+
+    off_t offset = (off_t)ft->chunk_number * cached->chunk_size;
+    size_t len = ft->chunk_number == ft->total_chunks - 1 ? (size_t)(ft->file_size - offset)
+                                                            : (size_t)cached->chunk_size;
+    ft->data_size = (int)len;
+    wire_buffer_t* prefix = NULL;
+    wire_buffer_t* suffix = NULL;
+    if (file_frame_parts(ft, client->wire_version, len, &prefix, &suffix) < 0) {
+        return -1;
+    }
+
+    tx_segment_t* first = tx_segment_new(TX_SEGMENT_BUFFER);
+    first->buffer = prefix;
+    first->len = prefix->len;
+    first->lane = TX_LANE_BULK;
+    tx_segment_t* data = tx_segment_new(TX_SEGMENT_FILE);
+    spool_ref(cached->spool);
+    data->spool = cached->spool;
+    data->offset = offset;
+    data->len = len;
+    data->lane = TX_LANE_BULK;
+    first->next = data;
+    tx_segment_t* last = data;
+    if (suffix) {
+        tx_segment_t* tail = tx_segment_new(TX_SEGMENT_BUFFER);
+        tail->buffer = suffix;
+        tail->len = suffix->len;
+        tail->lane = TX_LANE_BULK;
+        data->next = tail;
+        last = tail;
+    }
+    last->frame_end = 1;
+    size_t added = prefix->len + len + (suffix ? suffix->len : 0);
+
+    // Chunk cuối: đoạn cached không còn việc, thay hẳn bằng các đoạn vừa dựng
+    ft->chunk_number++;
+    if (ft->chunk_number >= ft->total_chunks) {
+        last->next = cached_segment->next;
+        if (client->tx_tail == cached_segment) {
+            client->tx_tail = last;
+        }
+        tx_segment_free(cached_segment);
+    } else {
+        last->next = cached_segment;
+    }
+    client->tx_head = first;
+    client->tx_queued += added;
+    queue_stats_bytes((long)added, client->tx_queued);
+    count_delivered(1);
+    count_file_bytes(&g_io_stats.file_bytes_spliced, len);
+    return 0;
+}
+
+// Gửi hàng đợi cho tới khi rỗng hoặc socket đầy: 0 = rỗng, 1 = còn dữ liệu, -1 = lỗi
+static int client_drain_locked(client_t* client) {
+    // Frame đang gửi ngoài khóa phải ra socket trước, người gửi nó đánh thức lại writer
+    if (client->tx_inflight) {
+        return 0;
+    }
+    int rc = 0;
+    size_t drained = 0;
+    trace_event(TRACE_SEND_BEGIN, (uint32_t)client->client_id, client->tx_queued);
+    while (client->tx_head) {
+        if (client->tx_head->kind == TX_SEGMENT_CACHED) {
+            if (client_expand_cached_locked(client) < 0) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+        count_syscall();
+        ssize_t sent = client_send_head_locked(client);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+            break;
+        }
+        if (sent == 0) {
+            // sendfile trả 0 khi spool ngắn hơn dự kiến, không thể gửi tiếp mà giữ đúng frame
+            rc = -1;
+            break;
+        }
+        client_consume_locked(client, (size_t)sent);
+        drained += (size_t)sent;
+    }
+    trace_event(TRACE_SEND_END, (uint32_t)client->client_id, drained);
+
+    // Thoát lossy khi hàng đợi đã xuống dưới low watermark và báo client số tin bị bỏ
+    if (rc >= 0 && client->tx_lossy && client->tx_queued <= g_queue_low) {
+        client_set_lossy(client, 0);
+
+        message_t notice;
+        memset(&notice, 0, sizeof(message_t));
+        notice.type = MSG_ERROR;
+        strcpy(notice.username, "SERVER");
+        snprintf(notice.content, MAX_MESSAGE_LEN,
+                 "Kết nối chậm: %lu tin nhắn đã bị bỏ qua", client->tx_dropped);
+        client->tx_dropped = 0;
+
+        unsigned char buf[WIRE_MAX_FRAME_SIZE];
+        int len = encode_message_frame(&notice, client->wire_version, buf, sizeof(buf));
+        wire_buffer_t* buffer = len > 0 ? wire_buffer_create(buf, (size_t)len) : NULL;
+        if (buffer) {
+            tx_segment_t* segment = client_append_segment(client, TX_SEGMENT_BUFFER, TX_LANE_CONTROL);
+            segment->buffer = buffer;
+            segment->len = buffer->len;
+            client->tx_queued += buffer->len;
+            queue_stats_bytes(len, client->tx_queued);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+int client_flush_output(client_t* client) {
+    pthread_mutex_lock(&client->tx_mutex);
+    int rc = client_drain_locked(client);
+    if (rc == 0 && client->tx_armed) {
+        rc = client_set_writable_interest(client, 0);
+    }
+    pthread_mutex_unlock(&client->tx_mutex);
+    return rc;
+}
+
+// Writer thread của một client ở chế độ threaded: chờ hàng đợi có dữ liệu rồi gửi,
+// chỉ chờ socket khi không giữ tx_mutex
+static void* client_writer_loop(void* arg) {
+    client_t* client = (client_t*)arg;
+
+    pthread_mutex_lock(&client->tx_mutex);
+    while (!client->tx_closing) {
+        if (!client->tx_head || client->tx_inflight) {
+            pthread_cond_wait(&client->tx_cond, &client->tx_mutex);
+            continue;
+        }
+
+        int rc = client_drain_locked(client);
+        if (rc < 0) {
+            client_evict_locked(client);
+            break;
+        }
+        if (rc > 0) {
+            pthread_mutex_unlock(&client->tx_mutex);
+            struct pollfd pfd = { .fd = client->socket_fd, .events = POLLOUT };
+            poll(&pfd, 1, -1);
+            pthread_mutex_lock(&client->tx_mutex);
+        }
+    }
+    pthread_mutex_unlock(&client->tx_mutex);
+    return NULL;
+}
+
+int client_start_writer(client_t* client) {
+    if (pthread_create(&client->writer_thread, NULL, client_writer_loop, client) != 0) {
+        return -1;
+    }
+    client->has_writer = 1;
+    return 0;
+}
+
 void cleanup_client(client_t* client) {
     if (client) {
+        if (client->has_writer) {
+            pthread_mutex_lock(&client->tx_mutex);
+            client->tx_closing = 1;
+            pthread_cond_signal(&client->tx_cond);
+            pthread_mutex_unlock(&client->tx_mutex);
+            // Đánh thức writer nếu nó đang chờ POLLOUT
+            shutdown(client->socket_fd, SHUT_RDWR);
+            pthread_join(client->writer_thread, NULL);
+        }
+        if (client->tx_lossy) {
+            client_set_lossy(client, 0);
+        }
+        client_discard_queue_locked(client);
         close(client->socket_fd);
-        safe_free(client);
+        ringbuf_free(&client->rx);
+        ringbuf_free(&client->tx);
+        pthread_mutex_destroy(&client->tx_mutex);
+        pthread_cond_destroy(&client->tx_cond);
+        slab_free(client, sizeof(client_t));
+    }
+}
+
+// Frame lịch sử bị ghi đè được gom lại rồi trả cho EBR cả lô, tránh một lần ebr_retire
+// (khóa limbo toàn cục) cho mỗi broadcast khi ring đã đầy
+#define HISTORY_RETIRE_BATCH 32
+// Tối đa số tin phát lại một lần khi có log: ring cộng phần cũ hơn đọc từ log
+#define HISTORY_REPLAY_MAX (4 * ROOM_HISTORY_SIZE)
+
+// Log lịch sử phòng do server cài, NULL khi không lưu ra ngoài
+static const room_log_t* g_room_log = NULL;
+
+struct history_retired {
+    int count;
+    wire_buffer_t* frames[HISTORY_RETIRE_BATCH];
+};
+
+static void history_retired_free(void* ptr) {
+    struct history_retired* retired = (struct history_retired*)ptr;
+    for (int i = 0; i < retired->count; i++) {
+        wire_buffer_unref(retired->frames[i]);
     }
+    safe_free(retired);
 }
 
 void cleanup_room(room_t* room) {
     if (room) {
+        // Phòng chỉ bị giải phóng sau EBR nên không còn ai đọc lịch sử
+        for (int i = 0; i < ROOM_HISTORY_SIZE; i++) {
+            wire_buffer_unref(room->history[i].frame);
+        }
+        if (room->history_retired) {
+            history_retired_free(room->history_retired);
+        }
         pthread_mutex_destroy(&room->mutex);
-        safe_free(room);
+        free(room->members);
+        slab_free(room, sizeof(room_t));
+    }
+}
+
+// Cách encode frame cho một nhóm người nhận
+typedef enum {
+    FANOUT_V1 = 0,
+    FANOUT_V2,
+    FANOUT_V2_DEFLATE,            // v2 đã thỏa thuận WIRE_FEATURE_DEFLATE
+    FANOUT_GROUPS
+} fanout_group_t;
+
+static int fanout_group_version(int group) {
+    return group == FANOUT_V1 ? WIRE_VERSION_LEGACY : WIRE_VERSION_V2;
+}
+
+// Tính một lần khi client vào phòng và lưu trong room_member_t
+static int fanout_group_of(const client_t* client) {
+    if (client->wire_version == WIRE_VERSION_LEGACY) {
+        return FANOUT_V1;
+    }
+    if (client->wire_version == WIRE_VERSION_V2) {
+        return (client->wire_features & WIRE_FEATURE_DEFLATE) ? FANOUT_V2_DEFLATE : FANOUT_V2;
+    }
+    return -1;
+}
+
+// Thành viên trong phòng (bản chụp handle), nhóm theo cách encode để mỗi nhóm chỉ encode
+// (và nén) một lần
+typedef struct {
+    room_member_t* members[FANOUT_GROUPS];
+    int count[FANOUT_GROUPS];
+    room_member_t stack[FANOUT_GROUPS][ROOM_FDS_STACK];
+} room_fanout_t;
+
+// Phải giữ room->mutex
+static void fanout_collect(room_fanout_t* fanout, room_t* room, int exclude_client_id) {
+    int capacity = ROOM_FDS_STACK;
+    for (int g = 0; g < FANOUT_GROUPS; g++) {
+        fanout->members[g] = fanout->stack[g];
+        fanout->count[g] = 0;
+    }
+    if (room->client_count > capacity) {
+        capacity = room->client_count;
+        for (int g = 0; g < FANOUT_GROUPS; g++) {
+            fanout->members[g] = (room_member_t*)safe_malloc(sizeof(room_member_t) * (size_t)capacity);
+        }
+    }
+
+    for (int i = 0; i < room->client_count; i++) {
+        const room_member_t* member = &room->members[i];
+        if (member->client_id == exclude_client_id || member->fanout_group < 0) {
+            continue;
+        }
+        int g = member->fanout_group;
+        fanout->members[g][fanout->count[g]++] = *member;
+    }
+}
+
+// Một người nhận của lô io_uring: byte kernel đã nhận và lỗi của CQE (0 nếu không có)
+typedef struct {
+    client_t* client;
+    size_t sent;
+    int error;
+} fanout_send_t;
+
+typedef struct {
+    fanout_send_t* sends;
+    wire_buffer_t* buffer;
+} fanout_batch_t;
+
+// Chỉ ghi nhận kết quả, người gọi xử lý dưới tx_mutex của từng client sau khi cả lô xong
+static int complete_client_write(void* ctx, int index, const void* rest, size_t rest_len, int error) {
+    fanout_batch_t* batch = (fanout_batch_t*)ctx;
+    (void)rest_len;
+    batch->sends[index].sent = (size_t)((const unsigned char*)rest - batch->buffer->data);
+    batch->sends[index].error = error;
+    return 0;
+}
+
+// Kết thúc lần gửi ngoài khóa của một client. Phần kernel chưa nhận lên đầu hàng đợi;
+// io_uring lỗi mà hàng đợi rỗng thì gửi lại qua đường socket, client hỏng bị loại ở đó
+// như khi không dùng io_uring. Phải giữ client->tx_mutex.
+static int fanout_finish_send_locked(const fanout_send_t* send, wire_buffer_t* buffer, int droppable,
+                                     tx_lane_t lane) {
+    client_t* client = send->client;
+    client->tx_inflight = 0;
+    if (client->tx_evicted) {
+        return -1;
+    }
+    if (send->sent == buffer->len) {
+        // Đã đếm trong uring_send_batch. Frame xếp hàng trong lúc gửi chờ writer.
+        return client->tx_head ? client_wake_writer_locked(client) : 0;
+    }
+    int rc;
+    if (send->error && !client->tx_head) {
+        rc = client_write_buffer_locked(client, buffer, droppable, lane);
+    } else {
+        rc = client_requeue_front_locked(client, buffer, send->sent, droppable && send->sent == 0, lane);
+    }
+    if (rc == 0) {
+        count_delivered(1);
+    }
+    return rc;
+}
+
+// Gửi một frame tới nhiều client, không chờ socket của client nào. tx_mutex của mỗi client
+// chỉ được giữ trong lúc xếp hàng hoặc ghi frame cho client đó, nên broadcast vào phòng
+// lớn không chặn reactor của các thành viên. Đường io_uring đánh dấu tx_inflight rồi gửi
+// cả lô ngoài khóa: trong lúc đó output khác của client xếp hàng sau frame này.
+// Client phải xếp hàng chỉ giữ tham chiếu tới buffer, frame không bị copy lần nào nữa.
+static void fanout_deliver(const room_member_t* members, int count, wire_buffer_t* buffer, int droppable,
+                           tx_lane_t lane) {
+    io_thread_ring_t* tr = g_io_backend == IO_BACKEND_URING ? get_thread_ring() : NULL;
+    if (!tr) {
+        for (int i = 0; i < count; i++) {
+            client_t* client = members[i].client;
+            pthread_mutex_lock(&client->tx_mutex);
+            int rc = client_write_buffer_locked(client, buffer, droppable, lane);
+            pthread_mutex_unlock(&client->tx_mutex);
+            if (rc == 0) {
+                count_delivered(1);
+            }
+        }
+        return;
+    }
+
+    fanout_batch_t batch;
+    batch.buffer = buffer;
+    int fd_stack[ROOM_FDS_STACK];
+    fanout_send_t send_stack[ROOM_FDS_STACK];
+    int* socket_fds = count > ROOM_FDS_STACK ? (int*)safe_malloc(sizeof(int) * (size_t)count) : fd_stack;
+    batch.sends = count > ROOM_FDS_STACK ? (fanout_send_t*)safe_malloc(sizeof(fanout_send_t) * (size_t)count)
+                                         : send_stack;
+
+    // Client đang có output chờ thì xếp frame sau phần đó, còn lại gửi trực tiếp theo lô
+    int ready = 0;
+    for (int i = 0; i < count; i++) {
+        client_t* client = members[i].client;
+        pthread_mutex_lock(&client->tx_mutex);
+        if (client->tx_evicted) {
+            pthread_mutex_unlock(&client->tx_mutex);
+            continue;
+        }
+        if (client_tx_busy_locked(client)) {
+            int rc = client_queue_frame_locked(client, buffer, 0, droppable, lane);
+            pthread_mutex_unlock(&client->tx_mutex);
+            if (rc == 0) {
+                count_delivered(1);
+            }
+            continue;
+        }
+        client->tx_inflight = 1;
+        pthread_mutex_unlock(&client->tx_mutex);
+        batch.sends[ready].client = client;
+        batch.sends[ready].sent = buffer->len;
+        batch.sends[ready].error = 0;
+        socket_fds[ready] = members[i].socket_fd;
+        ready++;
+    }
+
+    uring_send_batch(tr, socket_fds, ready, buffer->data, buffer->len, 1, complete_client_write, &batch);
+
+    for (int i = 0; i < ready; i++) {
+        client_t* client = batch.sends[i].client;
+        pthread_mutex_lock(&client->tx_mutex);
+        fanout_finish_send_locked(&batch.sends[i], buffer, droppable, lane);
+        pthread_mutex_unlock(&client->tx_mutex);
+    }
+    if (socket_fds != fd_stack) {
+        safe_free(socket_fds);
+        safe_free(batch.sends);
+    }
+}
+
+static wire_buffer_t* encode_message_buffer(const message_t* msg, int wire_version) {
+    unsigned char buf[WIRE_MAX_FRAME_SIZE];
+    int len = encode_message_frame(msg, wire_version, buf, sizeof(buf));
+    return len > 0 ? wire_buffer_create(buf, (size_t)len) : NULL;
+}
+
+// encoded: frame đã encode sẵn cho từng nhóm (NULL = tự encode), có thể là NULL.
+// Nhóm nén nhận bản nén của frame v2, nén một lần cho cả lượt broadcast; nén không
+// có lợi thì nhận luôn frame v2. Trả về tổng byte đưa tới các người nhận.
+static size_t fanout_send_message(room_fanout_t* fanout, const message_t* msg, wire_buffer_t** encoded) {
+    size_t bytes = 0;
+    wire_buffer_t* frames[FANOUT_GROUPS] = { NULL };
+    for (int g = 0; g < FANOUT_GROUPS; g++) {
+        if (encoded && encoded[g]) {
+            frames[g] = encoded[g];
+            wire_buffer_ref(frames[g]);
+        }
+    }
+
+    for (int g = 0; g < FANOUT_GROUPS; g++) {
+        if (fanout->count[g] == 0) continue;
+        if (!frames[g] && g == FANOUT_V2_DEFLATE) {
+            if (!frames[FANOUT_V2]) {
+                frames[FANOUT_V2] = encode_message_buffer(msg, WIRE_VERSION_V2);
+            }
+            wire_buffer_t* plain = frames[FANOUT_V2];
+            if (plain) {
+                unsigned char packed[WIRE_MAX_FRAME_SIZE];
+                int len = wire_compress_frame(plain->data, plain->len, packed, sizeof(packed));
+                if (len > 0) {
+                    frames[g] = wire_buffer_create(packed, (size_t)len);
+                } else {
+                    frames[g] = plain;
+                    wire_buffer_ref(plain);
+                }
+            }
+        } else if (!frames[g]) {
+            frames[g] = encode_message_buffer(msg, fanout_group_version(g));
+        }
+        if (frames[g]) {
+            fanout_deliver(fanout->members[g], fanout->count[g], frames[g], msg->type == MSG_BROADCAST,
+                           TX_LANE_CONTROL);
+            bytes += frames[g]->len * (size_t)fanout->count[g];
+        }
+    }
+
+    for (int g = 0; g < FANOUT_GROUPS; g++) {
+        wire_buffer_unref(frames[g]);
+    }
+    return bytes;
+}
+
+static int fanout_members(const room_fanout_t* fanout) {
+    int members = 0;
+    for (int g = 0; g < FANOUT_GROUPS; g++) {
+        members += fanout->count[g];
+    }
+    return members;
+}
+
+// Chunk gửi cho nhóm g. Chunk nén chỉ đi nguyên cho nhóm đã thỏa thuận nén, nhóm khác
+// nhận bản giải nén, dựng một lần vào *plain cho cả lượt broadcast (*inflated: 0 = chưa
+// dựng, 1 = đã có, -1 = payload hỏng). NULL nếu không gửi được.
+static const file_transfer_t* fanout_chunk_for_group(int group, const file_transfer_t* ft,
+                                                     file_transfer_t* plain, int* inflated) {
+    if (!ft->compressed || group == FANOUT_V2_DEFLATE) {
+        return ft;
+    }
+    if (*inflated == 0) {
+        memcpy(plain, ft, offsetof(file_transfer_t, data));
+        plain->compressed = 0;
+        int len = decompress_buffer((const unsigned char*)ft->data, (size_t)ft->data_size,
+                                    (unsigned char*)plain->data, sizeof(plain->data));
+        plain->data_size = len;
+        *inflated = len < 0 ? -1 : 1;
+    }
+    return *inflated > 0 ? plain : NULL;
+}
+
+static void fanout_send_chunk_copy(const room_member_t* members, int count, int wire_version,
+                                   const file_transfer_t* ft) {
+    unsigned char buf[WIRE_MAX_FRAME_SIZE];
+    int len = encode_file_transfer_frame(ft, wire_version, buf, sizeof(buf));
+    wire_buffer_t* buffer = len > 0 ? wire_buffer_create(buf, (size_t)len) : NULL;
+    if (buffer) {
+        fanout_deliver(members, count, buffer, 0, TX_LANE_BULK);
+        wire_buffer_unref(buffer);
+        count_file_bytes(&g_io_stats.file_bytes_copied, (unsigned long)ft->data_size * (unsigned long)count);
+    }
+}
+
+static void fanout_send_file_chunk(room_fanout_t* fanout, const file_transfer_t* ft) {
+    file_transfer_t plain;
+    int inflated = 0;
+    for (int g = 0; g < FANOUT_GROUPS; g++) {
+        if (fanout->count[g] == 0) continue;
+        const file_transfer_t* chunk = fanout_chunk_for_group(g, ft, &plain, &inflated);
+        if (chunk) {
+            fanout_send_chunk_copy(fanout->members[g], fanout->count[g], fanout_group_version(g), chunk);
+        }
     }
 }
 
+// Gửi một chunk file có payload nằm trong spool: prefix + spool[offset, offset + len) + suffix.
+// Payload đi thẳng từ page cache của memfd vào socket bằng sendfile, phần kernel chưa nhận
+// được xếp vào hàng đợi theo đúng thứ tự. suffix có thể NULL. Phải giữ client->tx_mutex.
+static int client_write_file_locked(client_t* client, wire_buffer_t* prefix, file_spool_t* spool,
+                                    off_t offset, size_t len, wire_buffer_t* suffix) {
+    if (client->tx_evicted) {
+        return -1;
+    }
+
+    size_t suffix_len = suffix ? suffix->len : 0;
+    size_t prefix_sent = 0;
+    size_t data_sent = 0;
+    size_t suffix_sent = 0;
+    if (!client_tx_busy_locked(client)) {
+        trace_event(TRACE_SEND_BEGIN, (uint32_t)client->client_id, prefix->len + len + suffix_len);
+        prefix_sent = send_nowait(client->socket_fd, prefix->data, prefix->len, MSG_MORE);
+        while (prefix_sent == prefix->len && data_sent < len) {
+            off_t pos = offset + (off_t)data_sent;
+            count_syscall();
+            ssize_t sent = sendfile(client->socket_fd, spool->fd, &pos, len - data_sent);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                break;
+            }
+            data_sent += (size_t)sent;
+        }
+        if (data_sent == len && suffix) {
+            suffix_sent = send_nowait(client->socket_fd, suffix->data, suffix_len, 0);
+        }
+        trace_event(TRACE_SEND_END, (uint32_t)client->client_id, prefix_sent + data_sent + suffix_sent);
+    }
+
+    if (prefix_sent < prefix->len &&
+        client_queue_buffer_locked(client, prefix, prefix_sent, prefix->len - prefix_sent, 0,
+                                   TX_LANE_BULK) < 0) {
+        return -1;
+    }
+    if (data_sent < len &&
+        client_queue_file_locked(client, spool, offset + (off_t)data_sent, len - data_sent) < 0) {
+        return -1;
+    }
+    if (suffix_sent < suffix_len &&
+        client_queue_buffer_locked(client, suffix, suffix_sent, suffix_len - suffix_sent, 0,
+                                   TX_LANE_BULK) < 0) {
+        return -1;
+    }
+    if (suffix_sent < suffix_len || data_sent < len || prefix_sent < prefix->len) {
+        client_bulk_queued_locked(client, prefix_sent > 0);
+    }
+    return 0;
+}
+
+static void fanout_send_file_range(room_fanout_t* fanout, const file_transfer_t* ft,
+                                   file_spool_t* spool, off_t offset) {
+    size_t len = (size_t)ft->data_size;
+    file_transfer_t* packed = NULL;
+    file_transfer_t plain;
+    int inflated = 0;
+    for (int g = 0; g < FANOUT_GROUPS; g++) {
+        if (fanout->count[g] == 0) continue;
+
+        // Chunk nén cho người nhận không hiểu nén: đọc payload khỏi spool một lần,
+        // giải nén rồi gửi theo đường copy
+        if (ft->compressed && g != FANOUT_V2_DEFLATE) {
+            if (!packed) {
+                packed = (file_transfer_t*)safe_malloc(sizeof(file_transfer_t));
+                *packed = *ft;
+                if (spool_read(spool, offset, packed->data, len) < 0) {
+                    inflated = -1;
+                }
+            }
+            const file_transfer_t* chunk = fanout_chunk_for_group(g, packed, &plain, &inflated);
+            if (chunk) {
+                fanout_send_chunk_copy(fanout->members[g], fanout->count[g], fanout_group_version(g), chunk);
+            }
+            continue;
+        }
+
+        // Phần đầu/đuôi frame encode một lần và dùng chung cho mọi người nhận cùng nhóm
+        wire_buffer_t* prefix = NULL;
+        wire_buffer_t* suffix = NULL;
+        if (file_frame_parts(ft, fanout_group_version(g), len, &prefix, &suffix) < 0) continue;
+
+        for (int i = 0; i < fanout->count[g]; i++) {
+            client_t* client = fanout->members[g][i].client;
+            pthread_mutex_lock(&client->tx_mutex);
+            int rc = client_write_file_locked(client, prefix, spool, offset, len, suffix);
+            pthread_mutex_unlock(&client->tx_mutex);
+            if (rc == 0) {
+                count_delivered(1);
+                count_file_bytes(&g_io_stats.file_bytes_spliced, len);
+            }
+        }
+        wire_buffer_unref(prefix);
+        wire_buffer_unref(suffix);
+    }
+    safe_free(packed);
+}
+
+static void fanout_release(room_fanout_t* fanout) {
+    for (int g = 0; g < FANOUT_GROUPS; g++) {
+        if (fanout->members[g] != fanout->stack[g]) {
+            safe_free(fanout->members[g]);
+        }
+    }
+}
+
+int send_to_client(client_t* client, const message_t* msg) {
+    unsigned char buf[WIRE_MAX_FRAME_SIZE];
+    int len = encode_message_frame(msg, client->wire_version, buf, sizeof(buf));
+    if (len < 0) {
+        return -1;
+    }
+    return client_send_frame(client, buf, (size_t)len);
+}
+
 // Encryption helper functions
-void send_room_key_to_client(int client_socket, room_t* room) {
-    message_t key_msg;
-    memset(&key_msg, 0, sizeof(message_t));
+static void build_room_key_message(message_t* key_msg, room_t* room) {
+    memset(key_msg, 0, sizeof(message_t));
     
-    key_msg.type = MSG_ROOM_KEY;
-    key_msg.room_id = room->room_id;
-    strcpy(key_msg.username, "SERVER");
+    key_msg->type = MSG_ROOM_KEY;
+    key_msg->room_id = room->room_id;
+    strcpy(key_msg->username, "SERVER");
     
     // Chuyển key và IV sang hex
-    key_to_hex(room->crypto.key, AES_KEY_SIZE, key_msg.room_key_hex);
-    key_to_hex(room->crypto.iv, AES_IV_SIZE, key_msg.room_iv_hex);
-    
-    send_message(client_socket, &key_msg);
+    key_to_hex(room->crypto.key, AES_KEY_SIZE, key_msg->room_key_hex);
+    key_to_hex(room->crypto.iv, AES_IV_SIZE, key_msg->room_iv_hex);
+    key_msg->is_encrypted = room->crypto.cipher;
+}
+
+void send_room_key_to_client(client_t* client, room_t* room) {
+    message_t key_msg;
+    build_room_key_message(&key_msg, room);
+    send_to_client(client, &key_msg);
 }
 
 int encrypt_message_content(message_t* msg, const room_crypto_t* crypto) {
     int plaintext_len = strlen(msg->content);
-    
-    int encrypted_len = encrypt_message(
-        (unsigned char*)msg->content, 
-        plaintext_len,
-        crypto->key, 
-        crypto->iv, 
-        msg->encrypted_content
-    );
+    int encrypted_len;
+    unsigned long start = metrics_now_ns();
+
+    if (crypto->cipher == ROOM_CIPHER_GCM) {
+        cipher_batch_item_t item = { (unsigned char*)msg->content, plaintext_len, msg->encrypted_content, -1 };
+        gcm_encrypt_batch(crypto->key, &item, 1);
+        encrypted_len = item.out_len;
+    } else {
+        encrypted_len = encrypt_message(
+            (unsigned char*)msg->content, 
+            plaintext_len,
+            crypto->key, 
+            crypto->iv, 
+            msg->encrypted_content
+        );
+    }
     
     if (encrypted_len < 0) {
         return -1;
     }
+    metrics_record(METRIC_CRYPTO_NS, metrics_now_ns() - start);
+    metrics_add(METRIC_CRYPTO_BYTES, (unsigned long)plaintext_len);
     
     msg->encrypted_len = encrypted_len;
-    msg->is_encrypted = 1;
+    msg->is_encrypted = crypto->cipher == ROOM_CIPHER_GCM ? ROOM_CIPHER_GCM : ROOM_CIPHER_CBC;
     
     // Xóa plaintext
     memset(msg->content, 0, MAX_MESSAGE_LEN);
@@ -167,47 +1768,125 @@ int encrypt_message_content(message_t* msg, const room_crypto_t* crypto) {
     return 0;
 }
 
+// Plaintext đã giải mã vào content, cắt nếu dài quá
+static void set_decrypted_content(message_t* msg, const unsigned char* plaintext, int plaintext_len) {
+    if (plaintext_len > MAX_MESSAGE_LEN - 1) {
+        plaintext_len = MAX_MESSAGE_LEN - 1;
+    }
+    memcpy(msg->content, plaintext, (size_t)plaintext_len);
+    msg->content[plaintext_len] = '\0';
+}
+
 int decrypt_message_content(message_t* msg, const room_crypto_t* crypto) {
-    unsigned char plaintext[MAX_MESSAGE_LEN];
-    
-    int plaintext_len = decrypt_message(
-        msg->encrypted_content, 
-        msg->encrypted_len,
-        crypto->key, 
-        crypto->iv, 
-        plaintext
-    );
-    
-    if (plaintext_len < 0) {
-        return -1;
+    int result;
+    decrypt_message_content_batch(msg, 1, crypto, &result);
+    return result;
+}
+
+int decrypt_message_content_batch(message_t* msgs, int count, const room_crypto_t* crypto, int* results) {
+    cipher_batch_item_t items[MESSAGE_BATCH_MAX];
+    unsigned char plaintext[MESSAGE_BATCH_MAX][MAX_ENCRYPTED_LEN];
+    unsigned char cbc_plaintext[MAX_ENCRYPTED_LEN];
+    int gcm_index[MESSAGE_BATCH_MAX];
+    int ok = 0;
+    unsigned long bytes = 0;
+    unsigned long start = metrics_now_ns();
+
+    for (int base = 0; base < count; base += MESSAGE_BATCH_MAX) {
+        int n = count - base < MESSAGE_BATCH_MAX ? count - base : MESSAGE_BATCH_MAX;
+        int gcm_count = 0;
+
+        // Tin CBC giải mã từng cái, tin GCM gom lại giải mã một lượt
+        for (int i = 0; i < n; i++) {
+            message_t* msg = &msgs[base + i];
+            bytes += (unsigned long)msg->encrypted_len;
+            if (msg->is_encrypted == ROOM_CIPHER_GCM) {
+                items[gcm_count].in = msg->encrypted_content;
+                items[gcm_count].in_len = msg->encrypted_len;
+                items[gcm_count].out = plaintext[gcm_count];
+                gcm_index[gcm_count++] = base + i;
+                continue;
+            }
+            int plaintext_len = decrypt_message(msg->encrypted_content, msg->encrypted_len,
+                                                crypto->key, crypto->iv, cbc_plaintext);
+            results[base + i] = plaintext_len < 0 ? -1 : 0;
+            if (plaintext_len >= 0) {
+                set_decrypted_content(msg, cbc_plaintext, plaintext_len);
+                ok++;
+            }
+        }
+
+        if (gcm_count > 0) {
+            gcm_decrypt_batch(crypto->key, items, gcm_count);
+            for (int i = 0; i < gcm_count; i++) {
+                results[gcm_index[i]] = items[i].out_len < 0 ? -1 : 0;
+                if (items[i].out_len >= 0) {
+                    set_decrypted_content(&msgs[gcm_index[i]], items[i].out, items[i].out_len);
+                    ok++;
+                }
+            }
+        }
     }
-    
-    plaintext[plaintext_len] = '\0';
-    strncpy(msg->content, (char*)plaintext, MAX_MESSAGE_LEN - 1);
-    msg->content[MAX_MESSAGE_LEN - 1] = '\0';
-    
-    return 0;
+    metrics_record(METRIC_CRYPTO_NS, metrics_now_ns() - start);
+    metrics_add(METRIC_CRYPTO_BYTES, bytes);
+    return ok;
+}
+
+// Khóa của phòng và của bảng phòng, kèm sự kiện trace (thời gian chờ khóa tính bằng tick)
+static void room_lock(room_t* room) {
+    if (!trace_enabled()) {
+        pthread_mutex_lock(&room->mutex);
+        return;
+    }
+    uint64_t start = trace_ticks();
+    pthread_mutex_lock(&room->mutex);
+    trace_record(TRACE_ROOM_LOCKED, (uint32_t)room->room_id, trace_ticks() - start);
+}
+
+static void room_unlock(room_t* room) {
+    trace_event(TRACE_ROOM_UNLOCKED, (uint32_t)room->room_id, 0);
+    pthread_mutex_unlock(&room->mutex);
+}
+
+static void rooms_lock(server_t* server) {
+    if (!trace_enabled()) {
+        pthread_mutex_lock(&server->rooms_mutex);
+        return;
+    }
+    uint64_t start = trace_ticks();
+    pthread_mutex_lock(&server->rooms_mutex);
+    trace_record(TRACE_ROOMS_LOCKED, 0, trace_ticks() - start);
+}
+
+static void rooms_unlock(server_t* server) {
+    trace_event(TRACE_ROOMS_UNLOCKED, 0, 0);
+    pthread_mutex_unlock(&server->rooms_mutex);
 }
 
-void enable_room_encryption(server_t* server, room_t* room) {
+void enable_room_encryption(server_t* server, room_t* room, room_cipher_t cipher) {
     (void)server;
-    pthread_mutex_lock(&room->mutex);
+    room_lock(room);
     
     if (room->encryption_enabled) {
-        pthread_mutex_unlock(&room->mutex);
+        room_unlock(room);
         return;
     }
     
     // Tạo key và IV cho room
-    generate_room_key(&room->crypto);
+    generate_room_key(&room->crypto, cipher);
     room->encryption_enabled = 1;
+    // Sau khi khởi động lại key không còn, phòng mã hóa không được khôi phục
+    if (g_room_log) {
+        g_room_log->dropped(room);
+    }
     
+    room_fanout_t fanout;
+    fanout_collect(&fanout, room, -1);
+
     // Gửi key cho tất cả client trong room
-    client_t* current = room->clients;
-    while (current) {
-        send_room_key_to_client(current->socket_fd, room);
-        current = current->next;
-    }
+    message_t key_msg;
+    build_room_key_message(&key_msg, room);
+    fanout_send_message(&fanout, &key_msg, NULL);
     
     // Thông báo cho tất cả client
     message_t notify;
@@ -216,135 +1895,726 @@ void enable_room_encryption(server_t* server, room_t* room) {
     strcpy(notify.username, "SERVER");
     strcpy(notify.content, "Mã hóa đã được bật cho phòng này");
     notify.room_id = room->room_id;
+    fanout_send_message(&fanout, &notify, NULL);
     
-    current = room->clients;
-    while (current) {
-        send_message(current->socket_fd, &notify);
-        current = current->next;
+    room_unlock(room);
+
+    fanout_release(&fanout);
+}
+
+static void destroy_room(void* room) {
+    cleanup_room((room_t*)room);
+}
+
+static room_table_t* room_table_create(size_t capacity) {
+    room_table_t* table = (room_table_t*)calloc(1, sizeof(room_table_t) + capacity * sizeof(room_slot_t));
+    if (!table) {
+        error_exit("Memory allocation failed");
     }
-    
-    pthread_mutex_unlock(&room->mutex);
+    table->capacity = capacity;
+    return table;
+}
+
+static size_t room_slot_index(int room_id, size_t capacity) {
+    // Băm nhân để room_id liên tiếp không dồn thành cụm khi có ô đã xóa
+    return ((uint32_t)room_id * 2654435761u) & (capacity - 1);
+}
+
+// Tra không khóa: đọc key trước rồi mới đọc room. Ô có thể vừa bị xóa rồi dùng lại
+// cho phòng khác giữa hai lần đọc nên phải so lại room_id (room vẫn hợp lệ nhờ EBR).
+static room_t* room_table_lookup(const room_table_t* table, int room_id) {
+    size_t mask = table->capacity - 1;
+    size_t index = room_slot_index(room_id, table->capacity);
+    for (size_t probes = 0; probes < table->capacity; probes++) {
+        const room_slot_t* slot = &table->slots[index];
+        int key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (key == ROOM_SLOT_EMPTY) {
+            return NULL;
+        }
+        if (key == room_id) {
+            room_t* room = __atomic_load_n(&slot->room, __ATOMIC_ACQUIRE);
+            if (room && room->room_id == room_id) {
+                return room;
+            }
+        }
+        index = (index + 1) & mask;
+    }
+    return NULL;
+}
+
+// Phải giữ rooms_mutex. Bảng luôn còn ô trống nhờ room_table_reserve_locked.
+static void room_table_place(room_table_t* table, room_t* room) {
+    size_t mask = table->capacity - 1;
+    size_t index = room_slot_index(room->room_id, table->capacity);
+    while (table->slots[index].key > 0) {
+        index = (index + 1) & mask;
+    }
+    room_slot_t* slot = &table->slots[index];
+    if (slot->key == ROOM_SLOT_EMPTY) {
+        table->used++;
+    }
+    table->live++;
+    __atomic_store_n(&slot->room, room, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->key, room->room_id, __ATOMIC_RELEASE);
+}
+
+// Giữ tải (kể cả ô đã xóa) dưới 3/4. Khi vượt thì dựng bảng mới chỉ với các phòng còn sống,
+// công bố bằng một atomic store và trả bảng cũ cho EBR vì reader có thể vẫn đang dò trong đó.
+static void room_table_reserve_locked(server_t* server) {
+    room_table_t* table = server->rooms;
+    if ((table->used + 1) * 4 <= table->capacity * 3) {
+        return;
+    }
+
+    size_t capacity = ROOM_TABLE_MIN;
+    while (capacity < (table->live + 1) * 2) {
+        capacity <<= 1;
+    }
+    room_table_t* fresh = room_table_create(capacity);
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].key > 0) {
+            room_table_place(fresh, table->slots[i].room);
+        }
+    }
+    __atomic_store_n(&server->rooms, fresh, __ATOMIC_RELEASE);
+    ebr_retire(table, free);
+}
+
+// Gỡ phòng khỏi bảng rồi giải phóng khi không còn reader nào giữ con trỏ.
+// Gọi sau khi đã đánh dấu room->deleted nên không ai thêm thành viên được nữa.
+static void delete_room(server_t* server, room_t* room) {
+    rooms_lock(server);
+    room_table_t* table = server->rooms;
+    size_t mask = table->capacity - 1;
+    size_t index = room_slot_index(room->room_id, table->capacity);
+    for (size_t probes = 0; probes < table->capacity; probes++) {
+        room_slot_t* slot = &table->slots[index];
+        if (slot->key == ROOM_SLOT_EMPTY) {
+            break;
+        }
+        if (slot->key == room->room_id && slot->room == room) {
+            __atomic_store_n(&slot->key, ROOM_SLOT_DELETED, __ATOMIC_RELEASE);
+            table->live--;
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+    rooms_unlock(server);
+
+    if (g_room_log) {
+        g_room_log->dropped(room);
+    }
+    ebr_retire(room, destroy_room);
 }
 
 // Thread-safe room management functions
-void add_client_to_room(server_t* server, int room_id, client_t* client) {
+int add_client_to_room(server_t* server, int room_id, client_t* client) {
+    ebr_enter();
     room_t* room = find_room(server, room_id);
-    if (!room) return;
+    if (!room) {
+        ebr_exit();
+        return -1;
+    }
 
-    pthread_mutex_lock(&room->mutex);
+    room_lock(room);
 
-    // Add client to room's client list
-    
-    client->next = room->clients;
-    room->clients = client;
-    room->client_count++;
+    // Thành viên cuối vừa rời đi và phòng đang bị xóa
+    if (room->deleted) {
+        room_unlock(room);
+        ebr_exit();
+        return -1;
+    }
+
+    if (room->client_count == room->member_capacity) {
+        int capacity = room->member_capacity ? room->member_capacity * 2 : ROOM_MEMBERS_MIN;
+        room_member_t* members = (room_member_t*)realloc(room->members, sizeof(room_member_t) * (size_t)capacity);
+        if (!members) {
+            room_unlock(room);
+            ebr_exit();
+            return -1;
+        }
+        room->members = members;
+        room->member_capacity = capacity;
+    }
+
+    room_member_t* member = &room->members[room->client_count];
+    member->socket_fd = client->socket_fd;
+    member->client_id = client->client_id;
+    member->fanout_group = fanout_group_of(client);
+    member->client = client;
+    client->room_index = room->client_count++;
     client->current_room_id = room_id;
 
-    pthread_mutex_unlock(&room->mutex);
+    room_unlock(room);
+    ebr_exit();
+    return 0;
 }
 
 void remove_client_from_room(server_t* server, int room_id, client_t* client) {
+    ebr_enter();
     room_t* room = find_room(server, room_id);
-    if (!room) return;
+    if (!room) {
+        ebr_exit();
+        return;
+    }
 
-    pthread_mutex_lock(&room->mutex);
+    room_lock(room);
 
-    // Remove client from room's client list
-    
-    if (room->clients == client) {
-        room->clients = client->next;
-    } else {
-        client_t* current = room->clients;
-        while (current && current->next != client) {
-            current = current->next;
+    // Thành viên cuối lấp vào chỗ trống, không cần duyệt danh sách
+    int index = client->room_index;
+    if (index < 0 || index >= room->client_count || room->members[index].client != client) {
+        room_unlock(room);
+        ebr_exit();
+        return;
+    }
+    room->members[index] = room->members[--room->client_count];
+    room->members[index].client->room_index = index;
+    client->room_index = -1;
+    client->current_room_id = -1;
+    int empty = room->client_count == 0;
+    if (empty) {
+        room->deleted = 1;
+    }
+
+    room_unlock(room);
+
+    if (empty) {
+        delete_room(server, room);
+    }
+    ebr_exit();
+}
+
+// Gán seq cho broadcast và lưu frame v2 của nó vào ring. Phải giữ room->mutex.
+// Trả về frame (tham chiếu của người gọi) để fan-out v2 dùng lại, NULL nếu lỗi.
+static wire_buffer_t* room_history_append(room_t* room, message_t* msg) {
+    unsigned char buf[WIRE_MAX_FRAME_SIZE];
+    msg->history_seq = room->history_seq + 1;
+    int len = encode_message_frame(msg, WIRE_VERSION_V2, buf, sizeof(buf));
+    wire_buffer_t* frame = len > 0 ? wire_buffer_create(buf, (size_t)len) : NULL;
+    if (!frame) {
+        msg->history_seq = 0;
+        return NULL;
+    }
+
+    // Reader thấy seq = 0 hoặc seq mới thì biết frame đọc được không còn thuộc seq cũ
+    room_history_slot_t* slot = &room->history[msg->history_seq & (ROOM_HISTORY_SIZE - 1)];
+    wire_buffer_t* old = slot->frame;
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_SEQ_CST);
+    wire_buffer_ref(frame);
+    __atomic_store_n(&slot->frame, frame, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&slot->seq, msg->history_seq, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&room->history_seq, msg->history_seq, __ATOMIC_RELEASE);
+    // Phòng mã hóa chỉ giữ ciphertext trong ring, key không được lưu nên log bỏ qua
+    if (g_room_log && !room->encryption_enabled) {
+        g_room_log->appended(room, msg->history_seq, msg->timestamp, frame);
+    }
+
+    if (old) {
+        struct history_retired* retired = room->history_retired;
+        if (!retired) {
+            retired = (struct history_retired*)safe_malloc(sizeof(struct history_retired));
+            retired->count = 0;
+            room->history_retired = retired;
         }
-        if (current) {
-            current->next = client->next;
+        retired->frames[retired->count++] = old;
+        if (retired->count == HISTORY_RETIRE_BATCH) {
+            ebr_retire(retired, history_retired_free);
+            room->history_retired = NULL;
         }
     }
-    room->client_count--;
-    client->current_room_id = -1;
+    return frame;
+}
 
-    pthread_mutex_unlock(&room->mutex);
+// Frame của seq nếu slot vẫn giữ đúng seq đó, kèm một tham chiếu. Phải ở trong ebr_enter.
+static wire_buffer_t* room_history_get(room_t* room, long seq) {
+    room_history_slot_t* slot = &room->history[seq & (ROOM_HISTORY_SIZE - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != seq) {
+        return NULL;
+    }
+    wire_buffer_t* frame = __atomic_load_n(&slot->frame, __ATOMIC_SEQ_CST);
+    if (!frame || __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != seq) {
+        return NULL;
+    }
+    // Frame bị ghi đè sau lần kiểm tra vẫn chưa bị giải phóng vì đang trong EBR
+    wire_buffer_ref(frame);
+    return frame;
+}
+
+static size_t history_append_frame(unsigned char** out, size_t* cap, size_t used,
+                                   const unsigned char* frame, size_t len) {
+    if (used + len > *cap) {
+        size_t grown = *cap * 2 > used + len ? *cap * 2 : used + len;
+        unsigned char* bigger = (unsigned char*)safe_malloc(grown);
+        memcpy(bigger, *out, used);
+        safe_free(*out);
+        *out = bigger;
+        *cap = grown;
+    }
+    memcpy(*out + used, frame, len);
+    return used + len;
+}
+
+static size_t history_append_marker(unsigned char** out, size_t* cap, size_t used, int wire_version,
+                                    message_type_t type, const room_t* room, long seq, int count) {
+    message_t marker;
+    memset(&marker, 0, sizeof(message_t));
+    marker.type = type;
+    strcpy(marker.username, "SERVER");
+    snprintf(marker.content, MAX_MESSAGE_LEN, "%d tin nhắn trước đó của phòng %s", count, room->room_name);
+    marker.room_id = room->room_id;
+    marker.history_seq = seq;
+
+    unsigned char buf[WIRE_MAX_FRAME_SIZE];
+    int len = encode_message_frame(&marker, wire_version, buf, sizeof(buf));
+    return len > 0 ? history_append_frame(out, cap, used, buf, (size_t)len) : used;
+}
+
+void room_set_log(const room_log_t* log) {
+    g_room_log = log;
+}
+
+void room_history_restore(room_t* room, long seq, const unsigned char* frame, size_t len) {
+    room_history_slot_t* slot = &room->history[seq & (ROOM_HISTORY_SIZE - 1)];
+    if (seq <= slot->seq || seq > room->history_seq) {
+        return;
+    }
+    wire_buffer_t* buffer = wire_buffer_create(frame, len);
+    if (!buffer) {
+        return;
+    }
+    // Chưa có reader nào nên không cần thứ tự ghi như room_history_append
+    wire_buffer_unref(slot->frame);
+    slot->frame = buffer;
+    slot->seq = seq;
+}
+
+// Các tin đọc từ log cho phần cũ hơn ring, chỉ giữ đoạn liền nhau kết thúc ở last
+typedef struct {
+    wire_buffer_t** frames;
+    int count;
+    int capacity;
+    long next_seq;
+} history_log_read_t;
+
+static int history_collect(void* arg, long seq, const unsigned char* frame, size_t len) {
+    history_log_read_t* read = (history_log_read_t*)arg;
+    if (read->count > 0 && seq != read->next_seq) {
+        // Thiếu tin ở giữa (chưa ghi xuống log): bỏ đoạn trước chỗ thiếu
+        for (int i = 0; i < read->count; i++) {
+            wire_buffer_unref(read->frames[i]);
+        }
+        read->count = 0;
+    }
+    if (read->count == read->capacity) {
+        return 1;
+    }
+    wire_buffer_t* buffer = wire_buffer_create(frame, len);
+    if (!buffer) {
+        return 1;
+    }
+    read->frames[read->count++] = buffer;
+    read->next_seq = seq + 1;
+    return 0;
+}
+
+int replay_room_history(client_t* client, room_t* room, long since) {
+    long head = __atomic_load_n(&room->history_seq, __ATOMIC_ACQUIRE);
+    long first = head - (g_room_log ? HISTORY_REPLAY_MAX : ROOM_HISTORY_SIZE) + 1;
+    if (first <= since) {
+        first = since + 1;
+    }
+    if (first < 1) {
+        first = 1;
+    }
+    if (first > head) {
+        return 0;
+    }
+
+    // Lấy tham chiếu tới các frame còn trong ring, từ mới về cũ cho tới khi hết ngân sách:
+    // lịch sử không được đẩy hàng đợi của người mới vào qua high watermark
+    wire_buffer_t* frames[HISTORY_REPLAY_MAX];
+    int count = 0;
+    size_t budget = g_queue_high / 2;
+    size_t total = 0;
+    int full = 0;
+    long seq;
+    for (seq = head; seq >= first; seq--) {
+        wire_buffer_t* frame = room_history_get(room, seq);
+        if (!frame) {
+            break;
+        }
+        size_t len = client->wire_version == WIRE_VERSION_V2 ? frame->len : sizeof(legacy_message_t);
+        if (total + len > budget) {
+            wire_buffer_unref(frame);
+            full = 1;
+            break;
+        }
+        total += len;
+        frames[count++] = frame;
+    }
+
+    // Người gọi cần tin cũ hơn những gì ring còn giữ: đọc tiếp từ log, vẫn từ mới về cũ
+    if (!full && seq >= first && g_room_log) {
+        history_log_read_t read;
+        read.capacity = HISTORY_REPLAY_MAX - count;
+        read.frames = (wire_buffer_t**)safe_malloc(sizeof(wire_buffer_t*) * (size_t)read.capacity);
+        read.count = 0;
+        read.next_seq = 0;
+        g_room_log->read(room->room_id, seq - read.capacity + 1 > first ? seq - read.capacity + 1 : first,
+                         seq, history_collect, &read);
+        int i = read.count - 1;
+        if (read.count > 0 && read.next_seq == seq + 1) {
+            for (; i >= 0; i--) {
+                size_t len = client->wire_version == WIRE_VERSION_V2 ? read.frames[i]->len
+                                                                     : sizeof(legacy_message_t);
+                if (total + len > budget) {
+                    break;
+                }
+                total += len;
+                frames[count++] = read.frames[i];
+            }
+        }
+        for (; i >= 0; i--) {
+            wire_buffer_unref(read.frames[i]);
+        }
+        safe_free(read.frames);
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // Ghép cả lịch sử thành một buffer để gửi bằng một lần ghi. Client v1 không hiểu
+    // BEGIN/END nên chỉ nhận các tin, frame được chuyển sang layout v1.
+    int v2 = client->wire_version == WIRE_VERSION_V2;
+    size_t cap = total + (v2 ? 2 * WIRE_MAX_FRAME_SIZE : 0);
+    unsigned char* out = (unsigned char*)safe_malloc(cap);
+    size_t used = 0;
+    if (v2) {
+        used = history_append_marker(&out, &cap, used, WIRE_VERSION_V2, MSG_HISTORY_BEGIN, room,
+                                     head - count, count);
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        if (v2) {
+            used = history_append_frame(&out, &cap, used, frames[i]->data, frames[i]->len);
+        } else {
+            message_t msg;
+            unsigned char buf[WIRE_MAX_FRAME_SIZE];
+            int len = -1;
+            if (wire_decode_message(frames[i]->data, frames[i]->len, &msg) == 0) {
+                len = encode_message_frame(&msg, client->wire_version, buf, sizeof(buf));
+            }
+            if (len > 0) {
+                used = history_append_frame(&out, &cap, used, buf, (size_t)len);
+            }
+        }
+        wire_buffer_unref(frames[i]);
+    }
+    if (v2) {
+        used = history_append_marker(&out, &cap, used, WIRE_VERSION_V2, MSG_HISTORY_END, room, head, count);
+    }
+
+    wire_buffer_t* buffer = wire_buffer_create(out, used);
+    safe_free(out);
+    if (!buffer) {
+        return 0;
+    }
+    pthread_mutex_lock(&client->tx_mutex);
+    int rc = client_write_buffer_locked(client, buffer, 0, TX_LANE_CONTROL);
+    pthread_mutex_unlock(&client->tx_mutex);
+    wire_buffer_unref(buffer);
+    if (rc < 0) {
+        return 0;
+    }
+    count_delivered((unsigned long)count);
+    return count;
 }
 
 void broadcast_to_room(server_t* server, int room_id, message_t* msg, int exclude_client_id) {
+    ebr_enter();
+    room_t* room = find_room(server, room_id);
+    if (!room) {
+        ebr_exit();
+        return;
+    }
+
+    room_lock(room);
+
+    room_fanout_t fanout;
+    fanout_collect(&fanout, room, exclude_client_id);
+    wire_buffer_t* encoded[FANOUT_GROUPS] = { NULL };
+    // Chỉ lưu tin chat của thành viên, thông báo vào/rời phòng của server thì không
+    if (msg->type == MSG_BROADCAST && msg->client_id > 0) {
+        encoded[FANOUT_V2] = room_history_append(room, msg);
+    }
+    size_t bytes = fanout_send_message(&fanout, msg, encoded);
+    wire_buffer_unref(encoded[FANOUT_V2]);
+
+    room_unlock(room);
+    ebr_exit();
+
+    metrics_add(METRIC_BROADCASTS, 1);
+    metrics_record(METRIC_BROADCAST_MEMBERS, (unsigned long)fanout_members(&fanout));
+    metrics_record(METRIC_BROADCAST_BYTES, bytes);
+    metrics_record_since_received(METRIC_FANOUT_LATENCY_NS);
+    fanout_release(&fanout);
+}
+
+// Chunk file vừa relay xong tới cả phòng
+static void count_file_chunk(const file_transfer_t* ft) {
+    trace_event(TRACE_FILE_CHUNK, (uint32_t)ft->chunk_number, (uint64_t)ft->data_size);
+    metrics_add(METRIC_FILE_CHUNKS, 1);
+    metrics_add(METRIC_FILE_BYTES_IN, (unsigned long)ft->data_size);
+    metrics_record_since_received(METRIC_FILE_CHUNK_NS);
+}
+
+void broadcast_file_chunk_to_room(server_t* server, int room_id, file_transfer_t* ft, int exclude_client_id) {
+    ebr_enter();
     room_t* room = find_room(server, room_id);
-    if (!room) return;
+    if (!room) {
+        ebr_exit();
+        return;
+    }
 
-    pthread_mutex_lock(&room->mutex);
+    room_lock(room);
+
+    room_fanout_t fanout;
+    fanout_collect(&fanout, room, exclude_client_id);
+    fanout_send_file_chunk(&fanout, ft);
+
+    room_unlock(room);
+    ebr_exit();
+
+    count_file_chunk(ft);
+    fanout_release(&fanout);
+}
+
+void broadcast_file_range_to_room(server_t* server, int room_id, const file_transfer_t* ft,
+                                  file_spool_t* spool, off_t offset, int exclude_client_id) {
+    ebr_enter();
+    room_t* room = find_room(server, room_id);
+    if (!room) {
+        ebr_exit();
+        return;
+    }
+
+    room_lock(room);
+
+    room_fanout_t fanout;
+    fanout_collect(&fanout, room, exclude_client_id);
+    fanout_send_file_range(&fanout, ft, spool, offset);
+
+    room_unlock(room);
+    ebr_exit();
 
-    client_t* current = room->clients;
-    while (current) {
-        if (current->client_id != exclude_client_id) {
-            send_message(current->socket_fd, msg);
+    count_file_chunk(ft);
+    fanout_release(&fanout);
+}
+
+// Phát lại một file trong cache: mỗi người nhận chỉ giữ một đoạn CACHED trỏ tới spool,
+// chunk được dựng dần khi đoạn trước gửi xong nên hàng đợi không phình theo kích thước file.
+void broadcast_cached_file_to_room(server_t* server, int room_id, const file_transfer_t* header,
+                                   file_spool_t* spool, int chunk_size, int exclude_client_id) {
+    ebr_enter();
+    room_t* room = find_room(server, room_id);
+    if (!room) {
+        ebr_exit();
+        return;
+    }
+
+    room_lock(room);
+
+    room_fanout_t fanout;
+    fanout_collect(&fanout, room, exclude_client_id);
+    for (int g = 0; g < FANOUT_GROUPS; g++) {
+        for (int i = 0; i < fanout.count[g]; i++) {
+            client_t* client = fanout.members[g][i].client;
+            cached_file_t* cached = (cached_file_t*)slab_alloc(sizeof(cached_file_t));
+            if (!cached) {
+                continue;
+            }
+            spool_ref(spool);
+            cached->spool = spool;
+            cached->header = *header;
+            cached->header.chunk_number = 0;
+            cached->chunk_size = chunk_size;
+
+            pthread_mutex_lock(&client->tx_mutex);
+            if (client->tx_evicted) {
+                pthread_mutex_unlock(&client->tx_mutex);
+                spool_unref(spool);
+                slab_free(cached, sizeof(cached_file_t));
+                continue;
+            }
+            tx_segment_t* segment = client_append_segment(client, TX_SEGMENT_CACHED, TX_LANE_BULK);
+            segment->cached = cached;
+            client_queue_added_locked(client, 0);
+            pthread_mutex_unlock(&client->tx_mutex);
         }
-        current = current->next;
     }
 
-    pthread_mutex_unlock(&room->mutex);
+    room_unlock(room);
+    ebr_exit();
+
+    fanout_release(&fanout);
 }
 
-room_t* find_room(server_t* server, int room_id) {
-    pthread_mutex_lock(&server->rooms_mutex);
+void registry_init(server_t* server, int shard_count) {
+    if (shard_count < 1) {
+        shard_count = 1;
+    }
+    server->shards = (registry_shard_t*)safe_malloc(sizeof(registry_shard_t) * (size_t)shard_count);
+    server->shard_count = shard_count;
+    for (int i = 0; i < shard_count; i++) {
+        pthread_mutex_init(&server->shards[i].mutex, NULL);
+        server->shards[i].clients = NULL;
+        server->shards[i].client_count = 0;
+    }
+    server->rooms = room_table_create(ROOM_TABLE_MIN);
+    pthread_mutex_init(&server->rooms_mutex, NULL);
+    server->next_room_id = 1;
+    server->next_client_id = 1;
+}
 
-    room_t* current = server->rooms;
-    while (current) {
-        if (current->room_id == room_id) {
-            pthread_mutex_unlock(&server->rooms_mutex);
-            return current;
+void registry_destroy(server_t* server) {
+    for (int i = 0; i < server->shard_count; i++) {
+        registry_shard_t* shard = &server->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        client_t* client = shard->clients;
+        while (client) {
+            client_t* next = client->registry_next;
+            cleanup_client(client);
+            client = next;
         }
-        current = current->next;
+        pthread_mutex_unlock(&shard->mutex);
+        pthread_mutex_destroy(&shard->mutex);
     }
+    safe_free(server->shards);
+    server->shards = NULL;
+    server->shard_count = 0;
 
+    // Không còn reader nào nên giải phóng luôn những gì đang chờ EBR
+    ebr_drain();
+    pthread_mutex_lock(&server->rooms_mutex);
+    room_table_t* table = server->rooms;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].key > 0) {
+            cleanup_room(table->slots[i].room);
+        }
+    }
+    free(table);
+    server->rooms = NULL;
     pthread_mutex_unlock(&server->rooms_mutex);
-    return NULL;
+    pthread_mutex_destroy(&server->rooms_mutex);
 }
 
-room_t* create_room(server_t* server, const char* room_name) {
-    pthread_mutex_lock(&server->rooms_mutex);
+// client->shard phải được gán trước
+void registry_add_client(server_t* server, client_t* client) {
+    registry_shard_t* shard = &server->shards[client->shard % server->shard_count];
+    client->client_id = __atomic_fetch_add(&server->next_client_id, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&shard->mutex);
+    client->registry_next = shard->clients;
+    shard->clients = client;
+    shard->client_count++;
+    pthread_mutex_unlock(&shard->mutex);
+}
 
-    room_t* new_room = (room_t*)safe_malloc(sizeof(room_t));
-    new_room->room_id = server->next_room_id++;
+void registry_remove_client(server_t* server, client_t* client) {
+    registry_shard_t* shard = &server->shards[client->shard % server->shard_count];
+
+    pthread_mutex_lock(&shard->mutex);
+    client_t** link = &shard->clients;
+    while (*link && *link != client) {
+        link = &(*link)->registry_next;
+    }
+    if (*link) {
+        *link = client->registry_next;
+        shard->client_count--;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+room_t* find_room(server_t* server, int room_id) {
+    return room_table_lookup(__atomic_load_n(&server->rooms, __ATOMIC_ACQUIRE), room_id);
+}
+
+static room_t* room_new(int room_id, const char* room_name) {
+    room_t* new_room = (room_t*)slab_alloc(sizeof(room_t));
+    if (!new_room) {
+        error_exit("Memory allocation failed");
+    }
+    new_room->room_id = room_id;
     strncpy(new_room->room_name, room_name, MAX_ROOM_NAME_LEN - 1);
     new_room->room_name[MAX_ROOM_NAME_LEN - 1] = '\0';
-    new_room->clients = NULL;
+    new_room->members = NULL;
+    new_room->member_capacity = 0;
     new_room->client_count = 0;
+    new_room->deleted = 0;
+    new_room->history_seq = 0;
+    memset(new_room->history, 0, sizeof(new_room->history));
+    new_room->history_retired = NULL;
     pthread_mutex_init(&new_room->mutex, NULL);
 
     
     // KHÔNG tạo key ngay - chỉ tạo khi có yêu cầu bật mã hóa
     new_room->encryption_enabled = 0;
     memset(&new_room->crypto, 0, sizeof(room_crypto_t));
-    
-    new_room->next = server->rooms;
-    server->rooms = new_room;
+    return new_room;
+}
 
-    pthread_mutex_unlock(&server->rooms_mutex);
+static void room_publish(server_t* server, room_t* room) {
+    rooms_lock(server);
+    room_table_reserve_locked(server);
+    room_table_place(server->rooms, room);
+    rooms_unlock(server);
+}
+
+room_t* create_room(server_t* server, const char* room_name) {
+    room_t* new_room = room_new(__atomic_fetch_add(&server->next_room_id, 1, __ATOMIC_RELAXED), room_name);
+    // Log phải có phòng trước tin đầu tiên, tức là trước khi ai đó vào được phòng
+    if (g_room_log) {
+        g_room_log->created(new_room);
+    }
+    room_publish(server, new_room);
     return new_room;
 }
 
-void list_rooms(server_t* server, int client_socket) {
-    pthread_mutex_lock(&server->rooms_mutex);
+room_t* restore_room(server_t* server, int room_id, const char* room_name, long history_seq) {
+    room_t* room = room_new(room_id, room_name);
+    room->history_seq = history_seq;
+    if (server->next_room_id <= room_id) {
+        server->next_room_id = room_id + 1;
+    }
+    room_publish(server, room);
+    return room;
+}
 
+void list_rooms(server_t* server, client_t* client) {
     message_t response;
+    memset(&response, 0, sizeof(message_t));
     response.type = MSG_ROOM_LIST;
     strcpy(response.username, "SERVER");
     strcpy(response.content, "");
 
     char room_list[BUFFER_SIZE] = "";
-    room_t* current = server->rooms;
-
-    while (current) {
-        char room_info[200];
-        snprintf(room_info, sizeof(room_info), "ID:%d Name:%s Members:%d\n",
-                current->room_id, current->room_name, current->client_count);
+    size_t used = 0;
+
+    // Duyệt bảng không khóa, phòng bị xóa giữa chừng vẫn đọc được nhờ EBR
+    ebr_enter();
+    const room_table_t* table = __atomic_load_n(&server->rooms, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < table->capacity && used < sizeof(room_list) - 1; i++) {
+        if (__atomic_load_n(&table->slots[i].key, __ATOMIC_ACQUIRE) <= 0) {
+            continue;
+        }
+        const room_t* current = __atomic_load_n(&table->slots[i].room, __ATOMIC_ACQUIRE);
         const char* encryption_status = current->encryption_enabled ? "🔒" : "📖";
-        snprintf(room_info, sizeof(room_info), "%s ID:%d Name:%s Members:%d\n", 
-                encryption_status, current->room_id, current->room_name, current->client_count);
-        strcat(room_list, room_info);
-        current = current->next;
+        int written = snprintf(room_list + used, sizeof(room_list) - used, "%s ID:%d Name:%s Members:%d\n",
+                               encryption_status, current->room_id, current->room_name, current->client_count);
+        if (written > 0) {
+            used += (size_t)written;
+        }
     }
+    ebr_exit();
 
     if (strlen(room_list) == 0) {
         strcpy(response.content, "Không có phòng nào");
@@ -353,28 +2623,131 @@ void list_rooms(server_t* server, int client_socket) {
         response.content[MAX_MESSAGE_LEN - 1] = '\0';
     }
 
-    pthread_mutex_unlock(&server->rooms_mutex);
-
-    send_message(client_socket, &response);
+    send_to_client(client, &response);
 }
 
 // File transfer functions
-int send_file_transfer(int socket_fd, file_transfer_t* ft) {
-    if (send(socket_fd, ft, sizeof(file_transfer_t), 0) < 0) {
+int send_file_transfer_wire(int socket_fd, const file_transfer_t* ft, int wire_version) {
+    unsigned char buf[WIRE_MAX_FRAME_SIZE];
+    int len = encode_file_transfer_frame(ft, wire_version, buf, sizeof(buf));
+    if (len < 0) {
         return -1;
     }
-    return 0;
+    return send_buffer_batch(&socket_fd, 1, buf, (size_t)len) == 0 ? 0 : -1;
+}
+
+int send_file_transfer(int socket_fd, file_transfer_t* ft) {
+    return send_file_transfer_wire(socket_fd, ft, WIRE_VERSION_LEGACY);
 }
 
 int receive_file_transfer(int socket_fd, file_transfer_t* ft) {
-    ssize_t bytes_received = recv(socket_fd, ft, sizeof(file_transfer_t), 0);
-    if (bytes_received <= 0) {
+    frame_t frame;
+    if (receive_frame(socket_fd, WIRE_VERSION_LEGACY, FRAME_FILE_CHUNK, &frame) < 0) {
         return -1;
     }
+    *ft = frame.body.ft;
     return 0;
 }
 
-int send_file(int socket_fd, const char* filepath, int sender_id, const char* sender_name) {
+void send_lanes_init(send_lanes_t* lanes, pthread_mutex_t* mutex) {
+    memset(lanes, 0, sizeof(send_lanes_t));
+    lanes->mutex = mutex;
+    pthread_cond_init(&lanes->turn, NULL);
+}
+
+void send_lanes_destroy(send_lanes_t* lanes) {
+    pthread_cond_destroy(&lanes->turn);
+}
+
+void send_lanes_control_lock(send_lanes_t* lanes) {
+    // Báo trước khi chờ mutex: chunk đang chờ lượt sẽ nhường, chỉ chunk đang gửi dở được xong
+    __atomic_fetch_add(&lanes->control_waiting, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(lanes->mutex);
+    __atomic_fetch_sub(&lanes->control_waiting, 1, __ATOMIC_RELAXED);
+}
+
+void send_lanes_control_unlock(send_lanes_t* lanes) {
+    pthread_cond_broadcast(&lanes->turn);
+    pthread_mutex_unlock(lanes->mutex);
+}
+
+void send_lanes_bulk_lock(send_lanes_t* lanes) {
+    pthread_mutex_lock(lanes->mutex);
+    unsigned long ticket = lanes->bulk_next++;
+    while (ticket != lanes->bulk_serving ||
+           __atomic_load_n(&lanes->control_waiting, __ATOMIC_RELAXED) > 0) {
+        pthread_cond_wait(&lanes->turn, lanes->mutex);
+    }
+}
+
+void send_lanes_bulk_unlock(send_lanes_t* lanes) {
+    lanes->bulk_serving++;
+    pthread_cond_broadcast(&lanes->turn);
+    pthread_mutex_unlock(lanes->mutex);
+}
+
+typedef struct {
+    int socket_fd;
+    int wire_version;
+    const send_gate_t* gate;
+    file_transfer_t ft;           // Field chung của mọi chunk, sink điền data
+} file_send_ctx_t;
+
+static int send_file_chunk(file_send_ctx_t* ctx) {
+    if (ctx->gate && ctx->gate->acquire(ctx->gate->arg) < 0) {
+        return -1;
+    }
+    int rc = send_file_transfer_wire(ctx->socket_fd, &ctx->ft, ctx->wire_version);
+    if (ctx->gate) {
+        ctx->gate->release(ctx->gate->arg);
+    }
+    return rc;
+}
+
+static int send_encrypted_chunk(void* arg, const file_chunk_t* chunk) {
+    file_send_ctx_t* ctx = (file_send_ctx_t*)arg;
+    ctx->ft.chunk_number = chunk->chunk_number;
+    memcpy(ctx->ft.data, chunk->out, (size_t)chunk->out_len);
+    ctx->ft.data_size = chunk->out_len;
+    return send_file_chunk(ctx);
+}
+
+// Thread này đọc đĩa, worker của pipeline mã hóa, thread sink gửi lên socket
+static int send_file_encrypted(FILE* file, file_send_ctx_t* ctx, const room_crypto_t* crypto) {
+    ctx->ft.file_id = random_file_id();
+    if (ctx->ft.file_id == 0) {
+        return -1;
+    }
+    chunk_binding_t binding = { ctx->ft.file_id, ctx->ft.file_size, ctx->ft.total_chunks };
+    file_pipeline_t* pipeline = file_pipeline_start(crypto->key, &binding, 1, send_encrypted_chunk, ctx);
+    if (!pipeline) {
+        return -1;
+    }
+
+    int read_error = 0;
+    for (int chunk_number = 0; chunk_number < ctx->ft.total_chunks; chunk_number++) {
+        file_chunk_t* chunk = file_pipeline_acquire(pipeline);
+        if (!chunk) {
+            break;
+        }
+        chunk->chunk_number = chunk_number;
+        chunk->in_len = (int)fread(chunk->in, 1, FILE_CRYPT_CHUNK_SIZE, file);
+        if (chunk->in_len <= 0) {
+            read_error = 1;
+            break;
+        }
+        file_pipeline_commit(pipeline, chunk);
+    }
+
+    int rc = file_pipeline_finish(pipeline);
+    return rc < 0 || read_error ? -1 : 0;
+}
+
+// Số chunk liên tiếp không nén được trước khi thôi thử nén phần còn lại của file
+#define FILE_COMPRESS_GIVE_UP 4
+
+int send_file(int socket_fd, const char* filepath, int sender_id, const char* sender_name, int wire_version,
+              const room_crypto_t* crypto, int compress, int stream_id, const send_gate_t* gate) {
     FILE* file = fopen(filepath, "rb");
     if (!file) {
         perror("Không thể mở file");
@@ -393,29 +2766,68 @@ int send_file(int socket_fd, const char* filepath, int sender_id, const char* se
     }
     filename = (filename == NULL) ? filepath : filename + 1;
 
-    // Calculate total chunks
-    int total_chunks = (file_size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+    // Chunk mã hóa nhỏ hơn để data vẫn vừa FILE_CHUNK_SIZE sau khi thêm nonce và tag
+    int chunk_size = crypto ? FILE_CRYPT_CHUNK_SIZE : FILE_CHUNK_SIZE;
+    int total_chunks = (file_size + chunk_size - 1) / chunk_size;
 
-    printf("Đang gửi file: %s (%.2f KB, %d chunks)\n",
+    printf("Đang gửi file%s: %s (%.2f KB, %d chunks)\n", crypto ? " (mã hóa)" : "",
            filename, file_size / 1024.0, total_chunks);
 
-    // Send file in chunks
+    file_send_ctx_t ctx;
+    memset(&ctx, 0, sizeof(file_send_ctx_t));
+    ctx.socket_fd = socket_fd;
+    ctx.wire_version = wire_version;
+    ctx.gate = gate;
+    ctx.ft.stream_id = stream_id;
+    strncpy(ctx.ft.filename, filename, MAX_FILENAME_LEN - 1);
+    ctx.ft.file_size = file_size;
+    ctx.ft.sender_id = sender_id;
+    strncpy(ctx.ft.sender_name, sender_name, MAX_USERNAME_LEN - 1);
+    ctx.ft.total_chunks = total_chunks;
+    ctx.ft.encrypted = crypto ? 1 : 0;
+
+    if (crypto) {
+        int rc = send_file_encrypted(file, &ctx, crypto);
+        fclose(file);
+        if (rc < 0) {
+            return -1;
+        }
+        printf("Hoàn thành gửi file: %s\n", filename);
+        return 0;
+    }
+
+    // Send file in chunks. Chunk nén được thì gửi bản nén; file đã nén sẵn (nhận ra qua chữ ký
+    // ở chunk đầu) hoặc vài chunk liền không nén được thì gửi nguyên phần còn lại.
     int chunk_number = 0;
+    int misses = 0;
+    long wire_bytes = 0;
+    unsigned char packed[FILE_CHUNK_SIZE];
     while (!feof(file)) {
-        file_transfer_t ft;
-        memset(&ft, 0, sizeof(file_transfer_t));
+        file_transfer_t* ft = &ctx.ft;
+        ft->chunk_number = chunk_number;
 
-        strncpy(ft.filename, filename, MAX_FILENAME_LEN - 1);
-        ft.file_size = file_size;
-        ft.sender_id = sender_id;
-        strncpy(ft.sender_name, sender_name, MAX_USERNAME_LEN - 1);
-        ft.chunk_number = chunk_number;
-        ft.total_chunks = total_chunks;
+        ft->data_size = fread(ft->data, 1, FILE_CHUNK_SIZE, file);
+        if (ft->data_size <= 0) break;
 
-        ft.data_size = fread(ft.data, 1, FILE_CHUNK_SIZE, file);
-        if (ft.data_size <= 0) break;
+        if (compress && chunk_number == 0 &&
+            compress_content_precompressed((const unsigned char*)ft->data, (size_t)ft->data_size)) {
+            compress = 0;
+        }
+        ft->compressed = 0;
+        if (compress) {
+            int len = compress_buffer((const unsigned char*)ft->data, (size_t)ft->data_size, packed, sizeof(packed));
+            if (len > 0) {
+                memcpy(ft->data, packed, (size_t)len);
+                ft->data_size = len;
+                ft->compressed = 1;
+                misses = 0;
+            } else if (++misses >= FILE_COMPRESS_GIVE_UP) {
+                compress = 0;
+            }
+        }
+        wire_bytes += ft->data_size;
 
-        if (send_file_transfer(socket_fd, &ft) < 0) {
+        if (send_file_chunk(&ctx) < 0) {
             fclose(file);
             return -1;
         }
@@ -424,59 +2836,59 @@ int send_file(int socket_fd, const char* filepath, int sender_id, const char* se
     }
 
     fclose(file);
-    printf("Hoàn thành gửi file: %s\n", filename);
+    if (file_size > 0 && wire_bytes < file_size) {
+        printf("Hoàn thành gửi file: %s (nén còn %.2f KB, %.0f%%)\n", filename, wire_bytes / 1024.0,
+               wire_bytes * 100.0 / file_size);
+    } else {
+        printf("Hoàn thành gửi file: %s\n", filename);
+    }
     return 0;
 }
 
-int receive_file(int socket_fd, const char* save_dir) {
+int receive_file(int socket_fd, ringbuf_t* rx, const char* save_dir) {
     char filepath[512];
     FILE* file = NULL;
     int expected_chunk = 0;
-    long total_received = 0;
 
     while (1) {
-        file_transfer_t ft;
-        if (receive_file_transfer(socket_fd, &ft) < 0) {
+        frame_t frame;
+        if (receive_buffered_frame(socket_fd, rx, WIRE_VERSION_LEGACY, FRAME_FILE_CHUNK, &frame) < 0) {
             if (file) fclose(file);
             return -1;
         }
+        file_transfer_t* ft = &frame.body.ft;
 
         // Open file on first chunk
         if (expected_chunk == 0) {
             #ifdef _WIN32
-                snprintf(filepath, sizeof(filepath), "%s\\%s", save_dir, ft.filename);
+                snprintf(filepath, sizeof(filepath), "%s\\%s", save_dir, ft->filename);
             #else
-                snprintf(filepath, sizeof(filepath), "%s/%s", save_dir, ft.filename);
+                snprintf(filepath, sizeof(filepath), "%s/%s", save_dir, ft->filename);
             #endif
             file = fopen(filepath, "wb");
             if (!file) {
                 perror("Không thể tạo file");
                 return -1;
             }
-            printf("\nĐang nhận file: %s (%.2f KB)\n",
-                   ft.filename, ft.file_size / 1024.0);
+            printf("\nĐang nhận file: %s (%.2f KB)\n", ft->filename, ft->file_size / 1024.0);
         }
 
         // Write chunk to file
-        if (ft.data_size > 0) {
-            fwrite(ft.data, 1, ft.data_size, file);
-            total_received += ft.data_size;
+        if (ft->data_size > 0) {
+            fwrite(ft->data, 1, ft->data_size, file);
         }
 
         expected_chunk++;
 
         // Check if transfer complete
-        if (ft.chunk_number >= ft.total_chunks - 1) {
+        if (ft->chunk_number >= ft->total_chunks - 1) {
             break;
         }
     }
 
-    if (file) {
-        fclose(file);
-        printf("Hoàn thành nhận file!\n");
-        printf("Đường dẫn: %s\n\n", filepath);
-    }
-
+    fclose(file);
+    printf("Hoàn thành nhận file!\n");
+    printf("Đường dẫn: %s\n\n", filepath);
     return 0;
 }
 
@@ -0,0 +1,457 @@
+#include "wire.h"
+
+typedef struct {
+    unsigned char* buf;
+    size_t cap;
+    size_t pos;
+} wire_writer_t;
+
+typedef struct {
+    const unsigned char* buf;
+    size_t len;
+    size_t pos;
+} wire_reader_t;
+
+// Bảng field mask sinh từ MESSAGE_TYPES
+#define MESSAGE_FIELDS_ENTRY(type, fields) [type] = (fields),
+static const uint32_t message_type_fields[MSG_TYPE_COUNT] = {
+    MESSAGE_TYPES(MESSAGE_FIELDS_ENTRY)
+};
+#undef MESSAGE_FIELDS_ENTRY
+
+uint32_t wire_message_fields(message_type_t type) {
+    if ((int)type <= MSG_INVALID || type >= MSG_TYPE_COUNT) {
+        return 0;
+    }
+    return message_type_fields[type];
+}
+
+// Writer helpers
+static int put_bytes(wire_writer_t* w, const void* data, size_t n) {
+    if (w->cap - w->pos < n) {
+        return -1;
+    }
+    memcpy(w->buf + w->pos, data, n);
+    w->pos += n;
+    return 0;
+}
+
+static int put_u8(wire_writer_t* w, uint8_t v) {
+    return put_bytes(w, &v, 1);
+}
+
+static int put_u16(wire_writer_t* w, uint16_t v) {
+    unsigned char b[2] = { (unsigned char)(v >> 8), (unsigned char)v };
+    return put_bytes(w, b, sizeof(b));
+}
+
+static int put_u32(wire_writer_t* w, uint32_t v) {
+    unsigned char b[4] = { (unsigned char)(v >> 24), (unsigned char)(v >> 16),
+                           (unsigned char)(v >> 8), (unsigned char)v };
+    return put_bytes(w, b, sizeof(b));
+}
+
+static int put_u64(wire_writer_t* w, uint64_t v) {
+    if (put_u32(w, (uint32_t)(v >> 32)) < 0) {
+        return -1;
+    }
+    return put_u32(w, (uint32_t)v);
+}
+
+static int put_string(wire_writer_t* w, const char* s, size_t max) {
+    const char* end = memchr(s, '\0', max);
+    size_t n = end ? (size_t)(end - s) : max;
+    if (put_u16(w, (uint16_t)n) < 0) {
+        return -1;
+    }
+    return put_bytes(w, s, n);
+}
+
+static int put_blob(wire_writer_t* w, const void* data, int len, size_t max) {
+    if (len < 0 || (size_t)len > max) {
+        return -1;
+    }
+    if (put_u32(w, (uint32_t)len) < 0) {
+        return -1;
+    }
+    return put_bytes(w, data, (size_t)len);
+}
+
+// Reader helpers
+static int get_bytes(wire_reader_t* r, void* out, size_t n) {
+    if (r->len - r->pos < n) {
+        return -1;
+    }
+    memcpy(out, r->buf + r->pos, n);
+    r->pos += n;
+    return 0;
+}
+
+static int get_u8(wire_reader_t* r, uint8_t* v) {
+    return get_bytes(r, v, 1);
+}
+
+static int get_u16(wire_reader_t* r, uint16_t* v) {
+    unsigned char b[2];
+    if (get_bytes(r, b, sizeof(b)) < 0) {
+        return -1;
+    }
+    *v = (uint16_t)((b[0] << 8) | b[1]);
+    return 0;
+}
+
+static int get_u32(wire_reader_t* r, uint32_t* v) {
+    unsigned char b[4];
+    if (get_bytes(r, b, sizeof(b)) < 0) {
+        return -1;
+    }
+    *v = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    return 0;
+}
+
+static int get_u64(wire_reader_t* r, uint64_t* v) {
+    uint32_t hi, lo;
+    if (get_u32(r, &hi) < 0 || get_u32(r, &lo) < 0) {
+        return -1;
+    }
+    *v = ((uint64_t)hi << 32) | lo;
+    return 0;
+}
+
+static int get_string(wire_reader_t* r, char* out, size_t size) {
+    uint16_t n;
+    if (get_u16(r, &n) < 0 || n >= size) {
+        return -1;
+    }
+    if (get_bytes(r, out, n) < 0) {
+        return -1;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+static int get_blob(wire_reader_t* r, void* out, int* len, size_t max) {
+    uint32_t n;
+    if (get_u32(r, &n) < 0 || n > max) {
+        return -1;
+    }
+    if (get_bytes(r, out, n) < 0) {
+        return -1;
+    }
+    *len = (int)n;
+    return 0;
+}
+
+// Mỗi kind trong schema ứng với một cặp PUT/GET
+#define WIRE_PUT_STRING(w, obj, field, len) put_string(w, (obj)->field, sizeof((obj)->field))
+#define WIRE_PUT_BLOB(w, obj, field, len) put_blob(w, (obj)->field, (obj)->len, sizeof((obj)->field))
+#define WIRE_PUT_U8(w, obj, field, len) put_u8(w, (uint8_t)(obj)->field)
+#define WIRE_PUT_I32(w, obj, field, len) put_u32(w, (uint32_t)(obj)->field)
+#define WIRE_PUT_I64(w, obj, field, len) put_u64(w, (uint64_t)(obj)->field)
+
+#define WIRE_GET_STRING(r, obj, field, len) get_string(r, (obj)->field, sizeof((obj)->field))
+#define WIRE_GET_BLOB(r, obj, field, len) get_blob(r, (obj)->field, &(obj)->len, sizeof((obj)->field))
+#define WIRE_GET_U8(r, obj, field, len) \
+    (get_u8(r, &v8) < 0 ? -1 : ((obj)->field = v8, 0))
+#define WIRE_GET_I32(r, obj, field, len) \
+    (get_u32(r, &v32) < 0 ? -1 : ((obj)->field = (int32_t)v32, 0))
+#define WIRE_GET_I64(r, obj, field, len) \
+    (get_u64(r, &v64) < 0 ? -1 : ((obj)->field = (int64_t)v64, 0))
+
+static int begin_frame(wire_writer_t* w, unsigned char* buf, size_t cap, message_type_t type) {
+    w->buf = buf;
+    w->cap = cap;
+    w->pos = WIRE_LENGTH_SIZE;
+    if (cap < WIRE_HEADER_SIZE) {
+        return -1;
+    }
+    put_u8(w, WIRE_VERSION_V2);
+    put_u8(w, (uint8_t)type);
+    return 0;
+}
+
+static int finish_frame(wire_writer_t* w) {
+    size_t pos = w->pos;
+    w->pos = 0;
+    put_u32(w, (uint32_t)(pos - WIRE_LENGTH_SIZE));
+    return (int)pos;
+}
+
+int wire_encode_message(const message_t* msg, unsigned char* buf, size_t cap) {
+    if ((int)msg->type <= MSG_INVALID || msg->type >= MSG_TYPE_COUNT || msg->type == MSG_FILE_DATA) {
+        return -1;
+    }
+
+    wire_writer_t w;
+    if (begin_frame(&w, buf, cap, msg->type) < 0) {
+        return -1;
+    }
+
+    uint32_t fields = wire_message_fields(msg->type);
+#define ENCODE_FIELD(flag, kind, field, len) \
+    if ((fields & (flag)) && WIRE_PUT_##kind(&w, msg, field, len) < 0) return -1;
+    MESSAGE_FIELDS(ENCODE_FIELD)
+#undef ENCODE_FIELD
+
+    return finish_frame(&w);
+}
+
+int wire_encode_file_transfer(const file_transfer_t* ft, unsigned char* buf, size_t cap) {
+    wire_writer_t w;
+    if (begin_frame(&w, buf, cap, MSG_FILE_DATA) < 0) {
+        return -1;
+    }
+
+#define ENCODE_FIELD(flag, kind, field, len) \
+    if (WIRE_PUT_##kind(&w, ft, field, len) < 0) return -1;
+    FILE_TRANSFER_FIELDS(ENCODE_FIELD)
+#undef ENCODE_FIELD
+
+    return finish_frame(&w);
+}
+
+int wire_encode_file_header(const file_transfer_t* ft, size_t data_len, unsigned char* buf, size_t cap) {
+    wire_writer_t w;
+    if (data_len > FILE_CHUNK_SIZE || begin_frame(&w, buf, cap, MSG_FILE_DATA) < 0) {
+        return -1;
+    }
+
+    // FF_DATA là field cuối: chỉ ghi độ dài, payload do người gọi gửi tiếp
+#define ENCODE_FIELD(flag, kind, field, len) \
+    if ((flag) == FF_DATA) { \
+        if (put_u32(&w, (uint32_t)data_len) < 0) return -1; \
+    } else if (WIRE_PUT_##kind(&w, ft, field, len) < 0) return -1;
+    FILE_TRANSFER_FIELDS(ENCODE_FIELD)
+#undef ENCODE_FIELD
+
+    size_t header_len = w.pos;
+    w.pos = 0;
+    put_u32(&w, (uint32_t)(header_len - WIRE_LENGTH_SIZE + data_len));
+    return (int)header_len;
+}
+
+size_t wire_frame_length(const unsigned char* buf) {
+    uint32_t len = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+                   ((uint32_t)buf[2] << 8) | buf[3];
+    if (len < WIRE_HEADER_SIZE - WIRE_LENGTH_SIZE ||
+        len > WIRE_MAX_FRAME_SIZE - WIRE_LENGTH_SIZE) {
+        return 0;
+    }
+    return (size_t)len + WIRE_LENGTH_SIZE;
+}
+
+int wire_frame_type(const unsigned char* frame) {
+    return frame[WIRE_LENGTH_SIZE + 1];
+}
+
+int wire_frame_compressed(const unsigned char* frame) {
+    return frame[WIRE_LENGTH_SIZE] == (WIRE_VERSION_V2 | WIRE_FLAG_DEFLATE);
+}
+
+int wire_compress_frame(const unsigned char* frame, size_t len, unsigned char* out, size_t cap) {
+    size_t body = len - WIRE_HEADER_SIZE;
+    if (len < WIRE_HEADER_SIZE || cap < WIRE_COMPRESSED_HEADER_SIZE) {
+        return -1;
+    }
+    int packed = compress_buffer(frame + WIRE_HEADER_SIZE, body, out + WIRE_COMPRESSED_HEADER_SIZE,
+                                 cap - WIRE_COMPRESSED_HEADER_SIZE);
+    if (packed < 0) {
+        return -1;
+    }
+
+    wire_writer_t w = { out, cap, 0 };
+    put_u32(&w, (uint32_t)(WIRE_COMPRESSED_HEADER_SIZE - WIRE_LENGTH_SIZE + (size_t)packed));
+    put_u8(&w, WIRE_VERSION_V2 | WIRE_FLAG_DEFLATE);
+    put_u8(&w, (uint8_t)wire_frame_type(frame));
+    put_u16(&w, (uint16_t)body);
+    return WIRE_COMPRESSED_HEADER_SIZE + packed;
+}
+
+int wire_decompress_frame(const unsigned char* frame, size_t len, unsigned char* out, size_t cap) {
+    if (len < WIRE_COMPRESSED_HEADER_SIZE || wire_frame_length(frame) != len || !wire_frame_compressed(frame)) {
+        return -1;
+    }
+    wire_reader_t r = { frame, len, WIRE_HEADER_SIZE };
+    uint16_t body;
+    get_u16(&r, &body);
+    if (cap < WIRE_HEADER_SIZE || (size_t)body > cap - WIRE_HEADER_SIZE) {
+        return -1;
+    }
+    int plain = decompress_buffer(frame + WIRE_COMPRESSED_HEADER_SIZE, len - WIRE_COMPRESSED_HEADER_SIZE,
+                                  out + WIRE_HEADER_SIZE, body);
+    if (plain != (int)body) {
+        return -1;
+    }
+
+    wire_writer_t w = { out, cap, 0 };
+    put_u32(&w, (uint32_t)(WIRE_HEADER_SIZE - WIRE_LENGTH_SIZE + body));
+    put_u8(&w, WIRE_VERSION_V2);
+    put_u8(&w, (uint8_t)wire_frame_type(frame));
+    return WIRE_HEADER_SIZE + plain;
+}
+
+static int begin_decode(wire_reader_t* r, const unsigned char* frame, size_t len) {
+    if (len < WIRE_HEADER_SIZE || wire_frame_length(frame) != len ||
+        frame[WIRE_LENGTH_SIZE] != WIRE_VERSION_V2) {
+        return -1;
+    }
+    r->buf = frame;
+    r->len = len;
+    r->pos = WIRE_HEADER_SIZE;
+    return wire_frame_type(frame);
+}
+
+int wire_decode_message(const unsigned char* frame, size_t len, message_t* msg) {
+    wire_reader_t r;
+    int type = begin_decode(&r, frame, len);
+    if (type <= MSG_INVALID || type >= MSG_TYPE_COUNT || type == MSG_FILE_DATA) {
+        return -1;
+    }
+
+    memset(msg, 0, sizeof(message_t));
+    msg->type = (message_type_t)type;
+
+    uint32_t fields = wire_message_fields(msg->type);
+    uint8_t v8;
+    uint32_t v32;
+    uint64_t v64;
+    (void)v8; (void)v32; (void)v64;
+#define DECODE_FIELD(flag, kind, field, len) \
+    if ((fields & (flag)) && WIRE_GET_##kind(&r, msg, field, len) < 0) return -1;
+    MESSAGE_FIELDS(DECODE_FIELD)
+#undef DECODE_FIELD
+
+    return r.pos == r.len ? 0 : -1;
+}
+
+int wire_decode_file_transfer(const unsigned char* frame, size_t len, file_transfer_t* ft) {
+    wire_reader_t r;
+    if (begin_decode(&r, frame, len) != MSG_FILE_DATA) {
+        return -1;
+    }
+
+    memset(ft, 0, offsetof(file_transfer_t, data));
+    uint8_t v8;
+    uint32_t v32;
+    uint64_t v64;
+    (void)v8; (void)v32; (void)v64;
+#define DECODE_FIELD(flag, kind, field, len) \
+    if (WIRE_GET_##kind(&r, ft, field, len) < 0) return -1;
+    FILE_TRANSFER_FIELDS(DECODE_FIELD)
+#undef DECODE_FIELD
+
+    return r.pos == r.len ? 0 : -1;
+}
+
+int wire_decode_file_header(const unsigned char* buf, size_t have, file_transfer_t* ft,
+                            size_t* header_len, size_t* data_len) {
+    if (have < WIRE_HEADER_SIZE) {
+        return 0;
+    }
+    size_t frame_len = wire_frame_length(buf);
+    if (frame_len == 0 || buf[WIRE_LENGTH_SIZE] != WIRE_VERSION_V2 ||
+        wire_frame_type(buf) != MSG_FILE_DATA) {
+        return -1;
+    }
+
+    wire_reader_t r;
+    r.buf = buf;
+    r.len = have < frame_len ? have : frame_len;
+    r.pos = WIRE_HEADER_SIZE;
+
+    memset(ft, 0, offsetof(file_transfer_t, data));
+    uint8_t v8;
+    uint32_t v32;
+    uint64_t v64;
+    (void)v8; (void)v32; (void)v64;
+    // Thiếu byte thì chờ thêm, trừ khi đã có đủ cả frame hoặc đủ header tối đa
+    int incomplete = r.len < frame_len && have < WIRE_FILE_HEADER_MAX;
+#define DECODE_FIELD(flag, kind, field, len) \
+    if ((flag) == FF_DATA) { \
+        if (get_u32(&r, &v32) < 0) return incomplete ? 0 : -1; \
+    } else if (WIRE_GET_##kind(&r, ft, field, len) < 0) return incomplete ? 0 : -1;
+    FILE_TRANSFER_FIELDS(DECODE_FIELD)
+#undef DECODE_FIELD
+
+    if (v32 > FILE_CHUNK_SIZE || r.pos + v32 != frame_len) {
+        return -1;
+    }
+    ft->data_size = (int)v32;
+    *header_len = r.pos;
+    *data_len = v32;
+    return 1;
+}
+
+void legacy_from_message(const message_t* msg, legacy_message_t* legacy) {
+    memset(legacy, 0, sizeof(legacy_message_t));
+    legacy->type = msg->type;
+    memcpy(legacy->username, msg->username, sizeof(legacy->username));
+    memcpy(legacy->content, msg->content, sizeof(legacy->content));
+    memcpy(legacy->encrypted_content, msg->encrypted_content, sizeof(legacy->encrypted_content));
+    legacy->encrypted_len = msg->encrypted_len;
+    legacy->is_encrypted = msg->is_encrypted;
+    legacy->room_id = msg->room_id;
+    legacy->client_id = msg->client_id;
+    legacy->timestamp = msg->timestamp;
+    memcpy(legacy->room_key_hex, msg->room_key_hex, sizeof(legacy->room_key_hex));
+    memcpy(legacy->room_iv_hex, msg->room_iv_hex, sizeof(legacy->room_iv_hex));
+}
+
+void legacy_to_message(const legacy_message_t* legacy, message_t* msg) {
+    memset(msg, 0, sizeof(message_t));
+    msg->type = (message_type_t)legacy->type;
+    memcpy(msg->username, legacy->username, sizeof(msg->username));
+    memcpy(msg->content, legacy->content, sizeof(msg->content));
+    memcpy(msg->encrypted_content, legacy->encrypted_content, sizeof(msg->encrypted_content));
+    msg->encrypted_len = legacy->encrypted_len;
+    msg->is_encrypted = legacy->is_encrypted;
+    msg->room_id = legacy->room_id;
+    msg->client_id = legacy->client_id;
+    msg->timestamp = legacy->timestamp;
+    memcpy(msg->room_key_hex, legacy->room_key_hex, sizeof(msg->room_key_hex));
+    memcpy(msg->room_iv_hex, legacy->room_iv_hex, sizeof(msg->room_iv_hex));
+
+    // Dữ liệu từ mạng: đảm bảo chuỗi luôn kết thúc bằng '\0'
+    msg->username[MAX_USERNAME_LEN - 1] = '\0';
+    msg->content[MAX_MESSAGE_LEN - 1] = '\0';
+    msg->room_key_hex[sizeof(msg->room_key_hex) - 1] = '\0';
+    msg->room_iv_hex[sizeof(msg->room_iv_hex) - 1] = '\0';
+    if (msg->encrypted_len < 0 || msg->encrypted_len > MAX_ENCRYPTED_LEN) {
+        msg->encrypted_len = 0;
+    }
+}
+
+void legacy_from_file_transfer(const file_transfer_t* ft, legacy_file_transfer_t* legacy) {
+    memset(legacy, 0, offsetof(legacy_file_transfer_t, data));
+    memcpy(legacy->filename, ft->filename, sizeof(legacy->filename));
+    legacy->file_size = ft->file_size;
+    legacy->sender_id = ft->sender_id;
+    legacy->receiver_id = ft->receiver_id;
+    memcpy(legacy->sender_name, ft->sender_name, sizeof(legacy->sender_name));
+    legacy->chunk_number = ft->chunk_number;
+    legacy->total_chunks = ft->total_chunks;
+    memcpy(legacy->data, ft->data, sizeof(legacy->data));
+    legacy->data_size = ft->data_size;
+}
+
+void legacy_to_file_transfer(const legacy_file_transfer_t* legacy, file_transfer_t* ft) {
+    memcpy(ft->filename, legacy->filename, sizeof(ft->filename));
+    ft->file_size = legacy->file_size;
+    ft->sender_id = legacy->sender_id;
+    ft->receiver_id = legacy->receiver_id;
+    memcpy(ft->sender_name, legacy->sender_name, sizeof(ft->sender_name));
+    ft->chunk_number = legacy->chunk_number;
+    ft->total_chunks = legacy->total_chunks;
+    ft->encrypted = 0;    // v1 không có field này
+    ft->compressed = 0;
+    ft->stream_id = 0;
+    ft->file_id = 0;
+    memcpy(ft->data, legacy->data, sizeof(ft->data));
+    ft->data_size = legacy->data_size;
+
+    ft->filename[MAX_FILENAME_LEN - 1] = '\0';
+    ft->sender_name[MAX_USERNAME_LEN - 1] = '\0';
+    if (ft->data_size < 0 || ft->data_size > FILE_CHUNK_SIZE) {
+        ft->data_size = 0;
+    }
+}
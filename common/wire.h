@@ -0,0 +1,89 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Frame v2 (big-endian):
+//   u32 length   số byte sau trường length
+//   u8  version  WIRE_VERSION_V2
+//   u8  type     message_type_t
+//   các field của type theo thứ tự trong MESSAGE_FIELDS / FILE_TRANSFER_FIELDS
+// STRING = u16 độ dài + byte (không có '\0'), BLOB = u32 độ dài + byte,
+// U8/I32/I64 = số nguyên kích thước cố định.
+// Frame nén (WIRE_FEATURE_DEFLATE): version có thêm WIRE_FLAG_DEFLATE, sau type là
+//   u16 độ dài phần field gốc, rồi các field đã nén raw deflate (compress_buffer).
+// Không dùng cho MSG_FILE_DATA: chunk file nén payload riêng (FF_COMPRESSED) để server
+// vẫn relay zero-copy được.
+#define WIRE_LENGTH_SIZE 4
+#define WIRE_HEADER_SIZE 6
+#define WIRE_FLAG_DEFLATE 0x80
+#define WIRE_COMPRESSED_HEADER_SIZE (WIRE_HEADER_SIZE + 2)
+// Kích thước tối đa phần header của frame MSG_FILE_DATA (mọi field trừ byte payload)
+#define WIRE_FILE_HEADER_MAX (WIRE_HEADER_SIZE + 2 + MAX_FILENAME_LEN + 8 + 4 + 4 + \
+                              2 + MAX_USERNAME_LEN + 4 + 4 + 1 + 1 + 4 + 8 + 4)
+
+// Layout cố định của protocol v1, không được thay đổi để client cũ vẫn hoạt động
+typedef struct {
+    int type;
+    char username[MAX_USERNAME_LEN];
+    char content[MAX_MESSAGE_LEN];
+    unsigned char encrypted_content[MAX_ENCRYPTED_LEN];
+    int encrypted_len;
+    int is_encrypted;
+    int room_id;
+    int client_id;
+    time_t timestamp;
+    char room_key_hex[AES_KEY_SIZE * 2 + 1];
+    char room_iv_hex[AES_IV_SIZE * 2 + 1];
+} legacy_message_t;
+
+typedef struct {
+    char filename[MAX_FILENAME_LEN];
+    long file_size;
+    int sender_id;
+    int receiver_id;
+    char sender_name[MAX_USERNAME_LEN];
+    int chunk_number;
+    int total_chunks;
+    char data[FILE_CHUNK_SIZE];
+    int data_size;
+} legacy_file_transfer_t;
+
+// Field mask của từng message type
+uint32_t wire_message_fields(message_type_t type);
+
+// Trả về độ dài frame, -1 nếu buffer không đủ
+int wire_encode_message(const message_t* msg, unsigned char* buf, size_t cap);
+int wire_encode_file_transfer(const file_transfer_t* ft, unsigned char* buf, size_t cap);
+
+// Chỉ phần header của frame MSG_FILE_DATA, payload data_len byte được gửi riêng ngay sau
+int wire_encode_file_header(const file_transfer_t* ft, size_t data_len, unsigned char* buf, size_t cap);
+// Đọc header MSG_FILE_DATA từ have byte đầu của frame (ft->data không được ghi).
+// 1 = đủ header, 0 = cần thêm byte, -1 = sai định dạng
+int wire_decode_file_header(const unsigned char* buf, size_t have, file_transfer_t* ft,
+                            size_t* header_len, size_t* data_len);
+
+// Tổng độ dài frame khi đã có đủ WIRE_LENGTH_SIZE byte, 0 nếu length không hợp lệ
+size_t wire_frame_length(const unsigned char* buf);
+int wire_frame_type(const unsigned char* frame);
+
+// 1 nếu frame là frame nén
+int wire_frame_compressed(const unsigned char* frame);
+// Nén frame v2 hoàn chỉnh vào out, -1 nếu không đáng nén (gửi frame gốc)
+int wire_compress_frame(const unsigned char* frame, size_t len, unsigned char* out, size_t cap);
+// Dựng lại frame v2 gốc từ frame nén, trả về độ dài hoặc -1 nếu frame hỏng
+int wire_decompress_frame(const unsigned char* frame, size_t len, unsigned char* out, size_t cap);
+
+// Giải mã một frame hoàn chỉnh, trả về 0 hoặc -1 nếu frame sai định dạng
+int wire_decode_message(const unsigned char* frame, size_t len, message_t* msg);
+int wire_decode_file_transfer(const unsigned char* frame, size_t len, file_transfer_t* ft);
+
+// Chuyển đổi với layout v1
+void legacy_from_message(const message_t* msg, legacy_message_t* legacy);
+void legacy_to_message(const legacy_message_t* legacy, message_t* msg);
+void legacy_from_file_transfer(const file_transfer_t* ft, legacy_file_transfer_t* legacy);
+void legacy_to_file_transfer(const legacy_file_transfer_t* legacy, file_transfer_t* ft);
+
+#endif // WIRE_H
@@ -0,0 +1,24 @@
+#include "wirebuf.h"
+#include "slab.h"
+#include <string.h>
+
+wire_buffer_t* wire_buffer_create(const void* data, size_t len) {
+    wire_buffer_t* buffer = (wire_buffer_t*)slab_alloc(sizeof(wire_buffer_t) + len);
+    if (!buffer) {
+        return NULL;
+    }
+    buffer->refcount = 1;
+    buffer->len = len;
+    memcpy(buffer->data, data, len);
+    return buffer;
+}
+
+void wire_buffer_ref(wire_buffer_t* buffer) {
+    __atomic_fetch_add(&buffer->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void wire_buffer_unref(wire_buffer_t* buffer) {
+    if (buffer && __atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        slab_free(buffer, sizeof(wire_buffer_t) + buffer->len);
+    }
+}
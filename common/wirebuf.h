@@ -0,0 +1,20 @@
+#ifndef WIREBUF_H
+#define WIREBUF_H
+
+#include <stddef.h>
+
+// Frame đã encode, dùng chung cho mọi người nhận của một broadcast.
+// Không được sửa sau khi tạo; hàng đợi gửi của mỗi client giữ một tham chiếu
+// và buffer được giải phóng khi lần gửi cuối cùng xong.
+typedef struct wire_buffer {
+    int refcount;
+    size_t len;
+    unsigned char data[];
+} wire_buffer_t;
+
+// Copy len byte vào buffer mới với refcount = 1, NULL nếu hết bộ nhớ
+wire_buffer_t* wire_buffer_create(const void* data, size_t len);
+void wire_buffer_ref(wire_buffer_t* buffer);
+void wire_buffer_unref(wire_buffer_t* buffer);
+
+#endif // WIREBUF_H
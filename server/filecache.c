@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+// Bucket cố định, mỗi bucket là một chuỗi entry. Cache tính theo byte nên số entry nhỏ.
+#define FILE_CACHE_BUCKETS 1024
+
+// Một file đã nhận đủ, định danh bằng SHA-256 của nội dung. Nội dung nằm trong spool
+// (memfd) nên người nhận được phục vụ bằng sendfile như khi relay.
+typedef struct cache_entry {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    file_spool_t* spool;
+    long file_size;
+    int chunk_size;
+    int total_chunks;
+    struct cache_entry* hash_next;
+    struct cache_entry* lru_prev;   // Phía mới dùng
+    struct cache_entry* lru_next;   // Phía cũ
+} cache_entry_t;
+
+static pthread_mutex_t g_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry_t* g_buckets[FILE_CACHE_BUCKETS];
+static cache_entry_t* g_lru_head = NULL;
+static cache_entry_t* g_lru_tail = NULL;
+static size_t g_capacity = 0;
+static file_cache_stats_t g_stats;
+
+static unsigned bucket_of(const unsigned char* hash) {
+    // Hash đã phân bố đều, lấy luôn vài byte đầu
+    return ((unsigned)hash[0] | (unsigned)hash[1] << 8) % FILE_CACHE_BUCKETS;
+}
+
+static void lru_unlink(cache_entry_t* entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        g_lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        g_lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(cache_entry_t* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = g_lru_head;
+    if (g_lru_head) {
+        g_lru_head->lru_prev = entry;
+    } else {
+        g_lru_tail = entry;
+    }
+    g_lru_head = entry;
+}
+
+static cache_entry_t* find_locked(const unsigned char* hash) {
+    for (cache_entry_t* entry = g_buckets[bucket_of(hash)]; entry; entry = entry->hash_next) {
+        if (memcmp(entry->hash, hash, SHA256_DIGEST_LENGTH) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Bỏ entry khỏi cache. Người nhận đang phát từ spool vẫn giữ tham chiếu riêng.
+static void evict_locked(cache_entry_t* entry) {
+    cache_entry_t** link = &g_buckets[bucket_of(entry->hash)];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    lru_unlink(entry);
+
+    g_stats.entries--;
+    g_stats.bytes -= (unsigned long)entry->file_size;
+    g_stats.evicted++;
+    spool_unref(entry->spool);
+    safe_free(entry);
+}
+
+void file_cache_init(size_t capacity) {
+    g_capacity = capacity;
+    g_stats.capacity = capacity;
+}
+
+int file_cache_enabled(void) {
+    return g_capacity > 0;
+}
+
+// Một file không được chiếm quá 1/4 cache, tránh một file lớn đẩy hết file khác ra
+long file_cache_entry_max(void) {
+    return (long)(g_capacity / 4);
+}
+
+int file_cache_probe(const unsigned char* hash, long file_size, file_cache_hit_t* hit) {
+    pthread_mutex_lock(&g_cache_mutex);
+    cache_entry_t* entry = find_locked(hash);
+    if (!entry || entry->file_size != file_size) {
+        pthread_mutex_unlock(&g_cache_mutex);
+        return 0;
+    }
+    spool_ref(entry->spool);
+    hit->spool = entry->spool;
+    hit->file_size = entry->file_size;
+    hit->chunk_size = entry->chunk_size;
+    hit->total_chunks = entry->total_chunks;
+    pthread_mutex_unlock(&g_cache_mutex);
+    return 1;
+}
+
+void file_cache_count_miss(void) {
+    pthread_mutex_lock(&g_cache_mutex);
+    g_stats.misses++;
+    pthread_mutex_unlock(&g_cache_mutex);
+}
+
+int file_cache_lookup(const unsigned char* hash, long file_size, file_cache_hit_t* hit) {
+    pthread_mutex_lock(&g_cache_mutex);
+    cache_entry_t* entry = find_locked(hash);
+    if (!entry || entry->file_size != file_size) {
+        g_stats.misses++;
+        pthread_mutex_unlock(&g_cache_mutex);
+        return 0;
+    }
+    lru_unlink(entry);
+    lru_push_front(entry);
+    spool_ref(entry->spool);
+    hit->spool = entry->spool;
+    hit->file_size = entry->file_size;
+    hit->chunk_size = entry->chunk_size;
+    hit->total_chunks = entry->total_chunks;
+    g_stats.hits++;
+    g_stats.bytes_saved += (unsigned long)file_size;
+    pthread_mutex_unlock(&g_cache_mutex);
+    return 1;
+}
+
+void file_cache_insert(const unsigned char* hash, file_spool_t* spool, long file_size,
+                       int chunk_size, int total_chunks) {
+    if (!file_cache_enabled() || file_size <= 0 || file_size > file_cache_entry_max()) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_cache_mutex);
+    cache_entry_t* existing = find_locked(hash);
+    if (existing) {
+        // Hai người gửi cùng nội dung song song: giữ bản cũ
+        lru_unlink(existing);
+        lru_push_front(existing);
+        pthread_mutex_unlock(&g_cache_mutex);
+        return;
+    }
+    while (g_lru_tail && g_stats.bytes + (unsigned long)file_size > g_capacity) {
+        evict_locked(g_lru_tail);
+    }
+
+    cache_entry_t* entry = (cache_entry_t*)safe_malloc(sizeof(cache_entry_t));
+    memset(entry, 0, sizeof(cache_entry_t));
+    memcpy(entry->hash, hash, SHA256_DIGEST_LENGTH);
+    spool_ref(spool);
+    entry->spool = spool;
+    entry->file_size = file_size;
+    entry->chunk_size = chunk_size;
+    entry->total_chunks = total_chunks;
+
+    unsigned bucket = bucket_of(hash);
+    entry->hash_next = g_buckets[bucket];
+    g_buckets[bucket] = entry;
+    lru_push_front(entry);
+    g_stats.entries++;
+    g_stats.bytes += (unsigned long)file_size;
+    g_stats.inserted++;
+    pthread_mutex_unlock(&g_cache_mutex);
+}
+
+void file_cache_get_stats(file_cache_stats_t* stats) {
+    pthread_mutex_lock(&g_cache_mutex);
+    *stats = g_stats;
+    pthread_mutex_unlock(&g_cache_mutex);
+}
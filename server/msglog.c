@@ -0,0 +1,981 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Phòng được chia vào shard theo room_id. Mỗi shard là một chuỗi segment append-only,
+// tên file <shard>-<id>.log, chỉ segment cuối còn được ghi.
+#define MSGLOG_SHARDS 4
+#define MSGLOG_SEGMENT_SIZE (16 * 1024 * 1024)
+// Cứ MSGLOG_INDEX_STRIDE tin của một phòng có một mục index (và luôn có ở tin đầu mỗi segment)
+#define MSGLOG_INDEX_STRIDE 32
+// Tin chưa ghi của một shard vượt ngưỡng này (đĩa không theo kịp) thì bị bỏ và đếm lại,
+// appender giữ room->mutex nên không được chờ flusher
+#define MSGLOG_PENDING_MAX (4 * 1024 * 1024)
+// Chu kỳ ghi khi không fdatasync
+#define MSGLOG_WRITE_MS 10
+#define MSGLOG_ROOM_BUCKETS 64
+
+typedef enum {
+    RECORD_ROOM = 1,     // Phòng tồn tại: tên và seq mới nhất. Đầu mỗi segment có một bản cho mọi phòng
+    RECORD_MESSAGE,      // Frame v2 của một tin chat
+    RECORD_DROP          // Phòng bị xóa hoặc chuyển sang mã hóa
+} record_type_t;
+
+// Header 32 byte ghi nguyên trạng (file chỉ đọc lại trên cùng máy), payload theo sau.
+// crc phủ từ type tới hết payload, record hỏng hoặc ghi dở ở cuối log bị cắt khi khôi phục.
+typedef struct {
+    uint32_t crc;
+    uint32_t len;
+    uint8_t type;
+    uint8_t reserved[3];
+    int32_t room_id;
+    int64_t seq;
+    int64_t timestamp;
+} record_header_t;
+
+#define RECORD_CRC_OFFSET offsetof(record_header_t, type)
+
+typedef struct segment {
+    struct segment* next;
+    unsigned long id;
+    int fd;                       // Chỉ segment đang ghi còn mở
+    unsigned char* map;           // mmap chỉ đọc, reader đọc tới size
+    size_t map_len;
+    size_t size;                  // Byte đã ghi xuống file
+    time_t last_timestamp;        // Tin mới nhất trong segment, dùng cho retention theo tuổi
+    int refs;                     // Shard giữ một tham chiếu, mỗi reader đang đọc giữ thêm một
+} segment_t;
+
+typedef struct {
+    long seq;
+    time_t timestamp;
+    segment_t* segment;
+    size_t offset;
+} index_entry_t;
+
+typedef struct log_room {
+    struct log_room* next;
+    int room_id;
+    char name[MAX_ROOM_NAME_LEN];
+    long head_seq;
+    index_entry_t* index;         // Tăng dần theo seq, các segment đã xóa bị cắt khỏi đầu
+    int index_count;
+    int index_capacity;
+} log_room_t;
+
+typedef struct {
+    unsigned char* data;
+    size_t len;
+    size_t cap;
+} log_buffer_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    log_buffer_t pending;         // Record chưa ghi, flusher đổi chỗ với spare
+    log_buffer_t spare;
+    int write_failed;             // Lô trước ghi lỗi, chỉ báo lỗi một lần cho tới khi ghi lại được
+    segment_t* oldest;
+    segment_t* active;
+    size_t disk_bytes;
+    log_room_t* rooms[MSGLOG_ROOM_BUCKETS];
+    int index;
+} log_shard_t;
+
+static log_shard_t g_shards[MSGLOG_SHARDS];
+static msglog_config_t g_log_config;
+static int g_log_enabled = 0;
+static int g_log_max_room_id = 0;
+static volatile int g_log_stop = 0;
+static pthread_t g_flusher;
+static uint32_t g_crc_table[256];
+static msglog_stats_t g_log_stats;
+static pthread_mutex_t g_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        g_crc_table[i] = c;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const unsigned char* data, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = g_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t record_crc(const record_header_t* header, const unsigned char* payload) {
+    uint32_t crc = crc_update(0, (const unsigned char*)header + RECORD_CRC_OFFSET,
+                              sizeof(record_header_t) - RECORD_CRC_OFFSET);
+    return crc_update(crc, payload, header->len);
+}
+
+static log_shard_t* shard_of(int room_id) {
+    return &g_shards[(unsigned)room_id % MSGLOG_SHARDS];
+}
+
+static log_room_t** room_link(log_shard_t* shard, int room_id) {
+    log_room_t** link = &shard->rooms[((unsigned)room_id / MSGLOG_SHARDS) % MSGLOG_ROOM_BUCKETS];
+    while (*link && (*link)->room_id != room_id) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static log_room_t* room_upsert(log_shard_t* shard, int room_id, const char* name) {
+    log_room_t** link = room_link(shard, room_id);
+    if (!*link) {
+        log_room_t* room = (log_room_t*)safe_malloc(sizeof(log_room_t));
+        memset(room, 0, sizeof(log_room_t));
+        room->room_id = room_id;
+        *link = room;
+    }
+    strncpy((*link)->name, name, MAX_ROOM_NAME_LEN - 1);
+    return *link;
+}
+
+static void room_remove(log_shard_t* shard, int room_id) {
+    log_room_t** link = room_link(shard, room_id);
+    log_room_t* room = *link;
+    if (room) {
+        *link = room->next;
+        safe_free(room->index);
+        safe_free(room);
+    }
+}
+
+// Mục index cho tin vừa ghi ở (segment, offset) nếu tới lượt
+static void room_index_add(log_room_t* room, long seq, time_t timestamp, segment_t* segment, size_t offset) {
+    if (room->index_count > 0) {
+        index_entry_t* last = &room->index[room->index_count - 1];
+        if (seq <= last->seq || (last->segment == segment && seq - last->seq < MSGLOG_INDEX_STRIDE)) {
+            return;
+        }
+    }
+    if (room->index_count == room->index_capacity) {
+        int capacity = room->index_capacity ? room->index_capacity * 2 : 16;
+        index_entry_t* index = (index_entry_t*)realloc(room->index, sizeof(index_entry_t) * (size_t)capacity);
+        if (!index) {
+            return;
+        }
+        room->index = index;
+        room->index_capacity = capacity;
+    }
+    index_entry_t* entry = &room->index[room->index_count++];
+    entry->seq = seq;
+    entry->timestamp = timestamp;
+    entry->segment = segment;
+    entry->offset = offset;
+}
+
+static void buffer_append(log_buffer_t* buffer, const record_header_t* header, const void* payload) {
+    size_t need = buffer->len + sizeof(record_header_t) + header->len;
+    if (need > buffer->cap) {
+        size_t cap = buffer->cap ? buffer->cap * 2 : 64 * 1024;
+        while (cap < need) {
+            cap *= 2;
+        }
+        unsigned char* data = (unsigned char*)realloc(buffer->data, cap);
+        if (!data) {
+            error_exit("Memory allocation failed");
+        }
+        buffer->data = data;
+        buffer->cap = cap;
+    }
+    memcpy(buffer->data + buffer->len, header, sizeof(record_header_t));
+    memcpy(buffer->data + buffer->len + sizeof(record_header_t), payload, header->len);
+    buffer->len = need;
+}
+
+static void record_init(record_header_t* header, record_type_t type, int room_id, long seq,
+                        time_t timestamp, const void* payload, size_t len) {
+    memset(header, 0, sizeof(record_header_t));
+    header->len = (uint32_t)len;
+    header->type = (uint8_t)type;
+    header->room_id = room_id;
+    header->seq = seq;
+    header->timestamp = timestamp;
+    header->crc = record_crc(header, (const unsigned char*)payload);
+}
+
+// Phải giữ shard->mutex. Chỉ tin chat bị bỏ khi pending đầy: ROOM/DROP hiếm và nhỏ,
+// thiếu chúng thì khôi phục dựng sai danh sách phòng.
+static void shard_queue_locked(log_shard_t* shard, record_type_t type, int room_id, long seq,
+                               time_t timestamp, const void* payload, size_t len) {
+    if (type == RECORD_MESSAGE && shard->pending.len > MSGLOG_PENDING_MAX) {
+        __atomic_fetch_add(&g_log_stats.records_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    record_header_t header;
+    record_init(&header, type, room_id, seq, timestamp, payload, len);
+    buffer_append(&shard->pending, &header, payload);
+}
+
+static void segment_path(char* path, size_t cap, int shard, unsigned long id) {
+    snprintf(path, cap, "%s/%d-%010lu.log", g_log_config.dir, shard, id);
+}
+
+static segment_t* segment_open(int shard, unsigned long id, int create) {
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), shard, id);
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    // Map cả kích thước segment ngay từ đầu: reader thấy dữ liệu mới ghi mà không phải map lại
+    size_t map_len = (size_t)st.st_size > MSGLOG_SEGMENT_SIZE ? (size_t)st.st_size : MSGLOG_SEGMENT_SIZE;
+    void* map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    segment_t* segment = (segment_t*)safe_malloc(sizeof(segment_t));
+    memset(segment, 0, sizeof(segment_t));
+    segment->id = id;
+    segment->fd = fd;
+    segment->map = (unsigned char*)map;
+    segment->map_len = map_len;
+    segment->size = (size_t)st.st_size;
+    segment->last_timestamp = time(NULL);
+    segment->refs = 1;
+    return segment;
+}
+
+// Phải giữ shard->mutex
+static void segment_unref_locked(segment_t* segment) {
+    if (--segment->refs == 0) {
+        if (segment->fd >= 0) {
+            close(segment->fd);
+        }
+        munmap(segment->map, segment->map_len);
+        safe_free(segment);
+    }
+}
+
+static void sync_directory(void) {
+    int fd = open(g_log_config.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void segment_sync(segment_t* segment) {
+    if (g_log_config.sync_ms <= 0 || segment->fd < 0) {
+        return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fdatasync(segment->fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long ns = (unsigned long)((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec));
+    pthread_mutex_lock(&g_stats_mutex);
+    g_log_stats.syncs++;
+    g_log_stats.sync_ns_total += ns;
+    if (ns > g_log_stats.sync_ns_max) {
+        g_log_stats.sync_ns_max = ns;
+    }
+    pthread_mutex_unlock(&g_stats_mutex);
+}
+
+static int write_fully(int fd, const unsigned char* data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Đóng segment đang ghi và mở segment mới, bắt đầu bằng bản ghi ROOM của mọi phòng trong shard
+// để retention xóa segment cũ không làm mất phòng. Chỉ flusher gọi.
+static int shard_roll(log_shard_t* shard) {
+    segment_t* old = shard->active;
+    unsigned long id = old ? old->id + 1 : 1;
+    segment_t* segment = segment_open(shard->index, id, 1);
+    if (!segment) {
+        if (!shard->write_failed) {
+            perror("Không thể tạo segment log");
+        }
+        return -1;
+    }
+    sync_directory();
+
+    log_buffer_t checkpoint = { NULL, 0, 0 };
+    pthread_mutex_lock(&shard->mutex);
+    for (int b = 0; b < MSGLOG_ROOM_BUCKETS; b++) {
+        for (log_room_t* room = shard->rooms[b]; room; room = room->next) {
+            record_header_t header;
+            size_t name_len = strlen(room->name);
+            record_init(&header, RECORD_ROOM, room->room_id, room->head_seq, 0, room->name, name_len);
+            buffer_append(&checkpoint, &header, room->name);
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (checkpoint.len > 0 && write_fully(segment->fd, checkpoint.data, checkpoint.len, 0) < 0) {
+        // Segment thiếu checkpoint sẽ bị cắt khi khôi phục: bỏ nó, lượt flush sau roll lại
+        if (!shard->write_failed) {
+            perror("Ghi log thất bại, giữ lại record để ghi lại");
+        }
+        free(checkpoint.data);
+        char path[PATH_MAX];
+        segment_path(path, sizeof(path), shard->index, id);
+        unlink(path);
+        segment_unref_locked(segment);
+        return -1;
+    }
+    free(checkpoint.data);
+
+    if (old) {
+        // Segment cũ phải bền trước khi dữ liệu sau nó được coi là đã commit
+        segment_sync(old);
+        close(old->fd);
+        old->fd = -1;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    segment->size = checkpoint.len;
+    shard->disk_bytes += segment->size;
+    if (old) {
+        old->next = segment;
+    } else {
+        shard->oldest = segment;
+    }
+    shard->active = segment;
+    pthread_mutex_unlock(&shard->mutex);
+    return 0;
+}
+
+// Ghi một lô record của shard, cập nhật index sau khi dữ liệu đã nằm trong file.
+// *written là số byte đầu lô đã ghi xong (luôn trọn record), kể cả khi lỗi giữa chừng.
+static int shard_write_batch(log_shard_t* shard, const unsigned char* data, size_t len, size_t* written) {
+    size_t done = 0;
+    *written = 0;
+    while (done < len) {
+        if (!shard->active && shard_roll(shard) < 0) {
+            return -1;
+        }
+        segment_t* segment = shard->active;
+
+        // Lấy nhiều record nhất vừa segment hiện tại (ít nhất một nếu segment đang rỗng)
+        size_t end = done;
+        while (end < len) {
+            const record_header_t* header = (const record_header_t*)(data + end);
+            size_t record_len = sizeof(record_header_t) + header->len;
+            if (segment->size + (end - done) + record_len > MSGLOG_SEGMENT_SIZE &&
+                (end > done || segment->size > 0)) {
+                break;
+            }
+            end += record_len;
+        }
+        if (end == done) {
+            if (shard_roll(shard) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (write_fully(segment->fd, data + done, end - done, (off_t)segment->size) < 0) {
+            if (!shard->write_failed) {
+                perror("Ghi log thất bại, giữ lại record để ghi lại");
+            }
+            return -1;
+        }
+
+        pthread_mutex_lock(&shard->mutex);
+        size_t offset = segment->size;
+        for (size_t at = done; at < end;) {
+            const record_header_t* header = (const record_header_t*)(data + at);
+            if (header->type == RECORD_MESSAGE) {
+                log_room_t* room = *room_link(shard, header->room_id);
+                if (room) {
+                    room_index_add(room, header->seq, header->timestamp, segment, offset + (at - done));
+                }
+                if (header->timestamp > segment->last_timestamp) {
+                    segment->last_timestamp = header->timestamp;
+                }
+            }
+            at += sizeof(record_header_t) + header->len;
+        }
+        segment->size += end - done;
+        shard->disk_bytes += end - done;
+        pthread_mutex_unlock(&shard->mutex);
+        done = end;
+        *written = done;
+    }
+    return 0;
+}
+
+// Xóa segment cũ nhất khi shard vượt dung lượng hoặc tuổi cho phép. Segment đang ghi luôn được giữ.
+static void shard_retain(log_shard_t* shard) {
+    size_t retain = g_log_config.retain_bytes / MSGLOG_SHARDS;
+    time_t cutoff = g_log_config.retain_seconds > 0 ? time(NULL) - g_log_config.retain_seconds : 0;
+
+    pthread_mutex_lock(&shard->mutex);
+    while (shard->oldest && shard->oldest != shard->active &&
+           ((retain > 0 && shard->disk_bytes > retain) || shard->oldest->last_timestamp < cutoff)) {
+        segment_t* segment = shard->oldest;
+        for (int b = 0; b < MSGLOG_ROOM_BUCKETS; b++) {
+            for (log_room_t* room = shard->rooms[b]; room; room = room->next) {
+                int drop = 0;
+                while (drop < room->index_count && room->index[drop].segment == segment) {
+                    drop++;
+                }
+                if (drop > 0) {
+                    room->index_count -= drop;
+                    memmove(room->index, room->index + drop, sizeof(index_entry_t) * (size_t)room->index_count);
+                }
+            }
+        }
+        shard->oldest = segment->next;
+        shard->disk_bytes -= segment->size;
+
+        char path[PATH_MAX];
+        segment_path(path, sizeof(path), shard->index, segment->id);
+        unlink(path);
+        // Reader đang đọc vẫn giữ mmap cho tới khi trả tham chiếu
+        segment_unref_locked(segment);
+        __atomic_fetch_add(&g_log_stats.segments_retired, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+// Một lượt group commit: ghi pending của mọi shard rồi fdatasync mỗi segment đã ghi một lần
+static void log_flush(void) {
+    unsigned long records = 0;
+    int written[MSGLOG_SHARDS] = { 0 };
+
+    for (int i = 0; i < MSGLOG_SHARDS; i++) {
+        log_shard_t* shard = &g_shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        log_buffer_t batch = shard->pending;
+        shard->pending = shard->spare;
+        shard->pending.len = 0;
+        pthread_mutex_unlock(&shard->mutex);
+
+        size_t done = 0;
+        int failed = 0;
+        if (batch.len > 0) {
+            failed = shard_write_batch(shard, batch.data, batch.len, &done) < 0;
+            for (size_t at = 0; at < done;) {
+                at += sizeof(record_header_t) + ((const record_header_t*)(batch.data + at))->len;
+                records++;
+            }
+            written[i] = done > 0;
+            pthread_mutex_lock(&g_stats_mutex);
+            g_log_stats.bytes_written += done;
+            if (failed) {
+                g_log_stats.write_errors++;
+            }
+            pthread_mutex_unlock(&g_stats_mutex);
+        }
+
+        pthread_mutex_lock(&shard->mutex);
+        shard->write_failed = failed;
+        if (done < batch.len) {
+            // Phần chưa ghi đứng trước mọi thứ append trong lúc ghi, lượt sau ghi lại đúng thứ tự
+            memmove(batch.data, batch.data + done, batch.len - done);
+            batch.len -= done;
+            for (size_t at = 0; at < shard->pending.len;) {
+                const record_header_t* header = (const record_header_t*)(shard->pending.data + at);
+                buffer_append(&batch, header, header + 1);
+                at += sizeof(record_header_t) + header->len;
+            }
+            log_buffer_t fresh = shard->pending;
+            shard->pending = batch;
+            batch = fresh;
+        }
+        batch.len = 0;
+        shard->spare = batch;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    for (int i = 0; i < MSGLOG_SHARDS; i++) {
+        if (written[i]) {
+            segment_sync(g_shards[i].active);
+        }
+    }
+    if (records > 0) {
+        pthread_mutex_lock(&g_stats_mutex);
+        g_log_stats.records_written += records;
+        if (g_log_config.sync_ms > 0) {
+            g_log_stats.records_synced += records;
+        }
+        pthread_mutex_unlock(&g_stats_mutex);
+    }
+
+    for (int i = 0; i < MSGLOG_SHARDS; i++) {
+        shard_retain(&g_shards[i]);
+    }
+}
+
+static void* flusher_loop(void* arg) {
+    (void)arg;
+    int interval_ms = g_log_config.sync_ms > 0 ? g_log_config.sync_ms : MSGLOG_WRITE_MS;
+    struct timespec interval = { interval_ms / 1000, (long)(interval_ms % 1000) * 1000000L };
+    while (!g_log_stop) {
+        nanosleep(&interval, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+// Áp một record khi đọc lại log lúc khởi động
+static void recover_record(log_shard_t* shard, segment_t* segment, size_t offset,
+                           const record_header_t* header, const unsigned char* payload) {
+    if (header->room_id > g_log_max_room_id) {
+        g_log_max_room_id = header->room_id;
+    }
+    log_room_t* room = *room_link(shard, header->room_id);
+    switch (header->type) {
+        case RECORD_ROOM: {
+            char name[MAX_ROOM_NAME_LEN];
+            size_t len = header->len < MAX_ROOM_NAME_LEN ? header->len : MAX_ROOM_NAME_LEN - 1;
+            memcpy(name, payload, len);
+            name[len] = '\0';
+            room = room_upsert(shard, header->room_id, name);
+            if (header->seq > room->head_seq) {
+                room->head_seq = header->seq;
+            }
+            break;
+        }
+        case RECORD_MESSAGE:
+            if (room) {
+                if (header->seq > room->head_seq) {
+                    room->head_seq = header->seq;
+                }
+                room_index_add(room, header->seq, header->timestamp, segment, offset);
+            }
+            if (header->timestamp > segment->last_timestamp) {
+                segment->last_timestamp = header->timestamp;
+            }
+            break;
+        case RECORD_DROP:
+            room_remove(shard, header->room_id);
+            break;
+    }
+}
+
+// Quét một segment, trả về số byte hợp lệ (record cuối ghi dở hoặc hỏng thì dừng trước nó)
+static size_t recover_segment(log_shard_t* shard, segment_t* segment) {
+    size_t at = 0;
+    segment->last_timestamp = 0;
+    while (at + sizeof(record_header_t) <= segment->size) {
+        record_header_t header;
+        memcpy(&header, segment->map + at, sizeof(record_header_t));
+        if (header.len > segment->size - at - sizeof(record_header_t) ||
+            header.type < RECORD_ROOM || header.type > RECORD_DROP) {
+            break;
+        }
+        const unsigned char* payload = segment->map + at + sizeof(record_header_t);
+        if (record_crc(&header, payload) != header.crc) {
+            break;
+        }
+        recover_record(shard, segment, at, &header, payload);
+        g_log_stats.records_recovered++;
+        at += sizeof(record_header_t) + header.len;
+    }
+    return at;
+}
+
+static int compare_ids(const void* a, const void* b) {
+    unsigned long x = *(const unsigned long*)a;
+    unsigned long y = *(const unsigned long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int recover_shard(log_shard_t* shard) {
+    DIR* dir = opendir(g_log_config.dir);
+    if (!dir) {
+        return -1;
+    }
+    unsigned long* ids = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int index;
+        unsigned long id;
+        char tail;
+        if (sscanf(entry->d_name, "%d-%lu.lo%c", &index, &id, &tail) != 3 || tail != 'g' ||
+            index != shard->index) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            ids = (unsigned long*)realloc(ids, sizeof(unsigned long) * capacity);
+            if (!ids) {
+                error_exit("Memory allocation failed");
+            }
+        }
+        ids[count++] = id;
+    }
+    closedir(dir);
+    qsort(ids, count, sizeof(unsigned long), compare_ids);
+
+    for (size_t i = 0; i < count; i++) {
+        segment_t* segment = segment_open(shard->index, ids[i], 0);
+        if (!segment) {
+            perror("Không thể mở segment log");
+            continue;
+        }
+        size_t valid = recover_segment(shard, segment);
+        if (valid < segment->size) {
+            fprintf(stderr, "Log shard %d segment %lu: bỏ %zu byte hỏng ở cuối\n",
+                    shard->index, segment->id, segment->size - valid);
+            if (ftruncate(segment->fd, (off_t)valid) < 0) {
+                perror("ftruncate");
+            }
+            segment->size = valid;
+        }
+        if (segment->last_timestamp == 0) {
+            segment->last_timestamp = time(NULL);
+        }
+        if (shard->active) {
+            // Chỉ segment cuối còn được ghi tiếp
+            close(shard->active->fd);
+            shard->active->fd = -1;
+            shard->active->next = segment;
+        } else {
+            shard->oldest = segment;
+        }
+        shard->active = segment;
+        shard->disk_bytes += segment->size;
+    }
+    free(ids);
+    return 0;
+}
+
+int msglog_open(const msglog_config_t* config) {
+    g_log_config = *config;
+    if (mkdir(config->dir, 0700) < 0 && errno != EEXIST) {
+        perror("Không thể tạo thư mục log");
+        return -1;
+    }
+    crc_init();
+    memset(&g_log_stats, 0, sizeof(g_log_stats));
+    g_log_max_room_id = 0;
+    for (int i = 0; i < MSGLOG_SHARDS; i++) {
+        log_shard_t* shard = &g_shards[i];
+        memset(shard, 0, sizeof(log_shard_t));
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->index = i;
+        if (recover_shard(shard) < 0) {
+            perror("Không thể đọc thư mục log");
+            return -1;
+        }
+    }
+
+    g_log_stop = 0;
+    if (pthread_create(&g_flusher, NULL, flusher_loop, NULL) != 0) {
+        return -1;
+    }
+    g_log_enabled = 1;
+    return 0;
+}
+
+void msglog_close(void) {
+    if (!g_log_enabled) {
+        return;
+    }
+    g_log_stop = 1;
+    pthread_join(g_flusher, NULL);
+    // Có thể gọi từ thread tín hiệu khi reactor vẫn chạy: append sau điểm này bị bỏ qua
+    for (int i = 0; i < MSGLOG_SHARDS; i++) {
+        pthread_mutex_lock(&g_shards[i].mutex);
+    }
+    g_log_enabled = 0;
+    for (int i = MSGLOG_SHARDS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&g_shards[i].mutex);
+    }
+    // Lượt cuối: mọi thứ đã append đều được ghi và sync
+    log_flush();
+    for (int i = 0; i < MSGLOG_SHARDS; i++) {
+        if (g_shards[i].pending.len > 0) {
+            fprintf(stderr, "Log shard %d: bỏ %zu byte chưa ghi được\n", i, g_shards[i].pending.len);
+        }
+    }
+
+    // Mutex được giữ lại: thread khác có thể vẫn đang chờ nó để rồi thấy log đã đóng
+    for (int i = 0; i < MSGLOG_SHARDS; i++) {
+        log_shard_t* shard = &g_shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        while (shard->oldest) {
+            segment_t* next = shard->oldest->next;
+            segment_unref_locked(shard->oldest);
+            shard->oldest = next;
+        }
+        for (int b = 0; b < MSGLOG_ROOM_BUCKETS; b++) {
+            while (shard->rooms[b]) {
+                room_remove(shard, shard->rooms[b]->room_id);
+            }
+        }
+        free(shard->pending.data);
+        free(shard->spare.data);
+        memset(&shard->pending, 0, sizeof(log_buffer_t));
+        memset(&shard->spare, 0, sizeof(log_buffer_t));
+        shard->active = NULL;
+        shard->disk_bytes = 0;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+int msglog_enabled(void) {
+    return g_log_enabled;
+}
+
+void msglog_room_created(int room_id, const char* name, long seq) {
+    log_shard_t* shard = shard_of(room_id);
+    pthread_mutex_lock(&shard->mutex);
+    if (!g_log_enabled) {
+        pthread_mutex_unlock(&shard->mutex);
+        return;
+    }
+    log_room_t* room = room_upsert(shard, room_id, name);
+    room->head_seq = seq;
+    shard_queue_locked(shard, RECORD_ROOM, room_id, seq, 0, room->name, strlen(room->name));
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void msglog_room_dropped(int room_id) {
+    log_shard_t* shard = shard_of(room_id);
+    pthread_mutex_lock(&shard->mutex);
+    if (*room_link(shard, room_id)) {
+        room_remove(shard, room_id);
+        shard_queue_locked(shard, RECORD_DROP, room_id, 0, 0, "", 0);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void msglog_append(int room_id, long seq, time_t timestamp, const void* frame, size_t len) {
+    log_shard_t* shard = shard_of(room_id);
+    pthread_mutex_lock(&shard->mutex);
+    log_room_t* room = *room_link(shard, room_id);
+    if (room) {
+        room->head_seq = seq;
+        shard_queue_locked(shard, RECORD_MESSAGE, room_id, seq, timestamp, frame, len);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+// visit được gọi ngoài khóa (trên bản chụp) nên có thể đọc log của phòng
+void msglog_for_each_room(msglog_room_visit_t visit, void* arg) {
+    for (int i = 0; i < MSGLOG_SHARDS; i++) {
+        log_shard_t* shard = &g_shards[i];
+        log_room_t* snapshot = NULL;
+        int count = 0;
+        int capacity = 0;
+        pthread_mutex_lock(&shard->mutex);
+        for (int b = 0; b < MSGLOG_ROOM_BUCKETS; b++) {
+            for (log_room_t* room = shard->rooms[b]; room; room = room->next) {
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : 16;
+                    snapshot = (log_room_t*)realloc(snapshot, sizeof(log_room_t) * (size_t)capacity);
+                    if (!snapshot) {
+                        error_exit("Memory allocation failed");
+                    }
+                }
+                snapshot[count++] = *room;
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        for (int j = 0; j < count; j++) {
+            visit(arg, snapshot[j].room_id, snapshot[j].name, snapshot[j].head_seq);
+        }
+        free(snapshot);
+    }
+}
+
+int msglog_max_room_id(void) {
+    return g_log_max_room_id;
+}
+
+// Vị trí bắt đầu đọc: mục index cuối cùng thỏa before(entry), hoặc mục đầu tiên.
+// Phải giữ shard->mutex. Trả về -1 nếu phòng chưa có tin nào trên đĩa.
+static int index_seek_seq(const log_room_t* room, long seq) {
+    if (room->index_count == 0) {
+        return -1;
+    }
+    int lo = 0;
+    int hi = room->index_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (room->index[mid].seq <= seq) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static int index_seek_time(const log_room_t* room, time_t timestamp) {
+    if (room->index_count == 0) {
+        return -1;
+    }
+    int lo = 0;
+    int hi = room->index_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (room->index[mid].timestamp < timestamp) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// Duyệt các tin của phòng từ mục index start. Các segment được giữ tham chiếu và duyệt
+// ngoài khóa nên flusher không phải chờ. visit trả về khác 0 để dừng.
+typedef int (*record_visit_t)(void* arg, const record_header_t* header, const unsigned char* payload);
+
+static void scan_room(log_shard_t* shard, const log_room_t* room, int start, record_visit_t visit, void* arg) {
+    int count = 0;
+    for (segment_t* segment = room->index[start].segment; segment; segment = segment->next) {
+        count++;
+    }
+    segment_t** segments = (segment_t**)safe_malloc(sizeof(segment_t*) * (size_t)count);
+    size_t* sizes = (size_t*)safe_malloc(sizeof(size_t) * (size_t)count);
+    int room_id = room->room_id;
+    size_t offset = room->index[start].offset;
+    segment_t* segment = room->index[start].segment;
+    for (int i = 0; i < count; i++, segment = segment->next) {
+        segment->refs++;
+        segments[i] = segment;
+        sizes[i] = segment->size;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    int stop = 0;
+    for (int i = 0; i < count && !stop; i++) {
+        size_t at = i == 0 ? offset : 0;
+        while (!stop && at + sizeof(record_header_t) <= sizes[i]) {
+            record_header_t header;
+            memcpy(&header, segments[i]->map + at, sizeof(record_header_t));
+            if (header.type == RECORD_MESSAGE && header.room_id == room_id) {
+                stop = visit(arg, &header, segments[i]->map + at + sizeof(record_header_t));
+            }
+            at += sizeof(record_header_t) + header.len;
+        }
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    for (int i = 0; i < count; i++) {
+        segment_unref_locked(segments[i]);
+    }
+    safe_free(segments);
+    safe_free(sizes);
+}
+
+typedef struct {
+    long first;
+    long last;
+    room_history_visit_t visit;
+    void* arg;
+    int count;
+} read_range_t;
+
+static int read_range_visit(void* arg, const record_header_t* header, const unsigned char* payload) {
+    read_range_t* range = (read_range_t*)arg;
+    if (header->seq > range->last) {
+        return 1;
+    }
+    if (header->seq < range->first) {
+        return 0;
+    }
+    range->count++;
+    return range->visit(range->arg, header->seq, payload, header->len);
+}
+
+int msglog_read_room(int room_id, long first, long last, room_history_visit_t visit, void* arg) {
+    log_shard_t* shard = shard_of(room_id);
+    read_range_t range = { first, last, visit, arg, 0 };
+    pthread_mutex_lock(&shard->mutex);
+    log_room_t* room = *room_link(shard, room_id);
+    int start = room ? index_seek_seq(room, first) : -1;
+    if (start >= 0) {
+        scan_room(shard, room, start, read_range_visit, &range);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return range.count;
+}
+
+typedef struct {
+    time_t timestamp;
+    long seq;
+} seek_time_t;
+
+static int seek_time_visit(void* arg, const record_header_t* header, const unsigned char* payload) {
+    (void)payload;
+    seek_time_t* seek = (seek_time_t*)arg;
+    if (header->timestamp >= seek->timestamp) {
+        seek->seq = header->seq;
+        return 1;
+    }
+    return 0;
+}
+
+long msglog_room_seq_at(int room_id, time_t timestamp) {
+    log_shard_t* shard = shard_of(room_id);
+    seek_time_t seek = { timestamp, 0 };
+    pthread_mutex_lock(&shard->mutex);
+    log_room_t* room = *room_link(shard, room_id);
+    int start = room ? index_seek_time(room, timestamp) : -1;
+    if (start >= 0) {
+        seek.seq = room->head_seq + 1;
+        scan_room(shard, room, start, seek_time_visit, &seek);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return seek.seq;
+}
+
+void msglog_get_stats(msglog_stats_t* stats) {
+    pthread_mutex_lock(&g_stats_mutex);
+    *stats = g_log_stats;
+    pthread_mutex_unlock(&g_stats_mutex);
+    stats->records_dropped = __atomic_load_n(&g_log_stats.records_dropped, __ATOMIC_RELAXED);
+    stats->segments_retired = __atomic_load_n(&g_log_stats.segments_retired, __ATOMIC_RELAXED);
+    stats->segments = 0;
+    stats->disk_bytes = 0;
+    stats->rooms = 0;
+    for (int i = 0; i < MSGLOG_SHARDS; i++) {
+        log_shard_t* shard = &g_shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (segment_t* segment = shard->oldest; segment; segment = segment->next) {
+            stats->segments++;
+        }
+        stats->disk_bytes += shard->disk_bytes;
+        for (int b = 0; b < MSGLOG_ROOM_BUCKETS; b++) {
+            for (log_room_t* room = shard->rooms[b]; room; room = room->next) {
+                stats->rooms++;
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include <errno.h>
+#include <sched.h>
+#include <sys/epoll.h>
+
+#define REACTOR_MAX_EVENTS 64
+// Giới hạn số frame xử lý cho một client mỗi lần epoll báo, tránh một client chiếm reactor
+#define REACTOR_FRAMES_PER_WAKEUP 32
+
+typedef struct {
+    int index;
+    int epoll_fd;
+    int listen_fd;            // Listener SO_REUSEPORT của shard, đăng ký với data.ptr = NULL
+    int cpu;                  // CPU reactor được gắn vào, -1 = không gắn
+    pthread_t thread;
+    // Client còn frame đầy đủ trong rx nhưng đã hết lượt ở lần wakeup trước.
+    // epoll không báo lại cho dữ liệu đã nằm trong buffer nên reactor tự giữ danh sách này.
+    client_t* backlog;
+} reactor_t;
+
+static reactor_t* g_reactors = NULL;
+static int g_reactor_count = 0;
+
+// Xử lý mọi frame đã nằm trong rx, chỉ gọi recv khi cần thêm dữ liệu.
+// Trả về -1 khi kết nối cần đóng, 1 nếu hết lượt mà rx có thể còn frame.
+static int reactor_read_client(client_t* client) {
+    int frames = 0;
+
+    while (1) {
+        frame_t frame;
+        int rc = parse_buffered_frame(&client->rx, client->wire_version,
+                                      client_expected_frame(client), &frame);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc > 0) {
+            if (dispatch_frame(client, &frame) < 0) {
+                return -1;
+            }
+            if (++frames >= REACTOR_FRAMES_PER_WAKEUP) {
+                return 1;
+            }
+            continue;
+        }
+
+        // Một recv lấy hết những gì kernel đang có, có thể là nhiều frame
+        rc = client_receive(client, 0);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == CLIENT_RECV_WOULD_BLOCK) {
+            return 0;
+        }
+        if (rc == CLIENT_RECV_RELAYED && ++frames >= REACTOR_FRAMES_PER_WAKEUP) {
+            return 1;
+        }
+    }
+}
+
+static void backlog_push(reactor_t* reactor, client_t* client) {
+    if (!client->rx_backlogged) {
+        client->rx_backlogged = 1;
+        client->backlog_next = reactor->backlog;
+        reactor->backlog = client;
+    }
+}
+
+static void backlog_remove(reactor_t* reactor, client_t* client) {
+    client_t** link = &reactor->backlog;
+    while (*link && *link != client) {
+        link = &(*link)->backlog_next;
+    }
+    if (*link) {
+        *link = client->backlog_next;
+    }
+    client->rx_backlogged = 0;
+}
+
+static void reactor_close_client(reactor_t* reactor, client_t* client) {
+    if (client->rx_backlogged) {
+        backlog_remove(reactor, client);
+    }
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL);
+    printf("Client %s (ID: %d) đã ngắt kết nối\n", client->username, client->client_id);
+    disconnect_client(client);
+}
+
+static void reactor_service_client(reactor_t* reactor, client_t* client, uint32_t events) {
+    if ((events & EPOLLOUT) && client_flush_output(client) < 0) {
+        reactor_close_client(reactor, client);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        int rc = reactor_read_client(client);
+        if (rc < 0) {
+            reactor_close_client(reactor, client);
+        } else if (rc > 0) {
+            backlog_push(reactor, client);
+        }
+    }
+}
+
+// Nhận các kết nối mới trên listener của shard, client thuộc luôn reactor này
+static void reactor_accept(reactor_t* reactor) {
+    for (int i = 0; i < REACTOR_MAX_EVENTS; i++) {
+        int client_socket = accept4(reactor->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept failed");
+            }
+            return;
+        }
+
+        client_t* client = register_client(client_socket, reactor->index);
+        printf("Client (ID: %d) đã kết nối\n", client->client_id);
+        if (reactor_add_client(client) < 0) {
+            perror("epoll_ctl failed");
+            disconnect_client(client);
+        }
+    }
+}
+
+static void* reactor_loop(void* arg) {
+    reactor_t* reactor = (reactor_t*)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (1) {
+        // Còn backlog thì chỉ poll nhanh rồi quay lại xử lý tiếp
+        int count = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS,
+                               reactor->backlog ? 0 : -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                reactor_accept(reactor);
+            } else {
+                reactor_service_client(reactor, (client_t*)events[i].data.ptr, events[i].events);
+            }
+        }
+
+        client_t* pending = reactor->backlog;
+        reactor->backlog = NULL;
+        while (pending) {
+            client_t* client = pending;
+            pending = client->backlog_next;
+            client->rx_backlogged = 0;
+            reactor_service_client(reactor, client, EPOLLIN);
+        }
+    }
+    return NULL;
+}
+
+// CPU thứ index (vòng lại) trong các CPU process được phép chạy, -1 nếu không xác định được
+static int pick_cpu(int index) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return -1;
+    }
+    int count = CPU_COUNT(&allowed);
+    if (count == 0) {
+        return -1;
+    }
+    int target = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+static int reactor_listen(reactor_t* reactor) {
+    reactor->listen_fd = create_socket();
+    setup_server_socket(reactor->listen_fd, g_config.port, g_config.backlog, 1);
+    if (set_nonblocking(reactor->listen_fd) < 0) {
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev);
+}
+
+int start_reactors(int thread_count) {
+    g_reactors = (reactor_t*)safe_malloc(sizeof(reactor_t) * (size_t)thread_count);
+    g_reactor_count = thread_count;
+
+    for (int i = 0; i < thread_count; i++) {
+        reactor_t* reactor = &g_reactors[i];
+        reactor->index = i;
+        reactor->backlog = NULL;
+        reactor->cpu = g_config.pin_cpus ? pick_cpu(i) : -1;
+        reactor->epoll_fd = epoll_create1(0);
+        if (reactor->epoll_fd < 0) {
+            perror("epoll_create1 failed");
+            return -1;
+        }
+        if (reactor_listen(reactor) < 0) {
+            perror("Không thể tạo listener cho reactor");
+            return -1;
+        }
+
+        // Gắn CPU ngay khi tạo thread để reactor không bắt đầu chạy trên core khác
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (reactor->cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(reactor->cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        int rc = pthread_create(&reactor->thread, &attr, reactor_loop, reactor);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            perror("Reactor thread creation failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void wait_reactors(void) {
+    for (int i = 0; i < g_reactor_count; i++) {
+        pthread_join(g_reactors[i].thread, NULL);
+    }
+}
+
+int reactor_add_client(client_t* client) {
+    reactor_t* reactor = &g_reactors[client->shard % g_reactor_count];
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    client->epoll_fd = reactor->epoll_fd;
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client->socket_fd, &ev);
+}
@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "../common/wire.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+// Spool lớn hơn mức này thì chuyển sang spool mới, spool cũ được giải phóng
+// khi người nhận cuối cùng gửi xong phần của mình
+#define RELAY_SPOOL_MAX (8 * 1024 * 1024)
+
+// Trạng thái relay zero-copy của một client đang gửi file
+struct file_relay {
+    int pipe_fds[2];          // splice socket -> pipe -> spool
+    file_spool_t* spool;      // NULL: kernel không hỗ trợ, luôn dùng đường copy
+    int lowat;                // SO_RCVLOWAT đang đặt cho socket, 0 = mặc định
+
+    // Chụp file vào cache. capture == NULL: spool chứa cả file từ offset 0, chunk i ở
+    // i * FILE_CHUNK_SIZE. Upload nén (hoặc chunk lệch chỗ) thì nội dung file được chép
+    // sang spool riêng capture, chunk nén được giải nén trước khi ghi.
+    int capturing;
+    file_spool_t* capture;
+    int capture_stream;       // Stream đang được chụp
+    int capture_next;         // Chunk tiếp theo phải đến
+    int total_chunks;
+    long file_size;
+    int has_expected;         // Upload sau offer: hash phải khớp
+    int expected_stream;
+    unsigned char expected[SHA256_DIGEST_LENGTH];
+};
+
+// Kết quả thử relay chunk đầu tiên trong socket
+typedef enum {
+    RELAY_DONE = 0,           // Đã relay xong một chunk
+    RELAY_WAIT,               // Chunk chưa về đủ, đã đặt SO_RCVLOWAT
+    RELAY_COPY,               // Frame này đi đường thường qua rx
+    RELAY_CLOSED
+} relay_result_t;
+
+static struct file_relay* relay_get(client_t* client) {
+    if (client->relay) {
+        return client->relay;
+    }
+
+    struct file_relay* relay = (struct file_relay*)slab_alloc(sizeof(struct file_relay));
+    if (!relay) {
+        error_exit("Memory allocation failed");
+    }
+    memset(relay, 0, sizeof(struct file_relay));
+    if (pipe2(relay->pipe_fds, O_CLOEXEC | O_NONBLOCK) == 0) {
+        relay->spool = spool_create();
+        if (!relay->spool) {
+            close(relay->pipe_fds[0]);
+            close(relay->pipe_fds[1]);
+        }
+    }
+    client->relay = relay;
+    return relay;
+}
+
+// Chỉ báo socket đọc được khi đã có ít nhất bytes byte (1 = mặc định)
+static void relay_set_lowat(client_t* client, struct file_relay* relay, int bytes) {
+    if (relay->lowat == bytes || (relay->lowat == 0 && bytes == 1)) {
+        return;
+    }
+    if (setsockopt(client->socket_fd, SOL_SOCKET, SO_RCVLOWAT, &bytes, sizeof(bytes)) == 0) {
+        relay->lowat = bytes == 1 ? 0 : bytes;
+    }
+}
+
+void relay_release(client_t* client) {
+    struct file_relay* relay = client->relay;
+    if (!relay) {
+        return;
+    }
+    relay_set_lowat(client, relay, 1);
+    if (relay->capture) {
+        spool_unref(relay->capture);
+    }
+    if (relay->spool) {
+        close(relay->pipe_fds[0]);
+        close(relay->pipe_fds[1]);
+        spool_unref(relay->spool);
+    }
+    slab_free(relay, sizeof(struct file_relay));
+    client->relay = NULL;
+}
+
+static int recv_exact(int socket_fd, void* buf, size_t len) {
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t bytes = recv(socket_fd, p, len, 0);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return -1;
+        }
+        p += bytes;
+        len -= (size_t)bytes;
+    }
+    return 0;
+}
+
+// Chờ tới khi socket có đủ bytes byte. Nếu đã chờ mà vẫn thiếu thì peer đã đóng
+// kết nối hoặc lỗi: trả frame về đường thường để phát hiện như mọi frame khác.
+static relay_result_t relay_wait_for(client_t* client, struct file_relay* relay, int bytes) {
+    if (relay->lowat == bytes) {
+        relay_set_lowat(client, relay, 1);
+        return RELAY_COPY;
+    }
+    relay_set_lowat(client, relay, bytes);
+    return RELAY_WAIT;
+}
+
+// Chuyển len byte payload từ socket vào cuối spool mà không copy qua user space.
+// Chỉ gọi khi cả frame đã nằm trong socket nên splice không phải chờ.
+static int relay_splice_payload(client_t* client, struct file_relay* relay, size_t len) {
+    // Đang chụp thẳng trong spool thì file phải nằm liền trong một spool,
+    // file_cache_entry_max giới hạn kích thước
+    if ((!relay->capturing || relay->capture) && relay->spool->size + (off_t)len > RELAY_SPOOL_MAX) {
+        file_spool_t* fresh = spool_create();
+        if (!fresh) {
+            return -1;
+        }
+        spool_unref(relay->spool);
+        relay->spool = fresh;
+    }
+
+    size_t left = len;
+    while (left > 0) {
+        ssize_t moved = splice(client->socket_fd, NULL, relay->pipe_fds[1], NULL, left,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            return -1;
+        }
+        left -= (size_t)moved;
+    }
+    return spool_append_from_pipe(relay->spool, relay->pipe_fds[0], len);
+}
+
+static void relay_capture_stop(struct file_relay* relay) {
+    relay->capturing = 0;
+    if (relay->capture) {
+        spool_unref(relay->capture);
+        relay->capture = NULL;
+    }
+}
+
+// Chuyển sang chụp vào spool riêng: chép các chunk đã chụp (nằm ở đầu spool relay)
+static int relay_capture_detach(struct file_relay* relay) {
+    file_spool_t* capture = spool_create();
+    if (!capture) {
+        return -1;
+    }
+    unsigned char buf[4 * FILE_CHUNK_SIZE];
+    off_t len = (off_t)relay->capture_next * FILE_CHUNK_SIZE;
+    for (off_t offset = 0; offset < len; offset += (off_t)sizeof(buf)) {
+        size_t part = len - offset < (off_t)sizeof(buf) ? (size_t)(len - offset) : sizeof(buf);
+        if (spool_read(relay->spool, offset, buf, part) < 0 || spool_append(capture, buf, part) < 0) {
+            spool_unref(capture);
+            return -1;
+        }
+    }
+    relay->capture = capture;
+    return 0;
+}
+
+// Ghi nội dung gốc của chunk vào spool chụp riêng. payload là data của chunk nếu đã nằm
+// trong user space, NULL thì đọc lại từ spool relay ở offset. Trả về độ dài bản gốc, -1 nếu lỗi.
+static int relay_capture_append(struct file_relay* relay, const file_transfer_t* ft, off_t offset,
+                                const void* payload) {
+    unsigned char packed[FILE_CHUNK_SIZE];
+    unsigned char plain[FILE_CHUNK_SIZE];
+    if (ft->data_size <= 0 || ft->data_size > FILE_CHUNK_SIZE) {
+        return -1;
+    }
+    if (!payload) {
+        if (spool_read(relay->spool, offset, packed, (size_t)ft->data_size) < 0) {
+            return -1;
+        }
+        payload = packed;
+    }
+    int len = ft->data_size;
+    if (ft->compressed) {
+        len = decompress_buffer((const unsigned char*)payload, (size_t)ft->data_size, plain, sizeof(plain));
+        payload = plain;
+    }
+    if (len < 0 || spool_append(relay->capture, payload, (size_t)len) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+// Chunk vừa nằm trong spool ở offset: còn liền mạch thì tiếp tục chụp, lệch thì bỏ.
+// Chunk 0 quyết định có chụp hay không. Chunk nén có độ dài thay đổi nên từ chunk nén đầu
+// tiên, nội dung gốc được chép sang spool riêng. Chunk của stream khác chen vào hoặc chunk
+// sai thứ tự làm file không còn liền mạch nên dừng chụp.
+static void relay_capture_track(struct file_relay* relay, const file_transfer_t* ft, off_t offset,
+                                const void* payload) {
+    if (ft->chunk_number == 0) {
+        relay_capture_stop(relay);
+        relay->capturing = file_cache_enabled() && !ft->encrypted &&
+                           ft->file_size > 0 && ft->file_size <= file_cache_entry_max() &&
+                           ft->total_chunks > 0;
+        relay->capture_stream = ft->stream_id;
+        relay->capture_next = 0;
+        relay->total_chunks = ft->total_chunks;
+        relay->file_size = ft->file_size;
+    }
+    if (!relay->capturing) {
+        return;
+    }
+    if (ft->stream_id != relay->capture_stream || ft->chunk_number != relay->capture_next) {
+        relay_capture_stop(relay);
+        return;
+    }
+    if (!relay->capture && (ft->compressed || offset != (off_t)ft->chunk_number * FILE_CHUNK_SIZE) &&
+        relay_capture_detach(relay) < 0) {
+        relay_capture_stop(relay);
+        return;
+    }
+    int len = relay->capture ? relay_capture_append(relay, ft, offset, payload) : ft->data_size;
+    int last = ft->chunk_number == relay->total_chunks - 1;
+    long end = (long)ft->chunk_number * FILE_CHUNK_SIZE + len;
+    if (len < 0 || (!last && len != FILE_CHUNK_SIZE) || (last && end != relay->file_size)) {
+        relay_capture_stop(relay);
+        return;
+    }
+    relay->capture_next++;
+}
+
+void relay_capture_copied(client_t* client, const file_transfer_t* ft) {
+    if (!file_cache_enabled()) {
+        return;
+    }
+    struct file_relay* relay = relay_get(client);
+    if (!relay->spool || (ft->chunk_number != 0 && !relay->capturing)) {
+        return;
+    }
+    if (ft->chunk_number == 0) {
+        relay_capture_stop(relay);
+    }
+    // Còn chụp thẳng trong spool thì payload được ghi bù vào spool như chunk đi đường splice
+    off_t offset = relay->spool->size;
+    if (!relay->capture && !ft->compressed &&
+        spool_append(relay->spool, ft->data, (size_t)ft->data_size) < 0) {
+        relay_capture_stop(relay);
+        return;
+    }
+    relay_capture_track(relay, ft, offset, ft->data);
+}
+
+void relay_expect_hash(client_t* client, int stream_id, const unsigned char* hash) {
+    struct file_relay* relay = relay_get(client);
+    memcpy(relay->expected, hash, SHA256_DIGEST_LENGTH);
+    relay->has_expected = 1;
+    relay->expected_stream = stream_id;
+}
+
+void relay_capture_finish(client_t* client, int stream_id) {
+    struct file_relay* relay = client->relay;
+    if (!relay) {
+        return;
+    }
+    int verify = relay->has_expected && relay->expected_stream == stream_id;
+    if (verify) {
+        relay->has_expected = 0;
+    }
+    if (!relay->capturing || relay->capture_stream != stream_id ||
+        relay->capture_next != relay->total_chunks) {
+        return;
+    }
+    file_spool_t* spool = relay->capture ? relay->capture : relay->spool;
+    spool_ref(spool);
+    relay_capture_stop(relay);
+
+    const unsigned char* data = spool_map(spool, (size_t)relay->file_size);
+    if (!data) {
+        spool_unref(spool);
+        return;
+    }
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(data, (size_t)relay->file_size, hash);
+    munmap((void*)data, (size_t)relay->file_size);
+
+    if (verify && memcmp(hash, relay->expected, SHA256_DIGEST_LENGTH) != 0) {
+        printf("Client %s gửi file không khớp hash đã offer, không đưa vào cache\n", client->username);
+        spool_unref(spool);
+        return;
+    }
+    file_cache_insert(hash, spool, relay->file_size, FILE_CHUNK_SIZE, relay->total_chunks);
+    spool_unref(spool);
+}
+
+// Relay chunk file đầu tiên trong socket khi rx đang rỗng: header đọc bình thường,
+// payload splice vào spool rồi sendfile tới từng người nhận
+static relay_result_t relay_try_chunk(client_t* client, struct file_relay* relay) {
+    unsigned char header[WIRE_FILE_HEADER_MAX];
+    int v2 = client->wire_version == WIRE_VERSION_V2;
+    size_t header_len = v2 ? sizeof(header) : offsetof(legacy_file_transfer_t, data);
+
+    ssize_t peeked = recv(client->socket_fd, header, header_len, MSG_PEEK);
+    if (peeked == 0) {
+        return RELAY_CLOSED;
+    }
+    if (peeked < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return RELAY_WAIT;
+        }
+        return RELAY_CLOSED;
+    }
+
+    size_t frame_len = sizeof(legacy_file_transfer_t);
+    if (v2) {
+        if ((size_t)peeked < WIRE_HEADER_SIZE) {
+            return relay_wait_for(client, relay, WIRE_HEADER_SIZE);
+        }
+        // Message xen giữa các chunk hoặc frame lỗi: để parser thường xử lý
+        if (wire_frame_type(header) != MSG_FILE_DATA) {
+            return RELAY_COPY;
+        }
+        frame_len = wire_frame_length(header);
+        if (frame_len == 0 || frame_len > WIRE_MAX_FRAME_SIZE) {
+            return RELAY_COPY;
+        }
+    }
+
+    int available = 0;
+    if (ioctl(client->socket_fd, FIONREAD, &available) < 0) {
+        return RELAY_COPY;
+    }
+    if ((size_t)available < frame_len) {
+        return relay_wait_for(client, relay, (int)frame_len);
+    }
+    relay_set_lowat(client, relay, 1);
+    metrics_mark_received();
+    metrics_add(METRIC_FRAMES_RECEIVED, 1);
+    trace_event(TRACE_FRAME_RECEIVED, (uint32_t)client->socket_fd, MSG_FILE_DATA);
+
+    file_transfer_t ft;
+    size_t data_len;
+    off_t offset;
+    if (v2) {
+        // Đã có cả frame nên lần peek lại luôn đủ header
+        peeked = recv(client->socket_fd, header, sizeof(header), MSG_PEEK);
+        if (peeked <= 0 ||
+            wire_decode_file_header(header, (size_t)peeked, &ft, &header_len, &data_len) <= 0) {
+            return RELAY_COPY;
+        }
+        if (recv_exact(client->socket_fd, header, header_len) < 0 ||
+            relay_splice_payload(client, relay, data_len) < 0) {
+            return RELAY_CLOSED;
+        }
+        offset = relay->spool->size - (off_t)data_len;
+    } else {
+        // v1 luôn gửi đủ FILE_CHUNK_SIZE byte data, data_size nằm sau phần data
+        legacy_file_transfer_t legacy;
+        size_t trailer = offsetof(legacy_file_transfer_t, data) + sizeof(legacy.data);
+        memset(&legacy, 0, sizeof(legacy));
+        if (recv_exact(client->socket_fd, &legacy, header_len) < 0 ||
+            relay_splice_payload(client, relay, sizeof(legacy.data)) < 0 ||
+            recv_exact(client->socket_fd, (char*)&legacy + trailer, sizeof(legacy) - trailer) < 0) {
+            return RELAY_CLOSED;
+        }
+        legacy_to_file_transfer(&legacy, &ft);
+        offset = relay->spool->size - (off_t)sizeof(legacy.data);
+    }
+    // Chunk của stream chưa mở: payload đã nằm trong spool nhưng không gửi tới ai
+    if (!client_upload_find(client, ft.stream_id)) {
+        return RELAY_DONE;
+    }
+    relay_capture_track(relay, &ft, offset, NULL);
+
+    ft.sender_id = client->client_id;
+    broadcast_file_range_to_room(&g_server, client->current_room_id, &ft, relay->spool, offset,
+                                 client->client_id);
+    return finish_file_chunk(client, &ft) < 0 ? RELAY_CLOSED : RELAY_DONE;
+}
+
+// Số byte còn thiếu của frame đang dở trong rx, để lần đọc dừng đúng ở ranh giới frame
+static size_t rx_frame_remaining(client_t* client) {
+    unsigned char header[WIRE_LENGTH_SIZE];
+    size_t have = ringbuf_peek(&client->rx, header, sizeof(header));
+    size_t need = frame_size_needed(header, have, client->wire_version, FRAME_FILE_CHUNK);
+    size_t used = ringbuf_used(&client->rx);
+    return need > used ? need - used : SIZE_MAX;
+}
+
+static int wait_readable(int socket_fd) {
+    struct pollfd pfd = { .fd = socket_fd, .events = POLLIN };
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int client_receive(client_t* client, int wait) {
+    while (1) {
+        size_t max = SIZE_MAX;
+        struct file_relay* relay = client->rx_mode == RX_FILE_CHUNK ? relay_get(client) : NULL;
+        if (relay && relay->spool) {
+            if (ringbuf_used(&client->rx) == 0) {
+                relay_result_t rc = relay_try_chunk(client, relay);
+                if (rc == RELAY_DONE) {
+                    return CLIENT_RECV_RELAYED;
+                }
+                if (rc == RELAY_CLOSED) {
+                    return -1;
+                }
+                if (rc == RELAY_COPY) {
+                    relay_set_lowat(client, relay, 1);
+                } else if (rc == RELAY_WAIT) {
+                    if (!wait) {
+                        return CLIENT_RECV_WOULD_BLOCK;
+                    }
+                    if (wait_readable(client->socket_fd) < 0) {
+                        return -1;
+                    }
+                    continue;
+                }
+            }
+            // Frame đã bắt đầu trong rx thì đọc vừa đủ phần còn lại, frame sau lại relay được
+            max = rx_frame_remaining(client);
+        }
+
+        ssize_t bytes = wait ? fill_receive_ring(client->socket_fd, &client->rx, max)
+                             : ringbuf_recv(&client->rx, client->socket_fd, max);
+        if (bytes > 0) {
+            return CLIENT_RECV_BUFFERED;
+        }
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return CLIENT_RECV_WOULD_BLOCK;
+        }
+        return -1;
+    }
+}
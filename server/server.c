@@ -1,336 +1,949 @@
-#include "../common/protocol.h"
+#include "server.h"
+#include "../common/uring.h"
+#include <openssl/crypto.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
 
 server_t g_server;
+server_config_t g_config = {
+    .mode = SERVER_MODE_EPOLL,
+    .port = SERVER_PORT,
+    .reactor_threads = 0,
+    .io_backend = IO_BACKEND_SOCKET,
+    .queue_high = CLIENT_QUEUE_HIGH_DEFAULT,
+    .queue_low = CLIENT_QUEUE_LOW_DEFAULT,
+    .slow_policy = SLOW_CONSUMER_EVICT,
+    .stats_interval = 0,
+    .backlog = SERVER_LISTEN_BACKLOG,
+    .pin_cpus = 1,
+    .worker_threads = 0,
+    .file_cache_bytes = (size_t)FILE_CACHE_DEFAULT_MB * 1024 * 1024,
+    .log_dir = NULL,
+    .log_sync_ms = MSGLOG_SYNC_DEFAULT_MS,
+    .log_retain_bytes = (size_t)MSGLOG_RETAIN_DEFAULT_MB * 1024 * 1024,
+    .log_retain_seconds = 0,
+    .metrics_port = 0,
+    .trace_events = 0,
+    .trace_dir = ".",
+};
+
+typedef int (*message_handler_t)(client_t* client, message_t* msg);
 
 void initialize_server() {
     init_crypto();
-    
-    g_server.server_socket = create_socket();
-    g_server.rooms = NULL;
-    g_server.clients = NULL;
-    g_server.next_room_id = 1;
-    g_server.next_client_id = 1;
-    pthread_mutex_init(&g_server.rooms_mutex, NULL);
-    pthread_mutex_init(&g_server.clients_mutex, NULL);
+
+    // Chế độ epoll: mỗi reactor có listener SO_REUSEPORT riêng và là một shard của registry
+    g_server.server_socket = -1;
+    if (g_config.mode == SERVER_MODE_THREADED) {
+        g_server.server_socket = create_socket();
+    }
+    registry_init(&g_server, g_config.reactor_threads);
 }
 
 void cleanup_server() {
-    pthread_mutex_lock(&g_server.rooms_mutex);
-    room_t* room = g_server.rooms;
-    while (room) {
-        room_t* next = room->next;
-        cleanup_room(room);
-        room = next;
-    }
-    pthread_mutex_unlock(&g_server.rooms_mutex);
-
-    // Cleanup all clients
-    
-    pthread_mutex_lock(&g_server.clients_mutex);
-    client_t* client = g_server.clients;
-    while (client) {
-        client_t* next = client->next;
-        cleanup_client(client);
-        client = next;
-    }
-    pthread_mutex_unlock(&g_server.clients_mutex);
-
-    // Destroy mutexes
-    
-    pthread_mutex_destroy(&g_server.rooms_mutex);
-    pthread_mutex_destroy(&g_server.clients_mutex);
-
-    close(g_server.server_socket);
+    // Cleanup all rooms and clients
+    registry_destroy(&g_server);
+    msglog_close();
+
+    if (g_server.server_socket >= 0) {
+        close(g_server.server_socket);
+    }
     cleanup_crypto();
 }
 
+static void init_server_message(message_t* msg, message_type_t type) {
+    memset(msg, 0, sizeof(message_t));
+    msg->type = type;
+    strcpy(msg->username, "SERVER");
+}
+
+static void send_error(client_t* client, const char* text) {
+    message_t response;
+    init_server_message(&response, MSG_ERROR);
+    strncpy(response.content, text, MAX_MESSAGE_LEN - 1);
+    send_to_client(client, &response);
+}
+
+static void broadcast_leave(client_t* client) {
+    message_t broadcast;
+    init_server_message(&broadcast, MSG_BROADCAST);
+    snprintf(broadcast.content, MAX_MESSAGE_LEN, "%s đã rời khỏi phòng", client->username);
+    broadcast.timestamp = time(NULL);
+    broadcast_to_room(&g_server, client->current_room_id, &broadcast, client->client_id);
+}
+
+static int handle_join(client_t* client, message_t* msg) {
+    strncpy(client->username, msg->username, MAX_USERNAME_LEN - 1);
+    client->username[MAX_USERNAME_LEN - 1] = '\0';
+
+    message_t response;
+    init_server_message(&response, MSG_WELCOME);
+    snprintf(response.content, MAX_MESSAGE_LEN,
+            "Chào mừng %s đến với chat server!", client->username);
+    response.client_id = client->client_id;
+
+    // Thỏa thuận wire version và feature: chỉ đổi khi client chưa ở phòng nào,
+    // để không có broadcast nào được encode theo cách cũ sau WELCOME
+    int agreed = client->wire_version;
+    int features = client->wire_features;
+    if ((msg->room_id & WIRE_NEGOTIATE_MASK) == WIRE_NEGOTIATE_MAGIC) {
+        int requested = msg->room_id & WIRE_NEGOTIATE_VERSION_MASK;
+        if (client->current_room_id == -1 && requested >= WIRE_VERSION_LEGACY) {
+            agreed = requested < WIRE_VERSION_MAX ? requested : WIRE_VERSION_MAX;
+            // Feature chỉ có ở v2
+            features = agreed == WIRE_VERSION_V2 ? msg->room_id & WIRE_FEATURES_SUPPORTED : 0;
+        }
+        response.room_id = WIRE_NEGOTIATE_MAGIC | features | agreed;
+    }
+
+    // WELCOME vẫn dùng version hiện tại, các frame sau dùng version mới
+    send_to_client(client, &response);
+    client->wire_version = agreed;
+    client->wire_features = features;
+    return 0;
+}
+
+static int handle_create_room(client_t* client, message_t* msg) {
+    msg->content[MAX_MESSAGE_LEN - 1] = '\0';
+    // Phòng mới có thể bị người khác vào rồi rời (và xóa) ngay sau khi tạo
+    ebr_enter();
+    room_t* new_room = create_room(&g_server, msg->content);
+
+    message_t response;
+    init_server_message(&response, MSG_ROOM_CREATED);
+    strcpy(response.content, new_room->room_name);
+    response.room_id = new_room->room_id;
+    ebr_exit();
+    send_to_client(client, &response);
+    return 0;
+}
+
+static int handle_join_room(client_t* client, message_t* msg) {
+    ebr_enter();
+    room_t* room = find_room(&g_server, msg->room_id);
+    if (!room) {
+        ebr_exit();
+        send_error(client, "Phòng không tồn tại");
+        return 0;
+    }
+    // Rời rồi vào lại có thể làm phòng trống và bị xóa
+    if (client->current_room_id == msg->room_id) {
+        ebr_exit();
+        send_error(client, "Bạn đã ở trong phòng này");
+        return 0;
+    }
+
+    if (client->current_room_id != -1) {
+        remove_client_from_room(&g_server, client->current_room_id, client);
+    }
+
+    // Join new room
+    if (add_client_to_room(&g_server, msg->room_id, client) < 0) {
+        ebr_exit();
+        send_error(client, "Phòng không tồn tại");
+        return 0;
+    }
+
+    // Nếu phòng đã bật mã hóa, gửi key cho client
+    if (room->encryption_enabled) {
+        send_room_key_to_client(client, room);
+    }
+
+    // Thông báo cho các client khác
+    message_t broadcast;
+    init_server_message(&broadcast, MSG_BROADCAST);
+    snprintf(broadcast.content, MAX_MESSAGE_LEN, "%s đã tham gia phòng", client->username);
+    broadcast.timestamp = time(NULL);
+    broadcast_to_room(&g_server, msg->room_id, &broadcast, client->client_id);
+
+    message_t response;
+    init_server_message(&response, MSG_ROOM_JOINED);
+    strcpy(response.content, room->room_name);
+    response.room_id = room->room_id;
+    send_to_client(client, &response);
+
+    // Người vào sau nhận các tin gần nhất, client vào lại chỉ nhận phần đã lỡ
+    replay_room_history(client, room, msg->history_seq);
+    ebr_exit();
+    return 0;
+}
+
+static int handle_history_request(client_t* client, message_t* msg) {
+    if (client->current_room_id == -1 || client->current_room_id != msg->room_id) {
+        send_error(client, "Bạn chưa tham gia phòng này");
+        return 0;
+    }
+
+    ebr_enter();
+    room_t* room = find_room(&g_server, msg->room_id);
+    if (room && replay_room_history(client, room, msg->history_seq) == 0) {
+        message_t response;
+        init_server_message(&response, MSG_HISTORY_END);
+        strcpy(response.content, "Không có tin nhắn mới");
+        response.room_id = room->room_id;
+        response.history_seq = __atomic_load_n(&room->history_seq, __ATOMIC_ACQUIRE);
+        send_to_client(client, &response);
+    }
+    ebr_exit();
+    return 0;
+}
+
+static int handle_enable_encryption(client_t* client, message_t* msg) {
+    if (client->current_room_id == -1) {
+        send_error(client, "Bạn cần tham gia phòng trước");
+        return 0;
+    }
+
+    ebr_enter();
+    room_t* room = find_room(&g_server, client->current_room_id);
+    if (room) {
+        if (room->encryption_enabled) {
+            send_error(client, "Phòng này đã được mã hóa rồi");
+        } else {
+            // Client cũ không gửi chế độ (0): giữ CBC như trước
+            room_cipher_t cipher = msg->is_encrypted == ROOM_CIPHER_GCM ? ROOM_CIPHER_GCM : ROOM_CIPHER_CBC;
+            enable_room_encryption(&g_server, room, cipher);
+        }
+    }
+    ebr_exit();
+    return 0;
+}
+
+static int handle_leave_room(client_t* client, message_t* msg) {
+    (void)msg;
+    if (client->current_room_id != -1) {
+        broadcast_leave(client);
+        remove_client_from_room(&g_server, client->current_room_id, client);
+
+        message_t response;
+        init_server_message(&response, MSG_ROOM_LEFT);
+        strcpy(response.content, "Đã rời khỏi phòng");
+        send_to_client(client, &response);
+    }
+    return 0;
+}
+
+static int handle_chat_message(client_t* client, message_t* msg) {
+    if (client->current_room_id == -1) {
+        send_error(client, "Bạn chưa tham gia phòng nào");
+        return 0;
+    }
+
+    // Broadcast message với timestamp và username, broadcast_to_room tự bỏ qua nếu phòng không còn
+    message_t broadcast = *msg;
+    broadcast.type = MSG_BROADCAST;
+    strcpy(broadcast.username, client->username);
+    broadcast.timestamp = time(NULL);
+    broadcast.client_id = client->client_id;
+    broadcast.room_id = client->current_room_id;
+    broadcast_to_room(&g_server, client->current_room_id, &broadcast, -1);
+    return 0;
+}
+
+static void broadcast_file_notification(client_t* client, const message_t* request) {
+    message_t notification;
+    init_server_message(&notification, MSG_FILE_NOTIFICATION);
+    strcpy(notification.username, client->username);
+    snprintf(notification.content, MAX_MESSAGE_LEN,
+            "[FILE] %.100s đang gửi file: %.300s", client->username, request->content);
+    notification.client_id = client->client_id;
+    notification.stream_id = request->stream_id;
+    broadcast_to_room(&g_server, client->current_room_id, &notification, client->client_id);
+}
+
+upload_stream_t* client_upload_find(client_t* client, int stream_id) {
+    for (int i = 0; i < client->upload_count; i++) {
+        if (client->uploads[i].stream_id == stream_id) {
+            return &client->uploads[i];
+        }
+    }
+    return NULL;
+}
+
+// Mở stream cho lần gửi file: chunk mang stream_id này được relay tới phòng cho đến chunk cuối.
+// v2 mở được nhiều stream cùng lúc và message vẫn xen giữa các chunk; v1 chỉ có stream 0.
+// Stream không mở được thì người gửi nhận MSG_FILE_REJECT để dừng gửi chunk.
+static int begin_file_upload(client_t* client, const message_t* msg) {
+    const char* reason = NULL;
+    // File rỗng không có chunk nào để đóng stream. v1 không mang kích thước.
+    if (client->wire_version == WIRE_VERSION_V2 && msg->file_size <= 0) {
+        reason = "File rỗng";
+    } else if (client_upload_find(client, msg->stream_id)) {
+        reason = "Stream này đang gửi file khác";
+    } else if (client->upload_count >= MAX_UPLOAD_STREAMS) {
+        reason = "Đang gửi quá nhiều file cùng lúc";
+    }
+    if (reason) {
+        message_t reject;
+        init_server_message(&reject, MSG_FILE_REJECT);
+        snprintf(reject.content, MAX_MESSAGE_LEN, "%s: %.300s", reason, msg->content);
+        reject.client_id = client->client_id;
+        reject.stream_id = msg->stream_id;
+        send_to_client(client, &reject);
+        return -1;
+    }
+
+    upload_stream_t* upload = &client->uploads[client->upload_count++];
+    upload->stream_id = msg->stream_id;
+    strncpy(upload->filename, msg->content, MAX_FILENAME_LEN - 1);
+    upload->filename[MAX_FILENAME_LEN - 1] = '\0';
+    client->rx_mode = RX_FILE_CHUNK;
+    return 0;
+}
+
+static int handle_file_request(client_t* client, message_t* msg) {
+    if (client->current_room_id == -1) {
+        send_error(client, "Bạn chưa tham gia phòng nào");
+        return 0;
+    }
+
+    if (begin_file_upload(client, msg) == 0) {
+        broadcast_file_notification(client, msg);
+    }
+    return 0;
+}
+
+// Nhận upload sau offer: nội dung nhận được phải khớp hash đã offer mới vào cache
+static void accept_offered_upload(client_t* client, const message_t* offer, const unsigned char* hash) {
+    if (begin_file_upload(client, offer) < 0) {
+        return;
+    }
+    broadcast_file_notification(client, offer);
+    relay_expect_hash(client, offer->stream_id, hash);
+
+    message_t accept;
+    init_server_message(&accept, MSG_FILE_ACCEPT);
+    strncpy(accept.content, offer->content, MAX_MESSAGE_LEN - 1);
+    accept.stream_id = offer->stream_id;
+    send_to_client(client, &accept);
+}
+
+// Phát file trong cache tới phòng và báo người gửi xong luôn, không upload byte nào
+static void send_cached_file(client_t* client, const message_t* offer, const file_cache_hit_t* hit) {
+    broadcast_file_notification(client, offer);
+
+    file_transfer_t header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.filename, offer->content, sizeof(header.filename) - 1);
+    strncpy(header.sender_name, client->username, sizeof(header.sender_name) - 1);
+    header.sender_id = client->client_id;
+    header.file_size = hit->file_size;
+    header.total_chunks = hit->total_chunks;
+    header.stream_id = offer->stream_id;
+    broadcast_cached_file_to_room(&g_server, client->current_room_id, &header, hit->spool,
+                                  hit->chunk_size, client->client_id);
+
+    message_t complete;
+    init_server_message(&complete, MSG_FILE_COMPLETE);
+    snprintf(complete.content, MAX_MESSAGE_LEN,
+            "File %.300s đã được gửi thành công (từ cache)", offer->content);
+    complete.stream_id = offer->stream_id;
+    send_to_client(client, &complete);
+}
+
+// Bản trong cache là plaintext nên không được phát vào phòng mã hóa
+static int room_allows_cached_files(client_t* client) {
+    ebr_enter();
+    room_t* room = find_room(&g_server, client->current_room_id);
+    int allowed = room && !room->encryption_enabled;
+    ebr_exit();
+    return allowed;
+}
+
+static int challenge_read_spool(void* arg, long offset, unsigned char* buf, size_t len) {
+    return spool_read((file_spool_t*)arg, (off_t)offset, buf, len);
+}
+
+// Hỏi người gửi vài đoạn nội dung do server chọn: hash và kích thước có thể lộ ra ngoài,
+// chỉ người thật sự có file mới trả lời được. -1 nếu không hỏi được (upload như thường).
+static int send_file_challenge(client_t* client, const message_t* offer, const unsigned char* hash,
+                               const file_cache_hit_t* hit) {
+    // Offer lại trên stream đang chờ thì thay câu hỏi cũ
+    int index = 0;
+    while (index < client->challenge_count && client->challenges[index].stream_id != offer->stream_id) {
+        index++;
+    }
+    if (index == MAX_UPLOAD_STREAMS) {
+        return -1;
+    }
+    file_challenge_t* challenge = &client->challenges[index];
+    unsigned char nonce[FILE_PROOF_NONCE_SIZE];
+    if (RAND_bytes(nonce, sizeof(nonce)) != 1 ||
+        file_proof_digest(nonce, hit->file_size, challenge_read_spool, hit->spool, challenge->proof) < 0) {
+        return -1;
+    }
+    challenge->stream_id = offer->stream_id;
+    challenge->file_size = offer->file_size;
+    memcpy(challenge->hash, hash, SHA256_DIGEST_LENGTH);
+    strncpy(challenge->filename, offer->content, MAX_FILENAME_LEN - 1);
+    challenge->filename[MAX_FILENAME_LEN - 1] = '\0';
+    if (index == client->challenge_count) {
+        client->challenge_count++;
+    }
+
+    message_t request;
+    init_server_message(&request, MSG_FILE_CHALLENGE);
+    key_to_hex(nonce, FILE_PROOF_NONCE_SIZE, request.file_hash_hex);
+    request.file_size = offer->file_size;
+    request.stream_id = offer->stream_id;
+    send_to_client(client, &request);
+    return 0;
+}
+
+// Offer theo hash: server đã có nội dung thì hỏi bằng chứng có file, đúng thì phát từ cache
+// (handle_file_proof); chưa có thì nhận upload như MSG_FILE_REQUEST rồi giữ lại cho lần sau
+static int handle_file_offer(client_t* client, message_t* msg) {
+    if (client->current_room_id == -1) {
+        send_error(client, "Bạn chưa tham gia phòng nào");
+        return 0;
+    }
+    if (strlen(msg->file_hash_hex) != SHA256_DIGEST_LENGTH * 2 || msg->file_size <= 0) {
+        send_error(client, "Offer file không hợp lệ");
+        return 0;
+    }
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    hex_to_key(msg->file_hash_hex, hash, SHA256_DIGEST_LENGTH);
+
+    // Mỗi offer được tính đúng một lần: miss ở đây, hoặc hit/miss khi lookup sau bằng chứng
+    file_cache_hit_t hit;
+    if (!room_allows_cached_files(client)) {
+        accept_offered_upload(client, msg, hash);
+        return 0;
+    }
+    if (!file_cache_probe(hash, msg->file_size, &hit)) {
+        file_cache_count_miss();
+        accept_offered_upload(client, msg, hash);
+        return 0;
+    }
+    int rc = send_file_challenge(client, msg, hash, &hit);
+    spool_unref(hit.spool);
+    if (rc < 0) {
+        accept_offered_upload(client, msg, hash);
+    }
+    return 0;
+}
+
+// Trả lời MSG_FILE_CHALLENGE. Bằng chứng sai, phòng vừa bật mã hóa hoặc file đã rời cache
+// thì người gửi upload như thường.
+static int handle_file_proof(client_t* client, message_t* msg) {
+    int index = 0;
+    while (index < client->challenge_count && client->challenges[index].stream_id != msg->stream_id) {
+        index++;
+    }
+    if (index == client->challenge_count) {
+        return 0;
+    }
+    file_challenge_t challenge = client->challenges[index];
+    client->challenges[index] = client->challenges[--client->challenge_count];
+
+    if (client->current_room_id == -1) {
+        send_error(client, "Bạn chưa tham gia phòng nào");
+        return 0;
+    }
+    message_t offer;
+    memset(&offer, 0, sizeof(message_t));
+    offer.type = MSG_FILE_OFFER;
+    strncpy(offer.content, challenge.filename, MAX_MESSAGE_LEN - 1);
+    offer.file_size = challenge.file_size;
+    offer.stream_id = challenge.stream_id;
+
+    unsigned char proof[SHA256_DIGEST_LENGTH];
+    int proven = strlen(msg->file_hash_hex) == SHA256_DIGEST_LENGTH * 2;
+    if (proven) {
+        hex_to_key(msg->file_hash_hex, proof, SHA256_DIGEST_LENGTH);
+        proven = CRYPTO_memcmp(proof, challenge.proof, SHA256_DIGEST_LENGTH) == 0;
+    }
+    if (!proven) {
+        printf("Client %s không chứng minh được có file %s, nhận upload\n", client->username, challenge.filename);
+    }
+
+    file_cache_hit_t hit;
+    if (!proven || !room_allows_cached_files(client) ||
+        !file_cache_lookup(challenge.hash, challenge.file_size, &hit)) {
+        accept_offered_upload(client, &offer, challenge.hash);
+        return 0;
+    }
+    send_cached_file(client, &offer, &hit);
+    spool_unref(hit.spool);
+    return 0;
+}
+
+static int handle_list_rooms(client_t* client, message_t* msg) {
+    (void)msg;
+    list_rooms(&g_server, client);
+    return 0;
+}
+
+// Mỗi dòng báo cáo là một MSG_STATS, số liệu cộng dồn từ lúc server khởi động
+static int handle_stats(client_t* client, message_t* msg) {
+    (void)msg;
+    metrics_snapshot_t* snapshot = (metrics_snapshot_t*)safe_malloc(sizeof(metrics_snapshot_t));
+    metrics_snapshot(snapshot);
+
+    message_t response;
+    init_server_message(&response, MSG_STATS);
+    double uptime = snapshot->uptime_seconds > 0 ? snapshot->uptime_seconds : 1.0;
+    snprintf(response.content, MAX_MESSAGE_LEN,
+             "uptime %.0fs, frames %lu, broadcasts %lu, file chunks %lu, file in %.2f MB/s, out %.2f MB/s",
+             snapshot->uptime_seconds, snapshot->counters[METRIC_FRAMES_RECEIVED],
+             snapshot->counters[METRIC_BROADCASTS], snapshot->counters[METRIC_FILE_CHUNKS],
+             (double)snapshot->counters[METRIC_FILE_BYTES_IN] / uptime / 1e6,
+             (double)snapshot->counters[METRIC_FILE_BYTES_OUT] / uptime / 1e6);
+    send_to_client(client, &response);
+
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        metrics_summary_t summary;
+        metrics_summarize(&snapshot->histograms[i], &summary);
+        snprintf(response.content, MAX_MESSAGE_LEN,
+                 "%s: n %lu, mean %.0f, p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu",
+                 metrics_histogram_name((metric_histogram_t)i), summary.count, summary.mean,
+                 summary.p50, summary.p90, summary.p99, summary.p999, summary.max);
+        send_to_client(client, &response);
+    }
+    safe_free(snapshot);
+    return 0;
+}
+
+static int handle_quit(client_t* client, message_t* msg) {
+    (void)msg;
+    if (client->current_room_id != -1) {
+        broadcast_leave(client);
+    }
+    printf("Client %s đã ngắt kết nối\n", client->username);
+    return -1;
+}
+
+static const message_handler_t message_handlers[] = {
+    [MSG_JOIN] = handle_join,
+    [MSG_CREATE_ROOM] = handle_create_room,
+    [MSG_JOIN_ROOM] = handle_join_room,
+    [MSG_LEAVE_ROOM] = handle_leave_room,
+    [MSG_MESSAGE] = handle_chat_message,
+    [MSG_LIST_ROOMS] = handle_list_rooms,
+    [MSG_QUIT] = handle_quit,
+    [MSG_FILE_REQUEST] = handle_file_request,
+    [MSG_FILE_OFFER] = handle_file_offer,
+    [MSG_FILE_PROOF] = handle_file_proof,
+    [MSG_HISTORY_REQUEST] = handle_history_request,
+    [MSG_ENABLE_ENCRYPTION] = handle_enable_encryption,
+    [MSG_STATS] = handle_stats,
+};
+
+int dispatch_message(client_t* client, message_t* msg) {
+    size_t type = (size_t)msg->type;
+    if (type >= sizeof(message_handlers) / sizeof(message_handlers[0]) ||
+        message_handlers[type] == NULL) {
+        return 0;
+    }
+    trace_event(TRACE_HANDLER_BEGIN, (uint32_t)client->client_id, type);
+    int rc = message_handlers[type](client, msg);
+    trace_event(TRACE_HANDLER_END, (uint32_t)client->client_id, type);
+    return rc;
+}
+
+// Message không đổi trạng thái mà network thread dùng để đọc frame tiếp theo
+// (wire version, rx_mode) thì giao được cho worker pool
+static int message_offloadable(const message_t* msg) {
+    switch (msg->type) {
+        case MSG_CREATE_ROOM:
+        case MSG_JOIN_ROOM:
+        case MSG_LEAVE_ROOM:
+        case MSG_MESSAGE:
+        case MSG_LIST_ROOMS:
+        case MSG_ENABLE_ENCRYPTION:
+        case MSG_HISTORY_REQUEST:
+        case MSG_STATS:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int dispatch_frame(client_t* client, frame_t* frame) {
+    metrics_mark_received();
+    metrics_add(METRIC_FRAMES_RECEIVED, 1);
+    trace_event(TRACE_FRAME_RECEIVED, (uint32_t)client->socket_fd,
+                frame->kind == FRAME_MESSAGE ? (uint64_t)frame->body.msg.type : (uint64_t)MSG_FILE_DATA);
+    if (frame->kind == FRAME_MESSAGE && client->rx_mode == RX_MESSAGE &&
+        message_offloadable(&frame->body.msg) && workers_submit(client, &frame->body.msg) == 0) {
+        return 0;
+    }
+    // Xử lý tại chỗ thì phải chờ các message trước đó của client xong để giữ thứ tự
+    workers_quiesce(client);
+
+    if (frame->kind == FRAME_FILE_CHUNK) {
+        // Chunk ngoài một lần gửi file thì bỏ qua
+        if (client->rx_mode != RX_FILE_CHUNK) {
+            return 0;
+        }
+        return dispatch_file_chunk(client, &frame->body.ft);
+    }
+    return dispatch_message(client, &frame->body.msg);
+}
+
+int dispatch_file_chunk(client_t* client, file_transfer_t* ft) {
+    // Chunk của stream chưa mở hoặc đã bị từ chối thì bỏ qua
+    if (!client_upload_find(client, ft->stream_id)) {
+        return 0;
+    }
+    // Người nhận phân biệt các file đang đến theo (sender_id, stream_id)
+    ft->sender_id = client->client_id;
+    // Broadcast file chunk to all clients in room except sender
+    broadcast_file_chunk_to_room(&g_server, client->current_room_id, ft, client->client_id);
+    relay_capture_copied(client, ft);
+    return finish_file_chunk(client, ft);
+}
+
+int finish_file_chunk(client_t* client, const file_transfer_t* ft) {
+    // Check if last chunk
+    upload_stream_t* upload = client_upload_find(client, ft->stream_id);
+    if (!upload || ft->chunk_number < ft->total_chunks - 1) {
+        return 0;
+    }
+    relay_capture_finish(client, ft->stream_id);
+
+    // Send completion notification
+    message_t complete;
+    init_server_message(&complete, MSG_FILE_COMPLETE);
+    snprintf(complete.content, MAX_MESSAGE_LEN,
+            "File %.300s đã được gửi thành công", upload->filename);
+    complete.stream_id = ft->stream_id;
+
+    // Đóng stream, stream cuối cùng đóng thì kết nối trở lại chỉ nhận message
+    *upload = client->uploads[--client->upload_count];
+    if (client->upload_count == 0) {
+        client->rx_mode = RX_MESSAGE;
+        relay_release(client);
+    }
+    send_to_client(client, &complete);
+    return 0;
+}
+
+frame_kind_t client_expected_frame(const client_t* client) {
+    return client->rx_mode == RX_FILE_CHUNK ? FRAME_FILE_CHUNK : FRAME_MESSAGE;
+}
+
+client_t* register_client(int client_socket, int shard) {
+    client_t* new_client = (client_t*)slab_alloc(sizeof(client_t));
+    if (!new_client) {
+        error_exit("Memory allocation failed");
+    }
+    memset(new_client, 0, sizeof(client_t));
+    new_client->socket_fd = client_socket;
+    new_client->current_room_id = -1;
+    new_client->room_index = -1;
+    new_client->wire_version = WIRE_VERSION_LEGACY;
+    new_client->rx_mode = RX_MESSAGE;
+    new_client->epoll_fd = -1;
+    pthread_mutex_init(&new_client->tx_mutex, NULL);
+    pthread_cond_init(&new_client->tx_cond, NULL);
+    if (ringbuf_init(&new_client->rx, CLIENT_RX_BUFFER_SIZE) < 0) {
+        error_exit("Memory allocation failed");
+    }
+
+    // Add client to server's client list
+    new_client->shard = shard;
+    registry_add_client(&g_server, new_client);
+
+    return new_client;
+}
+
+void disconnect_client(client_t* client) {
+    // Worker có thể vẫn đang xử lý message của client
+    workers_release(client);
+    if (client->current_room_id != -1) {
+        remove_client_from_room(&g_server, client->current_room_id, client);
+    }
+    relay_release(client);
+
+    // Remove client from server's client list
+    registry_remove_client(&g_server, client);
+
+    cleanup_client(client);
+}
+
 void* handle_client(void* arg) {
     client_t* client = (client_t*)arg;
-    message_t msg;
 
     printf("Client %s (ID: %d) đã kết nối\n", client->username, client->client_id);
 
     while (1) {
-        if (receive_message(client->socket_fd, &msg) < 0) {
+        frame_t frame;
+        int rc = parse_buffered_frame(&client->rx, client->wire_version,
+                                      client_expected_frame(client), &frame);
+        if (rc > 0) {
+            if (dispatch_frame(client, &frame) < 0) {
+                break;
+            }
+            continue;
+        }
+        if (rc < 0 || client_receive(client, 1) < 0) {
             break;
         }
+    }
 
-        // Process message based on type
-        
-        switch (msg.type) {
-            case MSG_JOIN: {
-                strcpy(client->username, msg.username);
-
-                message_t response;
-                response.type = MSG_WELCOME;
-                strcpy(response.username, "SERVER");
-                snprintf(response.content, MAX_MESSAGE_LEN, 
-                        "Chào mừng %s đến với chat server!", client->username);
-                send_message(client->socket_fd, &response);
-                break;
-            }
+    // Cleanup on disconnect
+    disconnect_client(client);
+    return NULL;
+}
 
-            case MSG_CREATE_ROOM: {
-                room_t* new_room = create_room(&g_server, msg.content);
+// Lịch sử phòng được ghi vào msglog
+static void log_room_created(const room_t* room) {
+    msglog_room_created(room->room_id, room->room_name, room->history_seq);
+}
 
-                message_t response;
-                response.type = MSG_ROOM_CREATED;
-                strcpy(response.username, "SERVER");
-                strcpy(response.content, new_room->room_name);
-                response.room_id = new_room->room_id;
-                send_message(client->socket_fd, &response);
-                break;
-            }
+static void log_room_appended(const room_t* room, long seq, time_t timestamp, const wire_buffer_t* frame) {
+    msglog_append(room->room_id, seq, timestamp, frame->data, frame->len);
+}
 
-            case MSG_JOIN_ROOM: {
-                room_t* room = find_room(&g_server, msg.room_id);
-
-                message_t response;
-                if (room) {
-                    if (client->current_room_id != -1) {
-                        remove_client_from_room(&g_server, client->current_room_id, client);
-                    }
-
-                    // Join new room
-                    
-                    add_client_to_room(&g_server, msg.room_id, client);
-
-                    
-                    // Nếu phòng đã bật mã hóa, gửi key cho client
-                    if (room->encryption_enabled) {
-                        send_room_key_to_client(client->socket_fd, room);
-                    }
-                    
-                    response.type = MSG_ROOM_JOINED;
-                    strcpy(response.username, "SERVER");
-                    strcpy(response.content, room->room_name);
-                    response.room_id = room->room_id;
-
-                    // Notify other clients in room
-                    
-                    // Thông báo cho các client khác
-                    message_t broadcast;
-                    broadcast.type = MSG_BROADCAST;
-                    broadcast.is_encrypted = 0;
-                    broadcast.timestamp = time(NULL);
-                    broadcast_to_room(&g_server, msg.room_id, &broadcast, client->client_id);
-                    
-                } else {
-                    response.type = MSG_ERROR;
-                    strcpy(response.username, "SERVER");
-                    strcpy(response.content, "Phòng không tồn tại");
-                }
-                send_message(client->socket_fd, &response);
-                break;
-            }
+static void log_room_dropped(const room_t* room) {
+    msglog_room_dropped(room->room_id);
+}
+
+static const room_log_t g_room_log_ops = {
+    .created = log_room_created,
+    .appended = log_room_appended,
+    .dropped = log_room_dropped,
+    .read = msglog_read_room,
+};
 
-            
-            case MSG_ENABLE_ENCRYPTION: {
-                if (client->current_room_id != -1) {
-                    room_t* room = find_room(&g_server, client->current_room_id);
-                    if (room) {
-                        if (room->encryption_enabled) {
-                            message_t response;
-                            response.type = MSG_ERROR;
-                            strcpy(response.username, "SERVER");
-                            strcpy(response.content, "Phòng này đã được mã hóa rồi");
-                            send_message(client->socket_fd, &response);
-                        } else {
-                            enable_room_encryption(&g_server, room);
-                        }
-                    }
+static int restore_history_frame(void* arg, long seq, const unsigned char* frame, size_t len) {
+    room_history_restore((room_t*)arg, seq, frame, len);
+    return 0;
+}
+
+static void restore_room_from_log(void* arg, int room_id, const char* name, long head_seq) {
+    int* restored = (int*)arg;
+    room_t* room = restore_room(&g_server, room_id, name, head_seq);
+    // Ring chỉ nhận các tin còn trong hạn giữ lại
+    long first = head_seq - ROOM_HISTORY_SIZE + 1;
+    if (g_config.log_retain_seconds > 0) {
+        long fresh = msglog_room_seq_at(room_id, time(NULL) - g_config.log_retain_seconds);
+        if (fresh > first) {
+            first = fresh;
+        }
+    }
+    msglog_read_room(room_id, first, head_seq, restore_history_frame, room);
+    (*restored)++;
+}
+
+// Mở log, dựng lại các phòng còn sống cùng lịch sử gần nhất, rồi ghi tiếp mọi tin chat
+static void open_message_log(void) {
+    msglog_config_t config = {
+        .dir = g_config.log_dir,
+        .sync_ms = g_config.log_sync_ms,
+        .retain_bytes = g_config.log_retain_bytes,
+        .retain_seconds = g_config.log_retain_seconds,
+    };
+    if (msglog_open(&config) < 0) {
+        error_exit("Không thể mở log tin nhắn");
+    }
+
+    int restored = 0;
+    msglog_for_each_room(restore_room_from_log, &restored);
+    // Không cấp lại id của phòng đã xóa mà log vẫn còn nhắc tới
+    if (g_server.next_room_id <= msglog_max_room_id()) {
+        g_server.next_room_id = msglog_max_room_id() + 1;
+    }
+    room_set_log(&g_room_log_ops);
+
+    msglog_stats_t stats;
+    msglog_get_stats(&stats);
+    printf("Message log: %s (%s), khôi phục %d phòng từ %lu record\n", g_config.log_dir,
+           g_config.log_sync_ms > 0 ? "group commit" : "không fdatasync", restored, stats.records_recovered);
+}
+
+static void print_usage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --mode <epoll|threaded>  Mô hình I/O (mặc định: epoll)\n");
+    printf("  --threads <n>            Số shard listener/reactor cho chế độ epoll (mặc định: số CPU)\n");
+    printf("  --port <port>            Port lắng nghe (mặc định: %d)\n", SERVER_PORT);
+    printf("  --backlog <n>            Độ dài hàng đợi kết nối của listen() (mặc định: %d)\n",
+           SERVER_LISTEN_BACKLOG);
+    printf("  --no-pin                 Không gắn mỗi reactor vào một CPU\n");
+    printf("  --workers <n>            Số worker xử lý message (mặc định: 0 = network thread tự xử lý)\n");
+    printf("  --io <socket|uring>      Backend I/O cho socket (mặc định: socket)\n");
+    printf("  --queue-high <KB>        High watermark hàng đợi gửi mỗi client (mặc định: %d)\n",
+           CLIENT_QUEUE_HIGH_DEFAULT / 1024);
+    printf("  --queue-low <KB>         Low watermark hàng đợi gửi mỗi client (mặc định: %d)\n",
+           CLIENT_QUEUE_LOW_DEFAULT / 1024);
+    printf("  --slow-consumer <evict|drop>\n");
+    printf("                           Client không đọc kịp: ngắt kết nối hoặc bỏ broadcast (mặc định: evict)\n");
+    printf("  --stats-interval <giây>  In thống kê định kỳ (mặc định: tắt)\n");
+    printf("  --file-cache <MB>        Cache file theo nội dung để bỏ qua upload trùng (mặc định: %d, 0 = tắt)\n",
+           FILE_CACHE_DEFAULT_MB);
+    printf("  --log-dir <thư mục>      Ghi tin chat vào log bền vững, khôi phục phòng khi khởi động (mặc định: tắt)\n");
+    printf("  --log-sync-ms <ms>       Chu kỳ group commit, một fdatasync cho cả lô (mặc định: %d, 0 = không sync)\n",
+           MSGLOG_SYNC_DEFAULT_MS);
+    printf("  --log-retain <MB>        Dung lượng log giữ lại (mặc định: %d, 0 = không giới hạn)\n",
+           MSGLOG_RETAIN_DEFAULT_MB);
+    printf("  --log-retain-hours <giờ> Xóa tin cũ hơn mức này (mặc định: 0 = không giới hạn)\n");
+    printf("  --metrics-port <port>    Phục vụ metrics dạng Prometheus tại 127.0.0.1:<port> (mặc định: tắt)\n");
+    printf("  --trace <sự kiện>        Ghi trace vào ring mỗi thread với số sự kiện này, SIGUSR1 ghi ra file\n");
+    printf("                           (mặc định: tắt, 0 = %d)\n", TRACE_DEFAULT_EVENTS);
+    printf("  --trace-dir <thư mục>    Nơi ghi file trace (mặc định: thư mục hiện tại)\n");
+    printf("  --help                   Hiển thị hướng dẫn\n");
+}
+
+static void parse_arguments(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        { "mode", required_argument, NULL, 'm' },
+        { "threads", required_argument, NULL, 't' },
+        { "port", required_argument, NULL, 'p' },
+        { "io", required_argument, NULL, 'i' },
+        { "queue-high", required_argument, NULL, 'Q' },
+        { "queue-low", required_argument, NULL, 'q' },
+        { "slow-consumer", required_argument, NULL, 'c' },
+        { "stats-interval", required_argument, NULL, 's' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "no-pin", no_argument, NULL, 'P' },
+        { "workers", required_argument, NULL, 'w' },
+        { "file-cache", required_argument, NULL, 'f' },
+        { "log-dir", required_argument, NULL, 'L' },
+        { "log-sync-ms", required_argument, NULL, 'S' },
+        { "log-retain", required_argument, NULL, 'R' },
+        { "log-retain-hours", required_argument, NULL, 'A' },
+        { "metrics-port", required_argument, NULL, 'M' },
+        { "trace", required_argument, NULL, 'T' },
+        { "trace-dir", required_argument, NULL, 'D' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:t:p:i:Q:q:c:s:b:Pw:f:L:S:R:A:M:T:D:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "epoll") == 0) {
+                    g_config.mode = SERVER_MODE_EPOLL;
+                } else if (strcmp(optarg, "threaded") == 0) {
+                    g_config.mode = SERVER_MODE_THREADED;
                 } else {
-                    message_t response;
-                    response.type = MSG_ERROR;
-                    strcpy(response.username, "SERVER");
-                    strcpy(response.content, "Bạn cần tham gia phòng trước");
-                    send_message(client->socket_fd, &response);
+                    fprintf(stderr, "Chế độ không hợp lệ: %s\n", optarg);
+                    exit(EXIT_FAILURE);
                 }
                 break;
-            }
-            
-            case MSG_LEAVE_ROOM: {
-                if (client->current_room_id != -1) {
-                    message_t broadcast;
-                    broadcast.type = MSG_BROADCAST;
-                    strcpy(broadcast.username, "SERVER");
-                    snprintf(broadcast.content, MAX_MESSAGE_LEN, "%s đã rời khỏi phòng", client->username);
-                    broadcast.is_encrypted = 0;
-                    broadcast.timestamp = time(NULL);
-                    broadcast_to_room(&g_server, client->current_room_id, &broadcast, client->client_id);
-
-                    remove_client_from_room(&g_server, client->current_room_id, client);
-
-                    message_t response;
-                    response.type = MSG_ROOM_LEFT;
-                    strcpy(response.username, "SERVER");
-                    strcpy(response.content, "Đã rời khỏi phòng");
-                    send_message(client->socket_fd, &response);
-                }
+            case 't':
+                g_config.reactor_threads = atoi(optarg);
                 break;
-            }
-
-            case MSG_MESSAGE: {
-                if (client->current_room_id != -1) {
-                    room_t* room = find_room(&g_server, client->current_room_id);
-                    if (room) {
-                        // Broadcast message với timestamp và username
-                        message_t broadcast = msg;
-                        broadcast.type = MSG_BROADCAST;
-                        strcpy(broadcast.username, client->username);
-                        broadcast.timestamp = time(NULL);
-                        broadcast.client_id = client->client_id;
-                        broadcast.room_id = client->current_room_id;
-                        broadcast_to_room(&g_server, client->current_room_id, &broadcast, -1);
-                    }
-                } else {
-                    message_t response;
-                    response.type = MSG_ERROR;
-                    strcpy(response.username, "SERVER");
-                    strcpy(response.content, "Bạn chưa tham gia phòng nào");
-                    send_message(client->socket_fd, &response);
-                }
+            case 'p':
+                g_config.port = atoi(optarg);
                 break;
-            }
-
-            case MSG_FILE_REQUEST: {
-                if (client->current_room_id != -1) {
-                    // Broadcast file notification to room
-                    message_t notification;
-                    notification.type = MSG_FILE_NOTIFICATION;
-                    strcpy(notification.username, client->username);
-                    snprintf(notification.content, MAX_MESSAGE_LEN,
-                    "[FILE] %.100s đang gửi file: %.300s", client->username, msg.content);
-                    notification.client_id = client->client_id;
-                    broadcast_to_room(&g_server, client->current_room_id, &notification, client->client_id);
-
-                    // Forward file data through server
-                    file_transfer_t ft;
-                    while (receive_file_transfer(client->socket_fd, &ft) == 0) {
-                        // Broadcast file chunk to all clients in room except sender
-                        room_t* room = find_room(&g_server, client->current_room_id);
-                        if (room) {
-                            pthread_mutex_lock(&room->mutex);
-                            client_t* current = room->clients;
-                            while (current) {
-                                if (current->client_id != client->client_id) {
-                                    send_file_transfer(current->socket_fd, &ft);
-                                }
-                                current = current->next;
-                            }
-                            pthread_mutex_unlock(&room->mutex);
-                        }
-
-                        // Check if last chunk
-                        if (ft.chunk_number >= ft.total_chunks - 1) {
-                            break;
-                        }
-                    }
-
-                    // Send completion notification
-                    message_t complete;
-                    complete.type = MSG_FILE_COMPLETE;
-                    strcpy(complete.username, "SERVER");
-                    snprintf(complete.content, MAX_MESSAGE_LEN,
-                            "File %.300s đã được gửi thành công", msg.content);
-                    send_message(client->socket_fd, &complete);
+            case 'i':
+                if (strcmp(optarg, "socket") == 0) {
+                    g_config.io_backend = IO_BACKEND_SOCKET;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    g_config.io_backend = IO_BACKEND_URING;
                 } else {
-                    message_t response;
-                    response.type = MSG_ERROR;
-                    strcpy(response.username, "SERVER");
-                    strcpy(response.content, "Bạn chưa tham gia phòng nào");
-                    send_message(client->socket_fd, &response);
+                    fprintf(stderr, "Backend I/O không hợp lệ: %s\n", optarg);
+                    exit(EXIT_FAILURE);
                 }
                 break;
-            }
-
-            case MSG_LIST_ROOMS: {
-                list_rooms(&g_server, client->socket_fd);
+            case 'Q':
+                g_config.queue_high = (size_t)atoi(optarg) * 1024;
                 break;
-            }
-
-            case MSG_QUIT: {
-                if (client->current_room_id != -1) {
-                    message_t broadcast;
-                    broadcast.type = MSG_BROADCAST;
-                    strcpy(broadcast.username, "SERVER");
-                    snprintf(broadcast.content, MAX_MESSAGE_LEN, "%s đã rời khỏi phòng", client->username);
-                    broadcast.is_encrypted = 0;
-                    broadcast.timestamp = time(NULL);
-                    broadcast_to_room(&g_server, client->current_room_id, &broadcast, client->client_id);
-                    remove_client_from_room(&g_server, client->current_room_id, client);
-                }
-
-                // Remove client from server's client list
-                
-                pthread_mutex_lock(&g_server.clients_mutex);
-                if (g_server.clients == client) {
-                    g_server.clients = client->next;
+            case 'q':
+                g_config.queue_low = (size_t)atoi(optarg) * 1024;
+                break;
+            case 'c':
+                if (strcmp(optarg, "evict") == 0) {
+                    g_config.slow_policy = SLOW_CONSUMER_EVICT;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    g_config.slow_policy = SLOW_CONSUMER_DROP;
                 } else {
-                    client_t* current = g_server.clients;
-                    while (current && current->next != client) {
-                        current = current->next;
-                    }
-                    if (current) {
-                        current->next = client->next;
-                    }
+                    fprintf(stderr, "Chính sách không hợp lệ: %s\n", optarg);
+                    exit(EXIT_FAILURE);
                 }
-                pthread_mutex_unlock(&g_server.clients_mutex);
-
-                printf("Client %s đã ngắt kết nối\n", client->username);
-                
-                cleanup_client(client);
-                return NULL;
-            }
-
-            default:
                 break;
+            case 's':
+                g_config.stats_interval = atoi(optarg);
+                break;
+            case 'b':
+                g_config.backlog = atoi(optarg);
+                break;
+            case 'P':
+                g_config.pin_cpus = 0;
+                break;
+            case 'w':
+                g_config.worker_threads = atoi(optarg);
+                break;
+            case 'f':
+                g_config.file_cache_bytes = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'L':
+                g_config.log_dir = optarg;
+                break;
+            case 'S':
+                g_config.log_sync_ms = atoi(optarg);
+                break;
+            case 'R':
+                g_config.log_retain_bytes = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'A':
+                g_config.log_retain_seconds = (long)atoi(optarg) * 3600;
+                break;
+            case 'M':
+                g_config.metrics_port = atoi(optarg);
+                break;
+            case 'T':
+                g_config.trace_events = atoi(optarg) > 0 ? (size_t)atoi(optarg) : TRACE_DEFAULT_EVENTS;
+                break;
+            case 'D':
+                g_config.trace_dir = optarg;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
         }
     }
 
-    // Cleanup on disconnect
-    
-    if (client->current_room_id != -1) {
-        remove_client_from_room(&g_server, client->current_room_id, client);
+    if (g_config.reactor_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        g_config.reactor_threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (g_config.backlog <= 0) {
+        g_config.backlog = SERVER_LISTEN_BACKLOG;
     }
+}
 
-    pthread_mutex_lock(&g_server.clients_mutex);
-    if (g_server.clients == client) {
-        g_server.clients = client->next;
-    } else {
-        client_t* current = g_server.clients;
-        while (current && current->next != client) {
-            current = current->next;
-        }
-        if (current) {
-            current->next = client->next;
-        }
+static void accept_threaded(int client_socket) {
+    // Writer gửi bằng send/sendfile không chờ nên socket phải non-blocking,
+    // thread nhận tự chờ bằng poll
+    if (set_nonblocking(client_socket) < 0) {
+        perror("fcntl O_NONBLOCK failed");
+        close(client_socket);
+        return;
     }
-    pthread_mutex_unlock(&g_server.clients_mutex);
 
-    cleanup_client(client);
-    return NULL;
-}
+    // Chỉ có một thread accept nên chia shard vòng tròn không cần atomic
+    static int next_shard = 0;
+    client_t* new_client = register_client(client_socket, next_shard);
+    next_shard = (next_shard + 1) % g_server.shard_count;
 
-int main() {
-    printf("=== CHAT SERVER ===\n");
-    printf("Khởi động server trên port %d...\n", SERVER_PORT);
+    // Writer thread gửi hàng đợi của client, thread của client chỉ nhận
+    if (client_start_writer(new_client) != 0) {
+        perror("Thread creation failed");
+        disconnect_client(new_client);
+        return;
+    }
 
-    printf("=== CHAT SERVER WITH END-TO-END ENCRYPTION ===\n");
-    printf("Server đang khởi động...\n");
-    printf("Hỗ trợ mã hóa AES-256-CBC\n");
-    printf("Listening on port %d...\n\n", SERVER_PORT);
-    
-    initialize_server();
-    setup_server_socket(g_server.server_socket, SERVER_PORT);
+    // Create thread for client
+    if (pthread_create(&new_client->thread_id, NULL, handle_client, new_client) != 0) {
+        perror("Thread creation failed");
+        disconnect_client(new_client);
+        return;
+    }
 
-    printf("Server đã sẵn sàng chấp nhận kết nối!\n");
-    printf("Nhấn Ctrl+C để dừng server\n\n");
+    // Detach thread
+    pthread_detach(new_client->thread_id);
+}
 
-    
-    printf("✓ Server ready!\n");
-    printf("Press Ctrl+C to stop\n\n");
-    
+static void accept_loop_socket(void) {
     while (1) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
@@ -343,32 +956,169 @@ int main() {
             continue;
         }
 
-        // Create new client
-        
-        client_t* new_client = (client_t*)safe_malloc(sizeof(client_t));
-        new_client->socket_fd = client_socket;
-        new_client->client_id = g_server.next_client_id++;
-        new_client->current_room_id = -1;
-        strcpy(new_client->username, "");
-
-        // Add client to server's client list
-        
-        pthread_mutex_lock(&g_server.clients_mutex);
-        new_client->next = g_server.clients;
-        g_server.clients = new_client;
-        pthread_mutex_unlock(&g_server.clients_mutex);
-
-        // Create thread for client
-        
-        if (pthread_create(&new_client->thread_id, NULL, handle_client, new_client) != 0) {
-            perror("Thread creation failed");
-            cleanup_client(new_client);
+        accept_threaded(client_socket);
+    }
+}
+
+// Multishot accept: một SQE sinh ra CQE cho mỗi kết nối mới
+static void accept_loop_uring(void) {
+    uring_t ring;
+    if (uring_init(&ring, 64) < 0) {
+        perror("io_uring accept không khả dụng");
+        accept_loop_socket();
+        return;
+    }
+
+    int armed = 0;
+    while (1) {
+        if (!armed) {
+            struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+            uring_prep_multishot_accept(sqe, g_server.server_socket);
+            armed = 1;
+        }
+
+        if (uring_submit(&ring, 1) < 0) {
+            perror("io_uring_enter failed");
+            uring_destroy(&ring);
+            accept_loop_socket();
+            return;
+        }
+
+        struct io_uring_cqe cqe;
+        while (uring_next_cqe(&ring, &cqe)) {
+            if (cqe.res >= 0) {
+                accept_threaded(cqe.res);
+            } else {
+                errno = -cqe.res;
+                perror("Accept failed");
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                armed = 0;
+            }
+        }
+    }
+}
+
+static sigset_t g_signal_set;
+
+// Thread duy nhất nhận tín hiệu: SIGUSR1 ghi trace, SIGINT/SIGTERM ghi nốt log rồi thoát
+static void* signal_loop(void* arg) {
+    (void)arg;
+    for (;;) {
+        int sig;
+        if (sigwait(&g_signal_set, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            if (g_trace_enabled) {
+                trace_dump();
+            }
             continue;
         }
+        printf("\nNhận %s, server dừng...\n", sig == SIGINT ? "SIGINT" : "SIGTERM");
+        msglog_close();
+        fflush(stdout);
+        // Reactor vẫn đang chạy: _exit để không chạy atexit (OpenSSL) dưới chân chúng
+        _exit(EXIT_SUCCESS);
+    }
+    return NULL;
+}
+
+// Phải gọi trước mọi thread khác: tín hiệu bị chặn ở thread gọi và các thread tạo sau,
+// nên reactor đang epoll_wait không bị ngắt
+static int start_signal_thread(void) {
+    sigemptyset(&g_signal_set);
+    sigaddset(&g_signal_set, SIGINT);
+    sigaddset(&g_signal_set, SIGTERM);
+    sigaddset(&g_signal_set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &g_signal_set, NULL) != 0) {
+        return -1;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, signal_loop, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    parse_arguments(argc, argv);
+
+    // Peer đóng kết nối không được làm chết server
+    signal(SIGPIPE, SIG_IGN);
+    if (start_signal_thread() < 0) {
+        error_exit("Không thể khởi động thread tín hiệu");
+    }
+    if (g_config.trace_events > 0) {
+        if (trace_init(g_config.trace_events, g_config.trace_dir) < 0) {
+            error_exit("Không thể bật trace");
+        }
+    }
+
+    printf("=== CHAT SERVER WITH END-TO-END ENCRYPTION ===\n");
+    printf("Server đang khởi động...\n");
+    printf("Hỗ trợ mã hóa AES-256-GCM và AES-256-CBC\n");
+    if (g_config.mode == SERVER_MODE_EPOLL) {
+        printf("Chế độ I/O: epoll (%d shard listener/reactor, SO_REUSEPORT%s)\n",
+               g_config.reactor_threads, g_config.pin_cpus ? ", gắn CPU" : "");
+    } else {
+        printf("Chế độ I/O: thread-per-client\n");
+    }
+
+    g_config.io_backend = io_backend_init(g_config.io_backend);
+    client_queue_configure(g_config.queue_high, g_config.queue_low, g_config.slow_policy);
+    printf("Backend socket: %s\n", g_config.io_backend == IO_BACKEND_URING ? "io_uring" : "socket");
+    printf("Listening on port %d...\n\n", g_config.port);
+
+    initialize_server();
+    if (g_config.worker_threads > 0) {
+        if (start_workers(g_config.worker_threads) < 0) {
+            error_exit("Không thể khởi động worker pool");
+        }
+        printf("Worker pool: %d worker (work-stealing)\n", g_config.worker_threads);
+    }
+    file_cache_init(g_config.file_cache_bytes);
+    if (file_cache_enabled()) {
+        printf("File cache: %zu MB (SHA-256, LRU)\n", g_config.file_cache_bytes / (1024 * 1024));
+    }
+    if (g_config.log_dir) {
+        open_message_log();
+    }
+    if (g_config.mode == SERVER_MODE_EPOLL) {
+        if (start_reactors(g_config.reactor_threads) < 0) {
+            error_exit("Không thể khởi động reactor");
+        }
+    } else {
+        setup_server_socket(g_server.server_socket, g_config.port, g_config.backlog, 0);
+    }
+
+    if (g_config.stats_interval > 0 && start_stats_reporter(g_config.stats_interval) < 0) {
+        perror("Không thể khởi động stats reporter");
+    }
+    if (g_config.metrics_port > 0) {
+        if (start_metrics_server(g_config.metrics_port) < 0) {
+            perror("Không thể mở cổng metrics");
+        } else {
+            printf("Metrics: http://127.0.0.1:%d/metrics\n", g_config.metrics_port);
+        }
+    }
+
+    if (g_trace_enabled) {
+        printf("Trace: %zu sự kiện mỗi thread, kill -USR1 %d để ghi vào %s\n", g_config.trace_events,
+               (int)getpid(), g_config.trace_dir);
+    }
 
-        // Detach thread
-        
-        pthread_detach(new_client->thread_id);
+    printf("✓ Server ready!\n");
+    printf("Press Ctrl+C to stop\n\n");
+
+    // Chế độ epoll: các reactor tự accept trên listener của mình
+    if (g_config.mode == SERVER_MODE_EPOLL) {
+        wait_reactors();
+    } else if (g_config.io_backend == IO_BACKEND_URING) {
+        accept_loop_uring();
+    } else {
+        accept_loop_socket();
     }
 
     cleanup_server();
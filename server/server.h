@@ -0,0 +1,179 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "../common/protocol.h"
+
+#define SERVER_LISTEN_BACKLOG 4096
+#define FILE_CACHE_DEFAULT_MB 64
+#define MSGLOG_SYNC_DEFAULT_MS 10
+#define MSGLOG_RETAIN_DEFAULT_MB 256
+
+// Server I/O model
+typedef enum {
+    SERVER_MODE_EPOLL = 0,   // Một số ít reactor thread dùng epoll cho tất cả client
+    SERVER_MODE_THREADED     // Mỗi client một thread (chế độ cũ)
+} server_mode_t;
+
+// Server configuration (command line)
+typedef struct {
+    server_mode_t mode;
+    int port;
+    int reactor_threads;
+    io_backend_t io_backend;
+    size_t queue_high;                    // High/low watermark hàng đợi gửi (byte)
+    size_t queue_low;
+    slow_consumer_policy_t slow_policy;
+    int stats_interval;                   // Giây giữa hai lần in thống kê, 0 = tắt
+    int backlog;                          // Backlog của listen()
+    int pin_cpus;                         // Gắn reactor i vào CPU thứ i được phép dùng
+    int worker_threads;                   // Số worker xử lý message, 0 = network thread tự xử lý
+    size_t file_cache_bytes;              // Dung lượng cache file theo nội dung, 0 = tắt
+    const char* log_dir;                  // Thư mục log tin chat bền vững, NULL = tắt
+    int log_sync_ms;                      // Chu kỳ group commit, 0 = không fdatasync
+    size_t log_retain_bytes;              // Dung lượng log giữ lại, 0 = không giới hạn
+    long log_retain_seconds;              // Tuổi tối đa của tin trong log, 0 = không giới hạn
+    int metrics_port;                     // Cổng scrape metrics trên loopback, 0 = tắt
+    size_t trace_events;                  // Sự kiện trace mỗi thread, 0 = tắt
+    const char* trace_dir;                // Nơi ghi file trace khi nhận SIGUSR1
+} server_config_t;
+
+extern server_t g_server;
+extern server_config_t g_config;
+
+// Message handlers (server.c)
+// Trả về -1 khi kết nối cần được đóng
+int dispatch_message(client_t* client, message_t* msg);
+int dispatch_file_chunk(client_t* client, file_transfer_t* ft);
+// Gọi sau khi một chunk đã được chuyển tới phòng, chunk cuối thì kết thúc lần gửi file
+int finish_file_chunk(client_t* client, const file_transfer_t* ft);
+// Upload đang mở của client theo stream_id, NULL nếu stream chưa mở
+upload_stream_t* client_upload_find(client_t* client, int stream_id);
+int dispatch_frame(client_t* client, frame_t* frame);
+frame_kind_t client_expected_frame(const client_t* client);
+client_t* register_client(int client_socket, int shard);
+void disconnect_client(client_t* client);
+
+// Epoll reactor (reactor.c). Mỗi reactor là một shard: listener SO_REUSEPORT riêng,
+// epoll riêng và các client nó accept.
+int start_reactors(int thread_count);
+void wait_reactors(void);
+int reactor_add_client(client_t* client);
+
+// Nhận dữ liệu và relay file zero-copy (relay.c)
+#define CLIENT_RECV_WOULD_BLOCK 0   // Socket chưa có dữ liệu (chỉ khi wait = 0)
+#define CLIENT_RECV_BUFFERED 1      // Đã đọc thêm byte vào client->rx
+#define CLIENT_RECV_RELAYED 2       // Đã relay thẳng một chunk file, không qua rx
+// Gọi khi rx không còn frame hoàn chỉnh. wait = 1 thì chờ socket (chế độ threaded).
+// Trả về -1 khi kết nối cần đóng.
+int client_receive(client_t* client, int wait);
+void relay_release(client_t* client);
+// Chụp file đang nhận vào cache (chỉ file không mã hóa, đủ nhỏ, chunk đến đúng thứ tự và
+// không xen với chunk của stream khác). Chunk nén được giải nén để cache giữ nội dung gốc.
+// Chunk đi đường copy thì payload được ghi bù vào spool để nội dung không bị thủng.
+void relay_capture_copied(client_t* client, const file_transfer_t* ft);
+// Upload trên stream_id là upload sau offer: nội dung phải khớp hash đã offer mới vào cache
+void relay_expect_hash(client_t* client, int stream_id, const unsigned char* hash);
+// Gọi ở chunk cuối của stream trước relay_release: băm nội dung đã chụp và đưa vào cache
+void relay_capture_finish(client_t* client, int stream_id);
+
+// Cache file theo nội dung SHA-256, LRU giới hạn theo byte (filecache.c)
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long bytes_saved;            // Byte upload được bỏ qua nhờ cache
+    unsigned long entries;
+    unsigned long bytes;
+    unsigned long capacity;
+    unsigned long inserted;
+    unsigned long evicted;
+} file_cache_stats_t;
+
+typedef struct {
+    file_spool_t* spool;                  // Người gọi giữ một tham chiếu, trả bằng spool_unref
+    long file_size;
+    int chunk_size;
+    int total_chunks;
+} file_cache_hit_t;
+
+void file_cache_init(size_t capacity);
+int file_cache_enabled(void);
+long file_cache_entry_max(void);
+// 1 = có trong cache và hit được điền, 0 = không có
+int file_cache_lookup(const unsigned char* hash, long file_size, file_cache_hit_t* hit);
+// Như file_cache_lookup nhưng không tính hit/miss và không đổi LRU (file chưa chắc được phát)
+int file_cache_probe(const unsigned char* hash, long file_size, file_cache_hit_t* hit);
+// Miss phát hiện bằng probe: lookup sẽ không được gọi cho file này
+void file_cache_count_miss(void);
+void file_cache_insert(const unsigned char* hash, file_spool_t* spool, long file_size,
+                       int chunk_size, int total_chunks);
+void file_cache_get_stats(file_cache_stats_t* stats);
+
+// Log tin chat bền vững (msglog.c): segment append-only chia shard theo room_id, đọc qua mmap.
+// Một luồng flusher gom mọi tin trong một chu kỳ rồi fdatasync mỗi shard một lần (group commit).
+typedef struct {
+    const char* dir;
+    int sync_ms;                          // 0 = chỉ ghi vào page cache, không fdatasync
+    size_t retain_bytes;                  // Tổng dung lượng, segment cũ nhất bị xóa khi vượt
+    long retain_seconds;                  // Segment có tin mới nhất cũ hơn mức này bị xóa
+} msglog_config_t;
+
+typedef struct {
+    unsigned long records_written;
+    unsigned long records_synced;         // Record đã được fdatasync phủ
+    unsigned long records_recovered;      // Record đọc lại khi khởi động
+    unsigned long bytes_written;
+    unsigned long syncs;
+    unsigned long sync_ns_total;
+    unsigned long sync_ns_max;
+    unsigned long records_dropped;        // Tin chat bị bỏ vì bộ đệm shard đầy (đĩa không theo kịp)
+    unsigned long write_errors;           // Lô ghi lỗi, phần chưa ghi được giữ lại cho lượt sau
+    unsigned long segments;
+    unsigned long segments_retired;
+    unsigned long disk_bytes;
+    unsigned long rooms;
+} msglog_stats_t;
+
+typedef void (*msglog_room_visit_t)(void* arg, int room_id, const char* name, long head_seq);
+
+// Đọc lại log có sẵn trong thư mục rồi khởi động flusher
+int msglog_open(const msglog_config_t* config);
+// Ghi và sync nốt những gì đã append. An toàn khi thread khác vẫn append (bị bỏ qua).
+void msglog_close(void);
+int msglog_enabled(void);
+void msglog_room_created(int room_id, const char* name, long seq);
+void msglog_room_dropped(int room_id);
+// Chỉ copy vào bộ đệm của shard, không bao giờ chờ đĩa: tin bị bỏ (và đếm) khi flusher tụt quá xa
+void msglog_append(int room_id, long seq, time_t timestamp, const void* frame, size_t len);
+void msglog_for_each_room(msglog_room_visit_t visit, void* arg);
+// room_id lớn nhất từng thấy trong log, kể cả phòng đã xóa
+int msglog_max_room_id(void);
+// Chỉ thấy tin đã ghi xuống file (tối đa trễ một chu kỳ flush)
+int msglog_read_room(int room_id, long first, long last, room_history_visit_t visit, void* arg);
+// Seq của tin đầu tiên có timestamp >= timestamp (head + 1 nếu không có, 0 nếu phòng chưa có tin)
+long msglog_room_seq_at(int room_id, time_t timestamp);
+void msglog_get_stats(msglog_stats_t* stats);
+
+// Worker pool work-stealing (workers.c). Network thread giao message đã decode cho pool;
+// message của cùng một client vẫn được xử lý tuần tự theo thứ tự nhận.
+typedef struct {
+    unsigned long processed;
+    unsigned long stolen;                 // Lần lấy trộm client từ deque của worker khác
+    unsigned long busy_ns;                // Thời gian chạy handler
+} worker_stats_t;
+
+int start_workers(int count);
+// -1 nếu pool tắt hoặc hộp thư của client đã đầy, khi đó người gọi tự xử lý
+int workers_submit(client_t* client, const message_t* msg);
+// Chờ mọi message đã giao của client xử lý xong
+void workers_quiesce(client_t* client);
+void workers_release(client_t* client);
+int workers_count(void);
+void workers_get_stats(int index, worker_stats_t* stats);
+
+// Thống kê (stats.c)
+void print_server_stats(FILE* out);
+int start_stats_reporter(int interval_seconds);
+// Trả metrics dạng text của Prometheus cho mọi request HTTP tới 127.0.0.1:port
+int start_metrics_server(int port);
+
+#endif // SERVER_H
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include <errno.h>
+
+// Phần trăm thời gian chạy handler của mỗi worker kể từ lần in trước
+static void print_worker_stats(FILE* out) {
+    static unsigned long* last_busy = NULL;
+    static struct timespec last_time;
+    int count = workers_count();
+    if (count == 0) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!last_busy) {
+        last_busy = (unsigned long*)safe_malloc(sizeof(unsigned long) * (size_t)count);
+        memset(last_busy, 0, sizeof(unsigned long) * (size_t)count);
+        last_time = now;
+    }
+    double elapsed_ns = (double)(now.tv_sec - last_time.tv_sec) * 1e9 +
+                        (double)(now.tv_nsec - last_time.tv_nsec);
+    last_time = now;
+
+    unsigned long processed = 0;
+    unsigned long stolen = 0;
+    fprintf(out, "[stats] worker utilization:");
+    for (int i = 0; i < count; i++) {
+        worker_stats_t stats;
+        workers_get_stats(i, &stats);
+        double busy = elapsed_ns > 0 ? (double)(stats.busy_ns - last_busy[i]) * 100.0 / elapsed_ns : 0.0;
+        last_busy[i] = stats.busy_ns;
+        processed += stats.processed;
+        stolen += stats.stolen;
+        fprintf(out, " %.0f%%", busy);
+    }
+    fprintf(out, "\n[stats] workers: %d, messages processed: %lu, steals: %lu\n", count, processed, stolen);
+}
+
+void print_server_stats(FILE* out) {
+    io_stats_t io;
+    queue_stats_t queue;
+    io_backend_get_stats(&io);
+    client_queue_get_stats(&queue);
+
+    fprintf(out, "[stats] send syscalls: %lu, messages delivered: %lu\n",
+            io.send_syscalls, io.messages_delivered);
+    fprintf(out, "[stats] file payload bytes: %lu spliced, %lu copied\n",
+            io.file_bytes_spliced, io.file_bytes_copied);
+    fprintf(out, "[stats] queued frames: %lu, queued bytes: %lu (peak/client: %lu)\n",
+            queue.frames_queued, queue.queued_bytes, queue.queued_bytes_peak);
+    fprintf(out, "[stats] lossy clients: %lu (entered %lu times), dropped broadcasts: %lu, evictions: %lu\n",
+            queue.lossy_clients, queue.lossy_entered, queue.frames_dropped, queue.evictions);
+
+    fprintf(out, "[stats] clients per shard:");
+    for (int i = 0; i < g_server.shard_count; i++) {
+        registry_shard_t* shard = &g_server.shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        int clients = shard->client_count;
+        pthread_mutex_unlock(&shard->mutex);
+        fprintf(out, " %d", clients);
+    }
+    fprintf(out, "\n");
+
+    print_worker_stats(out);
+
+    if (file_cache_enabled()) {
+        file_cache_stats_t cache;
+        file_cache_get_stats(&cache);
+        unsigned long lookups = cache.hits + cache.misses;
+        fprintf(out, "[stats] file cache: hits %lu, misses %lu (hit rate %.1f%%), bytes saved %lu, "
+                "entries %lu, %lu/%lu bytes, evicted %lu\n",
+                cache.hits, cache.misses, lookups ? (double)cache.hits * 100.0 / (double)lookups : 0.0,
+                cache.bytes_saved, cache.entries, cache.bytes, cache.capacity, cache.evicted);
+    }
+
+    if (msglog_enabled()) {
+        msglog_stats_t log;
+        msglog_get_stats(&log);
+        fprintf(out, "[stats] message log: %lu records (%lu bytes), %lu fdatasync (%.1f records/sync, "
+                "avg %.2f ms, max %.2f ms), dropped %lu, write errors %lu, %lu rooms, %lu segments (%lu bytes), "
+                "retired %lu\n",
+                log.records_written, log.bytes_written, log.syncs,
+                log.syncs ? (double)log.records_synced / (double)log.syncs : 0.0,
+                log.syncs ? (double)log.sync_ns_total / (double)log.syncs / 1e6 : 0.0,
+                (double)log.sync_ns_max / 1e6, log.records_dropped, log.write_errors, log.rooms, log.segments, log.disk_bytes,
+                log.segments_retired);
+    }
+
+    compress_stats_t zs;
+    compress_get_stats(&zs);
+    if (zs.compress_calls > 0 || zs.decompress_calls > 0) {
+        // Tỉ lệ = byte gốc / byte thực gửi, CPU time tính trên byte gốc
+        fprintf(out, "[stats] compression: %lu frames/chunks, %lu -> %lu bytes (ratio %.2f), %lu skipped, "
+                "%.1f ns/byte; decompression: %lu, %lu -> %lu bytes, %.1f ns/byte\n",
+                zs.compress_calls, zs.compress_in, zs.compress_out,
+                zs.compress_out ? (double)zs.compress_in / (double)zs.compress_out : 0.0, zs.compress_skipped,
+                zs.compress_in ? (double)zs.compress_ns / (double)zs.compress_in : 0.0,
+                zs.decompress_calls, zs.decompress_in, zs.decompress_out,
+                zs.decompress_out ? (double)zs.decompress_ns / (double)zs.decompress_out : 0.0);
+    }
+
+    // Độ trễ tính từ lúc server khởi động, đơn vị micro giây
+    metrics_snapshot_t* snapshot = (metrics_snapshot_t*)malloc(sizeof(metrics_snapshot_t));
+    if (snapshot) {
+        metrics_snapshot(snapshot);
+        static const metric_histogram_t latencies[] = { METRIC_FANOUT_LATENCY_NS, METRIC_FILE_CHUNK_NS, METRIC_CRYPTO_NS };
+        fprintf(out, "[stats] latency us (p50/p99/p99.9/max):");
+        for (size_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++) {
+            metrics_summary_t summary;
+            metrics_summarize(&snapshot->histograms[latencies[i]], &summary);
+            fprintf(out, " %s %.1f/%.1f/%.1f/%.1f", metrics_histogram_name(latencies[i]),
+                    (double)summary.p50 / 1e3, (double)summary.p99 / 1e3, (double)summary.p999 / 1e3,
+                    (double)summary.max / 1e3);
+        }
+        fprintf(out, "\n");
+        free(snapshot);
+    }
+
+    // Chỉ in class đã từng dùng: đang dùng/đỉnh/đã cắt từ slab
+    fprintf(out, "[stats] slab pools (in use/peak/allocated):");
+    for (int i = 0; i < slab_class_count(); i++) {
+        slab_stats_t slab;
+        slab_get_stats(i, &slab);
+        if (slab.allocated > 0) {
+            fprintf(out, " %zuB %lu/%lu/%lu", slab.object_size, slab.in_use, slab.peak, slab.allocated);
+        }
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+static void* stats_reporter_loop(void* arg) {
+    int interval = *(int*)arg;
+    while (1) {
+        sleep((unsigned)interval);
+        print_server_stats(stdout);
+    }
+    return NULL;
+}
+
+int start_stats_reporter(int interval_seconds) {
+    static int interval;
+    pthread_t thread;
+
+    interval = interval_seconds;
+    if (pthread_create(&thread, NULL, stats_reporter_loop, &interval) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+static void* metrics_server_loop(void* arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // Chỉ có một tài nguyên nên không cần đọc hết request, bỏ qua đường dẫn.
+        // Loop chỉ có một thread: scraper ngừng đọc không được giữ nó quá timeout.
+        struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+        char request[1024];
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (recv(fd, request, sizeof(request), 0) <= 0) {
+            close(fd);
+            continue;
+        }
+
+        FILE* out = fdopen(fd, "w");
+        metrics_snapshot_t* snapshot = (metrics_snapshot_t*)malloc(sizeof(metrics_snapshot_t));
+        if (!out || !snapshot) {
+            free(snapshot);
+            if (out) {
+                fclose(out);
+            } else {
+                close(fd);
+            }
+            continue;
+        }
+        metrics_snapshot(snapshot);
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        metrics_write_text(out, snapshot);
+        fclose(out);
+        free(snapshot);
+    }
+    close(listen_fd);
+    return NULL;
+}
+
+int start_metrics_server(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    // Chỉ nghe trên loopback: metrics không có xác thực
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_server_loop, (void*)(intptr_t)fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include <time.h>
+
+// Số message của một client xử lý liền nhau trước khi nhường worker cho client khác
+#define WORKER_BATCH 16
+// Hộp thư đầy thì network thread tự xử lý (sau khi chờ hộp thư trống) để tạo backpressure
+#define WORKER_MAILBOX_MAX 256
+
+typedef struct work_item {
+    message_t msg;
+    unsigned long received_ns;    // Lúc network thread nhận frame, để đo độ trễ qua hàng đợi
+    struct work_item* next;
+} work_item_t;
+
+// Hộp thư của một client. Chỉ một worker chạy client tại một thời điểm nên message
+// của cùng một client luôn được xử lý theo thứ tự nhận.
+struct client_work {
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;          // Báo khi pending về 0
+    work_item_t* head;
+    work_item_t* tail;
+    int pending;                  // Message đã giao nhưng chưa xử lý xong
+    int scheduled;                // Client đang nằm trong một deque hoặc đang chạy
+};
+
+// Deque client có việc của một worker. Chủ lấy từ đầu (client chờ lâu nhất),
+// worker rảnh lấy trộm từ cuối.
+typedef struct {
+    pthread_mutex_t mutex;
+    client_t** tasks;
+    size_t capacity;              // Lũy thừa của 2
+    size_t head;
+    size_t tail;
+    pthread_t thread;
+    int index;
+    unsigned long processed;
+    unsigned long stolen;
+    unsigned long busy_ns;
+} worker_t;
+
+static worker_t* g_workers = NULL;
+static int g_worker_count = 0;
+static int g_queued = 0;          // Tổng client đang chờ trong các deque
+static int g_sleeping = 0;
+static pthread_mutex_t g_idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_idle_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static void deque_push(worker_t* worker, client_t* client) {
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->tail - worker->head == worker->capacity) {
+        size_t capacity = worker->capacity * 2;
+        client_t** tasks = (client_t**)safe_malloc(sizeof(client_t*) * capacity);
+        for (size_t i = worker->head; i != worker->tail; i++) {
+            tasks[i & (capacity - 1)] = worker->tasks[i & (worker->capacity - 1)];
+        }
+        safe_free(worker->tasks);
+        worker->tasks = tasks;
+        worker->capacity = capacity;
+    }
+    worker->tasks[worker->tail++ & (worker->capacity - 1)] = client;
+    pthread_mutex_unlock(&worker->mutex);
+
+    __atomic_add_fetch(&g_queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_sleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&g_idle_mutex);
+        pthread_cond_signal(&g_idle_cond);
+        pthread_mutex_unlock(&g_idle_mutex);
+    }
+}
+
+static client_t* deque_take(worker_t* worker, int steal) {
+    client_t* client = NULL;
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->head != worker->tail) {
+        client = steal ? worker->tasks[--worker->tail & (worker->capacity - 1)]
+                       : worker->tasks[worker->head++ & (worker->capacity - 1)];
+    }
+    pthread_mutex_unlock(&worker->mutex);
+    if (client) {
+        __atomic_sub_fetch(&g_queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return client;
+}
+
+static client_t* worker_next(worker_t* self) {
+    client_t* client = deque_take(self, 0);
+    if (client) {
+        return client;
+    }
+    for (int i = 1; i < g_worker_count; i++) {
+        worker_t* victim = &g_workers[(self->index + i) % g_worker_count];
+        client = deque_take(victim, 1);
+        if (client) {
+            __atomic_add_fetch(&self->stolen, 1, __ATOMIC_RELAXED);
+            return client;
+        }
+    }
+    return NULL;
+}
+
+static void worker_run_client(worker_t* self, client_t* client) {
+    struct client_work* work = client->work;
+    int batch = 0;
+
+    pthread_mutex_lock(&work->mutex);
+    while (1) {
+        work_item_t* item = work->head;
+        if (!item) {
+            // Bỏ cờ cùng lúc pending về 0 nên người chờ trong workers_release được giải phóng hộp thư ngay
+            work->scheduled = 0;
+            pthread_mutex_unlock(&work->mutex);
+            return;
+        }
+        if (batch++ == WORKER_BATCH) {
+            // Hết lượt mà còn việc: xếp lại cuối deque, client vẫn đang được đánh dấu scheduled
+            pthread_mutex_unlock(&work->mutex);
+            deque_push(self, client);
+            return;
+        }
+        work->head = item->next;
+        if (!work->head) {
+            work->tail = NULL;
+        }
+        pthread_mutex_unlock(&work->mutex);
+
+        unsigned long start = now_ns();
+        metrics_set_received(item->received_ns);
+        // Handler muốn đóng kết nối: network thread sẽ thấy EOF và ngắt như bình thường
+        if (dispatch_message(client, &item->msg) < 0) {
+            shutdown(client->socket_fd, SHUT_RDWR);
+        }
+        __atomic_add_fetch(&self->busy_ns, now_ns() - start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&self->processed, 1, __ATOMIC_RELAXED);
+        slab_free(item, sizeof(work_item_t));
+
+        pthread_mutex_lock(&work->mutex);
+        if (--work->pending == 0) {
+            pthread_cond_broadcast(&work->idle);
+        }
+    }
+}
+
+static void* worker_loop(void* arg) {
+    worker_t* self = (worker_t*)arg;
+
+    while (1) {
+        client_t* client = worker_next(self);
+        if (client) {
+            worker_run_client(self, client);
+            continue;
+        }
+
+        pthread_mutex_lock(&g_idle_mutex);
+        __atomic_add_fetch(&g_sleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&g_queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&g_idle_cond, &g_idle_mutex);
+        }
+        __atomic_sub_fetch(&g_sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&g_idle_mutex);
+    }
+    return NULL;
+}
+
+int start_workers(int count) {
+    g_workers = (worker_t*)safe_malloc(sizeof(worker_t) * (size_t)count);
+    memset(g_workers, 0, sizeof(worker_t) * (size_t)count);
+
+    for (int i = 0; i < count; i++) {
+        worker_t* worker = &g_workers[i];
+        worker->index = i;
+        worker->capacity = 64;
+        worker->tasks = (client_t**)safe_malloc(sizeof(client_t*) * worker->capacity);
+        pthread_mutex_init(&worker->mutex, NULL);
+    }
+    // Chỉ bật sau khi mọi deque đã sẵn sàng vì worker có thể lấy trộm ngay
+    g_worker_count = count;
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&g_workers[i].thread, NULL, worker_loop, &g_workers[i]) != 0) {
+            perror("Worker thread creation failed");
+            return -1;
+        }
+        pthread_detach(g_workers[i].thread);
+    }
+    return 0;
+}
+
+int workers_submit(client_t* client, const message_t* msg) {
+    if (g_worker_count == 0) {
+        return -1;
+    }
+
+    struct client_work* work = client->work;
+    if (!work) {
+        work = (struct client_work*)slab_alloc(sizeof(struct client_work));
+        if (!work) {
+            return -1;
+        }
+        memset(work, 0, sizeof(struct client_work));
+        pthread_mutex_init(&work->mutex, NULL);
+        pthread_cond_init(&work->idle, NULL);
+        client->work = work;
+    }
+
+    work_item_t* item = (work_item_t*)slab_alloc(sizeof(work_item_t));
+    if (!item) {
+        return -1;
+    }
+    item->msg = *msg;
+    item->received_ns = metrics_received_ns();
+    item->next = NULL;
+
+    pthread_mutex_lock(&work->mutex);
+    if (work->pending >= WORKER_MAILBOX_MAX) {
+        pthread_mutex_unlock(&work->mutex);
+        slab_free(item, sizeof(work_item_t));
+        return -1;
+    }
+    if (work->tail) {
+        work->tail->next = item;
+    } else {
+        work->head = item;
+    }
+    work->tail = item;
+    work->pending++;
+    int schedule = !work->scheduled;
+    work->scheduled = 1;
+    pthread_mutex_unlock(&work->mutex);
+
+    // Client của cùng shard vào cùng deque, worker rảnh sẽ lấy trộm khi shard đó nóng
+    if (schedule) {
+        deque_push(&g_workers[client->shard % g_worker_count], client);
+    }
+    return 0;
+}
+
+void workers_quiesce(client_t* client) {
+    struct client_work* work = client->work;
+    if (!work) {
+        return;
+    }
+    pthread_mutex_lock(&work->mutex);
+    while (work->pending > 0) {
+        pthread_cond_wait(&work->idle, &work->mutex);
+    }
+    pthread_mutex_unlock(&work->mutex);
+}
+
+void workers_release(client_t* client) {
+    struct client_work* work = client->work;
+    if (!work) {
+        return;
+    }
+    workers_quiesce(client);
+    pthread_mutex_destroy(&work->mutex);
+    pthread_cond_destroy(&work->idle);
+    slab_free(work, sizeof(struct client_work));
+    client->work = NULL;
+}
+
+int workers_count(void) {
+    return g_worker_count;
+}
+
+void workers_get_stats(int index, worker_stats_t* stats) {
+    worker_t* worker = &g_workers[index];
+    stats->processed = __atomic_load_n(&worker->processed, __ATOMIC_RELAXED);
+    stats->stolen = __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED);
+    stats->busy_ns = __atomic_load_n(&worker->busy_ns, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""
+🧵 Đổi file trace của chat_server sang JSON của Chrome trace
+• File do server ghi khi nhận SIGUSR1 (chạy với --trace), xem common/trace.h
+• Mở kết quả bằng chrome://tracing hoặc https://ui.perfetto.dev
+• Lần chờ khóa từ WAIT_MIN_NS trở lên được vẽ thành đoạn *_wait ngay trước lúc lấy được khóa
+
+Cách dùng: python3 trace_to_chrome.py chat-trace-<pid>-<n>.bin [out.json]
+"""
+
+import json
+import struct
+import sys
+
+# --- Bố cục file, khớp với struct trong common/trace.h ---
+FILE_HEADER = struct.Struct('<8sIIQQQQII')
+EVENT_INFO = struct.Struct('<23sc')
+THREAD_HEADER = struct.Struct('<IIQ16s')
+ENTRY = struct.Struct('<QIIQ')
+MAGIC = b'CHTRACE1'
+
+# --- Khóa không tranh chấp mất vài chục ns, không đáng vẽ ---
+WAIT_MIN_NS = 1000
+
+# --- Tên của arg/value theo sự kiện; "wait" là tick chờ khóa, được đổi sang ns ---
+ARG_NAMES = {
+    'frame_received': ('socket', 'msg_type'),
+    'handler': ('client_id', 'msg_type'),
+    'rooms_mutex': (None, 'wait'),
+    'room_mutex': ('room_id', 'wait'),
+    'send': ('client_id', 'bytes'),
+    'file_chunk': ('chunk', 'bytes'),
+}
+
+
+def convert(data):
+    (magic, thread_count, event_types, start_ticks, start_ns,
+     dump_ticks, dump_ns, pid, entry_size) = FILE_HEADER.unpack_from(data, 0)
+    if magic != MAGIC or entry_size != ENTRY.size:
+        raise ValueError('không phải file trace của chat_server')
+    offset = FILE_HEADER.size
+
+    events = []
+    for _ in range(event_types):
+        name, phase = EVENT_INFO.unpack_from(data, offset)
+        events.append((name.split(b'\0')[0].decode(), phase.decode()))
+        offset += EVENT_INFO.size
+
+    # Tick -> ns theo hai mốc lúc bật trace và lúc dump
+    ns_per_tick = 1.0
+    if dump_ticks > start_ticks:
+        ns_per_tick = (dump_ns - start_ns) / (dump_ticks - start_ticks)
+
+    def to_us(ticks):
+        return (ticks - start_ticks) * ns_per_tick / 1000.0
+
+    out = []
+    dropped_total = 0
+    for _ in range(thread_count):
+        tid, count, dropped, name = THREAD_HEADER.unpack_from(data, offset)
+        offset += THREAD_HEADER.size
+        dropped_total += dropped
+        label = name.split(b'\0')[0].decode(errors='replace')
+        out.append({'name': 'thread_name', 'ph': 'M', 'pid': pid, 'tid': tid,
+                    'args': {'name': '%s (%d)' % (label, tid)}})
+
+        # Ring bị ghi đè từ đầu nên có thể có E mà không có B tương ứng: bỏ đi
+        depth = {}
+        for i in range(count):
+            ticks, event, arg, value = ENTRY.unpack_from(data, offset + i * ENTRY.size)
+            if event >= len(events):
+                continue
+            ev_name, phase = events[event]
+            arg_name, value_name = ARG_NAMES.get(ev_name, ('arg', 'value'))
+            args = {}
+            if arg_name:
+                args[arg_name] = arg
+            if value_name == 'wait':
+                args['wait_ns'] = round(value * ns_per_tick)
+            elif value_name:
+                args[value_name] = value
+
+            if phase == 'B':
+                depth[ev_name] = depth.get(ev_name, 0) + 1
+                if value_name == 'wait' and value * ns_per_tick >= WAIT_MIN_NS:
+                    out.append({'name': ev_name + '_wait', 'ph': 'X', 'pid': pid, 'tid': tid,
+                                'ts': to_us(ticks - value), 'dur': value * ns_per_tick / 1000.0,
+                                'args': dict(args)})
+            elif phase == 'E':
+                if depth.get(ev_name, 0) == 0:
+                    continue
+                depth[ev_name] -= 1
+
+            record = {'name': ev_name, 'ph': phase, 'pid': pid, 'tid': tid,
+                      'ts': to_us(ticks), 'args': args}
+            if phase == 'i':
+                record['s'] = 't'
+            out.append(record)
+        offset += count * ENTRY.size
+
+    return {
+        'traceEvents': out,
+        'displayTimeUnit': 'ns',
+        'otherData': {
+            'pid': pid,
+            'threads': thread_count,
+            'ns_per_tick': ns_per_tick,
+            'dropped_events': dropped_total,
+        },
+    }
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__.strip())
+        sys.exit(1)
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+    try:
+        trace = convert(data)
+    except (ValueError, struct.error) as e:
+        print('❌ %s: %s' % (sys.argv[1], e), file=sys.stderr)
+        sys.exit(1)
+
+    path = sys.argv[2] if len(sys.argv) > 2 else sys.argv[1].rsplit('.', 1)[0] + '.json'
+    with open(path, 'w') as f:
+        json.dump(trace, f)
+    print('✓ %s: %d sự kiện, %d thread -> %s' % (
+        sys.argv[1], len(trace['traceEvents']), trace['otherData']['threads'], path))
+
+
+if __name__ == '__main__':
+    main()